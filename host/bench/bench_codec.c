@@ -0,0 +1,190 @@
+// Encode/decode throughput of the OL305 frame codec against the implementation it replaced
+// (CRC table walk + separate XOR pass + VLA copy). One binary per OL305_CODEC_IMPL.
+//
+// bench_codec_<impl> [frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ol305_codec.h"
+
+#define BENCH_DEFAULT_FRAMES 2000000
+#define BENCH_MIX 5
+
+// Before the codec: ol305.c used these
+static const unsigned char legacy_table[256] =
+{
+    0, 94, 188, 226, 97, 63, 221, 131, 194, 156, 126, 32, 163, 253, 31, 65,
+    157, 195, 33, 127, 252, 162, 64, 30, 95, 1, 227, 189, 62, 96, 130, 220,
+    35, 125, 159, 193, 66, 28, 254, 160, 225, 191, 93, 3, 128, 222, 60, 98,
+    190, 224, 2, 92, 223, 129, 99, 61, 124, 34, 192, 158, 29, 67, 161, 255,
+    70, 24, 250, 164, 39, 121, 155, 197, 132, 218, 56, 102, 229, 187, 89, 7,
+    219, 133, 103, 57, 186, 228, 6, 88, 25, 71, 165, 251, 120, 38, 196, 154,
+    101, 59, 217, 135, 4, 90, 184, 230, 167, 249, 27, 69, 198, 152, 122, 36,
+    248, 166, 68, 26, 153, 199, 37, 123, 58, 100, 134, 216, 91, 5, 231, 185,
+    140, 210, 48, 110, 237, 179, 81, 15, 78, 16, 242, 172, 47, 113, 147, 205,
+    17, 79, 173, 243, 112, 46, 204, 146, 211, 141, 111, 49, 178, 236, 14, 80,
+    175, 241, 19, 77, 206, 144, 114, 44, 109, 51, 209, 143, 12, 82, 176, 238,
+    50, 108, 142, 208, 83, 13, 239, 177, 240, 174, 76, 18, 145, 207, 45, 115,
+    202, 148, 118, 40, 171, 245, 23, 73, 8, 86, 180, 234, 105, 55, 213, 139,
+    87, 9, 235, 181, 54, 104, 138, 212, 149, 203, 41, 119, 244, 170, 72, 22,
+    233, 183, 85, 11, 136, 214, 52, 106, 43, 117, 151, 201, 74, 20, 246, 168,
+    116, 42, 200, 150, 21, 75, 169, 247, 182, 232, 10, 84, 215, 137, 107, 53
+};
+
+static unsigned char legacy_crc(unsigned char *pucFrame, char usLen)
+{
+    unsigned char crc8 = 0;
+    while (usLen--)
+        crc8 = legacy_table[crc8 ^ *(pucFrame++)];
+    return crc8;
+}
+
+static uint16_t legacy_encode(uint8_t *frame, uint8_t rand, uint8_t key, uint8_t cmd, const uint8_t *data, uint8_t len)
+{
+    frame[0] = 0xa3;
+    frame[1] = 0xa4;
+    frame[2] = len;
+    frame[3] = 0x32 + rand;
+    uint8_t temp_data[2 + len];
+    temp_data[0] = key;
+    temp_data[1] = cmd;
+    memcpy(&temp_data[2], data, len);
+    for (uint8_t i = 0; i < (2 + len); i++)
+        frame[4 + i] = temp_data[i] ^ rand;
+    frame[6 + len] = legacy_crc(frame, 6 + len);
+    return 7 + len;
+}
+
+static int legacy_decode(const uint8_t *data, uint16_t len, ol305_frame_t *out)
+{
+    if (7 >= len)
+        return -1;
+    if (legacy_crc((unsigned char *)data, len - 1) != data[6 + data[2]])
+        return -1;
+    if (0xa3a4 != (uint16_t)((data[0] << 8) + (data[1] & 0x00ff)))
+        return -1;
+    out->len = data[2];
+    if (17 <= out->len)
+        return -1;
+    out->rand = data[3] - 0x32;
+    out->key = data[4] ^ out->rand;
+    out->cmd = data[5] ^ out->rand;
+    for (uint8_t i = 0; i < out->len; i++)
+        out->data[i] = data[6 + i] ^ out->rand;
+    return 0;
+}
+
+// Payload sizes sent by ol305.c: query/ack, settings, RFID card, unlock, the longest frame
+static const uint8_t bench_sizes[BENCH_MIX] = {1, 4, 8, 10, OL305_FRAME_MAX_DATA};
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double ns, long frames)
+{
+    printf("%-16s %7.1f ns/frame %12.0f frames/s\n", name, ns / frames, frames / (ns / 1e9));
+}
+
+static int check(void)
+{
+    uint8_t payload[OL305_FRAME_MAX_DATA];
+    uint8_t a[OL305_FRAME_MAX_LEN];
+    uint8_t b[OL305_FRAME_MAX_LEN];
+    ol305_frame_t frame;
+
+    for (int len = 0; len <= OL305_FRAME_MAX_DATA; len++)
+    {
+        for (int r = 0; r < 256; r += 7)
+        {
+            for (int i = 0; i < len; i++)
+                payload[i] = (uint8_t)(i * 37 + r);
+            uint16_t la = legacy_encode(a, r, 0x5a, 0x05, payload, len);
+            uint16_t lb = ol305_codec_encode(b, sizeof(b), r, 0x5a, 0x05, payload, len);
+            if (la != lb || 0 != memcmp(a, b, la) || a[la - 1] != ol305_crc8(a, la - 1))
+            {
+                printf("encode mismatch, len %d rand %d\n", len, r);
+                return 1;
+            }
+            if (0 < len && (ESP_OK != ol305_codec_decode(b, lb, &frame) || frame.len != len ||
+                            frame.key != 0x5a || frame.cmd != 0x05 || 0 != memcmp(frame.data, payload, len)))
+            {
+                printf("decode mismatch, len %d rand %d\n", len, r);
+                return 1;
+            }
+            b[lb - 1] ^= 0x01;
+            if (0 < len && ESP_ERR_INVALID_CRC != ol305_codec_decode(b, lb, &frame))
+            {
+                printf("corrupted frame accepted, len %d rand %d\n", len, r);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long frames = (1 < argc) ? atol(argv[1]) : BENCH_DEFAULT_FRAMES;
+    if (0 >= frames)
+        frames = BENCH_DEFAULT_FRAMES;
+    if (0 != check())
+        return 1;
+
+    uint8_t payloads[BENCH_MIX][OL305_FRAME_MAX_DATA];
+    uint8_t wire[BENCH_MIX][OL305_FRAME_MAX_LEN];
+    uint16_t wire_len[BENCH_MIX];
+    for (int m = 0; m < BENCH_MIX; m++)
+    {
+        for (int i = 0; i < OL305_FRAME_MAX_DATA; i++)
+            payloads[m][i] = rand();
+        wire_len[m] = ol305_codec_encode(wire[m], sizeof(wire[m]), 0x11 * m, 0x5a, 0x31, payloads[m], bench_sizes[m]);
+    }
+
+    uint8_t out[OL305_FRAME_MAX_LEN];
+    ol305_frame_t frame;
+    volatile uint32_t sink = 0;
+    double start;
+
+    printf("codec %s, %ld frames, payload mix 1/4/8/10/%d bytes\n", ol305_codec_name(), frames, OL305_FRAME_MAX_DATA);
+
+    start = now_ns();
+    for (long i = 0; i < frames; i++)
+    {
+        int m = i % BENCH_MIX;
+        sink += legacy_encode(out, (uint8_t)i, 0x5a, 0x31, payloads[m], bench_sizes[m]) + out[6];
+    }
+    report("legacy encode", now_ns() - start, frames);
+
+    start = now_ns();
+    for (long i = 0; i < frames; i++)
+    {
+        int m = i % BENCH_MIX;
+        sink += ol305_codec_encode(out, sizeof(out), (uint8_t)i, 0x5a, 0x31, payloads[m], bench_sizes[m]) + out[6];
+    }
+    report("codec encode", now_ns() - start, frames);
+
+    start = now_ns();
+    for (long i = 0; i < frames; i++)
+    {
+        int m = i % BENCH_MIX;
+        sink += legacy_decode(wire[m], wire_len[m], &frame) + frame.data[0];
+    }
+    report("legacy decode", now_ns() - start, frames);
+
+    start = now_ns();
+    for (long i = 0; i < frames; i++)
+    {
+        int m = i % BENCH_MIX;
+        sink += ol305_codec_decode(wire[m], wire_len[m], &frame) + frame.data[0];
+    }
+    report("codec decode", now_ns() - start, frames);
+
+    (void)sink;
+    return 0;
+}
@@ -0,0 +1,84 @@
+// Receive path of ol305.c on a replayed corpus: every input goes through ol305_recive_message, the
+// receive queue, the reassembler and ol305_handle_frame, as in fuzz_decode. Reports the decode rate
+// next to the error counters, so a slower decoder and a less robust one show up in the same run.
+//
+// bench_decode [-r rounds] corpus...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "ol305_fuzz.h"
+
+#define BENCH_DEFAULT_ROUNDS 2000
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = BENCH_DEFAULT_ROUNDS;
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "r:")))
+    {
+        switch (opt)
+        {
+            case 'r': rounds = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-r rounds] corpus...\n", argv[0]);
+                return 2;
+        }
+    }
+
+    ol305_fuzz_input_t *inputs = NULL;
+    size_t count = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        if (0 != ol305_fuzz_load(argv[i], &inputs, &count))
+        {
+            fprintf(stderr, "%s: can't read\n", argv[i]);
+            return 2;
+        }
+    }
+    if (0 == count || 0 >= rounds)
+    {
+        fprintf(stderr, "usage: %s [-r rounds] corpus...\n", argv[0]);
+        return 2;
+    }
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++)
+        bytes += inputs[i].size;
+
+    ol305_handle_t lock = ol305_fuzz_lock();
+    ol305_stats_t before;
+    ol305_stats_t after;
+    ol305_get_stats(lock, &before);
+    double start = now_ns();
+    for (long r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < count; i++)
+            LLVMFuzzerTestOneInput(inputs[i].data, inputs[i].size);
+    }
+    double ns = now_ns() - start;
+    ol305_get_stats(lock, &after);
+
+    uint32_t frames = after.counters[OL305_STAT_FRAMES_RX] - before.counters[OL305_STAT_FRAMES_RX];
+    uint32_t dropped = after.counters[OL305_STAT_RX_DROPPED] - before.counters[OL305_STAT_RX_DROPPED];
+    printf("%zu inputs, %zu bytes, %ld rounds\n", count, bytes, rounds);
+    printf("%10.0f frames/s %8.1f ns/frame %8.1f MB/s %7.1f us/input\n", frames / (ns / 1e9), ns / frames,
+           bytes * rounds / (ns / 1e3), ns / 1e3 / (count * rounds));
+    printf("frames %u crc %u length %u resyncs %u key %u dropped %u\n", frames,
+           after.counters[OL305_STAT_CRC_ERRORS] - before.counters[OL305_STAT_CRC_ERRORS],
+           after.counters[OL305_STAT_LENGTH_ERRORS] - before.counters[OL305_STAT_LENGTH_ERRORS],
+           after.counters[OL305_STAT_STX_RESYNCS] - before.counters[OL305_STAT_STX_RESYNCS],
+           after.counters[OL305_STAT_KEY_ERRORS] - before.counters[OL305_STAT_KEY_ERRORS], dropped);
+
+    ol305_fuzz_free(inputs, count);
+    //a notification of the corpus did not fit the receive queue
+    return 0 != dropped;
+}
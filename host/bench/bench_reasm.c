@@ -0,0 +1,125 @@
+// Notification reassembler on a replayed byte stream: frames of every size the lock sends,
+// with line noise and corrupted frames, cut into notifications of several sizes.
+//
+// bench_reasm [frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "ol305_reasm.h"
+
+#define BENCH_DEFAULT_FRAMES 200000
+#define BENCH_NOISE_EVERY 50    //a few junk bytes before every 50th frame
+#define BENCH_CORRUPT_EVERY 97  //every 97th frame has a wrong CRC
+
+typedef struct
+{
+    uint32_t frames;
+    uint32_t sum;
+} bench_sink;
+
+static void bench_frame(void *ctx, const ol305_frame_t *frame)
+{
+    bench_sink *sink = (bench_sink *)ctx;
+    sink->frames++;
+    sink->sum += frame->cmd + frame->len + frame->data[0];
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    long frames = (1 < argc) ? atol(argv[1]) : BENCH_DEFAULT_FRAMES;
+    if (0 >= frames)
+        frames = BENCH_DEFAULT_FRAMES;
+
+    uint8_t *stream = malloc(frames * (OL305_FRAME_MAX_LEN + 4));
+    size_t *ends = malloc(frames * sizeof(size_t));
+    if (NULL == stream || NULL == ends)
+        return 1;
+
+    size_t size = 0;
+    uint32_t expected = 0;
+    uint32_t expected_sum = 0;
+    uint8_t payload[OL305_FRAME_MAX_DATA];
+    srand(1);
+    for (long i = 0; i < frames; i++)
+    {
+        if (0 == i % BENCH_NOISE_EVERY)
+        {
+            for (int n = 1 + rand() % 3; 0 < n; n--)
+                stream[size++] = 0x10 + rand() % 0x80; //never STX_HI
+        }
+
+        uint8_t len = 1 + rand() % OL305_FRAME_MAX_DATA;
+        for (int j = 0; j < len; j++)
+            payload[j] = rand();
+        uint8_t cmd = 0x31;
+        uint16_t frame_len = ol305_codec_encode(&stream[size], OL305_FRAME_MAX_LEN, rand(), 0x5a, cmd, payload, len);
+        if (0 == i % BENCH_CORRUPT_EVERY)
+        {
+            stream[size + frame_len - 1] ^= 0x5a;
+        }
+        else
+        {
+            expected++;
+            expected_sum += cmd + len + payload[0];
+        }
+        size += frame_len;
+        ends[i] = size;
+    }
+
+    printf("%zu bytes, %ld frames, %u valid\n", size, frames, expected);
+
+    static const uint16_t chunks[] = {0, 1, 7, 20, 64, 244};
+    int failed = 0;
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+    {
+        ol305_reasm_t reasm;
+        bench_sink sink = {0};
+        ol305_reasm_init(&reasm);
+
+        double start = now_ns();
+        if (0 == chunks[c])
+        {
+            //one frame per notification, noise glued to the next frame
+            size_t from = 0;
+            for (long i = 0; i < frames; i++)
+            {
+                ol305_reasm_feed(&reasm, &stream[from], ends[i] - from, bench_frame, &sink);
+                from = ends[i];
+            }
+        }
+        else
+        {
+            for (size_t from = 0; from < size; from += chunks[c])
+            {
+                size_t len = (size - from < chunks[c]) ? size - from : chunks[c];
+                ol305_reasm_feed(&reasm, &stream[from], len, bench_frame, &sink);
+            }
+        }
+        double ns = now_ns() - start;
+
+        char name[16];
+        if (0 == chunks[c])
+            snprintf(name, sizeof(name), "per frame");
+        else
+            snprintf(name, sizeof(name), "%u B", chunks[c]);
+        bool ok = sink.frames == expected && sink.sum == expected_sum;
+        failed += !ok;
+        printf("%-10s %6.2f ns/byte %8.1f MB/s %7.1f ns/frame %10.0f frames/s  crc=%u len=%u skipped=%u %s\n",
+               name, ns / size, size / (ns / 1e3), ns / sink.frames, sink.frames / (ns / 1e9),
+               reasm.bad_crc, reasm.bad_length, reasm.skipped_bytes, ok ? "ok" : "MISMATCH");
+    }
+
+    free(ends);
+    free(stream);
+    return failed;
+}
@@ -0,0 +1,82 @@
+// Corpus files for the fuzz replay driver and bench_decode
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "ol305_fuzz.h"
+
+static int fuzz_load_file(const char *path, ol305_fuzz_input_t **inputs, size_t *count)
+{
+    FILE *file = fopen(path, "rb");
+    if (NULL == file)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    ol305_fuzz_input_t *grown = realloc(*inputs, (*count + 1) * sizeof(**inputs));
+    uint8_t *data = malloc((0 < size) ? size : 1);
+    if (NULL == grown || NULL == data || (0 < size && 1 != fread(data, size, 1, file)))
+    {
+        if (NULL != grown)
+            *inputs = grown;
+        free(data);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    *inputs = grown;
+    ol305_fuzz_input_t *input = &grown[(*count)++];
+    const char *name = strrchr(path, '/');
+    snprintf(input->name, sizeof(input->name), "%s", (NULL != name) ? name + 1 : path);
+    input->size = size;
+    input->data = data;
+    return 0;
+}
+
+static int fuzz_by_name(const void *a, const void *b)
+{
+    return strcmp(((const ol305_fuzz_input_t *)a)->name, ((const ol305_fuzz_input_t *)b)->name);
+}
+
+int ol305_fuzz_load(const char *path, ol305_fuzz_input_t **inputs, size_t *count)
+{
+    struct stat st;
+    if (0 != stat(path, &st))
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return fuzz_load_file(path, inputs, count);
+
+    DIR *dir = opendir(path);
+    if (NULL == dir)
+        return -1;
+    size_t first = *count;
+    struct dirent *entry;
+    char file[512];
+    while (NULL != (entry = readdir(dir)))
+    {
+        if ('.' == entry->d_name[0])
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        if (0 == stat(file, &st) && S_ISREG(st.st_mode) && 0 != fuzz_load_file(file, inputs, count))
+        {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    //readdir order depends on the file system, runs should be repeatable
+    if (*count > first)
+        qsort(&(*inputs)[first], *count - first, sizeof(**inputs), fuzz_by_name);
+    return 0;
+}
+
+void ol305_fuzz_free(ol305_fuzz_input_t *inputs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        free(inputs[i].data);
+    free(inputs);
+}
@@ -0,0 +1,94 @@
+// Fuzz target for the receive path of ol305.c: the input is cut into notifications, queued with
+// ol305_recive_message and decoded by the reassembler and ol305_handle_frame as ol305_task would.
+// The whole input is also decoded as one frame by ol305_codec_decode.
+//
+// Built for libFuzzer with clang, with fuzz_main.c (corpus replay) otherwise. See ol305_fuzz.h for the input.
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "ol305_codec.h"
+#include "ol305_fuzz.h"
+
+static bool fuzz_write(int link, uint8_t *data, uint16_t len)
+{
+    //the receive path never writes, answers are only queued
+    return false;
+}
+
+static void fuzz_nop(void)
+{
+}
+
+static int fuzz_open(uint8_t *mac_addr, uint16_t mac_len, ol305_link_cb_t cb, void *ctx)
+{
+    return OL305_INVALID_LINK;
+}
+
+static void fuzz_close(int link)
+{
+}
+
+static bool fuzz_is_connected(int link)
+{
+    return false;
+}
+
+static const ol305_transport_t fuzz_transport =
+{
+    .name = "fuzz",
+    .init = fuzz_nop,
+    .deinit = fuzz_nop,
+    .open = fuzz_open,
+    .close = fuzz_close,
+    .is_connected = fuzz_is_connected,
+    .write = fuzz_write,
+};
+
+ol305_handle_t ol305_fuzz_lock(void)
+{
+    static ol305_handle_t lock = NULL;
+    if (NULL == lock)
+    {
+        uint8_t mac[6] = {0xf0, 0x05, 0x0f, 0x05, 0x00, 0x01};
+        //a log line per frame would be all the fuzzer measures
+        esp_log_level_set("*", ESP_LOG_NONE);
+        ol305_set_transport(&fuzz_transport);
+        lock = ol305_add_lock();
+        set_ol305_mac_addr(lock, mac, sizeof(mac));
+    }
+    return lock;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    ol305_handle_t lock = ol305_fuzz_lock();
+    ol305_host_reset(lock);
+
+    ol305_frame_t frame;
+    ol305_codec_decode(data, (OL305_FRAME_MAX_LEN * 2 < size) ? OL305_FRAME_MAX_LEN * 2 : size, &frame);
+
+    uint8_t queued = 0;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t len = 1 + data[pos++] % OL305_FUZZ_MAX_NOTIFY;
+        if (len > size - pos)
+            len = size - pos;
+        if (0 == len)
+            break;
+        //a buffer of exactly the notification size, reads past it are caught by ASan
+        uint8_t *notify = malloc(len);
+        memcpy(notify, &data[pos], len);
+        ol305_recive_message(lock, notify, len);
+        free(notify);
+        pos += len;
+        if (OL305_FUZZ_BATCH == ++queued)
+        {
+            ol305_host_process_rx(lock);
+            queued = 0;
+        }
+    }
+    ol305_host_process_rx(lock);
+    return 0;
+}
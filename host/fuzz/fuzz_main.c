@@ -0,0 +1,147 @@
+// Driver of fuzz_decode when libFuzzer is not available (gcc): replays the corpus, then runs
+// mutations of it. Built with ASan/UBSan; on a crash the input is written to crash-input.
+//
+// fuzz_decode [-m mutations] [-s seed] corpus...
+// -m: mutated inputs per corpus file, 0 -> replay only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ol305_fuzz.h"
+
+#define FUZZ_MAX_INPUT 1024
+
+//provided by the sanitizer runtime when there is one
+void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+static const uint8_t *fuzz_current;
+static size_t fuzz_current_size;
+
+static void fuzz_dump(void)
+{
+    FILE *file = fopen("crash-input", "wb");
+    if (NULL == file)
+        return;
+    fwrite(fuzz_current, 1, fuzz_current_size, file);
+    fclose(file);
+    fprintf(stderr, "input written to crash-input, %zu bytes\n", fuzz_current_size);
+}
+
+static void fuzz_run(const uint8_t *data, size_t size)
+{
+    fuzz_current = data;
+    fuzz_current_size = size;
+    LLVMFuzzerTestOneInput(data, size);
+}
+
+// Bit flips, byte changes, inserted and removed bytes, a splice with another input
+static size_t fuzz_mutate(uint8_t *data, size_t size, const ol305_fuzz_input_t *other)
+{
+    for (int n = 1 + rand() % 4; 0 < n; n--)
+    {
+        size_t pos = (0 < size) ? rand() % size : 0;
+        switch (rand() % 6)
+        {
+            case 0:
+                if (0 < size)
+                    data[pos] ^= 1 << (rand() % 8);
+                break;
+            case 1:
+                if (0 < size)
+                    data[pos] = rand();
+                break;
+            case 2:
+                //STX and the bytes the frame length is checked against
+                if (0 < size)
+                    data[pos] = (const uint8_t[]){0x00, 0xff, 0xa3, 0xa4, 0x10, 0x17}[rand() % 6];
+                break;
+            case 3:
+                if (FUZZ_MAX_INPUT > size)
+                {
+                    memmove(&data[pos + 1], &data[pos], size - pos);
+                    data[pos] = rand();
+                    size++;
+                }
+                break;
+            case 4:
+                if (0 < size)
+                {
+                    memmove(&data[pos], &data[pos + 1], size - pos - 1);
+                    size--;
+                }
+                break;
+            case 5:
+                if (0 < other->size)
+                {
+                    size_t from = rand() % other->size;
+                    size_t len = 1 + rand() % (other->size - from);
+                    if (len > FUZZ_MAX_INPUT - pos)
+                        len = FUZZ_MAX_INPUT - pos;
+                    memcpy(&data[pos], &other->data[from], len);
+                    if (pos + len > size)
+                        size = pos + len;
+                }
+                break;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    long mutations = 0;
+    unsigned seed = 1;
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "m:s:")))
+    {
+        switch (opt)
+        {
+            case 'm': mutations = atol(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-m mutations] [-s seed] corpus...\n", argv[0]);
+                return 2;
+        }
+    }
+
+    ol305_fuzz_input_t *inputs = NULL;
+    size_t count = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        if (0 != ol305_fuzz_load(argv[i], &inputs, &count))
+        {
+            fprintf(stderr, "%s: can't read\n", argv[i]);
+            return 2;
+        }
+    }
+    if (0 == count)
+    {
+        fprintf(stderr, "usage: %s [-m mutations] [-s seed] corpus...\n", argv[0]);
+        return 2;
+    }
+
+    if (NULL != __sanitizer_set_death_callback)
+        __sanitizer_set_death_callback(fuzz_dump);
+    for (size_t i = 0; i < count; i++)
+        fuzz_run(inputs[i].data, inputs[i].size);
+    printf("%zu corpus inputs replayed\n", count);
+
+    uint8_t data[FUZZ_MAX_INPUT];
+    srand(seed);
+    for (size_t i = 0; i < count && 0 < mutations; i++)
+    {
+        for (long m = 0; m < mutations; m++)
+        {
+            size_t size = (FUZZ_MAX_INPUT < inputs[i].size) ? FUZZ_MAX_INPUT : inputs[i].size;
+            memcpy(data, inputs[i].data, size);
+            size = fuzz_mutate(data, size, &inputs[rand() % count]);
+            fuzz_run(data, size);
+        }
+    }
+    if (0 < mutations)
+        printf("%ld mutations of each input, seed %u\n", mutations, seed);
+
+    ol305_fuzz_free(inputs, count);
+    return 0;
+}
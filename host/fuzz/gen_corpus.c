@@ -0,0 +1,160 @@
+// Seed corpus of fuzz_decode and bench_decode: answers of the lock for every ol305b_cmd, whole,
+// split over notifications, coalesced and cut short, in the input format of ol305_fuzz.h.
+//
+// ol305_fuzz_corpus dir
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "ol305_codec.h"
+#include "ol305_fuzz.h"
+
+#define CORPUS_KEY 0x5a
+#define CORPUS_MAX_INPUT 1024
+
+typedef struct
+{
+    const char *name;
+    uint8_t cmd;
+    uint8_t len;
+    uint8_t data[OL305_FRAME_MAX_DATA];
+} corpus_frame_t;
+
+//what the lock sends, as ol305_handle_frame reads it
+static const corpus_frame_t corpus_frames[] =
+{
+    {"ble_key", BLE_KEY, 4, {0x01, CORPUS_KEY, 0x00, 0x00}},
+    {"ble_key_wrong", BLE_KEY, 4, {0x01, 0x11, 0x00, 0x00}},
+    {"unlock", UNLOCK, 1, {0x01}},
+    {"unlock_failed", UNLOCK, 1, {0x02}},
+    {"cmd_error_crc", CMD_ERROR, 1, {0x01}},
+    {"cmd_error_no_key", CMD_ERROR, 1, {0x02}},
+    {"cmd_error_key", CMD_ERROR, 1, {0x03}},
+    {"lock", LOCK, 1, {0x01}},
+    {"lock_failed", LOCK, 1, {0x02}},
+    {"key_setting", BLE_KEY_SETTING, 1, {0x01}},
+    {"query_info", QUERY_INFO, 3, {0x01, 0x68, 0x02}},
+    {"query_info_unlocked", QUERY_INFO, 3, {0x01, 0x40, 0x01}},
+    {"obtain_usage", OBTAIN_LAST_USAGE, 13, {0x01, 0x00, 0x00, 0x30, 0x39, 0x65, 0x00, 0x00, 0x10, 0x65, 0x00, 0x00, 0x4c}},
+    {"obtain_usage_empty", OBTAIN_LAST_USAGE, 1, {0x00}},
+    {"delete_usage", DELETE_LAST_USAGE, 1, {0x01}},
+    {"delete_usage_failed", DELETE_LAST_USAGE, 1, {0x00}},
+    {"settings", LOCK_SETTINGS, 3, {0x01, 0x05, 0x00}},
+    {"register_rfid_start", REGISTER_RFID, 1, {0x00}},
+    {"register_rfid", REGISTER_RFID, 9, {0x01, 0x04, 0xa2, 0x19, 0x7e, 0x00, 0x00, 0x00, 0x01}},
+    {"register_rfid_failed", REGISTER_RFID, 1, {0x02}},
+    {"register_rfid_exists", REGISTER_RFID, 9, {0x03, 0x04, 0xa2, 0x19, 0x7e, 0x00, 0x00, 0x00, 0x01}},
+    {"delete_rfid", DELETE_RFID, 1, {0x01}},
+    {"delete_rfid_missing", DELETE_RFID, 1, {0x00}},
+    {"get_rfid", GET_RFID, 11, {0x01, 0x02, 0x00, 0x04, 0xa2, 0x19, 0x7e, 0x00, 0x00, 0x00, 0x01}},
+    {"get_rfid_end", GET_RFID, 3, {0x00, 0x02, 0x02}},
+    {"max_payload", QUERY_INFO, OL305_FRAME_MAX_DATA, {0x01, 0x68, 0x02}},
+};
+
+#define CORPUS_FRAMES (sizeof(corpus_frames) / sizeof(corpus_frames[0]))
+
+typedef struct
+{
+    size_t size;
+    uint8_t data[CORPUS_MAX_INPUT];
+} corpus_input_t;
+
+static uint16_t corpus_encode(uint8_t *frame, const corpus_frame_t *src, uint8_t rand)
+{
+    return ol305_codec_encode(frame, OL305_FRAME_MAX_LEN, rand, CORPUS_KEY, src->cmd, src->data, src->len);
+}
+
+// One notification, the length byte of the input format in front
+static void corpus_notify(corpus_input_t *input, const uint8_t *data, size_t len)
+{
+    input->data[input->size++] = len - 1;
+    memcpy(&input->data[input->size], data, len);
+    input->size += len;
+}
+
+static int corpus_write(const char *dir, const char *name, const corpus_input_t *input)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *file = fopen(path, "wb");
+    if (NULL == file || 1 != fwrite(input->data, input->size, 1, file))
+    {
+        perror(path);
+        if (NULL != file)
+            fclose(file);
+        return 1;
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (2 != argc)
+    {
+        fprintf(stderr, "usage: %s dir\n", argv[0]);
+        return 2;
+    }
+    const char *dir = argv[1];
+    mkdir(dir, 0755);
+
+    int failed = 0;
+    int files = 0;
+    char name[80];
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    corpus_input_t input;
+    for (size_t i = 0; i < CORPUS_FRAMES; i++)
+    {
+        uint16_t len = corpus_encode(frame, &corpus_frames[i], 0x11 * i);
+
+        //as the lock sends it, one frame per notification
+        input.size = 0;
+        corpus_notify(&input, frame, len);
+        snprintf(name, sizeof(name), "%s", corpus_frames[i].name);
+        failed |= corpus_write(dir, name, &input);
+
+        //cut in the header and again in the payload
+        input.size = 0;
+        corpus_notify(&input, frame, 2);
+        corpus_notify(&input, &frame[2], 5);
+        corpus_notify(&input, &frame[7], len - 7);
+        snprintf(name, sizeof(name), "%s_split", corpus_frames[i].name);
+        failed |= corpus_write(dir, name, &input);
+        files += 2;
+
+        //a valid frame whose payload lacks the last byte, or all but the status byte
+        const uint8_t cuts[] = {corpus_frames[i].len - 1, 1};
+        for (size_t k = 0; k < sizeof(cuts) && 1 < corpus_frames[i].len; k++)
+        {
+            if (1 == k && cuts[0] == cuts[1])
+                break;
+            corpus_frame_t cut = corpus_frames[i];
+            cut.len = cuts[k];
+            input.size = 0;
+            corpus_notify(&input, frame, corpus_encode(frame, &cut, 0x11 * i));
+            snprintf(name, sizeof(name), "%s_short%u", corpus_frames[i].name, cut.len);
+            failed |= corpus_write(dir, name, &input);
+            files++;
+        }
+    }
+
+    //a whole session coalesced two frames per notification, after line noise and a bad CRC
+    uint8_t stream[OL305_FRAME_MAX_LEN * 2];
+    input.size = 0;
+    corpus_notify(&input, (const uint8_t[]){0x00, 0xa3, 0x17, 0xa3}, 4);
+    for (size_t i = 0; i < CORPUS_FRAMES; i += 2)
+    {
+        uint16_t len = corpus_encode(stream, &corpus_frames[i], i);
+        if (i + 1 < CORPUS_FRAMES)
+            len += corpus_encode(&stream[len], &corpus_frames[i + 1], i + 1);
+        if (6 == i)
+            stream[len - 1] ^= 0xff;
+        corpus_notify(&input, stream, len);
+    }
+    failed |= corpus_write(dir, "session", &input);
+    files++;
+
+    if (!failed)
+        printf("%d inputs written to %s\n", files, dir);
+    return failed;
+}
@@ -0,0 +1,28 @@
+#ifndef __OL305_FUZZ_H__
+#define __OL305_FUZZ_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ol305.h"
+
+//fuzz input: [n - 1] n bytes [n - 1] n bytes ..., n = 1 + length byte % OL305_FUZZ_MAX_NOTIFY
+#define OL305_FUZZ_MAX_NOTIFY 64
+//notifications queued before the receive path runs, the queue holds 16 slots of 24 bytes
+#define OL305_FUZZ_BATCH 4
+
+//lock the inputs are played against, created on the first input
+ol305_handle_t ol305_fuzz_lock(void);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+typedef struct
+{
+    char name[64];
+    size_t size;
+    uint8_t *data;
+} ol305_fuzz_input_t;
+
+//reads a file, or every file of a directory, and appends them to *inputs; -1 when path can't be read
+int ol305_fuzz_load(const char *path, ol305_fuzz_input_t **inputs, size_t *count);
+void ol305_fuzz_free(ol305_fuzz_input_t *inputs, size_t count);
+
+#endif
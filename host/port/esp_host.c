@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static int log_level = -1;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+int64_t esp_timer_get_time(void)
+{
+    static int64_t start = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    //never 0, the firmware uses 0 as "not set"
+    if (0 == start)
+        start = us - 1;
+    return us - start;
+}
+
+// Tags are not filtered separately on the host, the level applies to all of them
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    log_level = level;
+}
+
+static int esp_log_get_level()
+{
+    if (0 > log_level)
+    {
+        const char *env = getenv("ESP_LOG_LEVEL");
+        log_level = (NULL != env) ? atoi(env) : ESP_LOG_WARN;
+    }
+    return log_level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    static const char letters[] = "NEWIDV";
+    if (level > esp_log_get_level())
+        return;
+
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&log_mutex);
+    printf("%c (%lld) %s: ", letters[level], (long long)(esp_timer_get_time() / 1000), tag);
+    vprintf(format, args);
+    printf("\n");
+    pthread_mutex_unlock(&log_mutex);
+    va_end(args);
+}
+
+void esp_log_buffer_hex(const char *tag, const void *buffer, uint16_t buff_len)
+{
+    const uint8_t *bytes = (const uint8_t *)buffer;
+    char line[16 * 3 + 1];
+
+    for (uint16_t offset = 0; offset < buff_len; offset += 16)
+    {
+        int pos = 0;
+        for (uint16_t i = offset; i < buff_len && i < offset + 16; i++)
+            pos += snprintf(&line[pos], sizeof(line) - pos, "%02x ", bytes[i]);
+        esp_log_write(ESP_LOG_INFO, tag, "%s", line);
+    }
+}
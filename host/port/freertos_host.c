@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+struct host_task
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t notify_value;
+    bool notify_pending;
+    TaskFunction_t code;
+    void *parameters;
+};
+
+struct host_event_group
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+static __thread struct host_task *current_task = NULL;
+
+static void host_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct host_task *host_task_new()
+{
+    struct host_task *task = calloc(1, sizeof(*task));
+    if (NULL == task)
+        abort();
+    pthread_mutex_init(&task->mutex, NULL);
+    host_cond_init(&task->cond);
+    return task;
+}
+
+// Waits on cond until pred is true or ticks ms passed, the mutex is held by the caller
+static bool host_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, bool (*pred)(void *), void *ctx, TickType_t ticks)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ticks / 1000;
+    deadline.tv_nsec += (long)(ticks % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (!pred(ctx))
+    {
+        if (portMAX_DELAY == ticks)
+            pthread_cond_wait(cond, mutex);
+        else if (ETIMEDOUT == pthread_cond_timedwait(cond, mutex, &deadline))
+            return pred(ctx);
+    }
+    return true;
+}
+
+void portMUX_INITIALIZE(portMUX_TYPE *mux)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mux->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void *host_task_entry(void *arg)
+{
+    current_task = (struct host_task *)arg;
+    current_task->code(current_task->parameters);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task)
+{
+    struct host_task *task = host_task_new();
+    task->code = task_code;
+    task->parameters = parameters;
+    if (NULL != created_task)
+        *created_task = task;
+    if (0 != pthread_create(&task->thread, NULL, host_task_entry, task))
+        return pdFAIL;
+    pthread_detach(task->thread);
+#ifdef __linux__
+    pthread_setname_np(task->thread, name);
+#endif
+    return pdPASS;
+}
+
+// Only a task deleting itself is supported, its handle stays valid for late notifications
+void vTaskDelete(TaskHandle_t task)
+{
+    if (NULL == task || task == current_task)
+        pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec delay = {.tv_sec = ticks / 1000, .tv_nsec = (long)(ticks % 1000) * 1000000L};
+    while (0 != nanosleep(&delay, &delay) && EINTR == errno)
+        ;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    //threads not created by xTaskCreate (main) get a handle on first use
+    if (NULL == current_task)
+        current_task = host_task_new();
+    return current_task;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (TickType_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    pthread_mutex_lock(&task->mutex);
+    switch (action)
+    {
+        case eSetBits:
+            task->notify_value |= value;
+            break;
+        case eIncrement:
+            task->notify_value++;
+            break;
+        case eSetValueWithOverwrite:
+            task->notify_value = value;
+            break;
+        default:
+            break;
+    }
+    task->notify_pending = true;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+    return pdPASS;
+}
+
+static bool host_notify_pending(void *ctx)
+{
+    return ((struct host_task *)ctx)->notify_pending;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t bits_to_clear_on_entry, uint32_t bits_to_clear_on_exit, uint32_t *notification_value,
+                           TickType_t ticks_to_wait)
+{
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    pthread_mutex_lock(&task->mutex);
+    if (!task->notify_pending)
+        task->notify_value &= ~bits_to_clear_on_entry;
+
+    bool notified = host_wait(&task->cond, &task->mutex, host_notify_pending, task, ticks_to_wait);
+    if (NULL != notification_value)
+        *notification_value = task->notify_value;
+    if (notified)
+    {
+        task->notify_value &= ~bits_to_clear_on_exit;
+        task->notify_pending = false;
+    }
+    pthread_mutex_unlock(&task->mutex);
+    return notified ? pdTRUE : pdFALSE;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct host_event_group *group = calloc(1, sizeof(*group));
+    if (NULL == group)
+        return NULL;
+    pthread_mutex_init(&group->mutex, NULL);
+    host_cond_init(&group->cond);
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    pthread_cond_destroy(&group->cond);
+    pthread_mutex_destroy(&group->mutex);
+    free(group);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->mutex);
+    group->bits |= bits;
+    EventBits_t result = group->bits;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->mutex);
+    EventBits_t result = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    pthread_mutex_lock(&group->mutex);
+    EventBits_t result = group->bits;
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
+
+typedef struct
+{
+    struct host_event_group *group;
+    EventBits_t bits;
+    bool wait_for_all;
+} host_bits_wait;
+
+static bool host_bits_set(void *ctx)
+{
+    host_bits_wait *wait = (host_bits_wait *)ctx;
+    EventBits_t set = wait->group->bits & wait->bits;
+    return wait->wait_for_all ? set == wait->bits : 0 != set;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks_to_wait)
+{
+    host_bits_wait wait = {.group = group, .bits = bits, .wait_for_all = wait_for_all};
+    pthread_mutex_lock(&group->mutex);
+    bool done = host_wait(&group->cond, &group->mutex, host_bits_set, &wait, ticks_to_wait);
+    EventBits_t result = group->bits;
+    if (done && clear_on_exit)
+        group->bits &= ~bits;
+    pthread_mutex_unlock(&group->mutex);
+    return result;
+}
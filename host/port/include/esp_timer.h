@@ -0,0 +1,9 @@
+#ifndef __ESP_TIMER_H__
+#define __ESP_TIMER_H__
+
+#include <stdint.h>
+
+// Host build: microseconds on CLOCK_MONOTONIC since the first call
+int64_t esp_timer_get_time(void);
+
+#endif
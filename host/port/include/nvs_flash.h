@@ -0,0 +1,8 @@
+#ifndef __NVS_FLASH_H__
+#define __NVS_FLASH_H__
+
+#include "esp_err.h"
+
+esp_err_t nvs_flash_init(void);
+
+#endif
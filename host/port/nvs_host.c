@@ -0,0 +1,174 @@
+#include <string.h>
+#include <pthread.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#define NVS_HOST_MAX_ENTRIES 128
+#define NVS_HOST_MAX_NAMESPACES 16
+#define NVS_HOST_MAX_VALUE 1024
+
+typedef struct
+{
+    bool used;
+    uint8_t ns;
+    char key[16];
+    size_t len;
+    uint8_t value[NVS_HOST_MAX_VALUE];
+} nvs_host_entry;
+
+static char namespaces[NVS_HOST_MAX_NAMESPACES][16];
+static nvs_host_entry entries[NVS_HOST_MAX_ENTRIES];
+static pthread_mutex_t nvs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Handles are the namespace index + 1, under nvs_mutex
+static nvs_host_entry *nvs_host_find(nvs_handle_t handle, const char *key)
+{
+    for (int i = 0; i < NVS_HOST_MAX_ENTRIES; i++)
+    {
+        if (entries[i].used && entries[i].ns == handle - 1 && 0 == strncmp(entries[i].key, key, sizeof(entries[i].key)))
+            return &entries[i];
+    }
+    return NULL;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    pthread_mutex_lock(&nvs_mutex);
+    for (int i = 0; i < NVS_HOST_MAX_NAMESPACES; i++)
+    {
+        if (0 == strncmp(namespaces[i], name, sizeof(namespaces[i])) || '\0' == namespaces[i][0])
+        {
+            if ('\0' == namespaces[i][0])
+            {
+                //like the real NVS, a read only open does not create the namespace
+                if (NVS_READONLY == open_mode)
+                {
+                    ret = ESP_ERR_NVS_NOT_FOUND;
+                    break;
+                }
+                strncpy(namespaces[i], name, sizeof(namespaces[i]) - 1);
+            }
+            *out_handle = i + 1;
+            ret = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nvs_mutex);
+    return ret;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&nvs_mutex);
+    nvs_host_entry *entry = nvs_host_find(handle, key);
+    if (NULL != entry)
+    {
+        if (NULL == out_value)
+        {
+            *length = entry->len;
+            ret = ESP_OK;
+        }
+        else if (*length < entry->len)
+            ret = ESP_ERR_INVALID_SIZE;
+        else
+        {
+            memcpy(out_value, entry->value, entry->len);
+            *length = entry->len;
+            ret = ESP_OK;
+        }
+    }
+    pthread_mutex_unlock(&nvs_mutex);
+    return ret;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    if (NVS_HOST_MAX_VALUE < length)
+        return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    pthread_mutex_lock(&nvs_mutex);
+    nvs_host_entry *entry = nvs_host_find(handle, key);
+    for (int i = 0; NULL == entry && i < NVS_HOST_MAX_ENTRIES; i++)
+    {
+        if (!entries[i].used)
+        {
+            entry = &entries[i];
+            entry->used = true;
+            entry->ns = handle - 1;
+            strncpy(entry->key, key, sizeof(entry->key) - 1);
+        }
+    }
+    if (NULL != entry)
+    {
+        memcpy(entry->value, value, length);
+        entry->len = length;
+        ret = ESP_OK;
+    }
+    pthread_mutex_unlock(&nvs_mutex);
+    return ret;
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    size_t len = sizeof(*out_value);
+    return nvs_get_blob(handle, key, out_value, &len);
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    size_t len = sizeof(*out_value);
+    return nvs_get_blob(handle, key, out_value, &len);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&nvs_mutex);
+    nvs_host_entry *entry = nvs_host_find(handle, key);
+    if (NULL != entry)
+    {
+        entry->used = false;
+        ret = ESP_OK;
+    }
+    pthread_mutex_unlock(&nvs_mutex);
+    return ret;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    pthread_mutex_lock(&nvs_mutex);
+    for (int i = 0; i < NVS_HOST_MAX_ENTRIES; i++)
+    {
+        if (entries[i].used && entries[i].ns == handle - 1)
+            entries[i].used = false;
+    }
+    pthread_mutex_unlock(&nvs_mutex);
+    return ESP_OK;
+}
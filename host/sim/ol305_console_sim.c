@@ -0,0 +1,128 @@
+// The board as the host controller sees it: ol305_console.c on a pseudo terminal in front of simulated
+// locks, for ol305_ctl and the controller software without a board.
+//
+// ol305_console_sim [-l locks] [-c connect_ms] [-d latency_ms] [-j jitter_ms] [-p loss_pct] [-e data_dir]
+//
+// prints the path of the terminal, then serves it until killed
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "nvs_flash.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "ol305.h"
+#include "ol305_console.h"
+#include "ol305_transport_sim.h"
+#include "ol305_usage.h"
+#include "ol305_trace.h"
+
+const static char *password = "yOTmK50z";
+
+static int pty_fd = -1;
+
+static esp_err_t pty_init(void)
+{
+    pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (0 > pty_fd || 0 != grantpt(pty_fd) || 0 != unlockpt(pty_fd))
+        return ESP_FAIL;
+    //raw on both ends, the frames are binary
+    struct termios tio;
+    tcgetattr(pty_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(pty_fd, TCSANOW, &tio);
+    return ESP_OK;
+}
+
+static int pty_read(uint8_t *buf, size_t size, uint32_t timeout_ms)
+{
+    struct pollfd pfd = {.fd = pty_fd, .events = POLLIN};
+    if (0 >= poll(&pfd, 1, (UINT32_MAX == timeout_ms) ? -1 : (int)timeout_ms))
+        return 0;
+    ssize_t len = read(pty_fd, buf, size);
+    //no controller attached, EIO until one opens the terminal
+    if (0 >= len)
+    {
+        usleep(20000);
+        return 0;
+    }
+    return len;
+}
+
+static void pty_write(const uint8_t *data, size_t len)
+{
+    while (0 < len)
+    {
+        ssize_t done = write(pty_fd, data, len);
+        if (0 >= done)
+            return;
+        data += done;
+        len -= done;
+    }
+}
+
+static const ol305_console_io_t pty_console =
+{
+    .name = "pty",
+    .init = pty_init,
+    .read = pty_read,
+    .write = pty_write,
+};
+
+int main(int argc, char **argv)
+{
+    ol305_sim_config_t config = {.connect_ms = 50, .latency_ms = 15, .jitter_ms = 5, .loss_pct = 0};
+    int lock_count = 1;
+    const char *data_dir = NULL;
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "l:c:d:j:p:e:")))
+    {
+        switch (opt)
+        {
+            case 'l': lock_count = atoi(optarg); break;
+            case 'c': config.connect_ms = atoi(optarg); break;
+            case 'd': config.latency_ms = atoi(optarg); break;
+            case 'j': config.jitter_ms = atoi(optarg); break;
+            case 'p': config.loss_pct = atoi(optarg); break;
+            case 'e': data_dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-l locks] [-c connect_ms] [-d latency_ms] [-j jitter_ms] [-p loss_pct] [-e data_dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (0 >= lock_count || OL305_SIM_MAX_LINKS < lock_count)
+    {
+        fprintf(stderr, "1..%d locks\n", OL305_SIM_MAX_LINKS);
+        return 2;
+    }
+
+    nvs_flash_init();
+    ol305_usage_set_dir(data_dir);
+    ol305_sim_configure(&config);
+    //as on the board, the console can stream a trace
+    ol305_set_transport(ol305_trace_transport(&ol305_sim_transport));
+    for (int i = 0; i < lock_count; i++)
+    {
+        uint8_t mac[6] = {0xd5, 0x7b, 0xf1, 0xca, 0x51, 0x51 + i};
+        ol305_emulator_t *emu = ol305_sim_add_lock(mac, password);
+        for (int k = 0; k < 20; k++)
+            ol305_emulator_add_usage(emu, 1000 + k, 60 * k, 60 * k + 30);
+        ol305_handle_t lock = ol305_add_lock();
+        set_ol305_ble_password(lock, password);
+        set_ol305_mac_addr(lock, mac, sizeof(mac));
+        xTaskCreate(&ol305_task, "OL305_TASK", 5000, lock, 5, NULL);
+    }
+
+    if (ESP_OK != ol305_console_start(&pty_console))
+        return 1;
+    printf("%s\n", ptsname(pty_fd));
+    fflush(stdout);
+    while (1)
+        vTaskDelay(pdMS_TO_TICKS(1000));
+}
@@ -0,0 +1,258 @@
+#include <string.h>
+#include <stdlib.h>
+#include "ol305_emulator.h"
+#include "ol305.h"
+
+// CRC-8/MAXIM computed bit by bit, independent from the table used by the firmware
+static uint8_t emu_crc8(const uint8_t *data, uint16_t len)
+{
+    uint8_t crc = 0;
+    while (len--)
+    {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x01) ? (crc >> 1) ^ 0x8c : crc >> 1;
+    }
+    return crc;
+}
+
+uint16_t ol305_emulator_encode(uint8_t key, uint8_t cmd, const uint8_t *data, uint8_t len, uint8_t *frame)
+{
+    uint8_t rand_byte = rand() % 256;
+    frame[0] = 0xa3;
+    frame[1] = 0xa4;
+    frame[2] = len;
+    frame[3] = (uint8_t)(rand_byte + 0x32);
+    frame[4] = key ^ rand_byte;
+    frame[5] = cmd ^ rand_byte;
+    for (uint8_t i = 0; i < len; i++)
+        frame[6 + i] = data[i] ^ rand_byte;
+    frame[6 + len] = emu_crc8(frame, 6 + len);
+    return 7 + len;
+}
+
+static void emu_send(ol305_emulator_t *emu, uint32_t delay_ms, uint8_t cmd, const uint8_t *data, uint8_t len,
+                     ol305_emulator_tx_t tx, void *ctx)
+{
+    uint8_t frame[OL305_EMU_MAX_FRAME];
+    uint16_t frame_len = ol305_emulator_encode(emu->key, cmd, data, len, frame);
+    emu->frames_out++;
+    tx(ctx, delay_ms, frame, frame_len);
+}
+
+void ol305_emulator_init(ol305_emulator_t *emu, const uint8_t *mac, const char *password)
+{
+    memset(emu, 0, sizeof(*emu));
+    memcpy(emu->mac, mac, sizeof(emu->mac));
+    strncpy(emu->password, password, sizeof(emu->password) - 1);
+    emu->status = 0x02;
+    emu->battery_voltage = 3950;
+    emu->settings[0] = 0x02;
+    emu->settings[1] = 0x02;
+    emu->settings[2] = 0x02;
+    memcpy(emu->card, (uint8_t[]){0x04, 0x5a, 0x2b, 0x91, 0x7c, 0x10, 0x00, 0x00}, sizeof(emu->card));
+    emu->card_delay_ms = 500;
+}
+
+void ol305_emulator_reset_session(ol305_emulator_t *emu)
+{
+    emu->key = 0x00;
+}
+
+static int emu_find_card(const ol305_emulator_t *emu, const uint8_t *card)
+{
+    for (int i = 0; i < emu->card_count; i++)
+    {
+        if (0 == memcmp(emu->cards[i], card, 8))
+            return i;
+    }
+    return -1;
+}
+
+// 0x01 -> added; 0x02 -> no room; 0x03 -> already there
+static uint8_t emu_add_card(ol305_emulator_t *emu, const uint8_t *card)
+{
+    if (0 <= emu_find_card(emu, card))
+        return 0x03;
+    if (OL305_EMU_MAX_CARDS <= emu->card_count)
+        return 0x02;
+    memcpy(emu->cards[emu->card_count++], card, 8);
+    return 0x01;
+}
+
+bool ol305_emulator_add_usage(ol305_emulator_t *emu, uint32_t user_id, uint32_t unlock_time, uint32_t lock_time)
+{
+    if (OL305_EMU_MAX_USAGE <= emu->usage_count)
+        return false;
+    uint32_t *record = emu->usage[(emu->usage_first + emu->usage_count) % OL305_EMU_MAX_USAGE];
+    record[0] = user_id;
+    record[1] = unlock_time;
+    record[2] = lock_time;
+    emu->usage_count++;
+    return true;
+}
+
+void ol305_emulator_lock(ol305_emulator_t *emu, ol305_emulator_tx_t tx, void *ctx)
+{
+    uint8_t data[] = {0x01};
+    emu->status = 0x02;
+    if (0x00 != emu->key)
+        emu_send(emu, 0, LOCK, data, sizeof(data), tx, ctx);
+}
+
+void ol305_emulator_receive(ol305_emulator_t *emu, const uint8_t *frame, uint16_t len, ol305_emulator_tx_t tx, void *ctx)
+{
+    uint8_t data[OL305_EMU_MAX_FRAME];
+
+    if (7 > len || 0xa3 != frame[0] || 0xa4 != frame[1] || len != 7 + frame[2] || OL305_EMU_MAX_FRAME - 7 < frame[2] ||
+        emu_crc8(frame, len - 1) != frame[len - 1])
+    {
+        uint8_t crc_error[] = {0x01};
+        emu->bad_frames++;
+        emu_send(emu, 0, CMD_ERROR, crc_error, sizeof(crc_error), tx, ctx);
+        return;
+    }
+
+    emu->frames_in++;
+    uint8_t rand_byte = frame[3] - 0x32;
+    uint8_t key = frame[4] ^ rand_byte;
+    uint8_t cmd = frame[5] ^ rand_byte;
+    uint8_t data_len = frame[2];
+    for (uint8_t i = 0; i < data_len; i++)
+        data[i] = frame[6 + i] ^ rand_byte;
+
+    if (BLE_KEY == cmd)
+    {
+        if (strlen(emu->password) != data_len || 0 != memcmp(emu->password, data, data_len))
+        {
+            uint8_t key_error[] = {0x03};
+            emu->key = 0x00;
+            emu_send(emu, 0, CMD_ERROR, key_error, sizeof(key_error), tx, ctx);
+            return;
+        }
+        emu->key = 1 + rand() % 255;
+        uint8_t answer[] = {0x01, emu->key, 0x00, 0x00};
+        emu_send(emu, 0, BLE_KEY, answer, sizeof(answer), tx, ctx);
+        return;
+    }
+
+    if (0x00 == emu->key || key != emu->key)
+    {
+        uint8_t no_key[] = {0x02};
+        emu_send(emu, 0, CMD_ERROR, no_key, sizeof(no_key), tx, ctx);
+        return;
+    }
+
+    switch (cmd)
+    {
+        case UNLOCK:
+            //1 byte -> the client acknowledges our answer
+            if (1 == data_len)
+                break;
+            uint8_t unlock_answer[] = {0x01};
+            if (0 < emu->refuse_unlocks)
+            {
+                emu->refuse_unlocks--;
+                unlock_answer[0] = 0x02;
+            }
+            else
+                emu->status = 0x01;
+            emu_send(emu, 0, UNLOCK, unlock_answer, sizeof(unlock_answer), tx, ctx);
+            break;
+
+        case LOCK:
+            //acknowledge of a LOCK notification
+            break;
+
+        case QUERY_INFO:
+            uint16_t battery = emu->battery_voltage / 10;
+            uint8_t info[] = {battery >> 8, battery & 0xff, (0x01 == emu->status) ? 0x01 : 0x02};
+            emu_send(emu, 0, QUERY_INFO, info, sizeof(info), tx, ctx);
+            break;
+
+        case REGISTER_RFID:
+            uint8_t card[9] = {0x01};
+            //8 bytes -> the card is registered without being presented
+            if (8 == data_len)
+            {
+                memcpy(&card[1], data, 8);
+                card[0] = emu_add_card(emu, data);
+                emu_send(emu, 0, REGISTER_RFID, card, sizeof(card), tx, ctx);
+                break;
+            }
+            uint8_t start[] = {0x00};
+            memcpy(&card[1], emu->card, sizeof(emu->card));
+            card[0] = emu_add_card(emu, emu->card);
+            emu_send(emu, 0, REGISTER_RFID, start, sizeof(start), tx, ctx);
+            emu_send(emu, emu->card_delay_ms, REGISTER_RFID, card, sizeof(card), tx, ctx);
+            break;
+
+        case DELETE_RFID:
+            //all zero -> every card
+            uint8_t deleted[] = {0x01};
+            static const uint8_t all_cards[8] = {0};
+            if (8 > data_len || 0 == memcmp(data, all_cards, 8))
+                emu->card_count = 0;
+            else
+            {
+                int pos = emu_find_card(emu, data);
+                if (0 > pos)
+                    deleted[0] = 0x00;
+                else
+                    memmove(emu->cards[pos], emu->cards[pos + 1], (--emu->card_count - pos) * 8);
+            }
+            emu_send(emu, 0, DELETE_RFID, deleted, sizeof(deleted), tx, ctx);
+            break;
+
+        case GET_RFID:
+            //0x01 -> card follows; card count; index; card
+            uint8_t listed[11] = {0x00, emu->card_count, 0x00};
+            if (1 <= data_len)
+                listed[2] = data[0];
+            if (listed[2] < emu->card_count)
+            {
+                listed[0] = 0x01;
+                memcpy(&listed[3], emu->cards[listed[2]], 8);
+            }
+            emu_send(emu, 0, GET_RFID, listed, (0x01 == listed[0]) ? sizeof(listed) : 3, tx, ctx);
+            break;
+
+        case OBTAIN_LAST_USAGE:
+            //0x00 -> nothing left; 0x01, user id, unlock time, lock time, big endian
+            uint8_t usage[13] = {0x00};
+            if (0 < emu->usage_count)
+            {
+                const uint32_t *record = emu->usage[emu->usage_first];
+                usage[0] = 0x01;
+                for (uint8_t i = 0; i < 3; i++)
+                {
+                    usage[1 + 4 * i] = record[i] >> 24;
+                    usage[2 + 4 * i] = record[i] >> 16;
+                    usage[3 + 4 * i] = record[i] >> 8;
+                    usage[4 + 4 * i] = record[i];
+                }
+            }
+            emu_send(emu, 0, OBTAIN_LAST_USAGE, usage, (0 < emu->usage_count) ? sizeof(usage) : 1, tx, ctx);
+            break;
+
+        case DELETE_LAST_USAGE:
+            uint8_t usage_deleted[] = {0x00};
+            if (0 < emu->usage_count)
+            {
+                emu->usage_first = (emu->usage_first + 1) % OL305_EMU_MAX_USAGE;
+                emu->usage_count--;
+                usage_deleted[0] = 0x01;
+            }
+            emu_send(emu, 0, DELETE_LAST_USAGE, usage_deleted, sizeof(usage_deleted), tx, ctx);
+            break;
+
+        case LOCK_SETTINGS:
+            if (3 <= data_len)
+                memcpy(emu->settings, data, sizeof(emu->settings));
+            emu_send(emu, 0, LOCK_SETTINGS, emu->settings, sizeof(emu->settings), tx, ctx);
+            break;
+
+        default:
+            break;
+    }
+}
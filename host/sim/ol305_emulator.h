@@ -0,0 +1,45 @@
+#ifndef __OL305_EMULATOR_H__
+#define __OL305_EMULATOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OL305_EMU_MAX_FRAME 32
+#define OL305_EMU_MAX_USAGE 1024
+#define OL305_EMU_MAX_CARDS 64
+
+//a simulated OL305 lock, it answers the frames written by ol305.c the way the real lock does
+typedef struct
+{
+    uint8_t mac[6];
+    char password[9];
+    uint8_t key;                //session key handed out by the BLE_KEY answer, 0 -> no session
+    uint8_t status;             //unlocked -> 0x01; locked -> 0x02
+    int battery_voltage;        //mV
+    uint8_t settings[3];        //bluetooth, button, RFID unlock; off -> 0x01; on -> 0x02
+    uint8_t card[8];            //reported by the next RFID read
+    uint8_t cards[OL305_EMU_MAX_CARDS][8]; //registered cards, in the order they were added
+    uint16_t card_count;
+    uint32_t card_delay_ms;     //time until a card is presented after a read starts
+    uint32_t refuse_unlocks;    //the next unlock requests fail
+    uint32_t usage[OL305_EMU_MAX_USAGE][3]; //user id, unlock time, lock time; oldest first
+    uint16_t usage_first;
+    uint16_t usage_count;
+    uint32_t frames_in;
+    uint32_t frames_out;
+    uint32_t bad_frames;
+}ol305_emulator_t;
+
+//sends a frame to the client after delay_ms, provided by the transport
+typedef void (*ol305_emulator_tx_t)(void *ctx, uint32_t delay_ms, const uint8_t *frame, uint16_t len);
+
+void ol305_emulator_init(ol305_emulator_t *emu, const uint8_t *mac, const char *password);
+void ol305_emulator_reset_session(ol305_emulator_t *emu);
+void ol305_emulator_receive(ol305_emulator_t *emu, const uint8_t *frame, uint16_t len, ol305_emulator_tx_t tx, void *ctx);
+//the shackle is closed by hand, a LOCK notification is sent
+void ol305_emulator_lock(ol305_emulator_t *emu, ol305_emulator_tx_t tx, void *ctx);
+//a usage record the lock hands out with OBTAIN_LAST_USAGE, false when the memory of the lock is full
+bool ol305_emulator_add_usage(ol305_emulator_t *emu, uint32_t user_id, uint32_t unlock_time, uint32_t lock_time);
+uint16_t ol305_emulator_encode(uint8_t key, uint8_t cmd, const uint8_t *data, uint8_t len, uint8_t *frame);
+
+#endif
@@ -0,0 +1,199 @@
+// More locks than the simulator has links: ol305_fleet.c takes turns on the slots while requests arrive
+// for random locks. Reports the throughput, the latency of each request type and, per lock, the slots
+// it got, the longest wait for one and the deepest queue seen.
+//
+// ol305_fleet_sim [-l locks] [-s slots] [-n requests] [-r rate_per_s] [-c connect_ms] [-d latency_ms] [-j jitter_ms] [-p loss_pct]
+//
+// -s 0 runs without the scheduler: the first locks keep the links and the requests of the others time out
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nvs_flash.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "ol305.h"
+#include "ol305_fleet.h"
+#include "ol305_transport_sim.h"
+#include "ol305_txpool.h"
+
+#define SIM_MAX_REQUESTS 10000
+#define SIM_TIMEOUT_MS 30000
+
+const static char *password = "yOTmK50z";
+
+//request mix, in percent
+static const struct
+{
+    OL305_REQUEST request;
+    const char *name;
+    int share;
+} sim_mix[] =
+{
+    {OL305_REQ_UNLOCK, "unlock", 60},
+    {OL305_REQ_SETTINGS, "settings", 20},
+    {OL305_REQ_QUERY, "query", 20},
+};
+#define SIM_MIX_LEN (sizeof(sim_mix) / sizeof(sim_mix[0]))
+
+static int64_t sim_samples[SIM_MIX_LEN][SIM_MAX_REQUESTS];
+static int sim_counts[SIM_MIX_LEN];
+static int sim_failed[SIM_MIX_LEN];
+static int sim_done = 0;
+static portMUX_TYPE sim_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static int compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void sim_request_done(ol305_handle_t lock, const ol305_result_t *result, void *ctx)
+{
+    int type = (intptr_t)ctx;
+    portENTER_CRITICAL(&sim_mux);
+    if (ESP_OK == result->err)
+        sim_samples[type][sim_counts[type]++] = result->latency_us;
+    else
+        sim_failed[type]++;
+    sim_done++;
+    portEXIT_CRITICAL(&sim_mux);
+}
+
+static int sim_pick_type()
+{
+    int roll = rand() % 100;
+    for (int i = 0; i < SIM_MIX_LEN; i++)
+    {
+        if (roll < sim_mix[i].share)
+            return i;
+        roll -= sim_mix[i].share;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    ol305_sim_config_t config = {.connect_ms = 300, .latency_ms = 15, .jitter_ms = 5, .loss_pct = 0};
+    ol305_fleet_config_t fleet = {.slots = OL305_SIM_MAX_LINKS};
+    int lock_count = 12;
+    int requests = 200;
+    int rate = 20;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "l:s:n:r:c:d:j:p:")))
+    {
+        switch (opt)
+        {
+            case 'l': lock_count = atoi(optarg); break;
+            case 's': fleet.slots = atoi(optarg); break;
+            case 'n': requests = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'c': config.connect_ms = atoi(optarg); break;
+            case 'd': config.latency_ms = atoi(optarg); break;
+            case 'j': config.jitter_ms = atoi(optarg); break;
+            case 'p': config.loss_pct = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-l locks] [-s slots] [-n requests] [-r rate_per_s] [-c connect_ms] [-d latency_ms] [-j jitter_ms] [-p loss_pct]\n", argv[0]);
+                return 2;
+        }
+    }
+    int max_locks = (OL305_SIM_MAX_LOCKS < OL305_MAX_LOCKS) ? OL305_SIM_MAX_LOCKS : OL305_MAX_LOCKS;
+    if (0 >= lock_count || max_locks < lock_count || OL305_SIM_MAX_LINKS < fleet.slots ||
+        0 >= requests || SIM_MAX_REQUESTS < requests || 0 >= rate)
+    {
+        fprintf(stderr, "1..%d locks, 0..%d slots, 1..%d requests\n", max_locks, OL305_SIM_MAX_LINKS, SIM_MAX_REQUESTS);
+        return 2;
+    }
+
+    srand(1);
+    nvs_flash_init();
+    ol305_sim_configure(&config);
+    ol305_set_transport(&ol305_sim_transport);
+    ol305_fleet_configure(&fleet);
+
+    ol305_handle_t locks[OL305_SIM_MAX_LOCKS];
+    for (int i = 0; i < lock_count; i++)
+    {
+        uint8_t mac[6] = {0xd5, 0x7b, 0xf1, 0xca, 0x51, 0x51 + i};
+        ol305_sim_add_lock(mac, password);
+        locks[i] = ol305_add_lock();
+        set_ol305_ble_password(locks[i], password);
+        set_ol305_mac_addr(locks[i], mac, sizeof(mac));
+        //the status of a parked lock is refreshed by a turn on a slot
+        ol305_set_status_ttl(locks[i], 10000);
+        xTaskCreate(&ol305_task, "OL305_TASK", 5000, locks[i], 5, NULL);
+        ol305_control(locks[i], OL305_STATE_ENABLE, 0, 0);
+    }
+
+    uint8_t max_depth[OL305_SIM_MAX_LOCKS] = {0};
+    int rejected = 0;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < requests; i++)
+    {
+        int type = sim_pick_type();
+        ol305_request_t request =
+        {
+            .request = sim_mix[type].request,
+            .settings = {0x02, 0x02, 0x01},
+            .timeout_ms = SIM_TIMEOUT_MS,
+            .done_cb = sim_request_done,
+            .ctx = (void *)(intptr_t)type,
+        };
+        if (0 == ol305_submit(locks[rand() % lock_count], &request))
+            rejected++;
+        vTaskDelay(pdMS_TO_TICKS(1000 / rate));
+        for (int k = 0; k < lock_count; k++)
+        {
+            ol305_fleet_lock_t info;
+            ol305_fleet_get(k, &info, esp_timer_get_time());
+            if (max_depth[k] < info.depth)
+                max_depth[k] = info.depth;
+        }
+    }
+    int64_t deadline = esp_timer_get_time() + (SIM_TIMEOUT_MS + 5000) * 1000LL;
+    while (sim_done + rejected < requests && esp_timer_get_time() < deadline)
+        vTaskDelay(pdMS_TO_TICKS(10));
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    int ok = 0;
+    int failed = rejected;
+    for (int i = 0; i < SIM_MIX_LEN; i++)
+    {
+        ok += sim_counts[i];
+        failed += sim_failed[i];
+    }
+    printf("fleet    %d locks, %d slots, %d requests at %d/s\n", lock_count, fleet.slots, requests, rate);
+    printf("done     %d ok, %d failed, %d rejected in %.1f s, %.1f requests/s\n", ok, failed - rejected, rejected,
+           elapsed_us / 1e6, ok * 1e6 / elapsed_us);
+    for (int i = 0; i < SIM_MIX_LEN; i++)
+    {
+        int count = sim_counts[i];
+        if (0 == count)
+        {
+            printf("%-8s no samples, %d failed\n", sim_mix[i].name, sim_failed[i]);
+            continue;
+        }
+        qsort(sim_samples[i], count, sizeof(sim_samples[i][0]), compare_latency);
+        printf("%-8s n=%d p50=%.1f p95=%.1f max=%.1f ms, %d failed\n", sim_mix[i].name, count,
+               sim_samples[i][count / 2] / 1000.0, sim_samples[i][(count * 95) / 100] / 1000.0,
+               sim_samples[i][count - 1] / 1000.0, sim_failed[i]);
+    }
+    for (int i = 0; i < lock_count; i++)
+    {
+        ol305_fleet_lock_t info;
+        ol305_stats_t stats;
+        ol305_fleet_get(i, &info, esp_timer_get_time());
+        ol305_get_stats(locks[i], &stats);
+        printf("lock %-2d  grants=%u preemptions=%u max_wait=%u ms max_depth=%u connects=%u\n", i, info.grants,
+               info.preemptions, info.max_wait_ms, max_depth[i], stats.counters[OL305_STAT_CONNECTS]);
+    }
+    for (int i = 0; i < lock_count; i++)
+        ol305_control(locks[i], OL305_STATE_SHUTDOWN, 1, 5000);
+    printf("txpool   %u/%d buffers free\n", ol305_txpool_free_count(), OL305_TXPOOL_LEN);
+    return 0 < failed;
+}
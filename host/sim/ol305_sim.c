@@ -0,0 +1,263 @@
+// Host run of ol305.c against simulated locks: the full request path (queue, key
+// handshake, retries, replies) without a board or a radio.
+//
+// ol305_sim [-n unlocks] [-l locks] [-c connect_ms] [-d latency_ms] [-j jitter_ms] [-p loss_pct] [-r drop_every] [-e data_dir] [-u usage_records] [-k cards] [-t trace]
+//
+// data_dir gets the event log and the usage stores, -u needs it
+// trace gets every frame and link event, for ol305_replay
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nvs_flash.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "ol305.h"
+#include "ol305_transport_sim.h"
+#include "ol305_txpool.h"
+#include "ol305_latency.h"
+#include "ol305_evlog.h"
+#include "ol305_usage.h"
+#include "ol305_trace.h"
+
+#define SIM_DONE_BIT (1 << 0)
+#define SIM_MAX_SAMPLES 10000
+#define SIM_MAX_CARDS OL305_EMU_MAX_CARDS
+
+const static char *password = "yOTmK50z";
+
+static int compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static esp_err_t sim_request(ol305_handle_t lock, OL305_REQUEST type, ol305_result_t *result)
+{
+    EventGroupHandle_t done = xEventGroupCreate();
+    ol305_request_t request =
+    {
+        .request = type,
+        .event_group = done,
+        .done_bits = SIM_DONE_BIT,
+        .result = result,
+    };
+    if (OL305_REQ_SETTINGS == type)
+        request.settings = (ol305_settings_t){0x02, 0x02, 0x01};
+
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (0 != ol305_submit(lock, &request))
+    {
+        xEventGroupWaitBits(done, SIM_DONE_BIT, pdTRUE, pdTRUE, portMAX_DELAY);
+        err = result->err;
+    }
+    vEventGroupDelete(done);
+    return err;
+}
+
+static void print_latency(const char *name, int64_t *samples, int count)
+{
+    if (0 == count)
+    {
+        printf("%-8s no samples\n", name);
+        return;
+    }
+
+    int64_t sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += samples[i];
+    qsort(samples, count, sizeof(samples[0]), compare_latency);
+    printf("%-8s n=%d min=%.1f avg=%.1f p50=%.1f p95=%.1f max=%.1f ms\n", name, count,
+           samples[0] / 1000.0, sum / count / 1000.0, samples[count / 2] / 1000.0,
+           samples[(count * 95) / 100] / 1000.0, samples[count - 1] / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    ol305_sim_config_t config = {.connect_ms = 50, .latency_ms = 15, .jitter_ms = 5, .loss_pct = 0};
+    int iterations = 20;
+    int lock_count = 1;
+    int drop_every = 0;
+    const char *data_dir = NULL;
+    const char *trace_path = NULL;
+    int usage_records = 0;
+    int card_count = 0;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "n:l:c:d:j:p:r:e:u:k:t:")))
+    {
+        switch (opt)
+        {
+            case 'n': iterations = atoi(optarg); break;
+            case 'l': lock_count = atoi(optarg); break;
+            case 'c': config.connect_ms = atoi(optarg); break;
+            case 'd': config.latency_ms = atoi(optarg); break;
+            case 'j': config.jitter_ms = atoi(optarg); break;
+            case 'p': config.loss_pct = atoi(optarg); break;
+            case 'r': drop_every = atoi(optarg); break;
+            case 'e': data_dir = optarg; break;
+            case 'u': usage_records = atoi(optarg); break;
+            case 'k': card_count = atoi(optarg); break;
+            case 't': trace_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n unlocks] [-l locks] [-c connect_ms] [-d latency_ms] [-j jitter_ms] [-p loss_pct] [-r drop_every] [-e data_dir] [-u usage_records] [-k cards] [-t trace]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (0 >= lock_count || OL305_SIM_MAX_LINKS < lock_count || 0 > iterations || SIM_MAX_SAMPLES < iterations)
+    {
+        fprintf(stderr, "1..%d locks, 0..%d unlocks\n", OL305_SIM_MAX_LINKS, SIM_MAX_SAMPLES);
+        return 2;
+    }
+    if (0 > usage_records || OL305_EMU_MAX_USAGE < usage_records || (0 < usage_records && NULL == data_dir))
+    {
+        fprintf(stderr, "0..%d usage records, with -e\n", OL305_EMU_MAX_USAGE);
+        return 2;
+    }
+    if (0 > card_count || SIM_MAX_CARDS - 2 < card_count)
+    {
+        fprintf(stderr, "0..%d cards\n", SIM_MAX_CARDS - 2);
+        return 2;
+    }
+
+    srand(1);
+    nvs_flash_init();
+    if (NULL != data_dir && ESP_OK != ol305_evlog_start(data_dir))
+        return 2;
+    ol305_usage_set_dir(data_dir);
+    ol305_sim_configure(&config);
+    if (NULL != trace_path)
+    {
+        ol305_set_transport(ol305_trace_transport(&ol305_sim_transport));
+        if (ESP_OK != ol305_trace_start(trace_path))
+            return 2;
+    }
+    else
+        ol305_set_transport(&ol305_sim_transport);
+
+    ol305_handle_t locks[OL305_SIM_MAX_LINKS];
+    ol305_emulator_t *emus[OL305_SIM_MAX_LINKS];
+    for (int i = 0; i < lock_count; i++)
+    {
+        uint8_t mac[6] = {0xd5, 0x7b, 0xf1, 0xca, 0x51, 0x51 + i};
+        emus[i] = ol305_sim_add_lock(mac, password);
+        for (int k = 0; k < usage_records; k++)
+            ol305_emulator_add_usage(emus[i], 1000 + k, 60 * k, 60 * k + 30);
+        //registered on the lock by someone else, the first card sync has to list them
+        for (int k = 0; k < 3 && 0 < card_count; k++)
+            memcpy(emus[i]->cards[emus[i]->card_count++], (uint8_t[8]){0xf0, 0, 0, 0, 0, 0, 0, k}, 8);
+        locks[i] = ol305_add_lock();
+        set_ol305_ble_password(locks[i], password);
+        set_ol305_mac_addr(locks[i], mac, sizeof(mac));
+        xTaskCreate(&ol305_task, "OL305_TASK", 5000, locks[i], 5, NULL);
+    }
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < lock_count; i++)
+        ol305_control(locks[i], OL305_STATE_ENABLE, 1, 10000);
+    printf("connect   %.1f ms for %d lock(s)\n", (esp_timer_get_time() - start) / 1000.0, lock_count);
+
+    static int64_t samples[SIM_MAX_SAMPLES];
+    int count = 0;
+    int failed = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        ol305_result_t result;
+        ol305_handle_t lock = locks[i % lock_count];
+        if (ESP_OK == sim_request(lock, OL305_REQ_UNLOCK, &result))
+            samples[count++] = result.latency_us;
+        else
+            failed++;
+        ol305_sim_lock(emus[i % lock_count]);
+        //the LOCK notification refreshes the cached status
+        vTaskDelay(pdMS_TO_TICKS(2 * (config.latency_ms + config.jitter_ms)));
+        if (0 < drop_every && 0 == (i + 1) % drop_every)
+            ol305_sim_drop_link(emus[i % lock_count]);
+    }
+    print_latency("unlock", samples, count);
+    if (0 < failed)
+        printf("unlock   %d failed\n", failed);
+
+    const OL305_REQUEST others[] = {OL305_REQ_QUERY, OL305_REQ_READ_RFID, OL305_REQ_DELETE_RFID, OL305_REQ_SETTINGS};
+    const char *names[] = {"query", "rfid", "delete", "settings"};
+    for (int i = 0; i < sizeof(others) / sizeof(others[0]); i++)
+    {
+        ol305_result_t result;
+        esp_err_t err = sim_request(locks[0], others[i], &result);
+        printf("%-8s %s %.1f ms\n", names[i], esp_err_to_name(err), result.latency_us / 1000.0);
+    }
+
+    //the whole set, then the same set shifted by two cards: the second sync only sends the difference
+    static uint8_t cards[SIM_MAX_CARDS][8];
+    for (int k = 0; k < card_count + 2; k++)
+        memcpy(cards[k], (uint8_t[8]){0xc0, 0, 0, 0, 0, 0, k >> 8, k & 0xff}, 8);
+    for (int i = 0; i < lock_count && 0 < card_count; i++)
+    {
+        for (int shift = 0; shift <= 2; shift += 2)
+        {
+            ol305_result_t result = {0};
+            uint32_t frames = emus[i]->frames_in;
+            ol305_set_cards(locks[i], &cards[shift], card_count);
+            esp_err_t err = sim_request(locks[i], OL305_REQ_SYNC_RFID, &result);
+            printf("cards    lock %d %s %u registered, %u deleted, %u listed, %u frames in %u ms, %u on the lock\n", i,
+                   esp_err_to_name(err), result.rfid.registered, result.rfid.deleted, result.rfid.listed,
+                   emus[i]->frames_in - frames, result.rfid.elapsed_ms, emus[i]->card_count);
+            if (ESP_OK != err || card_count != emus[i]->card_count)
+                failed++;
+        }
+    }
+
+    for (int i = 0; i < lock_count && 0 < usage_records; i++)
+    {
+        ol305_result_t result = {0};
+        esp_err_t err = sim_request(locks[i], OL305_REQ_SYNC_USAGE, &result);
+        uint32_t ms = (0 == result.usage.elapsed_ms) ? 1 : result.usage.elapsed_ms;
+        printf("usage    lock %d %s %u records, %u duplicates in %u ms, %.1f records/s, %u left on the lock\n", i,
+               esp_err_to_name(err), result.usage.records, result.usage.duplicates, result.usage.elapsed_ms,
+               result.usage.records * 1000.0 / ms, emus[i]->usage_count);
+        if (ESP_OK != err)
+            failed++;
+    }
+
+    printf("%-12s %6s %9s %9s %9s %9s %9s (ms)\n", "histogram", "count", "min", "p50", "p95", "p99", "max");
+    for (ol305_lat_id_t id = 0; id < OL305_LAT_MAX; id++)
+    {
+        ol305_lat_summary_t summary;
+        if (ESP_OK != ol305_lat_get(id, &summary))
+            continue;
+        printf("%-12s %6u %9.1f %9.1f %9.1f %9.1f %9.1f\n", ol305_lat_name(id), summary.count, summary.min_us / 1000.0,
+               summary.p50_us / 1000.0, summary.p95_us / 1000.0, summary.p99_us / 1000.0, summary.max_us / 1000.0);
+    }
+
+    for (int i = 0; i < lock_count; i++)
+    {
+        printf("lock %d   frames in=%u out=%u bad=%u\n", i, emus[i]->frames_in, emus[i]->frames_out, emus[i]->bad_frames);
+        ol305_stats_t stats;
+        ol305_get_stats(locks[i], &stats);
+        printf("        ");
+        for (ol305_stat_t stat = 0; stat < OL305_STAT_MAX; stat++)
+        {
+            if (0 != stats.counters[stat])
+                printf(" %s=%u", ol305_stat_name(stat), stats.counters[stat]);
+        }
+        printf("\n");
+        ol305_control(locks[i], OL305_STATE_SHUTDOWN, 1, 5000);
+    }
+    printf("txpool   %u/%d buffers free\n", ol305_txpool_free_count(), OL305_TXPOOL_LEN);
+    if (NULL != data_dir)
+    {
+        esp_err_t err = ol305_evlog_flush(5000);
+        printf("evlog    %s, %u records lost\n", esp_err_to_name(err), ol305_evlog_lost());
+    }
+    if (NULL != trace_path)
+    {
+        esp_err_t err = ol305_trace_stop(5000);
+        printf("trace    %s, %u records lost\n", esp_err_to_name(err), ol305_trace_lost());
+    }
+    return 0 < failed;
+}
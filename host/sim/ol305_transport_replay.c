@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "ol305_transport_replay.h"
+#include "ol305_trace.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+const static char *TAG = "OL305_REPLAY";
+
+typedef struct
+{
+    int64_t time_us; //since the first record
+    uint8_t type;
+    int8_t lock; //index in replay_macs, -1 before the link was opened in the trace
+    uint16_t len;
+    const uint8_t *data;
+}replay_rec;
+
+typedef struct
+{
+    bool open;
+    bool connected;
+    ol305_link_cb_t cb;
+    void *ctx;
+    uint32_t trace_tx; //TX records the replay went past
+    uint32_t client_tx; //writes of the client, plus the ones given up on after a stall
+    uint32_t written_pending; //writes to complete, from the replay thread
+    uint8_t *expected; //commands of the TX records, in order
+    uint32_t expected_count;
+}replay_lock;
+
+static uint8_t *replay_file = NULL;
+static replay_rec *replay_recs = NULL;
+static uint32_t replay_count = 0;
+static uint8_t replay_macs[OL305_REPLAY_MAX_LOCKS][6];
+static uint8_t replay_lock_count = 0;
+static replay_lock replay_locks[OL305_REPLAY_MAX_LOCKS];
+static uint32_t replay_pos = 0; //record of the request callback, replay thread only
+static ol305_replay_config_t replay_config = {.stall_ms = 500};
+static ol305_replay_stats_t replay_stats;
+static bool replay_thread_started = false;
+static pthread_t replay_thread;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond;
+
+static int replay_find_mac(const uint8_t *mac)
+{
+    for (int i = 0; i < replay_lock_count; i++)
+    {
+        if (0 == memcmp(replay_macs[i], mac, 6))
+            return i;
+    }
+    return -1;
+}
+
+esp_err_t ol305_replay_load(const char *path, uint8_t (*macs)[6], uint8_t *count)
+{
+    //before the client or ol305_replay_wait can wait on it
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&replay_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    FILE *file = fopen(path, "rb");
+    if (NULL == file)
+        return ESP_ERR_NOT_FOUND;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    replay_file = malloc((0 < size) ? size : 1);
+    if (NULL == replay_file || (0 < size && 1 != fread(replay_file, size, 1, file)))
+    {
+        fclose(file);
+        return ESP_FAIL;
+    }
+    fclose(file);
+
+    ol305_trace_header_t header;
+    if ((long)sizeof(header) > size)
+        return ESP_ERR_INVALID_SIZE;
+    memcpy(&header, replay_file, sizeof(header));
+    if (OL305_TRACE_MAGIC != header.magic || OL305_TRACE_VERSION != header.version ||
+        sizeof(ol305_trace_rec_t) != header.rec_size)
+        return ESP_ERR_INVALID_RESPONSE;
+
+    //twice: count, then fill
+    int8_t link_lock[256];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        long pos = sizeof(header);
+        int64_t time_us = 0;
+        replay_count = 0;
+        replay_lock_count = 0;
+        memset(link_lock, -1, sizeof(link_lock));
+        for (int i = 0; i < OL305_REPLAY_MAX_LOCKS; i++)
+            replay_locks[i].expected_count = 0;
+
+        while (pos + (long)sizeof(ol305_trace_rec_t) <= size)
+        {
+            ol305_trace_rec_t rec;
+            memcpy(&rec, &replay_file[pos], sizeof(rec));
+            if (pos + (long)sizeof(rec) + rec.len > size)
+            {
+                //cut by a reset of the board
+                ESP_LOGW(TAG, "%s: truncated record at %ld", path, pos);
+                break;
+            }
+            const uint8_t *data = &replay_file[pos + sizeof(rec)];
+            pos += sizeof(rec) + rec.len;
+            time_us += rec.delta_us;
+
+            uint8_t link = (uint8_t)rec.link;
+            if (OL305_TRACE_OPEN == rec.type && 6 == rec.len)
+            {
+                int lock = replay_find_mac(data);
+                if (0 > lock && OL305_REPLAY_MAX_LOCKS > replay_lock_count)
+                {
+                    lock = replay_lock_count++;
+                    memcpy(replay_macs[lock], data, 6);
+                }
+                link_lock[link] = lock;
+            }
+            int8_t lock = (OL305_TRACE_LOST == rec.type) ? -1 : link_lock[link];
+            if (OL305_TRACE_TX == rec.type && 0 <= lock)
+            {
+                ol305_frame_t frame;
+                replay_lock *rl = &replay_locks[lock];
+                if (1 == pass)
+                    rl->expected[rl->expected_count] = (ESP_OK == ol305_codec_decode(data, rec.len, &frame)) ? frame.cmd : 0xff;
+                rl->expected_count++;
+            }
+            if (1 == pass)
+                replay_recs[replay_count] = (replay_rec){time_us, rec.type, lock, rec.len, data};
+            replay_count++;
+        }
+
+        if (0 == pass)
+        {
+            replay_recs = malloc((replay_count + 1) * sizeof(replay_rec));
+            if (NULL == replay_recs)
+                return ESP_ERR_NO_MEM;
+            for (int i = 0; i < replay_lock_count; i++)
+            {
+                replay_locks[i].expected = malloc(replay_locks[i].expected_count + 1);
+                if (NULL == replay_locks[i].expected)
+                    return ESP_ERR_NO_MEM;
+            }
+        }
+    }
+
+    memcpy(macs, replay_macs, replay_lock_count * 6);
+    *count = replay_lock_count;
+    ESP_LOGI(TAG, "%s: %u records, %u locks", path, replay_count, replay_lock_count);
+    return ESP_OK;
+}
+
+void ol305_replay_configure(const ol305_replay_config_t *config)
+{
+    pthread_mutex_lock(&replay_mutex);
+    replay_config = *config;
+    pthread_mutex_unlock(&replay_mutex);
+}
+
+// Called with replay_mutex held, released around the callback
+static void replay_deliver(int lock, ol305_link_event_t event, const uint8_t *data, uint16_t len)
+{
+    uint8_t copy[OL305_TRACE_MAX_DATA];
+    ol305_link_cb_t cb = replay_locks[lock].cb;
+    void *ctx = replay_locks[lock].ctx;
+    if (0 < len)
+        memcpy(copy, data, len);
+    pthread_mutex_unlock(&replay_mutex);
+    cb(ctx, event, copy, len);
+    pthread_mutex_lock(&replay_mutex);
+}
+
+// Writes of the client complete on this thread, like on the Bluetooth task
+static void replay_complete_writes()
+{
+    for (int i = 0; i < replay_lock_count; i++)
+    {
+        while (replay_locks[i].open && 0 < replay_locks[i].written_pending)
+        {
+            replay_locks[i].written_pending--;
+            replay_deliver(i, OL305_LINK_WRITTEN, NULL, 0);
+        }
+    }
+}
+
+static void replay_timedwait(int64_t until_us)
+{
+    int64_t wait_us = until_us - esp_timer_get_time();
+    if (0 >= wait_us)
+        return;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += wait_us / 1000000;
+    deadline.tv_nsec += (wait_us % 1000000) * 1000;
+    if (1000000000L <= deadline.tv_nsec)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&replay_cond, &replay_mutex, &deadline);
+}
+
+// An OPEN waits for the client to open the link, the events of the lock for the writes that
+// preceded them; a TX only for its time, it is what the client is expected to do next
+static bool replay_ready(const replay_rec *rec)
+{
+    const replay_lock *lock = &replay_locks[rec->lock];
+    if (OL305_TRACE_OPEN == rec->type)
+        return lock->open;
+    if (OL305_TRACE_TX == rec->type)
+        return true;
+    return lock->client_tx >= lock->trace_tx;
+}
+
+// Until due and ready, false when it gave up waiting for the client after stall_ms
+static bool replay_wait(const replay_rec *rec, int64_t due)
+{
+    int64_t give_up = 0;
+    while (1)
+    {
+        replay_complete_writes();
+        int64_t now = esp_timer_get_time();
+        if (now < due)
+        {
+            replay_timedwait(due);
+            continue;
+        }
+        if (replay_ready(rec))
+            return true;
+        if (0 == give_up)
+            give_up = now + replay_config.stall_ms * 1000LL;
+        if (now >= give_up)
+            return false;
+        replay_timedwait(give_up);
+    }
+}
+
+static void *replay_run(void *arg)
+{
+    pthread_mutex_lock(&replay_mutex);
+    int64_t base = 0;
+    int64_t first = -1;
+    for (uint32_t i = 0; i < replay_count; i++)
+    {
+        const replay_rec *rec = &replay_recs[i];
+        replay_stats.records++;
+        if (OL305_TRACE_LOST == rec->type)
+        {
+            uint32_t lost = 0;
+            memcpy(&lost, rec->data, (sizeof(lost) <= rec->len) ? sizeof(lost) : 0);
+            replay_stats.lost += lost;
+            ESP_LOGW(TAG, "%u records lost in the capture", lost);
+            continue;
+        }
+        if (0 > rec->lock)
+        {
+            replay_stats.skipped++;
+            continue;
+        }
+
+        replay_lock *lock = &replay_locks[rec->lock];
+        int64_t due = (0 > first || replay_config.full_speed) ? 0 : base + rec->time_us;
+        switch (rec->type)
+        {
+            case OL305_TRACE_OPEN:
+                if (!replay_wait(rec, due))
+                    replay_stats.stalls++;
+                lock->client_tx = lock->trace_tx;
+                //the recorded times count from the first link the client opened
+                if (0 > first)
+                {
+                    first = rec->time_us;
+                    base = esp_timer_get_time() - rec->time_us;
+                }
+                break;
+
+            case OL305_TRACE_READY:
+            case OL305_TRACE_RX:
+            case OL305_TRACE_CLOSED:
+                if (!replay_wait(rec, due))
+                {
+                    //never coming, the next writes are compared with the trace from here
+                    replay_stats.stalls++;
+                    lock->client_tx = lock->trace_tx;
+                }
+                if (!lock->open)
+                {
+                    replay_stats.skipped++;
+                    break;
+                }
+                if (OL305_TRACE_READY == rec->type)
+                    lock->connected = true;
+                else if (OL305_TRACE_CLOSED == rec->type)
+                    lock->connected = false;
+                replay_stats.delivered++;
+                replay_deliver(rec->lock, (OL305_TRACE_READY == rec->type) ? OL305_LINK_READY :
+                               (OL305_TRACE_RX == rec->type) ? OL305_LINK_DATA : OL305_LINK_CLOSED, rec->data, rec->len);
+                break;
+
+            case OL305_TRACE_TX:
+                replay_wait(rec, due);
+                lock->trace_tx++;
+                replay_stats.tx_expected++;
+                ol305_frame_t frame;
+                if (NULL != replay_config.request_cb && ESP_OK == ol305_codec_decode(rec->data, rec->len, &frame))
+                {
+                    replay_pos = i;
+                    ol305_replay_request_cb_t cb = replay_config.request_cb;
+                    void *ctx = replay_config.ctx;
+                    pthread_mutex_unlock(&replay_mutex);
+                    cb(rec->lock, &frame, ctx);
+                    pthread_mutex_lock(&replay_mutex);
+                }
+                break;
+
+            default:
+                //WRITTEN: the replay completes the writes of the client itself
+                break;
+        }
+    }
+
+    if (0 <= first && 0 < replay_count)
+    {
+        replay_stats.trace_us = replay_recs[replay_count - 1].time_us - first;
+        replay_stats.replay_us = esp_timer_get_time() - (base + first);
+    }
+    replay_stats.done = true;
+    pthread_cond_broadcast(&replay_cond);
+
+    //the client keeps writing until it is shut down
+    while (1)
+    {
+        replay_complete_writes();
+        pthread_cond_wait(&replay_cond, &replay_mutex);
+    }
+    return NULL;
+}
+
+// The records never change once loaded, no lock needed
+bool ol305_replay_peek(uint8_t lock, uint32_t n, ol305_trace_type_t *type, ol305_frame_t *frame)
+{
+    for (uint32_t i = replay_pos + 1; i < replay_count; i++)
+    {
+        const replay_rec *rec = &replay_recs[i];
+        if (lock != rec->lock || (OL305_TRACE_TX != rec->type && OL305_TRACE_RX != rec->type))
+            continue;
+        //a notification with more than one frame is not looked into
+        if (ESP_OK != ol305_codec_decode(rec->data, rec->len, frame))
+            continue;
+        if (0 == n--)
+        {
+            *type = rec->type;
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t ol305_replay_wait(uint32_t timeout_ms)
+{
+    int64_t until = esp_timer_get_time() + timeout_ms * 1000LL;
+    pthread_mutex_lock(&replay_mutex);
+    while (!replay_stats.done && esp_timer_get_time() < until)
+        replay_timedwait(until);
+    bool done = replay_stats.done;
+    pthread_mutex_unlock(&replay_mutex);
+    return done ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void ol305_replay_get_stats(ol305_replay_stats_t *stats)
+{
+    pthread_mutex_lock(&replay_mutex);
+    *stats = replay_stats;
+    pthread_mutex_unlock(&replay_mutex);
+}
+
+static void replay_init()
+{
+    pthread_mutex_lock(&replay_mutex);
+    if (!replay_thread_started)
+    {
+        pthread_create(&replay_thread, NULL, replay_run, NULL);
+        pthread_detach(replay_thread);
+        replay_thread_started = true;
+    }
+    pthread_mutex_unlock(&replay_mutex);
+}
+
+static void replay_deinit()
+{
+}
+
+// The link of a lock is its index in the trace
+static int replay_open(uint8_t *mac_addr, uint16_t mac_len, ol305_link_cb_t cb, void *ctx)
+{
+    int lock = (6 == mac_len) ? replay_find_mac(mac_addr) : -1;
+    if (0 > lock)
+        return OL305_INVALID_LINK;
+    pthread_mutex_lock(&replay_mutex);
+    if (replay_locks[lock].open)
+        lock = OL305_INVALID_LINK;
+    else
+    {
+        replay_locks[lock].open = true;
+        replay_locks[lock].connected = false;
+        replay_locks[lock].cb = cb;
+        replay_locks[lock].ctx = ctx;
+        pthread_cond_broadcast(&replay_cond);
+    }
+    pthread_mutex_unlock(&replay_mutex);
+    return lock;
+}
+
+static void replay_close(int link)
+{
+    if (0 > link || replay_lock_count <= link)
+        return;
+    pthread_mutex_lock(&replay_mutex);
+    replay_locks[link].open = false;
+    replay_locks[link].connected = false;
+    replay_locks[link].written_pending = 0;
+    pthread_mutex_unlock(&replay_mutex);
+}
+
+static bool replay_is_connected(int link)
+{
+    if (0 > link || replay_lock_count <= link)
+        return false;
+    pthread_mutex_lock(&replay_mutex);
+    bool connected = replay_locks[link].open && replay_locks[link].connected;
+    pthread_mutex_unlock(&replay_mutex);
+    return connected;
+}
+
+// Compared with the trace by command only, rand and key differ on every run
+static bool replay_write(int link, uint8_t *data, uint16_t len)
+{
+    if (!replay_is_connected(link))
+        return false;
+
+    ol305_frame_t frame;
+    uint8_t cmd = (ESP_OK == ol305_codec_decode(data, len, &frame)) ? frame.cmd : 0xff;
+    pthread_mutex_lock(&replay_mutex);
+    replay_lock *lock = &replay_locks[link];
+    if (lock->client_tx >= lock->expected_count || lock->expected[lock->client_tx] != cmd)
+    {
+        replay_stats.tx_mismatch++;
+        ESP_LOGD(TAG, "lock %d write %u: 0x%02x, 0x%02x in the trace", link, lock->client_tx, cmd,
+                 (lock->client_tx < lock->expected_count) ? lock->expected[lock->client_tx] : 0);
+    }
+    lock->client_tx++;
+    lock->written_pending++;
+    replay_stats.tx_written++;
+    pthread_cond_broadcast(&replay_cond);
+    pthread_mutex_unlock(&replay_mutex);
+    return true;
+}
+
+const ol305_transport_t ol305_replay_transport =
+{
+    .name = "replay",
+    .init = replay_init,
+    .deinit = replay_deinit,
+    .open = replay_open,
+    .close = replay_close,
+    .is_connected = replay_is_connected,
+    .write = replay_write,
+};
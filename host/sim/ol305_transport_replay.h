@@ -0,0 +1,51 @@
+#ifndef __OL305_TRANSPORT_REPLAY_H__
+#define __OL305_TRANSPORT_REPLAY_H__
+
+#include "ol305_transport.h"
+#include "ol305_codec.h"
+#include "ol305_trace.h"
+#include "esp_err.h"
+
+#define OL305_REPLAY_MAX_LOCKS 8
+
+//a frame the client wrote in the trace, for the requests it only sends when asked
+typedef void (*ol305_replay_request_cb_t)(uint8_t lock, const ol305_frame_t *frame, void *ctx);
+
+typedef struct
+{
+    bool full_speed;        //no waiting for the recorded times
+    uint32_t stall_ms;      //how long an event waits for the writes that came before it in the trace
+    ol305_replay_request_cb_t request_cb; //optional, called from the replay thread
+    void *ctx;
+}ol305_replay_config_t;
+
+typedef struct
+{
+    uint32_t records;
+    uint32_t delivered;     //READY, RX and CLOSED given to the client
+    uint32_t skipped;       //events of a lock the client had no link to
+    uint32_t tx_expected;   //TX records of the trace
+    uint32_t tx_written;    //writes of the client
+    uint32_t tx_mismatch;   //the n-th write of a lock has another command than in the trace
+    uint32_t stalls;        //events sent although the writes before them were missing
+    uint32_t lost;          //records the capture dropped
+    int64_t trace_us;       //first OPEN to the last record, as recorded
+    int64_t replay_us;      //the same, replayed
+    bool done;
+}ol305_replay_stats_t;
+
+//trace of ol305_trace.c played back to ol305.c: the recorded READY, RX and CLOSED events are
+//delivered in order, paced by the recorded times and by the writes of the client
+extern const ol305_transport_t ol305_replay_transport;
+
+//reads the trace, macs gets the locks that were opened in it, in order
+esp_err_t ol305_replay_load(const char *path, uint8_t (*macs)[6], uint8_t *count);
+void ol305_replay_configure(const ol305_replay_config_t *config);
+//until the trace is played, ESP_ERR_TIMEOUT otherwise
+esp_err_t ol305_replay_wait(uint32_t timeout_ms);
+void ol305_replay_get_stats(ol305_replay_stats_t *stats);
+//from the request callback: the n-th frame of the lock after the one it was given, written (TX)
+//or received (RX); false past the end of the trace
+bool ol305_replay_peek(uint8_t lock, uint32_t n, ol305_trace_type_t *type, ol305_frame_t *frame);
+
+#endif
@@ -0,0 +1,337 @@
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "ol305_transport_sim.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define SIM_MAX_EVENTS 64
+
+const static char *TAG = "OL305_SIM";
+
+typedef enum
+{
+    SIM_EVT_READY,
+    SIM_EVT_DATA,
+    SIM_EVT_CLOSED,
+    SIM_EVT_WRITTEN,
+}sim_event_type;
+
+typedef struct
+{
+    int64_t due; //us on the esp_timer clock
+    uint32_t seq; //keeps the order of events due at the same time
+    int link;
+    uint32_t generation;
+    sim_event_type type;
+    uint16_t len;
+    uint8_t data[OL305_EMU_MAX_FRAME];
+}sim_event;
+
+typedef struct
+{
+    bool used;
+    bool connected;
+    uint32_t generation; //events of a closed link are ignored
+    ol305_emulator_t *emu;
+    ol305_link_cb_t cb;
+    void *ctx;
+}sim_link;
+
+static ol305_sim_config_t sim_config = {.connect_ms = 50, .latency_ms = 15};
+static ol305_emulator_t sim_locks[OL305_SIM_MAX_LOCKS];
+static uint8_t sim_lock_count = 0;
+static sim_link sim_links[OL305_SIM_MAX_LINKS];
+static sim_event sim_events[SIM_MAX_EVENTS];
+static uint8_t sim_event_count = 0;
+static uint32_t sim_seq = 0;
+static uint32_t sim_uplink_ms = 0;
+static int sim_users = 0;
+static bool sim_thread_started = false;
+static pthread_t sim_thread;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_cond;
+
+static bool sim_lost()
+{
+    return 0 < sim_config.loss_pct && (uint32_t)(rand() % 100) < sim_config.loss_pct;
+}
+
+static uint32_t sim_delay_ms()
+{
+    uint32_t jitter = (0 < sim_config.jitter_ms) ? rand() % (sim_config.jitter_ms + 1) : 0;
+    return sim_config.latency_ms + jitter;
+}
+
+// Called with sim_mutex held
+static void sim_schedule(int link, sim_event_type type, uint32_t delay_ms, const uint8_t *data, uint16_t len)
+{
+    if (SIM_MAX_EVENTS <= sim_event_count || OL305_EMU_MAX_FRAME < len)
+    {
+        ESP_LOGW(TAG, "event dropped, radio queue full");
+        return;
+    }
+
+    sim_event *event = &sim_events[sim_event_count++];
+    event->due = esp_timer_get_time() + delay_ms * 1000LL;
+    event->seq = sim_seq++;
+    event->link = link;
+    event->generation = sim_links[link].generation;
+    event->type = type;
+    event->len = len;
+    if (NULL != data)
+        memcpy(event->data, data, len);
+    pthread_cond_signal(&sim_cond);
+}
+
+static int sim_next_event()
+{
+    int next = -1;
+    for (int i = 0; i < sim_event_count; i++)
+    {
+        if (0 > next || sim_events[i].due < sim_events[next].due ||
+            (sim_events[i].due == sim_events[next].due && sim_events[i].seq < sim_events[next].seq))
+            next = i;
+    }
+    return next;
+}
+
+// Answers of the emulator, called with sim_mutex held
+static void sim_emulator_tx(void *ctx, uint32_t delay_ms, const uint8_t *frame, uint16_t len)
+{
+    int link = (int)(intptr_t)ctx;
+    if (sim_lost())
+        return;
+    sim_schedule(link, SIM_EVT_DATA, sim_uplink_ms + delay_ms + sim_delay_ms(), frame, len);
+}
+
+// The radio: delivers the due events to ol305.c like the Bluetooth task does
+static void *sim_radio_thread(void *arg)
+{
+    pthread_mutex_lock(&sim_mutex);
+    while (1)
+    {
+        int next = sim_next_event();
+        if (0 > next)
+        {
+            pthread_cond_wait(&sim_cond, &sim_mutex);
+            continue;
+        }
+
+        int64_t wait_us = sim_events[next].due - esp_timer_get_time();
+        if (0 < wait_us)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += wait_us / 1000000;
+            deadline.tv_nsec += (wait_us % 1000000) * 1000;
+            if (1000000000L <= deadline.tv_nsec)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&sim_cond, &sim_mutex, &deadline);
+            continue;
+        }
+
+        sim_event event = sim_events[next];
+        sim_events[next] = sim_events[--sim_event_count];
+        sim_link *link = &sim_links[event.link];
+        if (!link->used || link->generation != event.generation)
+            continue;
+
+        ol305_link_event_t link_event;
+        switch (event.type)
+        {
+            case SIM_EVT_READY:
+                link->connected = true;
+                link_event = OL305_LINK_READY;
+                break;
+            case SIM_EVT_CLOSED:
+                link->connected = false;
+                ol305_emulator_reset_session(link->emu);
+                link_event = OL305_LINK_CLOSED;
+                break;
+            case SIM_EVT_WRITTEN:
+                link_event = OL305_LINK_WRITTEN;
+                break;
+            default:
+                if (!link->connected)
+                    continue;
+                link_event = OL305_LINK_DATA;
+                break;
+        }
+
+        ol305_link_cb_t cb = link->cb;
+        void *ctx = link->ctx;
+        pthread_mutex_unlock(&sim_mutex);
+        cb(ctx, link_event, event.data, event.len);
+        pthread_mutex_lock(&sim_mutex);
+    }
+    return NULL;
+}
+
+void ol305_sim_configure(const ol305_sim_config_t *config)
+{
+    pthread_mutex_lock(&sim_mutex);
+    sim_config = *config;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+ol305_emulator_t *ol305_sim_add_lock(const uint8_t *mac, const char *password)
+{
+    if (OL305_SIM_MAX_LOCKS <= sim_lock_count)
+        return NULL;
+    ol305_emulator_t *emu = &sim_locks[sim_lock_count++];
+    ol305_emulator_init(emu, mac, password);
+    return emu;
+}
+
+static int sim_link_of(const ol305_emulator_t *emu)
+{
+    for (int i = 0; i < OL305_SIM_MAX_LINKS; i++)
+    {
+        if (sim_links[i].used && sim_links[i].emu == emu)
+            return i;
+    }
+    return OL305_INVALID_LINK;
+}
+
+void ol305_sim_lock(ol305_emulator_t *emu)
+{
+    pthread_mutex_lock(&sim_mutex);
+    int link = sim_link_of(emu);
+    if (OL305_INVALID_LINK != link && sim_links[link].connected)
+        ol305_emulator_lock(emu, sim_emulator_tx, (void *)(intptr_t)link);
+    else
+        emu->status = 0x02;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+void ol305_sim_drop_link(ol305_emulator_t *emu)
+{
+    pthread_mutex_lock(&sim_mutex);
+    int link = sim_link_of(emu);
+    if (OL305_INVALID_LINK != link)
+    {
+        //supervision timeout, the usual way a lock walks out of range
+        const uint8_t reason[2] = {0x08, 0x00};
+        sim_schedule(link, SIM_EVT_CLOSED, 0, reason, sizeof(reason));
+        sim_schedule(link, SIM_EVT_READY, sim_config.connect_ms, NULL, 0);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+static void sim_init()
+{
+    pthread_mutex_lock(&sim_mutex);
+    if (0 == sim_users++ && !sim_thread_started)
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sim_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_create(&sim_thread, NULL, sim_radio_thread, NULL);
+        pthread_detach(sim_thread);
+        sim_thread_started = true;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+// The radio thread keeps running, like the warm BLE stack
+static void sim_deinit()
+{
+    pthread_mutex_lock(&sim_mutex);
+    if (0 < sim_users)
+        sim_users--;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+static int sim_open(uint8_t *mac_addr, uint16_t mac_len, ol305_link_cb_t cb, void *ctx)
+{
+    ol305_emulator_t *emu = NULL;
+    for (int i = 0; i < sim_lock_count && 6 == mac_len; i++)
+    {
+        if (0 == memcmp(sim_locks[i].mac, mac_addr, 6))
+            emu = &sim_locks[i];
+    }
+
+    int link = OL305_INVALID_LINK;
+    pthread_mutex_lock(&sim_mutex);
+    for (int i = 0; i < OL305_SIM_MAX_LINKS; i++)
+    {
+        if (!sim_links[i].used)
+        {
+            link = i;
+            sim_links[i].used = true;
+            sim_links[i].connected = false;
+            sim_links[i].generation++;
+            sim_links[i].emu = emu;
+            sim_links[i].cb = cb;
+            sim_links[i].ctx = ctx;
+            //a lock nobody emulates is searched forever, like an absent lock
+            if (NULL != emu)
+                sim_schedule(i, SIM_EVT_READY, sim_config.connect_ms, NULL, 0);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return link;
+}
+
+static void sim_close(int link)
+{
+    if (0 > link || OL305_SIM_MAX_LINKS <= link)
+        return;
+    pthread_mutex_lock(&sim_mutex);
+    if (NULL != sim_links[link].emu)
+        ol305_emulator_reset_session(sim_links[link].emu);
+    sim_links[link].used = false;
+    sim_links[link].connected = false;
+    sim_links[link].generation++;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+static bool sim_is_connected(int link)
+{
+    if (0 > link || OL305_SIM_MAX_LINKS <= link)
+        return false;
+    pthread_mutex_lock(&sim_mutex);
+    bool connected = sim_links[link].used && sim_links[link].connected;
+    pthread_mutex_unlock(&sim_mutex);
+    return connected;
+}
+
+// The frame reaches the lock after the link latency, its answers are scheduled from there
+static bool sim_write(int link, uint8_t *data, uint16_t len)
+{
+    if (!sim_is_connected(link))
+    {
+        ESP_LOGW(TAG, "write on a link that is not ready %d", link);
+        return false;
+    }
+
+    pthread_mutex_lock(&sim_mutex);
+    //the answers leave the lock once the frame got there
+    sim_uplink_ms = sim_delay_ms();
+    if (!sim_lost())
+        ol305_emulator_receive(sim_links[link].emu, data, len, sim_emulator_tx, (void *)(intptr_t)link);
+    //a lost frame is still acknowledged, like a write the lock drops
+    sim_schedule(link, SIM_EVT_WRITTEN, sim_uplink_ms, NULL, 0);
+    sim_uplink_ms = 0;
+    pthread_mutex_unlock(&sim_mutex);
+    return true;
+}
+
+const ol305_transport_t ol305_sim_transport =
+{
+    .name = "sim",
+    .init = sim_init,
+    .deinit = sim_deinit,
+    .open = sim_open,
+    .close = sim_close,
+    .is_connected = sim_is_connected,
+    .write = sim_write,
+};
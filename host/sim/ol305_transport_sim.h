@@ -0,0 +1,29 @@
+#ifndef __OL305_TRANSPORT_SIM_H__
+#define __OL305_TRANSPORT_SIM_H__
+
+#include "ol305_transport.h"
+#include "ol305_emulator.h"
+
+#define OL305_SIM_MAX_LOCKS 16
+#define OL305_SIM_MAX_LINKS 3
+
+//radio conditions of the simulated link
+typedef struct
+{
+    uint32_t connect_ms;    //open to READY
+    uint32_t latency_ms;    //one way, each frame
+    uint32_t jitter_ms;     //added to latency_ms, uniformly distributed
+    uint8_t loss_pct;       //frames lost, in each direction
+}ol305_sim_config_t;
+
+//in-process backend: frames written by ol305.c go to an emulated lock, its answers come back from the radio thread
+extern const ol305_transport_t ol305_sim_transport;
+
+void ol305_sim_configure(const ol305_sim_config_t *config);
+ol305_emulator_t *ol305_sim_add_lock(const uint8_t *mac, const char *password);
+//the lock closes its shackle and notifies the client
+void ol305_sim_lock(ol305_emulator_t *emu);
+//the link of the lock drops, it comes back after connect_ms
+void ol305_sim_drop_link(ol305_emulator_t *emu);
+
+#endif
@@ -0,0 +1,399 @@
+// Host controller for the binary console of ol305_console.c: sends the commands given on the command
+// line at once, each with its own seq, and prints every result as it comes back.
+//
+// ol305_ctl [-b baud] [-t timeout_ms] [-w wait_ms] [-o trace] device [lock:]command[=args]...
+//
+//   unlock query read_rfid sync_usage info status stats fleet disconnect
+//   delete[=card]           16 hex digits, every card without one
+//   settings=b,u,r          bluetooth, button, RFID unlock: 1 off, 2 on
+//   sync_cards=card,card... the cards the lock should accept
+//   latency=id              ol305_lat_id_t
+//   control=enable|disable|shutdown
+//   trace=stop|file|stream  the streamed records go to -o, replay them with ol305_replay
+//   log=level               0 leaves the UART to the frames
+//   usage=first             usage records stored on the board, 16 at most from the first-th
+//   drop_usage=count        removes the count oldest records, once they are read out
+//
+// -w keeps reading after the last result, for a trace stream. The exit status is 0 when every
+// command answered ESP_OK.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_err.h"
+#include "ol305.h"
+#include "ol305_console.h"
+#include "ol305_fleet.h"
+#include "ol305_trace.h"
+
+#define CTL_MAX_COMMANDS 64
+
+typedef struct
+{
+    const char *name;
+    uint8_t cmd;
+} ctl_name_t;
+
+static const ctl_name_t ctl_names[] =
+{
+    {"unlock", OL305_CON_UNLOCK},
+    {"query", OL305_CON_QUERY},
+    {"read_rfid", OL305_CON_READ_RFID},
+    {"delete", OL305_CON_DELETE_RFID},
+    {"settings", OL305_CON_SETTINGS},
+    {"sync_usage", OL305_CON_SYNC_USAGE},
+    {"sync_cards", OL305_CON_SYNC_CARDS},
+    {"info", OL305_CON_INFO},
+    {"status", OL305_CON_STATUS},
+    {"stats", OL305_CON_STATS},
+    {"latency", OL305_CON_LATENCY},
+    {"control", OL305_CON_CONTROL},
+    {"disconnect", OL305_CON_DISCONNECT},
+    {"trace", OL305_CON_TRACE},
+    {"log", OL305_CON_LOG_LEVEL},
+    {"fleet", OL305_CON_FLEET},
+    {"usage", OL305_CON_USAGE_READ},
+    {"drop_usage", OL305_CON_USAGE_DROP},
+};
+
+static bool answered[CTL_MAX_COMMANDS + 1];
+
+static const char *ctl_name(uint8_t cmd)
+{
+    for (size_t i = 0; i < sizeof(ctl_names) / sizeof(ctl_names[0]); i++)
+    {
+        if (ctl_names[i].cmd == cmd)
+            return ctl_names[i].name;
+    }
+    return "?";
+}
+
+static int64_t ctl_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool ctl_card(const char *text, uint8_t *card)
+{
+    if (16 != strspn(text, "0123456789abcdefABCDEF"))
+        return false;
+    for (int i = 0; i < 8; i++)
+    {
+        char byte[3] = {text[2 * i], text[2 * i + 1], 0};
+        card[i] = strtoul(byte, NULL, 16);
+    }
+    return true;
+}
+
+static bool ctl_word(const char *text, const char *const *words, int count, uint8_t *value)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (0 == strcmp(text, words[i]))
+        {
+            *value = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// [lock:]name[=args] -> request body, 0 when it does not parse
+static uint16_t ctl_request(const char *text, uint16_t seq, uint8_t *body)
+{
+    static const char *const states[] = {"enable", "disable", "shutdown"};
+    static const char *const trace_modes[] = {"stop", "file", "stream"};
+    char word[OL305_CON_MAX_BODY * 3];
+    snprintf(word, sizeof(word), "%s", text);
+
+    char *name = word;
+    long lock = 0;
+    char *colon = strchr(word, ':');
+    if (NULL != colon)
+    {
+        *colon = '\0';
+        lock = strtol(word, NULL, 0);
+        name = colon + 1;
+    }
+    char *args = strchr(name, '=');
+    if (NULL != args)
+        *args++ = '\0';
+
+    int cmd = -1;
+    for (size_t i = 0; i < sizeof(ctl_names) / sizeof(ctl_names[0]); i++)
+    {
+        if (0 == strcmp(name, ctl_names[i].name))
+            cmd = ctl_names[i].cmd;
+    }
+    if (0 > cmd || 0 > lock || 255 < lock)
+        return 0;
+
+    body[0] = seq;
+    body[1] = seq >> 8;
+    body[2] = lock;
+    body[3] = cmd;
+    uint16_t len = OL305_CON_REQ_HEADER;
+    uint8_t *p = &body[OL305_CON_REQ_HEADER];
+    switch (cmd)
+    {
+        case OL305_CON_DELETE_RFID:
+            memset(p, 0, 8);
+            if (NULL != args && !ctl_card(args, p))
+                return 0;
+            return len + 8;
+        case OL305_CON_SETTINGS:
+            if (NULL == args || 3 != sscanf(args, "%hhu,%hhu,%hhu", &p[0], &p[1], &p[2]))
+                return 0;
+            return len + 3;
+        case OL305_CON_SYNC_CARDS:
+            for (char *card = strtok(args, ","); NULL != card; card = strtok(NULL, ","))
+            {
+                if (OL305_CON_MAX_BODY < len + 8 || !ctl_card(card, &body[len]))
+                    return 0;
+                len += 8;
+            }
+            return (OL305_CON_REQ_HEADER < len) ? len : 0;
+        case OL305_CON_LATENCY:
+        case OL305_CON_LOG_LEVEL:
+            if (NULL == args)
+                return 0;
+            p[0] = strtoul(args, NULL, 0);
+            return len + 1;
+        case OL305_CON_USAGE_READ:
+        case OL305_CON_USAGE_DROP:
+        {
+            if (NULL == args)
+                return 0;
+            uint32_t value = strtoul(args, NULL, 0);
+            p[0] = value;
+            p[1] = value >> 8;
+            p[2] = value >> 16;
+            p[3] = value >> 24;
+            return len + 4;
+        }
+        case OL305_CON_CONTROL:
+            return (NULL != args && ctl_word(args, states, 3, p)) ? len + 1 : 0;
+        case OL305_CON_TRACE:
+            return (NULL != args && ctl_word(args, trace_modes, 3, p)) ? len + 1 : 0;
+        default:
+            return (NULL == args) ? len : 0;
+    }
+}
+
+static void ctl_print(const ol305_con_response_t *r)
+{
+    const uint8_t *p = r->payload;
+    printf("%-4u lock %-3u %-11s %-22s %9.1f ms", r->seq, r->lock, ctl_name(r->cmd), esp_err_to_name(r->err),
+           r->latency_us / 1000.0);
+    switch (r->cmd)
+    {
+        case OL305_CON_UNLOCK:
+        case OL305_CON_QUERY:
+            if (3 <= r->len)
+                printf("  status %u battery %u mV", p[0], get16(&p[1]));
+            break;
+        case OL305_CON_READ_RFID:
+        case OL305_CON_DELETE_RFID:
+            if (8 <= r->len)
+                printf("  card %02x%02x%02x%02x%02x%02x%02x%02x", p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+            break;
+        case OL305_CON_SETTINGS:
+            if (3 <= r->len)
+                printf("  bluetooth %u button %u rfid %u", p[0], p[1], p[2]);
+            break;
+        case OL305_CON_SYNC_USAGE:
+            if (12 <= r->len)
+                printf("  records %u duplicates %u in %u ms", get32(&p[0]), get32(&p[4]), get32(&p[8]));
+            break;
+        case OL305_CON_SYNC_CARDS:
+            if (10 <= r->len)
+                printf("  registered %u deleted %u listed %u in %u ms", get16(&p[0]), get16(&p[2]), get16(&p[4]),
+                       get32(&p[6]));
+            break;
+        case OL305_CON_INFO:
+            if (14 <= r->len)
+                printf("  version %u locks %u connected 0x%x rx_errors %u tx_dropped %u", p[0], p[1], get32(&p[2]),
+                       get32(&p[6]), get32(&p[10]));
+            break;
+        case OL305_CON_STATUS:
+            if (7 <= r->len)
+                printf("  status %u battery %u mV, %u ms old", p[0], get16(&p[1]), get32(&p[3]));
+            break;
+        case OL305_CON_STATS:
+            for (ol305_stat_t stat = 0; stat < OL305_STAT_MAX && 4 * (stat + 1) <= r->len; stat++)
+            {
+                if (0 != get32(&p[4 * stat]))
+                    printf(" %s=%u", ol305_stat_name(stat), get32(&p[4 * stat]));
+            }
+            break;
+        case OL305_CON_LATENCY:
+            if (28 <= r->len)
+                printf("  count %u min %.1f max %.1f avg %.1f p50 %.1f p95 %.1f p99 %.1f ms", get32(&p[0]),
+                       get32(&p[4]) / 1000.0, get32(&p[8]) / 1000.0, get32(&p[12]) / 1000.0, get32(&p[16]) / 1000.0,
+                       get32(&p[20]) / 1000.0, get32(&p[24]) / 1000.0);
+            break;
+        case OL305_CON_FLEET:
+            if (19 <= r->len)
+                printf("  work %s depth %u %s wait %u ms max_wait %u ms grants %u preemptions %u", ol305_work_name(p[0]),
+                       p[1], p[2] ? "holding" : "parked", get32(&p[3]), get32(&p[7]), get32(&p[11]), get32(&p[15]));
+            break;
+        case OL305_CON_USAGE_READ:
+            printf("  records %u", (unsigned)(r->len / sizeof(ol305_usage_rec_t)));
+            for (uint16_t i = 0; i + sizeof(ol305_usage_rec_t) <= r->len; i += sizeof(ol305_usage_rec_t))
+                printf("%s user %u %u..%u", (0 == i) ? ":" : ",", get32(&p[i]), get32(&p[i + 4]), get32(&p[i + 8]));
+            break;
+        default:
+            break;
+    }
+    printf("\n");
+}
+
+static int ctl_open(const char *path, int baud)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (0 > fd || !isatty(fd))
+        return fd;
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    speed_t speed = (921600 == baud) ? B921600 : (460800 == baud) ? B460800 : (230400 == baud) ? B230400 : B115200;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tcsetattr(fd, TCSANOW, &tio);
+    tcflush(fd, TCIFLUSH);
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    int baud = 115200;
+    int timeout_ms = 35000; //longer than the 30 s deadline of the requests
+    int wait_ms = 0;
+    const char *trace_path = NULL;
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "b:t:w:o:")))
+    {
+        switch (opt)
+        {
+            case 'b': baud = atoi(optarg); break;
+            case 't': timeout_ms = atoi(optarg); break;
+            case 'w': wait_ms = atoi(optarg); break;
+            case 'o': trace_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-b baud] [-t timeout_ms] [-w wait_ms] [-o trace] device [lock:]command[=args]...\n", argv[0]);
+                return 2;
+        }
+    }
+    int count = argc - optind - 1;
+    if (0 > count || CTL_MAX_COMMANDS < count)
+    {
+        fprintf(stderr, "usage: %s [-b baud] [-t timeout_ms] [-w wait_ms] [-o trace] device [lock:]command[=args]...\n", argv[0]);
+        return 2;
+    }
+
+    int fd = ctl_open(argv[optind], baud);
+    if (0 > fd)
+    {
+        perror(argv[optind]);
+        return 2;
+    }
+    FILE *trace = NULL;
+    if (NULL != trace_path && NULL == (trace = fopen(trace_path, "wb")))
+    {
+        perror(trace_path);
+        return 2;
+    }
+
+    //every command goes out now, seq 1..count, the console runs them concurrently
+    static uint8_t body[OL305_CON_MAX_BODY];
+    static uint8_t frame[OL305_CON_MAX_FRAME];
+    for (int i = 0; i < count; i++)
+    {
+        uint16_t len = ctl_request(argv[optind + 1 + i], i + 1, body);
+        if (0 == len)
+        {
+            fprintf(stderr, "can't parse %s\n", argv[optind + 1 + i]);
+            return 2;
+        }
+        len = ol305_con_encode(frame, sizeof(frame), body, len);
+        if (len != write(fd, frame, len))
+        {
+            perror("write");
+            return 2;
+        }
+    }
+
+    static ol305_con_parser_t parser;
+    int pending = count;
+    int failed = 0;
+    int64_t start = ctl_now_ms();
+    int64_t deadline = start + timeout_ms;
+    while (1)
+    {
+        int64_t now = ctl_now_ms();
+        if (0 == pending && now >= start + wait_ms)
+            break;
+        if (now >= deadline)
+            break;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (0 >= poll(&pfd, 1, 50))
+            continue;
+        uint8_t chunk[256];
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+        if (0 >= len)
+            break;
+        for (ssize_t i = 0; i < len; i++)
+        {
+            uint16_t body_len = ol305_con_parse(&parser, chunk[i]);
+            ol305_con_response_t response;
+            if (0 == body_len || ESP_OK != ol305_con_get_response(&parser.frame[4], body_len, &response))
+                continue;
+            if (OL305_CON_EVENT == response.kind)
+            {
+                if (OL305_CON_TRACE == response.cmd && NULL != trace)
+                    fwrite(response.payload, response.len, 1, trace);
+                continue;
+            }
+            if (0 == response.seq || count < response.seq || answered[response.seq])
+                continue;
+            answered[response.seq] = true;
+            pending--;
+            if (ESP_OK != response.err)
+                failed++;
+            //the stream header starts the trace file
+            if (OL305_CON_TRACE == response.cmd && sizeof(ol305_trace_header_t) == response.len && NULL != trace)
+                fwrite(response.payload, response.len, 1, trace);
+            ctl_print(&response);
+        }
+    }
+    for (int seq = 1; seq <= count; seq++)
+    {
+        if (!answered[seq])
+            printf("%-4d no answer: %s\n", seq, argv[optind + seq]);
+    }
+    if (0 != parser.errors)
+        printf("%u damaged frames\n", parser.errors);
+    if (NULL != trace)
+        fclose(trace);
+    close(fd);
+    return (0 == pending && 0 == failed) ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+// Turns the binary event log of the board (ol305.log and its rotated ol305.N.log) into text or CSV.
+//
+// ol305_evlog_decode [-c] file...
+// Files are read in the order given: list the oldest rotation first.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_err.h"
+#include "ol305.h"
+#include "ol305_evlog.h"
+
+static const char *ev_names[] =
+{
+    [OL305_EV_FRAME_TX] = "frame_tx",
+    [OL305_EV_FRAME_RX] = "frame_rx",
+    [OL305_EV_REQUEST] = "request",
+    [OL305_EV_CONNECTED] = "connected",
+    [OL305_EV_DISCONNECTED] = "disconnected",
+    [OL305_EV_LINK_LOST] = "link_lost",
+    [OL305_EV_OVERRUN] = "overrun",
+};
+
+static const char *req_names[OL305_REQ_MAX] =
+{
+    [OL305_REQ_UNLOCK] = "unlock",
+    [OL305_REQ_QUERY] = "query",
+    [OL305_REQ_READ_RFID] = "read_rfid",
+    [OL305_REQ_DELETE_RFID] = "delete_rfid",
+    [OL305_REQ_SETTINGS] = "settings",
+    [OL305_REQ_SYNC_USAGE] = "sync_usage",
+    [OL305_REQ_SYNC_RFID] = "sync_rfid",
+};
+
+static const char *cmd_name(uint8_t cmd)
+{
+    switch (cmd)
+    {
+        case BLE_KEY: return "ble_key";
+        case UNLOCK: return "unlock";
+        case CMD_ERROR: return "cmd_error";
+        case LOCK: return "lock";
+        case BLE_KEY_SETTING: return "key_setting";
+        case QUERY_INFO: return "query_info";
+        case OBTAIN_LAST_USAGE: return "obtain_usage";
+        case DELETE_LAST_USAGE: return "delete_usage";
+        case LOCK_SETTINGS: return "settings";
+        case REGISTER_RFID: return "register_rfid";
+        case DELETE_RFID: return "delete_rfid";
+        case GET_RFID: return "get_rfid";
+        default: return "?";
+    }
+}
+
+static const char *ev_name(uint8_t type)
+{
+    if (type < sizeof(ev_names) / sizeof(ev_names[0]) && NULL != ev_names[type])
+        return ev_names[type];
+    return "?";
+}
+
+// What the cmd byte means depends on the record type
+static const char *ev_cmd(const ol305_ev_t *ev)
+{
+    switch (ev->type)
+    {
+        case OL305_EV_FRAME_TX:
+        case OL305_EV_FRAME_RX:
+            return cmd_name(ev->cmd);
+        case OL305_EV_REQUEST:
+            return (ev->cmd < OL305_REQ_MAX) ? req_names[ev->cmd] : "?";
+        default:
+            return "";
+    }
+}
+
+static void print_text(const ol305_ev_t *ev)
+{
+    printf("%10.3f seq %5u lock %3u %-12s", ev->time_ms / 1000.0, ev->seq, ev->lock, ev_name(ev->type));
+    switch (ev->type)
+    {
+        case OL305_EV_FRAME_TX:
+            printf(" %s (0x%02x)\n", ev_cmd(ev), ev->cmd);
+            break;
+        case OL305_EV_FRAME_RX:
+            printf(" %s (0x%02x) data0 0x%02x\n", ev_cmd(ev), ev->cmd, (uint8_t)ev->result);
+            break;
+        case OL305_EV_REQUEST:
+            printf(" %s %s %.1f ms\n", ev_cmd(ev), esp_err_to_name(ev->result), ev->latency_us / 1000.0);
+            break;
+        case OL305_EV_CONNECTED:
+            printf(" in %.1f ms\n", ev->latency_us / 1000.0);
+            break;
+        case OL305_EV_LINK_LOST:
+            printf(" reason 0x%02x\n", (uint16_t)ev->result);
+            break;
+        case OL305_EV_OVERRUN:
+            printf(" %d records lost\n", ev->result);
+            break;
+        default:
+            printf("\n");
+            break;
+    }
+}
+
+static void print_csv(const ol305_ev_t *ev)
+{
+    printf("%u,%u,%u,%s,%u,%s,%d,%u\n", ev->time_ms, ev->seq, ev->lock, ev_name(ev->type), ev->cmd, ev_cmd(ev),
+           ev->result, ev->latency_us);
+}
+
+static int decode(const char *path, void (*print)(const ol305_ev_t *))
+{
+    FILE *file = fopen(path, "rb");
+    if (NULL == file)
+    {
+        perror(path);
+        return 1;
+    }
+
+    ol305_ev_header_t header;
+    if (1 != fread(&header, sizeof(header), 1, file) || OL305_EVLOG_MAGIC != header.magic)
+    {
+        fprintf(stderr, "%s: not an OL305 event log\n", path);
+        fclose(file);
+        return 1;
+    }
+    if (OL305_EVLOG_VERSION != header.version || sizeof(ol305_ev_t) != header.record_size)
+    {
+        fprintf(stderr, "%s: version %u, record size %u not supported\n", path, header.version, header.record_size);
+        fclose(file);
+        return 1;
+    }
+
+    ol305_ev_t ev;
+    while (1 == fread(&ev, sizeof(ev), 1, file))
+        print(&ev);
+    //a record cut by a reset of the board
+    if (!feof(file) || 0 != ftell(file) % sizeof(ev))
+        fprintf(stderr, "%s: truncated record at the end\n", path);
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    void (*print)(const ol305_ev_t *) = print_text;
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "c")))
+    {
+        switch (opt)
+        {
+            case 'c': print = print_csv; break;
+            default:
+                fprintf(stderr, "usage: %s [-c] file...\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-c] file...\n", argv[0]);
+        return 2;
+    }
+
+    if (print_csv == print)
+        printf("time_ms,seq,lock,type,cmd,cmd_name,result,latency_us\n");
+    int failed = 0;
+    for (int i = optind; i < argc; i++)
+        failed |= decode(argv[i], print);
+    return failed;
+}
@@ -0,0 +1,222 @@
+// Plays a trace captured with ol305_trace.c (ol305.trc from the spiffs partition, or ol305_sim -t)
+// back into ol305.c: the notifications and link events of the locks reach ol305_recive_message and
+// ol305_task as they were recorded, the writes of the client are checked against the trace.
+//
+// ol305_replay [-f] [-s stall_ms] [-e data_dir] trace
+// -f: full speed, events only wait for the writes that came before them in the trace
+//
+// Requests the client sends on its own (key, status, acknowledgements, sync steps) come back by
+// themselves; unlock, settings, card reads, deletes of every card and the usage and card syncs are
+// submitted when the trace shows them. The cards of a card sync are read ahead in the trace, a
+// single card deleted with ol305_delete_rfid is replayed as a card sync: the frames are the same.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nvs_flash.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "ol305.h"
+#include "ol305_transport_replay.h"
+#include "ol305_txpool.h"
+#include "ol305_latency.h"
+#include "ol305_usage.h"
+#include "ol305_rfid.h"
+
+const static char *password = "replay";
+
+static ol305_handle_t locks[OL305_REPLAY_MAX_LOCKS];
+static uint8_t last_cmd[OL305_REPLAY_MAX_LOCKS];
+static int8_t card_phase[OL305_REPLAY_MAX_LOCKS]; //step of the card sync the trace is in, -1 outside of one
+
+// A card sync lists, then deletes, then registers: -1 for any other frame
+static int8_t card_step(const ol305_frame_t *frame)
+{
+    static const uint8_t all_cards[8] = {0};
+    if (GET_RFID == frame->cmd)
+        return 0;
+    if (8 == frame->len && DELETE_RFID == frame->cmd && 0 != memcmp(frame->data, all_cards, 8))
+        return 1;
+    if (8 == frame->len && REGISTER_RFID == frame->cmd)
+        return 2;
+    return -1;
+}
+
+// The cards a sync of the trace ends with: the ones known or listed, minus its deletes, plus its registers.
+// A step of an earlier phase starts the next sync.
+static void replay_card_sync(uint8_t index, const ol305_frame_t *first)
+{
+    static ol305_rfid_index_t desired;
+    static uint8_t cards[OL305_RFID_MAX_CARDS][8];
+    ol305_handle_t lock = locks[index];
+    uint16_t count = ol305_get_cards(lock, cards, OL305_RFID_MAX_CARDS);
+    ol305_rfid_build(&desired, (const uint8_t (*)[8])cards, (OL305_RFID_MAX_CARDS < count) ? OL305_RFID_MAX_CARDS : count);
+
+    ol305_frame_t frame = *first;
+    ol305_trace_type_t type = OL305_TRACE_TX;
+    int8_t phase = 0;
+    for (uint32_t n = 0; ; )
+    {
+        if (OL305_TRACE_TX == type)
+        {
+            int8_t step = card_step(&frame);
+            if (step < phase)
+                break;
+            phase = step;
+            if (1 == step)
+                ol305_rfid_remove(&desired, frame.data);
+            else if (2 == step)
+                ol305_rfid_insert(&desired, frame.data);
+        }
+        else if (GET_RFID == frame.cmd && 0x01 == frame.data[0] && 11 <= frame.len)
+        {
+            ol305_rfid_insert(&desired, &frame.data[3]);
+        }
+        if (!ol305_replay_peek(index, n++, &type, &frame))
+            break;
+    }
+    ol305_set_cards(lock, (const uint8_t (*)[8])desired.cards, desired.count);
+    ol305_sync_cards(lock);
+}
+
+static void replay_request(uint8_t index, const ol305_frame_t *frame, void *ctx)
+{
+    ol305_handle_t lock = locks[index];
+    uint8_t previous = last_cmd[index];
+    last_cmd[index] = frame->cmd;
+    int8_t step = card_step(frame);
+    if (0 <= step && step < card_phase[index])
+        card_phase[index] = -1;
+    if (0 <= step)
+    {
+        if (0 > card_phase[index])
+            replay_card_sync(index, frame);
+        card_phase[index] = step;
+        return;
+    }
+    card_phase[index] = -1;
+    ol305_request_t request = {0};
+    switch (frame->cmd)
+    {
+        case UNLOCK:
+            //1 byte: acknowledge of the answer of the lock
+            if (1 < frame->len)
+                ol305_unlock(lock);
+            break;
+        case LOCK_SETTINGS:
+            if (3 <= frame->len)
+            {
+                request.request = OL305_REQ_SETTINGS;
+                request.settings = (ol305_settings_t){frame->data[0], frame->data[1], frame->data[2]};
+                ol305_submit(lock, &request);
+            }
+            break;
+        case REGISTER_RFID:
+            ol305_read_rfid(lock);
+            break;
+        case DELETE_RFID:
+            ol305_delete_rfid(lock, NULL);
+            break;
+        case OBTAIN_LAST_USAGE:
+            if (OBTAIN_LAST_USAGE != previous && DELETE_LAST_USAGE != previous)
+                ol305_sync_usage(lock);
+            break;
+        default:
+            break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ol305_replay_config_t config = {.stall_ms = 500, .request_cb = replay_request};
+    const char *data_dir = NULL;
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "fs:e:")))
+    {
+        switch (opt)
+        {
+            case 'f': config.full_speed = true; break;
+            case 's': config.stall_ms = atoi(optarg); break;
+            case 'e': data_dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-f] [-s stall_ms] [-e data_dir] trace\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind + 1 != argc)
+    {
+        fprintf(stderr, "usage: %s [-f] [-s stall_ms] [-e data_dir] trace\n", argv[0]);
+        return 2;
+    }
+
+    uint8_t macs[OL305_REPLAY_MAX_LOCKS][6];
+    uint8_t count = 0;
+    esp_err_t err = ol305_replay_load(argv[optind], macs, &count);
+    if (ESP_OK != err)
+    {
+        fprintf(stderr, "%s: %s\n", argv[optind], esp_err_to_name(err));
+        return 1;
+    }
+    if (0 == count)
+    {
+        fprintf(stderr, "%s: no lock opened in the trace\n", argv[optind]);
+        return 1;
+    }
+
+    nvs_flash_init();
+    ol305_usage_set_dir(data_dir);
+    ol305_replay_configure(&config);
+    ol305_set_transport(&ol305_replay_transport);
+    for (int i = 0; i < count; i++)
+    {
+        card_phase[i] = -1;
+        locks[i] = ol305_add_lock();
+        set_ol305_ble_password(locks[i], password);
+        set_ol305_mac_addr(locks[i], macs[i], sizeof(macs[i]));
+        xTaskCreate(&ol305_task, "OL305_TASK", 5000, locks[i], 5, NULL);
+    }
+    for (int i = 0; i < count; i++)
+        ol305_control(locks[i], OL305_STATE_ENABLE, 0, 0);
+
+    err = ol305_replay_wait(24 * 3600 * 1000);
+    //the answers to the last writes
+    vTaskDelay(pdMS_TO_TICKS(100));
+
+    ol305_replay_stats_t stats;
+    ol305_replay_get_stats(&stats);
+    printf("replay   %s, %u records, %u events delivered, %u skipped, %u lost in the capture\n", esp_err_to_name(err),
+           stats.records, stats.delivered, stats.skipped, stats.lost);
+    printf("writes   %u in the trace, %u replayed, %u other command, %u stalls\n", stats.tx_expected, stats.tx_written,
+           stats.tx_mismatch, stats.stalls);
+    printf("time     %.1f ms recorded, %.1f ms replayed\n", stats.trace_us / 1000.0, stats.replay_us / 1000.0);
+
+    printf("%-12s %6s %9s %9s %9s %9s %9s (ms)\n", "histogram", "count", "min", "p50", "p95", "p99", "max");
+    for (ol305_lat_id_t id = 0; id < OL305_LAT_MAX; id++)
+    {
+        ol305_lat_summary_t summary;
+        if (ESP_OK != ol305_lat_get(id, &summary))
+            continue;
+        printf("%-12s %6u %9.1f %9.1f %9.1f %9.1f %9.1f\n", ol305_lat_name(id), summary.count, summary.min_us / 1000.0,
+               summary.p50_us / 1000.0, summary.p95_us / 1000.0, summary.p99_us / 1000.0, summary.max_us / 1000.0);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        ol305_stats_t lock_stats;
+        ol305_get_stats(locks[i], &lock_stats);
+        printf("lock %d   %02x:%02x:%02x:%02x:%02x:%02x\n        ", i, macs[i][0], macs[i][1], macs[i][2], macs[i][3],
+               macs[i][4], macs[i][5]);
+        for (ol305_stat_t stat = 0; stat < OL305_STAT_MAX; stat++)
+        {
+            if (0 != lock_stats.counters[stat])
+                printf(" %s=%u", ol305_stat_name(stat), lock_stats.counters[stat]);
+        }
+        printf("\n");
+        ol305_control(locks[i], OL305_STATE_SHUTDOWN, 1, 5000);
+    }
+    printf("txpool   %u/%d buffers free\n", ol305_txpool_free_count(), OL305_TXPOOL_LEN);
+    return ESP_OK != err;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <setjmp.h>
+#include "unity.h"
+
+static const char *unity_file;
+static const char *unity_test;
+static jmp_buf unity_abort;
+static int unity_tests;
+static int unity_failures;
+static int unity_ignores;
+
+void UnityBegin(const char *file)
+{
+    unity_file = file;
+    unity_tests = 0;
+    unity_failures = 0;
+    unity_ignores = 0;
+}
+
+int UnityEnd(void)
+{
+    printf("\n-----------------------\n%d Tests %d Failures %d Ignored\n%s\n", unity_tests, unity_failures,
+           unity_ignores, (0 == unity_failures) ? "OK" : "FAIL");
+    return unity_failures;
+}
+
+void UnityDefaultTestRun(void (*func)(void), const char *name, int line)
+{
+    unity_test = name;
+    unity_tests++;
+    int result = setjmp(unity_abort);
+    if (0 == result)
+    {
+        setUp();
+        func();
+    }
+    //tearDown runs after a failure too, as in Unity
+    if (2 != result && 0 == setjmp(unity_abort))
+        tearDown();
+    if (0 == result)
+        printf("%s:%d:%s:PASS\n", unity_file, line, name);
+}
+
+void UnityFail(const char *msg, int line)
+{
+    unity_failures++;
+    printf("%s:%d:%s:FAIL: %s\n", unity_file, line, unity_test, (NULL == msg) ? "" : msg);
+    longjmp(unity_abort, 1);
+}
+
+void UnityIgnore(const char *msg, int line)
+{
+    unity_ignores++;
+    printf("%s:%d:%s:IGNORE: %s\n", unity_file, line, unity_test, (NULL == msg) ? "" : msg);
+    longjmp(unity_abort, 1);
+}
+
+void UnityMessage(const char *msg, int line)
+{
+    printf("%s:%d:%s:INFO: %s\n", unity_file, line, unity_test, msg);
+}
+
+void UnityAssertEqualNumber(int64_t expected, int64_t actual, const char *msg, int line, int hex)
+{
+    if (expected == actual)
+        return;
+    char text[160];
+    if (hex)
+        snprintf(text, sizeof(text), "Expected 0x%02" PRIX64 " Was 0x%02" PRIX64 " %s", expected, actual, (NULL == msg) ? "" : msg);
+    else
+        snprintf(text, sizeof(text), "Expected %" PRId64 " Was %" PRId64 " %s", expected, actual, (NULL == msg) ? "" : msg);
+    UnityFail(text, line);
+}
+
+void UnityAssertLessOrEqual(uint64_t threshold, uint64_t actual, const char *msg, int line)
+{
+    if (actual <= threshold)
+        return;
+    char text[160];
+    snprintf(text, sizeof(text), "Expected less than or equal to %" PRIu64 " Was %" PRIu64 " %s", threshold, actual,
+             (NULL == msg) ? "" : msg);
+    UnityFail(text, line);
+}
+
+void UnityAssertEqualMemory(const void *expected, const void *actual, size_t len, const char *msg, int line)
+{
+    const uint8_t *e = expected;
+    const uint8_t *a = actual;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (e[i] == a[i])
+            continue;
+        char text[160];
+        snprintf(text, sizeof(text), "Memory Mismatch. Byte %zu Expected 0x%02X Was 0x%02X %s", i, e[i], a[i],
+                 (NULL == msg) ? "" : msg);
+        UnityFail(text, line);
+    }
+}
+
+void UnityAssertEqualString(const char *expected, const char *actual, const char *msg, int line)
+{
+    if (NULL != expected && NULL != actual && 0 == strcmp(expected, actual))
+        return;
+    char text[320];
+    snprintf(text, sizeof(text), "Expected '%s' Was '%s' %s", (NULL == expected) ? "(null)" : expected,
+             (NULL == actual) ? "(null)" : actual, (NULL == msg) ? "" : msg);
+    UnityFail(text, line);
+}
@@ -0,0 +1,56 @@
+#ifndef __UNITY_H__
+#define __UNITY_H__
+
+// Host build without Unity (-DOL305_UNITY_DIR unset): the subset of the Unity API used by test/,
+// same macros and output, a failed assertion ends the test with longjmp as Unity does
+
+#include <stdint.h>
+#include <stddef.h>
+
+void setUp(void);
+void tearDown(void);
+
+void UnityBegin(const char *file);
+int UnityEnd(void);
+void UnityDefaultTestRun(void (*func)(void), const char *name, int line);
+void UnityFail(const char *msg, int line);
+void UnityIgnore(const char *msg, int line);
+void UnityMessage(const char *msg, int line);
+void UnityAssertEqualNumber(int64_t expected, int64_t actual, const char *msg, int line, int hex);
+void UnityAssertLessOrEqual(uint64_t threshold, uint64_t actual, const char *msg, int line);
+void UnityAssertEqualMemory(const void *expected, const void *actual, size_t len, const char *msg, int line);
+void UnityAssertEqualString(const char *expected, const char *actual, const char *msg, int line);
+
+#define UNITY_BEGIN() UnityBegin(__FILE__)
+#define UNITY_END() UnityEnd()
+#define RUN_TEST(func) UnityDefaultTestRun(func, #func, __LINE__)
+
+#define TEST_FAIL_MESSAGE(msg) UnityFail((msg), __LINE__)
+#define TEST_IGNORE_MESSAGE(msg) UnityIgnore((msg), __LINE__)
+#define TEST_IGNORE() UnityIgnore(NULL, __LINE__)
+#define TEST_MESSAGE(msg) UnityMessage((msg), __LINE__)
+
+#define TEST_ASSERT_MESSAGE(cond, msg) do { if (!(cond)) UnityFail((msg), __LINE__); } while (0)
+#define TEST_ASSERT(cond) TEST_ASSERT_MESSAGE(cond, "Expression Evaluated To FALSE")
+#define TEST_ASSERT_TRUE(cond) TEST_ASSERT_MESSAGE(cond, "Expected TRUE Was FALSE")
+#define TEST_ASSERT_FALSE(cond) TEST_ASSERT_MESSAGE(!(cond), "Expected FALSE Was TRUE")
+#define TEST_ASSERT_NULL(ptr) TEST_ASSERT_MESSAGE(NULL == (ptr), "Expected NULL")
+#define TEST_ASSERT_NOT_NULL(ptr) TEST_ASSERT_MESSAGE(NULL != (ptr), "Expected Non-NULL")
+
+#define TEST_ASSERT_EQUAL_MESSAGE(e, a, msg) UnityAssertEqualNumber((int64_t)(e), (int64_t)(a), (msg), __LINE__, 0)
+#define TEST_ASSERT_EQUAL(e, a) TEST_ASSERT_EQUAL_MESSAGE(e, a, NULL)
+#define TEST_ASSERT_EQUAL_INT(e, a) TEST_ASSERT_EQUAL(e, a)
+#define TEST_ASSERT_EQUAL_UINT(e, a) TEST_ASSERT_EQUAL(e, a)
+#define TEST_ASSERT_EQUAL_UINT8(e, a) TEST_ASSERT_EQUAL((uint8_t)(e), (uint8_t)(a))
+#define TEST_ASSERT_EQUAL_UINT16(e, a) TEST_ASSERT_EQUAL((uint16_t)(e), (uint16_t)(a))
+#define TEST_ASSERT_EQUAL_UINT32(e, a) TEST_ASSERT_EQUAL((uint32_t)(e), (uint32_t)(a))
+#define TEST_ASSERT_EQUAL_HEX8(e, a) UnityAssertEqualNumber((uint8_t)(e), (uint8_t)(a), NULL, __LINE__, 1)
+#define TEST_ASSERT_EQUAL_HEX8_ARRAY(e, a, n) UnityAssertEqualMemory((e), (a), (n), NULL, __LINE__)
+#define TEST_ASSERT_EQUAL_MEMORY(e, a, n) UnityAssertEqualMemory((e), (a), (n), NULL, __LINE__)
+#define TEST_ASSERT_EQUAL_STRING(e, a) UnityAssertEqualString((e), (a), NULL, __LINE__)
+#define TEST_ASSERT_EQUAL_STRING_MESSAGE(e, a, msg) UnityAssertEqualString((e), (a), (msg), __LINE__)
+//Unity order: the bound first, then the measured value
+#define TEST_ASSERT_LESS_OR_EQUAL_UINT32(threshold, a) UnityAssertLessOrEqual((uint32_t)(threshold), (uint32_t)(a), NULL, __LINE__)
+#define TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(threshold, a, msg) UnityAssertLessOrEqual((uint32_t)(threshold), (uint32_t)(a), (msg), __LINE__)
+
+#endif
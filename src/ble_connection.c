@@ -1,10 +1,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "ble_connection.h"
+#include "ol305_latency.h"
 #include "esp_bt.h"
 #include "esp_gap_ble_api.h"
 #include "esp_gattc_api.h"
@@ -12,16 +14,33 @@
 #include "esp_bt_main.h"
 #include "esp_gatt_common_api.h"
 #include "esp_log.h"
-#include "ol305.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include <sys/lock.h>
 
 #define INVALID_HANDLE 0
+#define SCAN_DURATION_S 30
+#define GATT_CACHE_NAMESPACE "ble_gatt"
+#define GATT_CACHE_VERSION 1
+#define ADDR_TYPE_NAMESPACE "ble_addr"
+#define DIRECT_CONNECT_TIMEOUT_MS 3000
+#define SCAN_TARGETS_HASH_SIZE 16 //power of two, at least twice BLE_MAX_LINKS
 const static char *TAG = "BLE_CONNECTION";
 
-esp_bd_addr_t TARGET_MAC;
-static bool ble_connection = false;
-static bool get_server = false;
 static bool firts_time = true;
+static uint8_t ble_users = 0;
+static _lock_t ble_stack_lock;
+static portMUX_TYPE ble_links_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool scan_params_set = false;
+static bool scanning = false;
+//links are opened one at a time, discovery events without a conn_id belong to this one
+static int connecting_link = BLE_INVALID_LINK;
+//searched links by MAC hash, looked up for every advertisement
+static int8_t scan_targets[SCAN_TARGETS_HASH_SIZE];
+static uint8_t scan_targets_count = 0;
+static bool whitelist_dirty = true; //the searched links changed since the whitelist was programmed
+static bool scan_params_dirty = false; //preset or filter policy changed since the scan params were set
+static bool whitelist_bypass = false; //a whitelisted scan found nothing, maybe a wrong address type
 static esp_gattc_char_elem_t *char_elem_result = NULL;
 static esp_gattc_char_elem_t *write_elem_result = NULL;
 static esp_gattc_descr_elem_t *descr_elem_result = NULL;
@@ -35,13 +54,48 @@ typedef struct
     esp_gattc_cb_t gattc_cb;
     uint16_t gattc_if;
     uint16_t app_id;
+}gattc_profile_inst;
+
+typedef enum
+{
+    LINK_FREE = 0,
+    LINK_SEARCHING,
+    LINK_OPENING,
+    LINK_READY,
+}gattc_link_state;
+
+typedef struct
+{
+    gattc_link_state state;
+    bool get_server;
     uint16_t conn_id;
     uint16_t service_start_handle;
     uint16_t service_end_handle;
     uint16_t char_handle;
     uint16_t write_handle;
+    uint16_t cccd_handle;
+    bool cached; //handles loaded from NVS, discovery is skipped
+    bool addr_known; //addr_type was seen in a previous scan, the lock can be opened without scanning
+    bool direct_failed; //the last direct open timed out, scan until the lock is found again
+    bool connected; //CONNECT_EVT received for the current open
+    esp_ble_addr_type_t addr_type;
+    esp_timer_handle_t direct_timer;
+    int64_t open_time; //connect-to-ready latency
     esp_bd_addr_t remote_bda;
-}gattc_profile_inst;
+    ble_link_cb_t cb;
+    void *ctx;
+}gattc_link_inst;
+
+//handles discovered on a lock, stored in NVS under its MAC
+typedef struct
+{
+    uint8_t version;
+    uint16_t service_start_handle;
+    uint16_t service_end_handle;
+    uint16_t char_handle;
+    uint16_t write_handle;
+    uint16_t cccd_handle;
+}gatt_cache_entry;
 
 esp_bt_uuid_t remote_filter_service_uuid;
 esp_bt_uuid_t remote_filter_char_uuid;
@@ -55,7 +109,15 @@ static esp_ble_scan_params_t ble_scan_params =
     .scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL,
     .scan_interval = 0x50,
     .scan_window = 0x30,
-    .scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE
+    .scan_duplicate = BLE_SCAN_DUPLICATE_ENABLE
+};
+
+//interval and window in 0.625 ms units
+static const uint16_t scan_presets[][2] =
+{
+    [BLE_SCAN_FAST] = {0x30, 0x30},         //30 ms / 30 ms, continuous
+    [BLE_SCAN_BALANCED] = {0x50, 0x30},     //50 ms / 30 ms
+    [BLE_SCAN_LOW_POWER] = {0x640, 0x30},   //1 s / 30 ms
 };
 
 gattc_profile_inst gl_profile_tab =
@@ -64,21 +126,390 @@ gattc_profile_inst gl_profile_tab =
     .gattc_if = ESP_GATT_IF_NONE,
 };
 
-bool is_ble_connected()
+static gattc_link_inst gl_link_tab[BLE_MAX_LINKS];
+
+static int find_link_by_conn_id(uint16_t conn_id)
+{
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if ((LINK_OPENING == gl_link_tab[i].state || LINK_READY == gl_link_tab[i].state) && gl_link_tab[i].conn_id == conn_id)
+            return i;
+    }
+    return BLE_INVALID_LINK;
+}
+
+static int find_link_by_bda(const uint8_t *bda, gattc_link_state state)
+{
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if (state == gl_link_tab[i].state && 0 == memcmp(gl_link_tab[i].remote_bda, bda, sizeof(esp_bd_addr_t)))
+            return i;
+    }
+    return BLE_INVALID_LINK;
+}
+
+static void gatt_cache_key(const uint8_t *bda, char *key)
+{
+    snprintf(key, 13, "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+
+static bool gatt_cache_load(const uint8_t *bda, gatt_cache_entry *entry)
+{
+    nvs_handle_t handle;
+    char key[13];
+    size_t len = sizeof(*entry);
+
+    if (ESP_OK != nvs_open(GATT_CACHE_NAMESPACE, NVS_READONLY, &handle))
+        return false;
+    gatt_cache_key(bda, key);
+    esp_err_t ret = nvs_get_blob(handle, key, entry, &len);
+    nvs_close(handle);
+    return ESP_OK == ret && sizeof(*entry) == len && GATT_CACHE_VERSION == entry->version;
+}
+
+static void gatt_cache_store(const gattc_link_inst *link)
+{
+    nvs_handle_t handle;
+    char key[13];
+    gatt_cache_entry entry =
+    {
+        .version = GATT_CACHE_VERSION,
+        .service_start_handle = link->service_start_handle,
+        .service_end_handle = link->service_end_handle,
+        .char_handle = link->char_handle,
+        .write_handle = link->write_handle,
+        .cccd_handle = link->cccd_handle,
+    };
+
+    if (ESP_OK != nvs_open(GATT_CACHE_NAMESPACE, NVS_READWRITE, &handle))
+    {
+        ESP_LOGE(TAG, "GATT cache not stored, nvs open failed");
+        return;
+    }
+    gatt_cache_key(link->remote_bda, key);
+    if (ESP_OK != nvs_set_blob(handle, key, &entry, sizeof(entry)) || ESP_OK != nvs_commit(handle))
+        ESP_LOGE(TAG, "GATT cache not stored");
+    nvs_close(handle);
+}
+
+static void gatt_cache_erase(const uint8_t *bda)
+{
+    nvs_handle_t handle;
+    char key[13];
+
+    if (ESP_OK != nvs_open(GATT_CACHE_NAMESPACE, NVS_READWRITE, &handle))
+        return;
+    gatt_cache_key(bda, key);
+    if (ESP_OK == nvs_erase_key(handle, key))
+        nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static bool addr_type_load(const uint8_t *bda, esp_ble_addr_type_t *addr_type)
+{
+    nvs_handle_t handle;
+    char key[13];
+    uint8_t value;
+
+    if (ESP_OK != nvs_open(ADDR_TYPE_NAMESPACE, NVS_READONLY, &handle))
+        return false;
+    gatt_cache_key(bda, key);
+    esp_err_t ret = nvs_get_u8(handle, key, &value);
+    nvs_close(handle);
+    if (ESP_OK != ret)
+        return false;
+    *addr_type = (esp_ble_addr_type_t)value;
+    return true;
+}
+
+static void addr_type_store(const uint8_t *bda, esp_ble_addr_type_t addr_type)
 {
-    return ble_connection;
+    nvs_handle_t handle;
+    char key[13];
+
+    if (ESP_OK != nvs_open(ADDR_TYPE_NAMESPACE, NVS_READWRITE, &handle))
+        return;
+    gatt_cache_key(bda, key);
+    if (ESP_OK == nvs_set_u8(handle, key, (uint8_t)addr_type))
+        nvs_commit(handle);
+    nvs_close(handle);
+}
+
+// The cached handles are wrong, forget them and discover the services again
+static void link_rediscover(esp_gatt_if_t gattc_if, gattc_link_inst *link)
+{
+    ESP_LOGW(TAG, "GATT cache invalid, full discovery");
+    gatt_cache_erase(link->remote_bda);
+    link->cached = false;
+    link->get_server = false;
+    link->cccd_handle = INVALID_HANDLE;
+    esp_ble_gattc_search_service(gattc_if, link->conn_id, NULL);
+}
+
+static uint8_t scan_target_hash(const uint8_t *bda)
+{
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < sizeof(esp_bd_addr_t); i++)
+        hash = (hash ^ bda[i]) * 16777619u;
+    return hash & (SCAN_TARGETS_HASH_SIZE - 1);
+}
+
+// Rebuilds the hash of the searched links, called under ble_links_mux
+static void scan_targets_rebuild()
+{
+    int8_t targets[SCAN_TARGETS_HASH_SIZE];
+    uint8_t count = 0;
+
+    memset(targets, BLE_INVALID_LINK, sizeof(targets));
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if (LINK_SEARCHING != gl_link_tab[i].state)
+            continue;
+        uint8_t slot = scan_target_hash(gl_link_tab[i].remote_bda);
+        while (BLE_INVALID_LINK != targets[slot])
+            slot = (slot + 1) & (SCAN_TARGETS_HASH_SIZE - 1);
+        targets[slot] = i;
+        count++;
+    }
+
+    if (count != scan_targets_count || 0 != memcmp(targets, scan_targets, sizeof(targets)))
+        whitelist_dirty = true;
+    memcpy(scan_targets, targets, sizeof(targets));
+    scan_targets_count = count;
+}
+
+// Searched link of an advertiser, called under ble_links_mux
+static int scan_target_find(const uint8_t *bda)
+{
+    uint8_t slot = scan_target_hash(bda);
+    for (int i = 0; i < SCAN_TARGETS_HASH_SIZE && BLE_INVALID_LINK != scan_targets[slot]; i++)
+    {
+        int link_id = scan_targets[slot];
+        if (LINK_SEARCHING == gl_link_tab[link_id].state && 0 == memcmp(gl_link_tab[link_id].remote_bda, bda, sizeof(esp_bd_addr_t)))
+            return link_id;
+        slot = (slot + 1) & (SCAN_TARGETS_HASH_SIZE - 1);
+    }
+    return BLE_INVALID_LINK;
+}
+
+// Programs the searched links into the controller whitelist, the scan must be stopped.
+// When they do not fit, every advertisement is reported and filtered by scan_target_find().
+static void scan_whitelist_sync()
+{
+    esp_bd_addr_t addrs[BLE_MAX_LINKS];
+    esp_ble_wl_addr_type_t types[BLE_MAX_LINKS];
+    uint8_t count = 0;
+    uint16_t whitelist_size = 0;
+
+    portENTER_CRITICAL(&ble_links_mux);
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        gattc_link_inst *link = &gl_link_tab[i];
+        if (LINK_SEARCHING != link->state)
+            continue;
+        memcpy(addrs[count], link->remote_bda, sizeof(esp_bd_addr_t));
+        if (link->addr_known)
+            types[count] = (BLE_ADDR_TYPE_PUBLIC == link->addr_type) ? BLE_WL_ADDR_TYPE_PUBLIC : BLE_WL_ADDR_TYPE_RANDOM;
+        else
+            types[count] = (0xc0 == (link->remote_bda[0] & 0xc0)) ? BLE_WL_ADDR_TYPE_RANDOM : BLE_WL_ADDR_TYPE_PUBLIC; //static random
+        count++;
+    }
+    whitelist_dirty = false;
+    portEXIT_CRITICAL(&ble_links_mux);
+
+    esp_ble_gap_get_whitelist_size(&whitelist_size);
+    esp_ble_gap_clear_whitelist();
+    bool use_whitelist = !whitelist_bypass && 0 < count && count <= whitelist_size;
+    for (int i = 0; use_whitelist && i < count; i++)
+    {
+        if (ESP_OK != esp_ble_gap_update_whitelist(true, addrs[i], types[i]))
+            use_whitelist = false;
+    }
+
+    esp_ble_scan_filter_t policy = use_whitelist ? BLE_SCAN_FILTER_ALLOW_ONLY_WLST : BLE_SCAN_FILTER_ALLOW_ALL;
+    if (policy != ble_scan_params.scan_filter_policy)
+    {
+        ESP_LOGI(TAG, "scan filter: %s", use_whitelist ? "whitelist" : "all advertisers");
+        ble_scan_params.scan_filter_policy = policy;
+        scan_params_dirty = true;
+    }
+}
+
+static void link_event(int link, ble_link_event_t event, uint8_t *data, uint16_t len)
+{
+    if (BLE_INVALID_LINK != link && NULL != gl_link_tab[link].cb)
+        gl_link_tab[link].cb(gl_link_tab[link].ctx, event, data, len);
+}
+
+// A direct open that did not connect in time is cancelled, the OPEN_EVT failure sends the link back to scanning
+static void direct_connect_timeout(void *arg)
+{
+    int link_id = (int)(intptr_t)arg;
+    bool cancel = false;
+
+    portENTER_CRITICAL(&ble_links_mux);
+    gattc_link_inst *link = &gl_link_tab[link_id];
+    if (LINK_OPENING == link->state && !link->connected)
+    {
+        link->direct_failed = true;
+        cancel = true;
+    }
+    portEXIT_CRITICAL(&ble_links_mux);
+
+    if (cancel)
+    {
+        ESP_LOGW(TAG, "direct connect of link %d timed out, scanning", link_id);
+        esp_ble_gap_disconnect(link->remote_bda);
+    }
+}
+
+// Opens a link without scanning when the address type of the lock is known
+static void direct_connect(int link_id)
+{
+    gattc_link_inst *link = &gl_link_tab[link_id];
+
+    if (NULL == link->direct_timer)
+    {
+        esp_timer_create_args_t timer_args =
+        {
+            .callback = direct_connect_timeout,
+            .arg = (void *)(intptr_t)link_id,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "ble_direct",
+        };
+        esp_timer_create(&timer_args, &link->direct_timer);
+    }
+
+    ESP_LOGI(TAG, "direct connect to link %d", link_id);
+    link->open_time = esp_timer_get_time();
+    if (ESP_OK != esp_ble_gattc_open(gl_profile_tab.gattc_if, link->remote_bda, link->addr_type, true))
+    {
+        portENTER_CRITICAL(&ble_links_mux);
+        link->direct_failed = true;
+        link->state = LINK_SEARCHING;
+        connecting_link = BLE_INVALID_LINK;
+        portEXIT_CRITICAL(&ble_links_mux);
+        return;
+    }
+    if (NULL != link->direct_timer)
+        esp_timer_start_once(link->direct_timer, DIRECT_CONNECT_TIMEOUT_MS * 1000ULL);
+}
+
+// Opens a known lock directly, otherwise scans while some link is still searched and no other link is being opened
+static void ble_scan_update()
+{
+    bool searching = false;
+    bool start = false;
+    bool stop = false;
+    int direct = BLE_INVALID_LINK;
+
+    portENTER_CRITICAL(&ble_links_mux);
+    scan_targets_rebuild();
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if (LINK_SEARCHING != gl_link_tab[i].state)
+            continue;
+        if (BLE_INVALID_LINK == direct && gl_link_tab[i].addr_known && !gl_link_tab[i].direct_failed)
+            direct = i;
+        else
+            searching = true;
+    }
+
+    if (BLE_INVALID_LINK != direct && (BLE_INVALID_LINK != connecting_link || ESP_GATT_IF_NONE == gl_profile_tab.gattc_if))
+    {
+        //tried once the current open is done
+        direct = BLE_INVALID_LINK;
+    }
+    else if (BLE_INVALID_LINK != direct)
+    {
+        gl_link_tab[direct].state = LINK_OPENING;
+        gl_link_tab[direct].connected = false;
+        connecting_link = direct;
+    }
+
+    if (searching && !scanning && scan_params_set && BLE_INVALID_LINK == connecting_link)
+    {
+        scanning = true;
+        start = true;
+    }
+    else if ((!searching || BLE_INVALID_LINK != direct || whitelist_dirty || scan_params_dirty) && scanning)
+    {
+        //restarted by ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT with the new whitelist or params
+        scanning = false;
+        stop = true;
+    }
+    portEXIT_CRITICAL(&ble_links_mux);
+
+    if (start && whitelist_dirty)
+        scan_whitelist_sync();
+
+    if (start && scan_params_dirty)
+    {
+        //the scan starts once ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT confirms them
+        scanning = false;
+        scan_params_set = false;
+        scan_params_dirty = false;
+        esp_ble_gap_set_scan_params(&ble_scan_params);
+    }
+    else if (start)
+    {
+        esp_err_t ret = esp_ble_gap_start_scanning(SCAN_DURATION_S);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to start scanning, error: %s", esp_err_to_name(ret));
+            scanning = false;
+        }
+    }
+    else if (stop)
+    {
+        esp_ble_gap_stop_scanning();
+    }
+
+    if (BLE_INVALID_LINK != direct)
+    {
+        direct_connect(direct);
+        if (BLE_INVALID_LINK == connecting_link)
+            ble_scan_update();
+    }
+}
+
+static void link_opened(int link)
+{
+    if (connecting_link == link)
+        connecting_link = BLE_INVALID_LINK;
+    ble_scan_update();
+}
+
+bool is_ble_connected(int link)
+{
+    if (0 > link || BLE_MAX_LINKS <= link)
+        return false;
+    return LINK_READY == gl_link_tab[link].state;
 }
 
 void ble_deinit()
 {
-    esp_ble_gattc_close(gl_profile_tab.gattc_if, gl_profile_tab.conn_id);
+    _lock_acquire(&ble_stack_lock);
+    if (0 == ble_users || 0 != --ble_users)
+    {
+        _lock_release(&ble_stack_lock);
+        return;
+    }
+
+    esp_ble_gap_stop_scanning();
+    esp_ble_gattc_app_unregister(gl_profile_tab.gattc_if);
     esp_bluedroid_disable();
     esp_bluedroid_deinit();
     esp_bt_controller_disable();
     esp_bt_controller_deinit();
-    esp_ble_gattc_app_unregister(gl_profile_tab.gattc_if);
-    esp_ble_gattc_unregister_for_notify(gl_profile_tab.gattc_if, gl_profile_tab.remote_bda, gl_profile_tab.char_handle);
-    esp_ble_gattc_app_unregister(INVALID_HANDLE);
+    gl_profile_tab.gattc_if = ESP_GATT_IF_NONE;
+    scan_params_set = false;
+    scanning = false;
+    connecting_link = BLE_INVALID_LINK;
+    //the controller comes back with an empty whitelist
+    whitelist_dirty = true;
+    ble_scan_params.scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL;
+    _lock_release(&ble_stack_lock);
 
     ESP_LOGI(TAG, "BLE deinitialized");
 }
@@ -86,37 +517,71 @@ void ble_deinit()
 static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param)
 {
     esp_ble_gattc_cb_param_t *p_data = (esp_ble_gattc_cb_param_t *)param;
+    gattc_link_inst *link = NULL;
+    int link_id = BLE_INVALID_LINK;
     switch (event)
     {
         case ESP_GATTC_REG_EVT:
             ESP_LOGI(TAG, "REG_EVT");
+            scan_params_dirty = false;
             esp_err_t scan_ret = esp_ble_gap_set_scan_params(&ble_scan_params);
             if (scan_ret)
             {
                 ESP_LOGE(TAG, "set scan params error, error code = %x", scan_ret);
             }
+            ble_scan_update();
             break;
 
         case ESP_GATTC_CONNECT_EVT:
             ESP_LOGI(TAG, "ESP_GATTC_CONNECT_EVT conn_id %d, if %d", p_data->connect.conn_id, gattc_if);
-            gl_profile_tab.conn_id = p_data->connect.conn_id;
-            memcpy(gl_profile_tab.remote_bda, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
+            link_id = find_link_by_bda(p_data->connect.remote_bda, LINK_OPENING);
+            if (BLE_INVALID_LINK == link_id)
+            {
+                //the owner closed the link while it was being opened
+                ESP_LOGW(TAG, "connection from an unknown device");
+                esp_ble_gattc_close(gattc_if, p_data->connect.conn_id);
+                break;
+            }
+            gl_link_tab[link_id].conn_id = p_data->connect.conn_id;
+            gl_link_tab[link_id].connected = true;
+            if (NULL != gl_link_tab[link_id].direct_timer)
+                esp_timer_stop(gl_link_tab[link_id].direct_timer);
             ESP_LOGI(TAG, "REMOTE BDA:");
-            esp_log_buffer_hex(TAG, gl_profile_tab.remote_bda, sizeof(esp_bd_addr_t));
+            esp_log_buffer_hex(TAG, gl_link_tab[link_id].remote_bda, sizeof(esp_bd_addr_t));
             esp_err_t mtu_ret = esp_ble_gattc_send_mtu_req(gattc_if, p_data->connect.conn_id);
             if (mtu_ret)
             {
                 ESP_LOGE(TAG, "config MTU error, error code = %x", mtu_ret);
             }
+            link = &gl_link_tab[link_id];
+            if (link->cached)
+            {
+                //known lock, go straight to the notification registration
+                ESP_LOGI(TAG, "using cached GATT handles");
+                link->get_server = true;
+                esp_ble_gattc_register_for_notify(gattc_if, link->remote_bda, link->char_handle);
+            }
             break;
         
         case ESP_GATTC_OPEN_EVT:
             if (param->open.status != ESP_GATT_OK)
             {
                 ESP_LOGE(TAG, "open failed, status %d", p_data->open.status);
+                link_id = find_link_by_bda(p_data->open.remote_bda, LINK_OPENING);
+                if (BLE_INVALID_LINK != link_id)
+                {
+                    link = &gl_link_tab[link_id];
+                    if (NULL != link->direct_timer)
+                        esp_timer_stop(link->direct_timer);
+                    //a failed open falls back to scanning until the lock is seen again
+                    link->direct_failed = true;
+                    link->state = LINK_SEARCHING;
+                    link_opened(link_id);
+                }
                 break;
             }
             ESP_LOGI(TAG, "open success");
+            ol305_lat_mark(find_link_by_bda(p_data->open.remote_bda, LINK_OPENING), OL305_LAT_OPEN);
             break;
 
         case ESP_GATTC_DIS_SRVC_CMPL_EVT:
@@ -126,6 +591,9 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                 break;
             }
             ESP_LOGI(TAG, "discover service complete conn_id %d", param->dis_srvc_cmpl.conn_id);
+            link_id = find_link_by_conn_id(param->dis_srvc_cmpl.conn_id);
+            if (BLE_INVALID_LINK != link_id && gl_link_tab[link_id].cached)
+                break;
             esp_ble_gattc_search_service(gattc_if, param->dis_srvc_cmpl.conn_id, NULL);
             break;
 
@@ -135,11 +603,16 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                 ESP_LOGE(TAG, "config mtu failed, error status = %x", param->cfg_mtu.status);
             }
             ESP_LOGI(TAG, "ESP_GATTC_CFG_MTU_EVT, Status %d, MTU %d, conn_id %d", param->cfg_mtu.status, param->cfg_mtu.mtu, param->cfg_mtu.conn_id);
+            ol305_lat_mark(find_link_by_conn_id(param->cfg_mtu.conn_id), OL305_LAT_MTU);
             break;
 
         case ESP_GATTC_SEARCH_RES_EVT:
             ESP_LOGI(TAG, "SEARCH RES: conn_id = %x is primary service %d", p_data->search_res.conn_id, p_data->search_res.is_primary);
             ESP_LOGI(TAG, "start handle %d end handle %d current handle value %d", p_data->search_res.start_handle, p_data->search_res.end_handle, p_data->search_res.srvc_id.inst_id);
+            link_id = find_link_by_conn_id(p_data->search_res.conn_id);
+            if (BLE_INVALID_LINK == link_id)
+                break;
+            link = &gl_link_tab[link_id];
 
             if (p_data->search_res.srvc_id.uuid.len == ESP_UUID_LEN_128)
             {
@@ -156,9 +629,9 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                 if (comp == true)
                 {
                     ESP_LOGI(TAG, "service found");
-                    get_server = true;
-                    gl_profile_tab.service_start_handle = p_data->search_res.start_handle;
-                    gl_profile_tab.service_end_handle = p_data->search_res.end_handle;
+                    link->get_server = true;
+                    link->service_start_handle = p_data->search_res.start_handle;
+                    link->service_end_handle = p_data->search_res.end_handle;
                 }
             }
             break;
@@ -184,14 +657,19 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
             }
 
             ESP_LOGI(TAG, "ESP_GATTC_SEARCH_CMPL_EVT");
-            if (get_server)
+            link_id = find_link_by_conn_id(p_data->search_cmpl.conn_id);
+            if (BLE_INVALID_LINK == link_id)
+                break;
+            ol305_lat_mark(link_id, OL305_LAT_SEARCH);
+            link = &gl_link_tab[link_id];
+            if (link->get_server)
             {
                 uint16_t count = 0;
                 esp_gatt_status_t status = esp_ble_gattc_get_attr_count(gattc_if,
                                                                         p_data->search_cmpl.conn_id,
                                                                         ESP_GATT_DB_CHARACTERISTIC,
-                                                                        gl_profile_tab.service_start_handle,
-                                                                        gl_profile_tab.service_end_handle,
+                                                                        link->service_start_handle,
+                                                                        link->service_end_handle,
                                                                         INVALID_HANDLE,
                                                                         &count);
                 if (status != ESP_GATT_OK)
@@ -212,8 +690,8 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                     {
                         status = esp_ble_gattc_get_char_by_uuid(gattc_if,
                                                                 p_data->search_cmpl.conn_id,
-                                                                gl_profile_tab.service_start_handle,
-                                                                gl_profile_tab.service_end_handle,
+                                                                link->service_start_handle,
+                                                                link->service_end_handle,
                                                                 (esp_bt_uuid_t)notify_uuid,
                                                                 char_elem_result,
                                                                 &count);
@@ -227,8 +705,8 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
 
                         if (count > 0 && (char_elem_result[0].properties & ESP_GATT_CHAR_PROP_BIT_NOTIFY))
                         {
-                            gl_profile_tab.char_handle = char_elem_result[0].char_handle;
-                            esp_ble_gattc_register_for_notify(gattc_if, gl_profile_tab.remote_bda, char_elem_result[0].char_handle);
+                            link->char_handle = char_elem_result[0].char_handle;
+                            esp_ble_gattc_register_for_notify(gattc_if, link->remote_bda, char_elem_result[0].char_handle);
                         }
                     }
 
@@ -244,8 +722,8 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                     {
                         status = esp_ble_gattc_get_char_by_uuid(gattc_if,
                                                                 p_data->search_cmpl.conn_id,
-                                                                gl_profile_tab.service_start_handle,
-                                                                gl_profile_tab.service_end_handle,
+                                                                link->service_start_handle,
+                                                                link->service_end_handle,
                                                                 remote_filter_char_uuid,
                                                                 write_elem_result,
                                                                 &count);
@@ -259,7 +737,7 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
 
                         if (count > 0 && (write_elem_result[0].properties & ESP_GATT_CHAR_PROP_BIT_WRITE))
                         {
-                            gl_profile_tab.write_handle = write_elem_result[0].char_handle;
+                            link->write_handle = write_elem_result[0].char_handle;
                         }
                     }
                     free(write_elem_result);
@@ -276,17 +754,36 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
             if (p_data->reg_for_notify.status != ESP_GATT_OK)
             {
                 ESP_LOGE(TAG, "REG FOR NOTIFY failed: error status = %d", p_data->reg_for_notify.status);
+                if (BLE_INVALID_LINK != connecting_link && gl_link_tab[connecting_link].cached)
+                    link_rediscover(gattc_if, &gl_link_tab[connecting_link]);
             }
-            else
+            else if (BLE_INVALID_LINK != connecting_link && gl_link_tab[connecting_link].cached)
             {
+                ol305_lat_mark(connecting_link, OL305_LAT_NOTIFY_REG);
+                link = &gl_link_tab[connecting_link];
+                uint16_t notify_en = 1;
+                esp_gatt_status_t ret_status = esp_ble_gattc_write_char_descr(gattc_if,
+                                                                              link->conn_id,
+                                                                              link->cccd_handle,
+                                                                              sizeof(notify_en),
+                                                                              (uint8_t *)&notify_en,
+                                                                              ESP_GATT_WRITE_TYPE_RSP,
+                                                                              ESP_GATT_AUTH_REQ_NONE);
+                if (ret_status != ESP_GATT_OK)
+                    link_rediscover(gattc_if, link);
+            }
+            else if (BLE_INVALID_LINK != connecting_link)
+            {
+                ol305_lat_mark(connecting_link, OL305_LAT_NOTIFY_REG);
+                link = &gl_link_tab[connecting_link];
                 uint16_t count = 0;
                 uint16_t notify_en = 1;
                 esp_gatt_status_t ret_status = esp_ble_gattc_get_attr_count(gattc_if,
-                                                                            gl_profile_tab.conn_id,
+                                                                            link->conn_id,
                                                                             ESP_GATT_DB_DESCRIPTOR,
-                                                                            gl_profile_tab.service_start_handle,
-                                                                            gl_profile_tab.service_end_handle,
-                                                                            gl_profile_tab.char_handle,
+                                                                            link->service_start_handle,
+                                                                            link->service_end_handle,
+                                                                            link->char_handle,
                                                                             &count);
                 if (ret_status != ESP_GATT_OK)
                 {
@@ -305,9 +802,9 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                     else
                     {
                         ret_status = esp_ble_gattc_get_descr_by_uuid(gattc_if,
-                                                                    gl_profile_tab.conn_id,
-                                                                    gl_profile_tab.service_start_handle,
-                                                                    gl_profile_tab.service_end_handle,
+                                                                    link->conn_id,
+                                                                    link->service_start_handle,
+                                                                    link->service_end_handle,
                                                                     notify_uuid,
                                                                     notify_decr_uuid,
                                                                     descr_elem_result,
@@ -322,8 +819,9 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
 
                         if (count > 0 && descr_elem_result[0].uuid.len == ESP_UUID_LEN_16 && descr_elem_result[0].uuid.uuid.uuid16 == ESP_GATT_UUID_CHAR_CLIENT_CONFIG)
                         {
+                            link->cccd_handle = descr_elem_result[0].handle;
                             ret_status = esp_ble_gattc_write_char_descr(gattc_if,
-                                                                        gl_profile_tab.conn_id,
+                                                                        link->conn_id,
                                                                         descr_elem_result[0].handle,
                                                                         sizeof(notify_en),
                                                                         (uint8_t *)&notify_en,
@@ -346,17 +844,32 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
             break;
         
         case ESP_GATTC_NOTIFY_EVT:
-            ol305_recive_message(p_data->notify.value, p_data->notify.value_len);
+            link_event(find_link_by_conn_id(p_data->notify.conn_id), BLE_LINK_DATA, p_data->notify.value, p_data->notify.value_len);
             break;
 
         case ESP_GATTC_WRITE_DESCR_EVT:
+            link_id = find_link_by_conn_id(p_data->write.conn_id);
             if (p_data->write.status != ESP_GATT_OK)
             {
                 ESP_LOGE(TAG, "write descr failed, error status = %x", p_data->write.status);
+                if (BLE_INVALID_LINK != link_id && gl_link_tab[link_id].cached)
+                    link_rediscover(gattc_if, &gl_link_tab[link_id]);
                 break;
             }
             ESP_LOGI(TAG, "write descr success"); 
-            ble_connection = true;
+            if (BLE_INVALID_LINK == link_id)
+                break;
+            link = &gl_link_tab[link_id];
+            if (!link->cached && INVALID_HANDLE != link->write_handle && INVALID_HANDLE != link->cccd_handle)
+            {
+                gatt_cache_store(link);
+                link->cached = true;
+            }
+            ESP_LOGI(TAG, "link %d ready in %" PRId64 " us", link_id, esp_timer_get_time() - link->open_time);
+            ol305_lat_mark(link_id, OL305_LAT_CCCD);
+            link->state = LINK_READY;
+            link_opened(link_id);
+            link_event(link_id, BLE_LINK_READY, NULL, 0);
             break;
 
         case ESP_GATTC_SRVC_CHG_EVT:
@@ -364,32 +877,46 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
             memcpy(bda, p_data->srvc_chg.remote_bda, sizeof(esp_bd_addr_t));
             ESP_LOGI(TAG, "ESP_GATTC_SRVC_CHG_EVT, bd_addr:");
             esp_log_buffer_hex(TAG, bda, sizeof(esp_bd_addr_t));
+            //the handles of this lock may have moved
+            gatt_cache_erase(bda);
+            link_id = find_link_by_bda(bda, LINK_READY);
+            if (BLE_INVALID_LINK == link_id)
+                link_id = find_link_by_bda(bda, LINK_OPENING);
+            if (BLE_INVALID_LINK != link_id)
+                link_rediscover(gattc_if, &gl_link_tab[link_id]);
             break;
 
         case ESP_GATTC_WRITE_CHAR_EVT:
+            link_id = find_link_by_conn_id(p_data->write.conn_id);
+            //the owner gets its buffer back whatever the outcome
+            link_event(link_id, BLE_LINK_WRITTEN, NULL, 0);
             if (p_data->write.status != ESP_GATT_OK)
             {
                 ESP_LOGE(TAG, "write char failed, error status = %x", p_data->write.status);
+                if (ESP_GATT_INVALID_HANDLE == p_data->write.status && BLE_INVALID_LINK != link_id)
+                {
+                    //stale write handle, the next connection runs a full discovery
+                    gatt_cache_erase(gl_link_tab[link_id].remote_bda);
+                    gl_link_tab[link_id].cached = false;
+                    esp_ble_gattc_close(gattc_if, p_data->write.conn_id);
+                }
                 break;
             }
             ESP_LOGD(TAG, "write char success");
             break;
 
         case ESP_GATTC_DISCONNECT_EVT:
-            ble_connection = false;
-            get_server = false;
             ESP_LOGI(TAG, "ESP_GATTC_DISCONNECT_EVT, reason = %d", p_data->disconnect.reason);
-            
-            uint32_t scan_duration = 30;
-            esp_err_t scan_retry = esp_ble_gap_start_scanning(scan_duration);
-            if (scan_retry != ESP_OK) 
-            {
-                ESP_LOGE(TAG, "Failed to start scanning for reconnection, error: %s", esp_err_to_name(scan_retry));
-            }
-            else 
-            {
-                ESP_LOGI(TAG, "Started scanning to reconnect...");
-            }
+            link_id = find_link_by_conn_id(p_data->disconnect.conn_id);
+            if (BLE_INVALID_LINK == link_id)
+                break;
+            //the owner did not close the link, search the lock again
+            gl_link_tab[link_id].state = LINK_SEARCHING;
+            gl_link_tab[link_id].get_server = false;
+            link_opened(link_id);
+            ESP_LOGI(TAG, "Started scanning to reconnect...");
+            uint8_t reason[2] = {p_data->disconnect.reason & 0xff, (p_data->disconnect.reason >> 8) & 0xff};
+            link_event(link_id, BLE_LINK_CLOSED, reason, sizeof(reason));
             break;
 
         default:
@@ -402,17 +929,23 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
     switch (event)
     {
         case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
-            uint32_t duration = 30;
-            esp_ble_gap_start_scanning(duration);
+            scan_params_set = true;
+            ble_scan_update();
             break;
 
         case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
             if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS)
             {
                 ESP_LOGE(TAG, "scan start failed, error status = %x", param->scan_start_cmpl.status);
+                scanning = false;
                 break;
             }
             ESP_LOGI(TAG, "scan start success");
+            for (int i = 0; i < BLE_MAX_LINKS; i++)
+            {
+                if (LINK_SEARCHING == gl_link_tab[i].state)
+                    ol305_lat_mark(i, OL305_LAT_SCAN);
+            }
             break;
 
         case ESP_GAP_BLE_SCAN_RESULT_EVT:
@@ -421,15 +954,49 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
             switch (scan_result->scan_rst.search_evt)
             {
                 case ESP_GAP_SEARCH_INQ_RES_EVT:
-                    if (memcmp(scan_result->scan_rst.bda, TARGET_MAC, sizeof(esp_bd_addr_t)) == 0)
+                {
+                    if (BLE_INVALID_LINK != connecting_link)
+                        break;
+                    portENTER_CRITICAL(&ble_links_mux);
+                    int link_id = scan_target_find(scan_result->scan_rst.bda);
+                    if (BLE_INVALID_LINK != link_id)
+                    {
+                        gl_link_tab[link_id].state = LINK_OPENING;
+                        connecting_link = link_id;
+                    }
+                    portEXIT_CRITICAL(&ble_links_mux);
+                    if (BLE_INVALID_LINK == link_id)
+                        break;
+
+                    ESP_LOGD(TAG, "connect to the remote device.");
+                    ol305_lat_mark(link_id, OL305_LAT_ADV);
+                    esp_ble_gap_stop_scanning();
+                    scanning = false;
+                    gattc_link_inst *link = &gl_link_tab[link_id];
+                    whitelist_bypass = false;
+                    link->connected = false;
+                    link->direct_failed = false;
+                    if (!link->addr_known || link->addr_type != scan_result->scan_rst.ble_addr_type)
                     {
-                        ESP_LOGD(TAG, "connect to the remote device.");
-                        esp_ble_gap_stop_scanning();
-                        esp_ble_gattc_open(gl_profile_tab.gattc_if, scan_result->scan_rst.bda, scan_result->scan_rst.ble_addr_type, true);
+                        link->addr_type = scan_result->scan_rst.ble_addr_type;
+                        link->addr_known = true;
+                        addr_type_store(link->remote_bda, link->addr_type);
                     }
+                    link->open_time = esp_timer_get_time();
+                    esp_ble_gattc_open(gl_profile_tab.gattc_if, scan_result->scan_rst.bda, scan_result->scan_rst.ble_addr_type, true);
                     break;
+                }
 
                 case ESP_GAP_SEARCH_INQ_CMPL_EVT:
+                    //the scan window ended, keep looking for the locks that were not found
+                    if (BLE_SCAN_FILTER_ALLOW_ONLY_WLST == ble_scan_params.scan_filter_policy)
+                    {
+                        //the next window listens to everybody, a hit stores the right address type
+                        whitelist_bypass = true;
+                        whitelist_dirty = true;
+                    }
+                    scanning = false;
+                    ble_scan_update();
                     break;
 
                 default:
@@ -445,6 +1012,7 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
                 break;
             }
             ESP_LOGI(TAG, "stop scan successfully");
+            ble_scan_update();
             break;
 
         case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
@@ -504,7 +1072,7 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp
     }
 }
 
-void ble_init()
+static void ble_stack_init()
 {
     esp_err_t ret;
     if (true == firts_time)
@@ -569,36 +1137,134 @@ void ble_init()
     }
 }
 
-void ble_write(uint8_t *data, uint16_t len)
+// The stack is shared by all the links, it is brought up by the first user and torn down by the last one
+void ble_init()
+{
+    _lock_acquire(&ble_stack_lock);
+    if (0 == ble_users++)
+        ble_stack_init();
+    _lock_release(&ble_stack_lock);
+}
+
+bool ble_write(int link, uint8_t *data, uint16_t len)
 {
-    esp_ble_gattc_write_char( gl_profile_tab.gattc_if,
-                            gl_profile_tab.conn_id,
-                            gl_profile_tab.write_handle,
+    if (!is_ble_connected(link))
+    {
+        ESP_LOGW(TAG, "write on a link that is not ready %d", link);
+        return false;
+    }
+
+    esp_err_t ret = esp_ble_gattc_write_char( gl_profile_tab.gattc_if,
+                            gl_link_tab[link].conn_id,
+                            gl_link_tab[link].write_handle,
                             len,
                             data,
                             ESP_GATT_WRITE_TYPE_RSP,
                             ESP_GATT_AUTH_REQ_NONE);
+    if (ESP_OK != ret)
+    {
+        ESP_LOGE(TAG, "write char error, error code = %x", ret);
+        return false;
+    }
+    return true;
 }
 
-void set_target_mac(uint8_t* new_mac_addr,uint16_t mac_len)
+int ble_link_open(uint8_t *mac_addr, uint16_t mac_len, ble_link_cb_t cb, void *ctx)
 {
-    
-    if (mac_len != sizeof(TARGET_MAC)) 
+    if (mac_len != sizeof(esp_bd_addr_t)) 
     {
-        ESP_LOGE(TAG, "Error: Invalid MAC address length. Expected %d, but got %04x", sizeof(TARGET_MAC), mac_len);
-        return;
+        ESP_LOGE(TAG, "Error: Invalid MAC address length. Expected %d, but got %04x", sizeof(esp_bd_addr_t), mac_len);
+        return BLE_INVALID_LINK;
     }
 
-    if (is_ble_connected() == true)
+    gatt_cache_entry entry;
+    bool cached = gatt_cache_load(mac_addr, &entry);
+    esp_ble_addr_type_t addr_type;
+    bool addr_known = addr_type_load(mac_addr, &addr_type);
+
+    int link = BLE_INVALID_LINK;
+    portENTER_CRITICAL(&ble_links_mux);
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
     {
-        esp_ble_gattc_close(gl_profile_tab.gattc_if, gl_profile_tab.conn_id);
-        ESP_LOGI(TAG, "BLE connection disconnected.");
+        if (LINK_FREE == gl_link_tab[i].state)
+        {
+            link = i;
+            esp_timer_handle_t direct_timer = gl_link_tab[i].direct_timer;
+            memset(&gl_link_tab[i], 0, sizeof(gl_link_tab[i]));
+            gl_link_tab[i].direct_timer = direct_timer;
+            memcpy(gl_link_tab[i].remote_bda, mac_addr, sizeof(esp_bd_addr_t));
+            gl_link_tab[i].addr_known = addr_known;
+            gl_link_tab[i].addr_type = addr_type;
+            if (cached)
+            {
+                gl_link_tab[i].cached = true;
+                gl_link_tab[i].service_start_handle = entry.service_start_handle;
+                gl_link_tab[i].service_end_handle = entry.service_end_handle;
+                gl_link_tab[i].char_handle = entry.char_handle;
+                gl_link_tab[i].write_handle = entry.write_handle;
+                gl_link_tab[i].cccd_handle = entry.cccd_handle;
+            }
+            gl_link_tab[i].cb = cb;
+            gl_link_tab[i].ctx = ctx;
+            gl_link_tab[i].state = LINK_SEARCHING;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&ble_links_mux);
+
+    if (BLE_INVALID_LINK == link)
+    {
+        ESP_LOGW(TAG, "No free connection slot");
+        return BLE_INVALID_LINK;
     }
 
-    memcpy(TARGET_MAC, new_mac_addr, sizeof(TARGET_MAC));
     ESP_LOGI(TAG, "Search MAC : %02x:%02x:%02x:%02x:%02x:%02x",
-             TARGET_MAC[0], TARGET_MAC[1], TARGET_MAC[2],
-             TARGET_MAC[3], TARGET_MAC[4], TARGET_MAC[5]);
+             mac_addr[0], mac_addr[1], mac_addr[2],
+             mac_addr[3], mac_addr[4], mac_addr[5]);
+    ble_scan_update();
+    return link;
+}
+
+void ble_link_close(int link)
+{
+    if (0 > link || BLE_MAX_LINKS <= link)
+        return;
+
+    portENTER_CRITICAL(&ble_links_mux);
+    gattc_link_state state = gl_link_tab[link].state;
+    gl_link_tab[link].state = LINK_FREE;
+    gl_link_tab[link].cb = NULL;
+    portEXIT_CRITICAL(&ble_links_mux);
+
+    if (NULL != gl_link_tab[link].direct_timer)
+        esp_timer_stop(gl_link_tab[link].direct_timer);
+
+    if (LINK_OPENING == state && !gl_link_tab[link].connected)
+    {
+        //pending open, nothing to unregister yet
+        esp_ble_gap_disconnect(gl_link_tab[link].remote_bda);
+    }
+    else if (LINK_OPENING == state || LINK_READY == state)
+    {
+        esp_ble_gattc_unregister_for_notify(gl_profile_tab.gattc_if, gl_link_tab[link].remote_bda, gl_link_tab[link].char_handle);
+        esp_ble_gattc_close(gl_profile_tab.gattc_if, gl_link_tab[link].conn_id);
+        ESP_LOGI(TAG, "BLE connection disconnected.");
+    }
+    link_opened(link);
+}
+
+// Takes effect on the running scan, which is restarted with the new timing
+void ble_set_scan_preset(ble_scan_preset_t preset)
+{
+    if (BLE_SCAN_PRESET_MAX <= preset)
+        return;
+    portENTER_CRITICAL(&ble_links_mux);
+    ble_scan_params.scan_interval = scan_presets[preset][0];
+    ble_scan_params.scan_window = scan_presets[preset][1];
+    scan_params_dirty = true;
+    portEXIT_CRITICAL(&ble_links_mux);
+    if (ESP_GATT_IF_NONE != gl_profile_tab.gattc_if)
+        ble_scan_update();
 }
 
 void set_uuid(uint8_t *uuid, uuid_type type)
@@ -8,6 +8,15 @@
 #include "esp_bt_main.h"
 #include "esp_gatt_common_api.h"
 
+//one GATTC link per connection slot of the controller
+#ifdef CONFIG_BTDM_CTRL_BLE_MAX_CONN
+#define BLE_MAX_LINKS CONFIG_BTDM_CTRL_BLE_MAX_CONN
+#else
+#define BLE_MAX_LINKS 3
+#endif
+
+#define BLE_INVALID_LINK -1
+
 typedef enum
 {
     SERVICE_UUID,
@@ -17,11 +26,32 @@ typedef enum
     LAST_UUID,
 }uuid_type;
 
+typedef enum
+{
+    BLE_LINK_READY,     //notifications enabled, the link can be written
+    BLE_LINK_DATA,      //notification received
+    BLE_LINK_CLOSED,    //link lost, it is searched again until ble_link_close(); data: disconnect reason, uint16 little endian
+    BLE_LINK_WRITTEN,   //write acknowledged by the lock, in the order of ble_write()
+}ble_link_event_t;
+
+typedef enum
+{
+    BLE_SCAN_FAST,          //finds the locks quickest, the radio listens all the time
+    BLE_SCAN_BALANCED,
+    BLE_SCAN_LOW_POWER,     //low duty cycle, slower discovery
+    BLE_SCAN_PRESET_MAX,
+}ble_scan_preset_t;
+
+//called from the Bluetooth task, keep it short
+typedef void (*ble_link_cb_t)(void *ctx, ble_link_event_t event, uint8_t *data, uint16_t len);
+
 void ble_init();
 void ble_deinit();
 void set_uuid(uint8_t *uuid, uuid_type type);
-void set_target_mac(uint8_t* new_mac_addr,uint16_t mac_len);
-bool is_ble_connected();
-void ble_write(uint8_t *data, uint16_t len);
+void ble_set_scan_preset(ble_scan_preset_t preset);
+int ble_link_open(uint8_t *mac_addr, uint16_t mac_len, ble_link_cb_t cb, void *ctx);
+void ble_link_close(int link);
+bool is_ble_connected(int link);
+bool ble_write(int link, uint8_t *data, uint16_t len);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,18 +1,53 @@
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "ol305.h"
-#include "test_ol305.h"
+#include "ol305_evlog.h"
+#include "ol305_usage.h"
+#include "ol305_trace.h"
+#include "ol305_console.h"
+#include "ol305_fleet.h"
+#include "ble_connection.h"
 #include "freertos/FreeRTOS.h"
 
 const static char *password  = "yOTmK50z";
 
+//status refresh of a lock waiting for its turn on a connection slot
+#define FLEET_STATUS_TTL_MS 60000
+
+//the specific mac addresses of the OL305 lockers served by this board
+static uint8_t mac_addrs[][6] =
+{
+    {0xd5, 0x7b, 0xf1, 0xca, 0x51, 0x51},
+};
+
+//the Unity suites of test/ bring their own app_main
+#ifndef PIO_UNIT_TESTING
 void app_main(void)
 {
     nvs_flash_init();
-    set_ol305_ble_password(password);
-    //the specific mac address of the OL305
-    uint8_t mac_addr[] = {0xd5, 0x7b, 0xf1, 0xca, 0x51, 0x51};
-    set_ol305_mac_addr(mac_addr,sizeof(mac_addr));
-    xTaskCreate(&ol305_task,"OL305_TASK", 5000, NULL, 5 , NULL);
-    xTaskCreate(&test_task,"TEST_TASK", 5000, NULL, 5 , NULL);
-}
\ No newline at end of file
+    if (ESP_OK == ol305_evlog_mount())
+    {
+        ol305_evlog_start(OL305_EVLOG_MOUNT);
+        ol305_usage_set_dir(OL305_EVLOG_MOUNT);
+    }
+    //captures start from the console, without one the wrapper only forwards
+    ol305_set_transport(ol305_trace_transport(&ol305_ble_transport));
+    //more lockers than the controller has connections: they take turns, unlocks first
+    bool fleet = BLE_MAX_LINKS < sizeof(mac_addrs) / sizeof(mac_addrs[0]);
+    if (fleet)
+        ol305_fleet_configure(&(ol305_fleet_config_t){.slots = BLE_MAX_LINKS});
+    for (uint8_t i = 0; i < sizeof(mac_addrs) / sizeof(mac_addrs[0]); i++)
+    {
+        ol305_handle_t lock = ol305_add_lock();
+        if (NULL == lock)
+            break;
+        set_ol305_ble_password(lock, password);
+        set_ol305_mac_addr(lock, mac_addrs[i], sizeof(mac_addrs[i]));
+        if (fleet)
+            ol305_set_status_ttl(lock, FLEET_STATUS_TTL_MS);
+        xTaskCreate(&ol305_task,"OL305_TASK", 5000, lock, 5 , NULL);
+    }
+    //the host controller drives the locks over the console UART
+    ol305_console_start(&ol305_console_uart);
+}
+#endif
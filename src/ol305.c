@@ -1,16 +1,54 @@
 #include <string.h>
-#include "ble_connection.h"
+#include <stdlib.h>
+#include <inttypes.h>
 #include "ol305.h"
+#include "ol305_cmdq.h"
+#include "ol305_codec.h"
+#include "ol305_txpool.h"
+#include "ol305_reasm.h"
+#include "ol305_rxq.h"
+#include "ol305_latency.h"
+#include "ol305_stats.h"
+#include "ol305_evlog.h"
+#include "ol305_usage.h"
+#include "ol305_rfid.h"
+#include "ol305_fleet.h"
 #include "esp_log.h"
 #include "esp_timer.h"
-
-#define MAX_MSG_LEN 22
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define OL305_STATUS_TTL_MS 5000 //default age after which the cached status is queried again
+#define OL305_QUERY_RETRY_MS 500 //a stale status is queried again when the lock did not answer
+#define OL305_KEY_RETRY_MS 1000
+#define OL305_MAX_WAITERS 16
+#define OL305_TX_PENDING 4
+
+//unlock retries: the first one waits a few answer times, then the wait doubles
+#define OL305_UNLOCK_MAX_ATTEMPTS 5
+#define OL305_UNLOCK_MIN_RETRY_MS 200
+#define OL305_UNLOCK_MAX_RETRY_MS 1600
+#define OL305_UNLOCK_DEADLINE_MS 6000
+
+//usage sync: a lost answer is asked for again, a record the lock keeps handing out ends the sync
+#define OL305_USAGE_STALL_MS 1000
+#define OL305_USAGE_MAX_ATTEMPTS 3
+#define OL305_USAGE_RECORD_LEN 13
+
+//card sync: one GET_RFID, REGISTER_RFID or DELETE_RFID at a time, asked again when unanswered
+#define OL305_RFID_STALL_MS 1000
+#define OL305_RFID_MAX_ATTEMPTS 3
+#define OL305_RFID_LIST_LEN 11
+
+//task notification bits used to wake ol305_task
+#define OL305_EVT_COMMAND (1 << 0)
+#define OL305_EVT_NOTIFY (1 << 1)
+#define OL305_EVT_STATE (1 << 2)
+#define OL305_EVT_LINK (1 << 3)
+#define OL305_EVT_RESULT (1 << 4)
 const static char *TAG = "OL305";
 
-static uint8_t service_uuid[] = {0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e};
-static uint8_t write_uuid[] = {0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x02, 0x00, 0x40, 0x6e};
-static uint8_t notify_uuid[] = {0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x03, 0x00, 0x40, 0x6e};
-static uint8_t notify_decr_uuid[] = {0x29, 0x02};
+static const ol305_transport_t *ol305_transport = NULL;
 
 typedef enum
 {
@@ -31,70 +69,204 @@ typedef enum
     REGISTER_RFID_MESSAGE,
     DELETE_RFID_MESSAGE,
     LOCK_SETTINGS_MESSAGE,
+    USAGE_SYNC_MESSAGE,
+    RFID_SYNC_MESSAGE,
 } OL305_MSG_TYPE;
 
+//how each request is queued and completed
 typedef struct
 {
-    OL305_MSG_TYPE msg_type;
-    uint16_t stx;
-    uint8_t len;
-    uint8_t rand;
-    uint8_t key;
-    uint8_t cmd;
-    uint8_t data[MAX_MSG_LEN - 5];
-    uint8_t crc;
-} Message_OL305B_t;
+    uint8_t priority; //0 is the most urgent
+    bool idempotent;
+    bool awaits_reply; //completed by the answer of the lock, one in flight per request type
+    OL305_REQUEST request; //OL305_REQ_MAX -> internal message, nobody waits for it
+    uint32_t timeout_ms;
+    ol305_work_t work; //how urgently the lock needs a connection slot for it
+} OL305CmdPolicy_t;
+
+static const OL305CmdPolicy_t ol305_cmd_policy[] =
+{
+    [UNLOCK_RESPONSE_MESSAGE] = {.priority = 0, .idempotent = true, .request = OL305_REQ_MAX, .timeout_ms = 5000, .work = OL305_WORK_UNLOCK},
+    [LOCK_RESPONSE_MESSAGE] = {.priority = 0, .idempotent = true, .request = OL305_REQ_MAX, .timeout_ms = 5000, .work = OL305_WORK_UNLOCK},
+    [UNLOCK_MESSAGE] = {.priority = 1, .idempotent = true, .awaits_reply = true, .request = OL305_REQ_UNLOCK, .timeout_ms = 30000, .work = OL305_WORK_UNLOCK},
+    [REGISTER_RFID_MESSAGE] = {.priority = 2, .idempotent = false, .awaits_reply = true, .request = OL305_REQ_READ_RFID, .timeout_ms = 30000, .work = OL305_WORK_PROVISION},
+    [DELETE_RFID_MESSAGE] = {.priority = 2, .idempotent = true, .awaits_reply = true, .request = OL305_REQ_DELETE_RFID, .timeout_ms = 30000, .work = OL305_WORK_PROVISION},
+    [LOCK_SETTINGS_MESSAGE] = {.priority = 2, .idempotent = true, .awaits_reply = true, .request = OL305_REQ_SETTINGS, .timeout_ms = 30000, .work = OL305_WORK_PROVISION},
+    [QUERY_INFO_MESSAGE] = {.priority = 3, .idempotent = true, .awaits_reply = true, .request = OL305_REQ_QUERY, .timeout_ms = 30000, .work = OL305_WORK_REFRESH},
+    [USAGE_SYNC_MESSAGE] = {.priority = 3, .idempotent = true, .awaits_reply = true, .request = OL305_REQ_SYNC_USAGE, .timeout_ms = 120000, .work = OL305_WORK_REFRESH},
+    [RFID_SYNC_MESSAGE] = {.priority = 2, .idempotent = true, .awaits_reply = true, .request = OL305_REQ_SYNC_RFID, .timeout_ms = 120000, .work = OL305_WORK_PROVISION},
+};
+
+//bytes an answer needs before ol305_handle_frame reads it, by command; the decoder guarantees one
+static const uint8_t ol305_answer_min_len[] =
+{
+    [BLE_KEY] = 2,
+    [QUERY_INFO] = 3,
+    [LOCK_SETTINGS] = 3,
+    [GET_RFID] = 3,
+};
 
+//a caller waiting for the result of a request
 typedef struct
 {
+    uint32_t id; //0 -> free
+    bool done;
+    ol305_done_cb_t done_cb;
+    void *ctx;
+    EventGroupHandle_t event_group;
+    EventBits_t done_bits;
+    ol305_result_t *result_out;
+    ol305_result_t result;
+} OL305Waiter_t;
+
+typedef struct ol305_lock
+{
+	uint8_t index;
 	OL305_STATE new_state;
 	OL305_STATES state;
 	uint8_t mac[6];
     uint8_t status; //invalid -> 0x00; unlocked -> 0x01; locked -> 0x02
     uint8_t expected_status; //invalid -> 0x00; unlocked -> 0x01; locked -> 0x02
     int battery_voltage;
-    char password[8];
+    int64_t status_time; //when status/battery_voltage were last reported by the lock, 0 -> never
+    uint32_t status_ttl_ms;
+    int64_t query_time; //last QUERY_INFO sent by ol305_status_check
+    char password[9];
+    int link;
+    bool ble_started;
+    OL305_BLE_MODE ble_mode;
+    bool cold_start; //the stack was brought up by the current connection attempt
+    int64_t connect_start; //reconnect latency
+    int64_t key_sent_time; //0 -> key not sent on the current link
+    int64_t command_time; //when the pending command was submitted, used for latency logging
+    int64_t write_time; //last frame written, used to measure the answer time
+    int64_t rtt_us; //smoothed answer time of the lock, 0 -> not measured yet
+    uint8_t unlock_attempts;
+    bool unlock_refused; //the lock answered that the unlock failed
+    uint32_t unlock_backoff_ms;
+    int64_t unlock_retry_at;
+    ol305_usage_store_t usage; //open while a usage sync runs
+    bool usage_busy; //usage store open, under queue_mux
+    bool usage_dropping; //ol305_drop_usage rewrites the file, under queue_mux
+    ol305_usage_sync_t usage_sync; //progress of the running sync
+    int64_t usage_start;
+    int64_t usage_retry_at;
+    uint8_t usage_attempts;
+    uint8_t usage_repeats; //duplicates in a row
+    uint8_t usage_obtains; //OBTAIN_LAST_USAGE sent on this link and not answered yet
+    uint8_t usage_deletes; //DELETE_LAST_USAGE sent on this link and not answered yet
+    bool usage_fresh; //the newest OBTAIN_LAST_USAGE was sent with every DELETE_LAST_USAGE answered
+    ol305_rfid_index_t rfid; //cards on the lock as far as we know, written by ol305_task under queue_mux
+    ol305_rfid_index_t rfid_desired; //set by ol305_set_cards, under queue_mux
+    bool rfid_has_desired;
+    bool rfid_loaded; //rfid read from NVS
+    bool rfid_verified; //card count checked against the lock since the key was obtained
+    ol305_rfid_op_t rfid_op; //NONE -> listing the cards of the lock
+    uint8_t rfid_card[OL305_RFID_CARD_LEN]; //card of rfid_op
+    uint16_t rfid_next; //next index asked with GET_RFID
+    ol305_rfid_sync_t rfid_sync; //progress of the running sync
+    int64_t rfid_start;
+    int64_t rfid_retry_at;
+    uint8_t rfid_attempts;
+    uint8_t key; //session key handed out by the lock, 0x00 -> none
+    ol305_txbuf_t *tx_pending[OL305_TX_PENDING]; //lent to the transport, oldest first
+    uint8_t tx_pending_count;
+    ol305_rxq_t rxq; //notification bytes, transport context -> ol305_task
+    ol305_reasm_t rx; //ol305_task only
+    uint32_t rx_dropped; //rxq drops already reported
+    ol305_stats_block_t stats; //written by ol305_task only
+    ol305_cmdq_t queue;
+    ol305_cmd_t inflight[OL305_REQ_MAX]; //sent and waiting for the answer of the lock, id 0 -> none
+    int64_t sent_time[OL305_REQ_MAX]; //when the inflight request was first sent
+    OL305Waiter_t waiters[OL305_MAX_WAITERS];
+    portMUX_TYPE queue_mux; //guards queue, inflight, waiters, the status cache and tx_pending
+    TaskHandle_t task;
+    uint32_t missed_events;
 } OL305Details_t;
 
-Message_OL305B_t message_to_send=
+static OL305Details_t ol305_locks[OL305_MAX_LOCKS];
+static uint8_t ol305_lock_count = 0;
+
+static void ol305_wake(OL305Details_t *lock, uint32_t event)
 {
-    .stx = 0xa3a4,
-};
-static OL305Details_t ol305_details;
-
-unsigned char CRC8Table[]=
-{
-    0, 94, 188, 226, 97, 63, 221, 131, 194, 156, 126, 32, 163, 253, 31, 65,
-    157, 195, 33, 127, 252, 162, 64, 30, 95, 1, 227, 189, 62, 96, 130, 220,
-    35, 125, 159, 193, 66, 28, 254, 160, 225, 191, 93, 3, 128, 222, 60, 98,
-    190, 224, 2, 92, 223, 129, 99, 61, 124, 34, 192, 158, 29, 67, 161, 255,
-    70, 24, 250, 164, 39, 121, 155, 197, 132, 218, 56, 102, 229, 187, 89, 7,
-    219, 133, 103, 57, 186, 228, 6, 88, 25, 71, 165, 251, 120, 38, 196, 154,
-    101, 59, 217, 135, 4, 90, 184, 230, 167, 249, 27, 69, 198, 152, 122, 36,
-    248, 166, 68, 26, 153, 199, 37, 123, 58, 100, 134, 216, 91, 5, 231, 185,
-    140, 210, 48, 110, 237, 179, 81, 15, 78, 16, 242, 172, 47, 113, 147, 205,
-    17, 79, 173, 243, 112, 46, 204, 146, 211, 141, 111, 49, 178, 236, 14, 80,
-    175, 241, 19, 77, 206, 144, 114, 44, 109, 51, 209, 143, 12, 82, 176, 238,
-    50, 108, 142, 208, 83, 13, 239, 177, 240, 174, 76, 18, 145, 207, 45, 115,
-    202, 148, 118, 40, 171, 245, 23, 73, 8, 86, 180, 234, 105, 55, 213, 139,
-    87, 9, 235, 181, 54, 104, 138, 212, 149, 203, 41, 119, 244, 170, 72, 22,
-    233, 183, 85, 11, 136, 214, 52, 106, 43, 117, 151, 201, 74, 20, 246, 168,
-    116, 42, 200, 150, 21, 75, 169, 247, 182, 232, 10, 84, 215, 137, 107, 53
-};
+    if (NULL != lock->task)
+        xTaskNotify(lock->task, event, eSetBits);
+}
 
-static unsigned char crc_calc(unsigned char *pucFrame, char usLen)
+// ol305_task only, the counters have a single writer
+static inline void ol305_stat(OL305Details_t *lock, ol305_stat_t stat)
 {
-    unsigned char crc8 = 0;
-    
-    while(usLen--)
+    ol305_stats_add(&lock->stats, stat, 1);
+}
+
+static inline uint32_t ol305_get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint32_t ol305_clip_us(int64_t us)
+{
+    return (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+}
+
+static uint32_t ol305_wait_event(OL305Details_t *lock, uint32_t timeout_ms)
+{
+    uint32_t events = 0;
+    TickType_t ticks = (portMAX_DELAY == timeout_ms) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    xTaskNotifyWait(0, UINT32_MAX, &events, ticks);
+    lock->missed_events |= events;
+    return events;
+}
+
+static void ol305_task_sleep(OL305Details_t *lock, uint32_t timeout_ms)
+{
+    //events consumed by a nested wait have not been seen by the state machine yet
+    if (0 == lock->missed_events)
+        ol305_wait_event(lock, timeout_ms);
+    lock->missed_events = 0;
+}
+
+// The backend every lock is reached through, set once before the tasks start
+void ol305_set_transport(const ol305_transport_t *transport)
+{
+    ol305_transport = transport;
+}
+
+ol305_handle_t ol305_add_lock()
+{
+    if (OL305_MAX_LOCKS <= ol305_lock_count)
     {
-        crc8 = CRC8Table[crc8^*(pucFrame++)];
+        ESP_LOGE(TAG,"Too many locks, max %d", OL305_MAX_LOCKS);
+        return NULL;
     }
 
-    return(crc8);
+    OL305Details_t *lock = &ol305_locks[ol305_lock_count];
+    memset(lock, 0, sizeof(*lock));
+    lock->index = ol305_lock_count;
+    lock->link = OL305_INVALID_LINK;
+    lock->status_ttl_ms = OL305_STATUS_TTL_MS;
+    ol305_cmdq_init(&lock->queue);
+    ol305_rxq_init(&lock->rxq);
+    ol305_reasm_init(&lock->rx);
+    ol305_stats_init(&lock->stats);
+    portMUX_INITIALIZE(&lock->queue_mux);
+    ol305_lock_count++;
+    return lock;
+}
+
+ol305_handle_t ol305_get_lock(uint8_t index)
+{
+    if (index >= ol305_lock_count)
+        return NULL;
+    return &ol305_locks[index];
+}
+
+uint8_t ol305_get_lock_count()
+{
+    return ol305_lock_count;
 }
 
-void set_ol305_ble_password(const char *password)
+void set_ol305_ble_password(ol305_handle_t lock, const char *password)
 {
     if (4 > strlen(password) || 8 < strlen(password))
     {
@@ -102,22 +274,39 @@ void set_ol305_ble_password(const char *password)
         return;
     }
 
-    memcpy(ol305_details.password,password,strlen(password));
+    memset(lock->password, 0, sizeof(lock->password));
+    memcpy(lock->password,password,strlen(password));
 }
 
-void set_ol305_mac_addr(uint8_t *ol305_mac_addr, uint16_t len)
+void set_ol305_mac_addr(ol305_handle_t lock, uint8_t *ol305_mac_addr, uint16_t len)
 {
     if (len != 6)
     {
         ESP_LOGE(TAG,"Wrong MAC addr for OL305");
         return;
     }
-    memcpy(ol305_details.mac,ol305_mac_addr,len);
+    memcpy(lock->mac,ol305_mac_addr,len);
 }
 
-static void ol305_task_events(OL305_STATES new_state)
+// Index of the cards kept from the last connection
+static void ol305_rfid_reload(OL305Details_t *lock)
+{
+    ol305_rfid_index_t stored;
+    ol305_rfid_load(&stored, lock->mac);
+    portENTER_CRITICAL(&lock->queue_mux);
+    lock->rfid = stored;
+    portEXIT_CRITICAL(&lock->queue_mux);
+    lock->rfid_loaded = true;
+}
+
+#ifdef OL305_TEST_HOOKS
+static ol305_test_state_cb_t ol305_test_state_cb = NULL;
+static void *ol305_test_state_ctx = NULL;
+#endif
+
+static void ol305_task_events(OL305Details_t *lock, OL305_STATES new_state)
 {
-	if (ol305_details.state == new_state)
+	if (lock->state == new_state)
 	{
 		ESP_LOGI(TAG, "Same state received %d", new_state);
 		return;
@@ -125,482 +314,1787 @@ static void ol305_task_events(OL305_STATES new_state)
 	switch (new_state)
 	{
         case CONNECTING:
-            ESP_LOGI(TAG, "OL305 connecting...");
-            ol305_details.state = new_state;
+            ESP_LOGI(TAG, "OL305 %d connecting...", lock->index);
+            lock->state = new_state;
+            lock->connect_start = esp_timer_get_time();
+            lock->cold_start = false;
+            //a lost link is searched again by the transport, the attempt is timed from here
+            ol305_lat_begin(lock->link, lock->connect_start);
             break;
         case CONNECTED:
-            ESP_LOGI(TAG, "OL305 connected");
-            ol305_details.state = new_state;
+            ESP_LOGI(TAG, "OL305 %d connected in %" PRId64 " ms (%s stack)", lock->index,
+                     (esp_timer_get_time() - lock->connect_start) / 1000, lock->cold_start ? "cold" : "warm");
+            ol305_evlog_write(lock->index, OL305_EV_CONNECTED, 0, 0, ol305_clip_us(esp_timer_get_time() - lock->connect_start));
+            ol305_fleet_set_connected(lock->index, true, esp_timer_get_time());
+            //cards may have been changed on the lock while we were away
+            lock->rfid_verified = false;
+            lock->usage_obtains = 0;
+            lock->usage_deletes = 0;
+            if (!lock->rfid_loaded)
+                ol305_rfid_reload(lock);
+            lock->state = new_state;
             break;
         case DISCONNECTING:
-            ESP_LOGI(TAG, "OL305 disconnecting...");
-            ol305_details.state = new_state;
+            ESP_LOGI(TAG, "OL305 %d disconnecting...", lock->index);
+            lock->state = new_state;
             break;
         case DISCONNECTED:
-            ESP_LOGI(TAG, "OL305 disconnected");
-            ol305_details.state = new_state;
+            ESP_LOGI(TAG, "OL305 %d disconnected", lock->index);
+            ol305_evlog_write(lock->index, OL305_EV_DISCONNECTED, 0, 0, 0);
+            lock->state = new_state;
             break;
         default:
             ESP_LOGI(TAG, "Unknown state received %d", new_state);
-            break;
+            return;
 	}
+#ifdef OL305_TEST_HOOKS
+    if (NULL != ol305_test_state_cb)
+        ol305_test_state_cb(lock, new_state, ol305_test_state_ctx);
+#endif
+	ol305_wake(lock, OL305_EVT_STATE);
 }
 
-static void ol305_encode_key_message(const char* password)
+static ol305_txbuf_t *ol305_encode_key_message(OL305Details_t *lock, const char* password)
 {
-    message_to_send.len = strlen(password); 
-    message_to_send.key = 0x00; 
-    message_to_send.cmd = BLE_KEY;
-    memcpy(message_to_send.data, (uint8_t*)password, message_to_send.len);
+    ol305_txbuf_t *buf = ol305_txpool_get(BLE_KEY);
+    if (NULL == buf)
+        return NULL;
+    lock->key = 0x00;
+    buf->len = strlen(password);
+    memcpy(OL305_TXBUF_DATA(buf), password, buf->len);
+    return buf;
 }
 
-static void ol305_encode_unlock_message(uint8_t control_cmd, int64_t user_id, int64_t operation_timestamp, uint8_t unlock_status)
+static ol305_txbuf_t *ol305_encode_unlock_message(uint8_t control_cmd, int64_t user_id, int64_t operation_timestamp, uint8_t unlock_status)
 {
-    message_to_send.len = 0x0a;
-    message_to_send.cmd = UNLOCK;
+    ol305_txbuf_t *buf = ol305_txpool_get(UNLOCK);
+    if (NULL == buf)
+        return NULL;
 
     uint8_t *id = (uint8_t*)&user_id;
     uint8_t *timestamp = (uint8_t*)&operation_timestamp;
+    uint8_t *data = OL305_TXBUF_DATA(buf);
+
+    buf->len = 0x0a;
+    data[0] = control_cmd;
+    data[1] = id[3];
+    data[2] = id[2];
+    data[3] = id[1];
+    data[4] = id[0];
+    data[5] = timestamp[3];
+    data[6] = timestamp[2];
+    data[7] = timestamp[1];
+    data[8] = timestamp[0];
+    data[9] = unlock_status;
+    return buf;
+}
 
-    uint8_t data[] = {control_cmd, id[3], id[2], id[1], id[0], timestamp[3], timestamp[2], timestamp[1], timestamp[0], unlock_status};
-    memcpy(message_to_send.data, data, message_to_send.len); 
+static ol305_txbuf_t *ol305_encode_query_message()
+{
+    ol305_txbuf_t *buf = ol305_txpool_get(QUERY_INFO);
+    if (NULL == buf)
+        return NULL;
+    buf->len = 0x01;
+    OL305_TXBUF_DATA(buf)[0] = 0x01;
+    return buf;
 }
 
-static void ol305_encode_query_message()
+static ol305_txbuf_t *ol305_encode_read_rfid_message()
 {
-    message_to_send.len = 0x01;
-    message_to_send.cmd = QUERY_INFO; 
-    message_to_send.data[0] = 0x01; 
+    ol305_txbuf_t *buf = ol305_txpool_get(REGISTER_RFID);
+    if (NULL == buf)
+        return NULL;
+    buf->len = 0x01;
+    OL305_TXBUF_DATA(buf)[0] = 0x01;
+    return buf;
 }
 
-static void ol305_encode_read_rfid_message()
+static ol305_txbuf_t *ol305_encode_register_card_message(const uint8_t *card)
 {
-    message_to_send.len = 0x01; 
-    message_to_send.cmd = REGISTER_RFID;
-    message_to_send.data[0] = 0x01;
+    ol305_txbuf_t *buf = ol305_txpool_get(REGISTER_RFID);
+    if (NULL == buf)
+        return NULL;
+    buf->len = OL305_RFID_CARD_LEN;
+    memcpy(OL305_TXBUF_DATA(buf), card, buf->len);
+    return buf;
 }
 
-static void ol305_encode_delete_rfid_message(const uint8_t *data, uint16_t len)
+static ol305_txbuf_t *ol305_encode_get_rfid_message(uint8_t index)
 {
-    message_to_send.len = 0x08; 
-    message_to_send.cmd = DELETE_RFID; 
-    if (message_to_send.len == len)
-    {
-        memcpy(message_to_send.data, data, message_to_send.len);
-    }
-    else
+    ol305_txbuf_t *buf = ol305_txpool_get(GET_RFID);
+    if (NULL == buf)
+        return NULL;
+    buf->len = 0x01;
+    OL305_TXBUF_DATA(buf)[0] = index;
+    return buf;
+}
+
+static ol305_txbuf_t *ol305_encode_delete_rfid_message(const uint8_t *data, uint16_t len)
+{
+    if (0x08 != len)
     {
         ESP_LOGE(TAG,"WRONG LEN FOR RFID CARD, TRY AGAIN");
-        return;
+        return NULL;
     }
+
+    ol305_txbuf_t *buf = ol305_txpool_get(DELETE_RFID);
+    if (NULL == buf)
+        return NULL;
+    buf->len = 0x08;
+    memcpy(OL305_TXBUF_DATA(buf), data, buf->len);
+    return buf;
 }
 
-static void ol305_encode_settings_message(uint8_t bluetooth_unlock, uint8_t button_unlock, uint8_t RFID_unlock)
+static ol305_txbuf_t *ol305_encode_settings_message(uint8_t bluetooth_unlock, uint8_t button_unlock, uint8_t RFID_unlock)
 {
-    message_to_send.len = 0x04; 
-    message_to_send.cmd = LOCK_SETTINGS; 
     if (2 < bluetooth_unlock || 2 < button_unlock || 2 < RFID_unlock)
-        return;
-        
-    message_to_send.data[0] = bluetooth_unlock; 
-    message_to_send.data[1] = button_unlock; 
-    message_to_send.data[2] = RFID_unlock; 
+        return NULL;
+
+    ol305_txbuf_t *buf = ol305_txpool_get(LOCK_SETTINGS);
+    if (NULL == buf)
+        return NULL;
+    uint8_t *data = OL305_TXBUF_DATA(buf);
+    buf->len = 0x04;
+    data[0] = bluetooth_unlock;
+    data[1] = button_unlock;
+    data[2] = RFID_unlock;
+    data[3] = 0x00;
+    return buf;
 }
 
-static void ol305_encode_response_message(uint8_t response)
+static ol305_txbuf_t *ol305_encode_usage_message(uint8_t usage_cmd)
 {
-    message_to_send.len = 0x01;
-    if (UNLOCK == response)
-        message_to_send.cmd = UNLOCK;
-    else if (LOCK == response)
-        message_to_send.cmd = LOCK;
-    message_to_send.data[0] = 0x02;
+    ol305_txbuf_t *buf = ol305_txpool_get(usage_cmd);
+    if (NULL == buf)
+        return NULL;
+    buf->len = 0x01;
+    OL305_TXBUF_DATA(buf)[0] = 0x01;
+    return buf;
 }
 
-static void ol305_deinit_message()
+static ol305_txbuf_t *ol305_encode_response_message(uint8_t response)
 {
-    message_to_send.msg_type = INVALID_MESSAGE;
-    message_to_send.len = 0x00;  
-    message_to_send.cmd = 0x00;
-    for (uint8_t i = 0; i < MAX_MSG_LEN - 5; i++)
-        message_to_send.data[i] = 0x00;
+    ol305_txbuf_t *buf = ol305_txpool_get(response);
+    if (NULL == buf)
+        return NULL;
+    buf->len = 0x01;
+    OL305_TXBUF_DATA(buf)[0] = 0x02;
+    return buf;
 }
 
-static void ol305_details_deinit()
+// Gives back the buffers the transport still holds, no OL305_LINK_WRITTEN follows for them
+static void ol305_tx_release_all(OL305Details_t *lock)
 {
-	ol305_details.state = INVALID;
-    ol305_details.status = 0x00; 
-    ol305_details.battery_voltage = 0;
+    portENTER_CRITICAL(&lock->queue_mux);
+    for (uint8_t i = 0; i < lock->tx_pending_count; i++)
+    {
+        ol305_txpool_put(lock->tx_pending[i]);
+        lock->tx_pending[i] = NULL;
+    }
+    lock->tx_pending_count = 0;
+    portEXIT_CRITICAL(&lock->queue_mux);
 }
 
-static void ol305_send_message()
+// OL305_LINK_WRITTEN: the transport completes the writes in order
+static void ol305_tx_written(OL305Details_t *lock)
 {
-    uint8_t data_to_write[MAX_MSG_LEN]; 
-    data_to_write[0]= (message_to_send.stx >> 8) & 0xFF;
-    data_to_write[1]= message_to_send.stx & 0xFF;
-
-    if (0x00 == message_to_send.cmd)
+    ol305_txbuf_t *buf = NULL;
+    portENTER_CRITICAL(&lock->queue_mux);
+    if (0 < lock->tx_pending_count)
     {
-        return;
+        buf = lock->tx_pending[0];
+        lock->tx_pending_count--;
+        memmove(&lock->tx_pending[0], &lock->tx_pending[1], lock->tx_pending_count * sizeof(lock->tx_pending[0]));
     }
-    else
-    {
-        int64_t time = esp_timer_get_time() / 1000;
-        srand(time);
-        message_to_send.rand =  rand() % 256;
-        data_to_write[2] = message_to_send.len;              
-        data_to_write[3] = 0x32 + message_to_send.rand;     
-        
-        uint8_t temp_data[2 + message_to_send.len];
-        temp_data[0] = message_to_send.key;
-        temp_data[1] = message_to_send.cmd;
-        memcpy(&temp_data[2], message_to_send.data, message_to_send.len);
-
-        for (uint8_t i = 0; i < (2 + message_to_send.len); i++) 
-        {
-            data_to_write[4 + i] = temp_data[i] ^ message_to_send.rand;
-        }
+    portEXIT_CRITICAL(&lock->queue_mux);
+    ol305_txpool_put(buf);
+}
 
-        message_to_send.crc = crc_calc(data_to_write, 6 + message_to_send.len);
-        data_to_write[6 + message_to_send.len] = message_to_send.crc;
+// Closes the usage store, ol305_drop_usage may rewrite the file again
+static void ol305_usage_release(OL305Details_t *lock)
+{
+    ol305_usage_close(&lock->usage);
+    portENTER_CRITICAL(&lock->queue_mux);
+    lock->usage_busy = false;
+    portEXIT_CRITICAL(&lock->queue_mux);
+}
 
-        ble_write(data_to_write, 7 + message_to_send.len);
-        ol305_deinit_message();
-    }
+static void ol305_details_deinit(OL305Details_t *lock)
+{
+	lock->state = INVALID;
+    portENTER_CRITICAL(&lock->queue_mux);
+    lock->status = 0x00; 
+    lock->battery_voltage = 0;
+    lock->status_time = 0;
+    portEXIT_CRITICAL(&lock->queue_mux);
+    lock->query_time = 0;
+    lock->key_sent_time = 0;
+    lock->command_time = 0;
+    ol305_usage_release(lock);
 }
 
-void ol305_recive_message(uint8_t *data, uint16_t len)
-{    
-    Message_OL305B_t message_recived;
-    if (7 >= len)
+// Seals the frame built by an ol305_encode_* function and lends it to the transport
+static void ol305_send_message(OL305Details_t *lock, ol305_txbuf_t *buf)
+{
+    if (NULL == buf)
     {
-        ESP_LOGE(TAG, "Invalid data recived");
-        return; 
+        ESP_LOGE(TAG,"No frame to send");
+        ol305_stat(lock, OL305_STAT_TX_DROPPED);
+        return;
     }
 
-    message_recived.crc = data[6 + data[2]];
-    if (crc_calc(data, len-1) != message_recived.crc)
+    int64_t time = esp_timer_get_time() / 1000;
+    srand(time);
+    buf->len = ol305_codec_seal(buf->frame, rand() % 256, lock->key, buf->cmd, buf->len);
+    if (0 == buf->len)
     {
-        ESP_LOGE(TAG,"Invalid CRC recived");
+        ESP_LOGE(TAG,"The length of the message is to big");
+        ol305_stat(lock, OL305_STAT_TX_DROPPED);
+        ol305_txpool_put(buf);
         return;
     }
 
-    message_recived.stx = (uint16_t)((data[0] << 8) + (data[1] & 0x00ff));
-    if (0xa3a4 != message_recived.stx)
+    //queued before the write, the completion may arrive before write returns
+    bool queued = false;
+    portENTER_CRITICAL(&lock->queue_mux);
+    if (OL305_TX_PENDING > lock->tx_pending_count)
     {
-        ESP_LOGE(TAG,"Invalid STX recived");
+        lock->tx_pending[lock->tx_pending_count++] = buf;
+        queued = true;
+    }
+    portEXIT_CRITICAL(&lock->queue_mux);
+    if (!queued)
+    {
+        ESP_LOGW(TAG, "OL305 %d too many writes pending", lock->index);
+        ol305_stat(lock, OL305_STAT_TX_DROPPED);
+        ol305_txpool_put(buf);
         return;
     }
 
-    message_recived.len = data[2];
-    if (MAX_MSG_LEN-5 <= message_recived.len)
+    if (!ol305_transport->write(lock->link, buf->frame, buf->len))
     {
-        ESP_LOGE(TAG,"The length of the message is to big");
+        //no completion follows, the buffer is the newest pending one
+        portENTER_CRITICAL(&lock->queue_mux);
+        if (0 < lock->tx_pending_count && buf == lock->tx_pending[lock->tx_pending_count - 1])
+            lock->tx_pending[--lock->tx_pending_count] = NULL;
+        portEXIT_CRITICAL(&lock->queue_mux);
+        ol305_stat(lock, OL305_STAT_TX_DROPPED);
+        ol305_txpool_put(buf);
         return;
     }
+    ol305_stat(lock, OL305_STAT_FRAMES_TX);
+    ol305_evlog_write(lock->index, OL305_EV_FRAME_TX, buf->cmd, 0, 0);
 
-    message_recived.rand = data[3] - 0x32;
-    message_recived.key = data[4] ^ message_recived.rand;
-    if (message_recived.key != message_to_send.key && 0x00 != message_to_send.key)
+    portENTER_CRITICAL(&lock->queue_mux);
+    lock->write_time = esp_timer_get_time();
+    portEXIT_CRITICAL(&lock->queue_mux);
+    if (0 != lock->command_time)
     {
-        ESP_LOGE(TAG,"Invalid key recived");
-        return;
+        ESP_LOGD(TAG,"Request to first write : %" PRId64 " us", esp_timer_get_time() - lock->command_time);
+        lock->command_time = 0;
     }
+}
+
+// Marks the callers waiting for cmd as done, their callbacks are run by ol305_task
+static void ol305_complete(OL305Details_t *lock, const ol305_cmd_t *cmd, esp_err_t err, const ol305_result_t *payload)
+{
+    bool found = false;
+    int64_t latency = esp_timer_get_time() - cmd->created;
 
-    message_recived.cmd = data[5] ^ message_recived.rand;
-    for (uint8_t i = 0; i < message_recived.len; i++)
+    portENTER_CRITICAL(&lock->queue_mux);
+    for (uint8_t i = 0; i < OL305_MAX_WAITERS; i++)
     {
-        message_recived.data[i] = data[6 + i] ^ message_recived.rand;
+        OL305Waiter_t *waiter = &lock->waiters[i];
+        if (waiter->id != cmd->id || waiter->done)
+            continue;
+
+        if (NULL != payload)
+            waiter->result = *payload;
+        else
+            memset(&waiter->result, 0, sizeof(waiter->result));
+        waiter->result.id = cmd->id;
+        waiter->result.request = ol305_cmd_policy[cmd->type].request;
+        waiter->result.err = err;
+        waiter->result.latency_us = latency;
+        waiter->done = true;
+        found = true;
     }
-    
-    switch (message_recived.cmd)
-    {   
-        case BLE_KEY:
-            if (message_recived.key == message_recived.data[1])
-            {
-                ESP_LOGI(TAG,"Correct BLE Key");
-                message_to_send.key=message_recived.key;
-                ol305_task_events(CONNECTED);
-            }
-            else
-                ESP_LOGE(TAG,"Error trying to get the BLE Key");
-            break;
-        
-        case UNLOCK:
-            if (0x01 == message_recived.data[0])
-            {
-                message_to_send.msg_type = UNLOCK_RESPONSE_MESSAGE;
-            }
-            else if (0x02 == message_recived.data[0])
-                ESP_LOGE(TAG,"Unlock failed");
-            break;
-        
-        case CMD_ERROR:
-            if (0x01 == message_recived.data[0])
-                ESP_LOGE(TAG,"CRC authentication error");
-            else if (0x02 == message_recived.data[0])
-            {
-                ESP_LOGE(TAG,"Bluetooth KEY not obtained");
-                ol305_task_events(DISCONNECTING);
-            }
-            else if (0x03 == message_recived.data[0])
-            {
-                ESP_LOGE(TAG,"Received Bluetooth KEY, but Bluetooth KEY error");
-                ol305_task_events(DISCONNECTING);
-            }
-            break;
-        
-        case LOCK:
-            if (0x01 == message_recived.data[0])
-            {
-                ESP_LOGI(TAG,"Successfully locked");
-                ol305_details.expected_status = 0x02;
-                message_to_send.msg_type = LOCK_RESPONSE_MESSAGE;
-            }
-            else if (0x02 == message_recived.data[0])
-                ESP_LOGE(TAG,"Lock failed");
-            break;
-        
-        case QUERY_INFO:
-            uint16_t battery_voltage = (message_recived.data[0] << 8) | message_recived.data[1];
-            ol305_details.battery_voltage = ((int)battery_voltage)* 10;
+    portEXIT_CRITICAL(&lock->queue_mux);
 
-            if (1 == ((message_recived.data[2] >> 1) & 1))  
-                ol305_details.status = 0x02; //locked
+    ol305_evlog_write(lock->index, OL305_EV_REQUEST, ol305_cmd_policy[cmd->type].request, err, ol305_clip_us(latency));
+    if (found)
+        ol305_wake(lock, OL305_EVT_RESULT);
+}
 
-            if (1 == ((message_recived.data[2] >> 0) & 1))
-                ol305_details.status = 0x01; //unlocked
+// Hands the finished results to their callers, outside of the critical section
+static void ol305_dispatch_results(OL305Details_t *lock)
+{
+    while (1)
+    {
+        OL305Waiter_t waiter;
+        bool found = false;
 
-            break;
-        
-        case REGISTER_RFID:
-            if (0x00 == message_recived.data[0])
-                ESP_LOGD(TAG,"Start reading");
-            else if (0x01 == message_recived.data[0])
+        portENTER_CRITICAL(&lock->queue_mux);
+        for (uint8_t i = 0; i < OL305_MAX_WAITERS; i++)
+        {
+            if (0 != lock->waiters[i].id && lock->waiters[i].done)
             {
-                ESP_LOGI(TAG,"Read card successfully, valid card number : ");
-                uint8_t card_readed[8];
-                memcpy(card_readed, &message_recived.data+1, 8);
-                ESP_LOGI(TAG,"RFID registered : ");
-                ESP_LOG_BUFFER_HEX(TAG, card_readed, sizeof(card_readed));
+                waiter = lock->waiters[i];
+                memset(&lock->waiters[i], 0, sizeof(lock->waiters[i]));
+                found = true;
+                break;
             }
-            else if (0x02 == message_recived.data[0])
-                ESP_LOGE(TAG,"Adding failed");
-            else if (0x03 == message_recived.data[0])
-                ESP_LOGW(TAG,"Card already exists");
+        }
+        portEXIT_CRITICAL(&lock->queue_mux);
+
+        if (!found)
             break;
+        if (NULL != waiter.result_out)
+            *waiter.result_out = waiter.result;
+        if (NULL != waiter.done_cb)
+            waiter.done_cb(lock, &waiter.result, waiter.ctx);
+        if (NULL != waiter.event_group)
+            xEventGroupSetBits(waiter.event_group, waiter.done_bits);
+    }
+}
 
-        case DELETE_RFID:
-            if (0x00 == message_recived.data[0])
-                ESP_LOGE(TAG,"Delete failed/Card doesn't exist");
-            else if (0x01 == message_recived.data[0])
-                ESP_LOGI(TAG,"Deleted successfully");
+// Queues a request for ol305_task, returns its id or 0 when it was rejected
+// desired: cards the lock should accept from now on, set only when the message is queued; NULL -> unchanged
+static uint32_t ol305_queue_message(OL305Details_t *lock, OL305_MSG_TYPE msg_type, const uint8_t *data, uint8_t len,
+                                    const ol305_request_t *request, const ol305_rfid_index_t *desired)
+{
+    const OL305CmdPolicy_t *policy = &ol305_cmd_policy[msg_type];
+    ol305_cmd_t cmd = {0};
+    ol305_cmd_t dropped;
+    OL305Waiter_t *waiter = NULL;
+    bool wants_result = NULL != request && (NULL != request->done_cb || NULL != request->event_group || NULL != request->result);
+
+    cmd.type = msg_type;
+    cmd.priority = policy->priority;
+    cmd.idempotent = policy->idempotent;
+    cmd.created = esp_timer_get_time();
+    cmd.deadline = cmd.created + policy->timeout_ms * 1000LL;
+    if (NULL != request && 0 != request->timeout_ms)
+        cmd.deadline = cmd.created + request->timeout_ms * 1000LL;
+    cmd.data_len = len;
+    if (NULL != data && OL305_CMD_DATA_LEN >= len)
+        memcpy(cmd.data, data, len);
+
+    portENTER_CRITICAL(&lock->queue_mux);
+    for (uint8_t i = 0; wants_result && i < OL305_MAX_WAITERS; i++)
+    {
+        if (0 == lock->waiters[i].id)
+        {
+            waiter = &lock->waiters[i];
             break;
+        }
+    }
+    uint32_t id = 0;
+    dropped.id = 0;
+    if (!wants_result || NULL != waiter)
+        id = ol305_cmdq_push(&lock->queue, &cmd, &dropped);
+    if (0 != id && NULL != desired)
+    {
+        lock->rfid_desired = *desired;
+        lock->rfid_has_desired = true;
+    }
+    if (0 != id && NULL != waiter)
+    {
+        waiter->id = id;
+        waiter->done_cb = request->done_cb;
+        waiter->ctx = request->ctx;
+        waiter->event_group = request->event_group;
+        waiter->done_bits = request->done_bits;
+        waiter->result_out = request->result;
+    }
+    portEXIT_CRITICAL(&lock->queue_mux);
 
-        case LOCK_SETTINGS:
-            for (uint8_t i = 0; i < 3; i++)
-            {
-                switch (i)
-                {
-                    case 0:
-                        ESP_LOGI(TAG,"BLE Unlock : ");
-                        break;
+    if (0 != dropped.id)
+    {
+        ESP_LOGW(TAG,"OL305 %d request %" PRIu32 " dropped for a more urgent one", lock->index, dropped.id);
+        ol305_complete(lock, &dropped, ESP_ERR_NO_MEM, NULL);
+    }
+    if (wants_result && NULL == waiter)
+    {
+        ESP_LOGE(TAG,"OL305 %d too many requests waiting for a result", lock->index);
+        return 0;
+    }
+    if (0 == id)
+    {
+        ESP_LOGE(TAG,"OL305 %d command queue full", lock->index);
+        return 0;
+    }
 
-                    case 1:
-                        ESP_LOGI(TAG,"Button Unlock : ");
-                        break;
+    ol305_wake(lock, OL305_EVT_COMMAND);
+    return id;
+}
 
-                    case 2:
-                        ESP_LOGI(TAG,"RFID Unlock : ");
-                        break;
-                    
-                    default:
-                        break;
-                }
+static uint32_t ol305_submit_message(OL305Details_t *lock, OL305_MSG_TYPE msg_type, const uint8_t *data, uint8_t len, const ol305_request_t *request)
+{
+    return ol305_queue_message(lock, msg_type, data, len, request, NULL);
+}
 
-                if (0x01 == message_recived.data[i])
-                    ESP_LOGI(TAG,"OFF");
-                else if (0x02 == message_recived.data[i])
-                    ESP_LOGI(TAG,"ON");
-            }
-            break;
-        default:
-            ESP_LOGI(TAG,"Invalid command recived");
-            break;
-    }
+static bool ol305_is_rfid_request(OL305_REQUEST request)
+{
+    return OL305_REQ_READ_RFID == request || OL305_REQ_DELETE_RFID == request || OL305_REQ_SYNC_RFID == request;
+}
+
+// A request waiting for an answer blocks the next one of the same type until it is answered,
+// the RFID requests share their answers and block each other
+static bool ol305_can_run(const ol305_cmd_t *cmd, void *ctx)
+{
+    OL305Details_t *lock = (OL305Details_t *)ctx;
+    const OL305CmdPolicy_t *policy = &ol305_cmd_policy[cmd->type];
+    if (!policy->awaits_reply)
+        return true;
+    //waits for the records read out to be dropped
+    if (OL305_REQ_SYNC_USAGE == policy->request && lock->usage_dropping)
+        return false;
+    if (ol305_is_rfid_request(policy->request))
+        return 0 == lock->inflight[OL305_REQ_READ_RFID].id && 0 == lock->inflight[OL305_REQ_DELETE_RFID].id &&
+               0 == lock->inflight[OL305_REQ_SYNC_RFID].id;
+    return 0 == lock->inflight[policy->request].id;
+}
+
+static bool ol305_next_command(OL305Details_t *lock, ol305_cmd_t *cmd)
+{
+    portENTER_CRITICAL(&lock->queue_mux);
+    bool found = ol305_cmdq_pop_first(&lock->queue, ol305_can_run, lock, cmd);
+    portEXIT_CRITICAL(&lock->queue_mux);
+    return found;
+}
+
+static bool ol305_runnable_commands(OL305Details_t *lock)
+{
+    bool found = false;
+    portENTER_CRITICAL(&lock->queue_mux);
+    for (uint8_t i = 0; i < ol305_cmdq_count(&lock->queue) && !found; i++)
+        found = ol305_can_run(&lock->queue.entries[i], lock);
+    portEXIT_CRITICAL(&lock->queue_mux);
+    return found;
+}
+
+// Must be called before the command is sent, the answer may arrive before ol305_send_message returns
+static void ol305_track_reply(OL305Details_t *lock, const ol305_cmd_t *cmd)
+{
+    OL305_REQUEST request = ol305_cmd_policy[cmd->type].request;
+    portENTER_CRITICAL(&lock->queue_mux);
+    lock->inflight[request] = *cmd;
+    lock->sent_time[request] = esp_timer_get_time();
+    portEXIT_CRITICAL(&lock->queue_mux);
+}
+
+// Completes the request of the given type waiting for the answer of the lock
+static void ol305_reply(OL305Details_t *lock, OL305_REQUEST request, esp_err_t err, const ol305_result_t *payload)
+{
+    ol305_cmd_t cmd;
+    portENTER_CRITICAL(&lock->queue_mux);
+    cmd = lock->inflight[request];
+    lock->inflight[request].id = 0;
+    int64_t sent_time = lock->sent_time[request];
+    portEXIT_CRITICAL(&lock->queue_mux);
+
+    if (0 == cmd.id)
+        return;
+    if (ESP_OK == err)
+        ol305_lat_record(OL305_LAT_REQ_BASE + request, esp_timer_get_time() - sent_time);
+    ol305_complete(lock, &cmd, err, payload);
+}
+
+static void ol305_fail_inflight(OL305Details_t *lock, esp_err_t err)
+{
+    for (uint8_t i = 0; i < OL305_REQ_MAX; i++)
+        ol305_reply(lock, i, err, NULL);
+}
+
+static bool ol305_in_flight(OL305Details_t *lock, OL305_REQUEST request)
+{
+    portENTER_CRITICAL(&lock->queue_mux);
+    bool found = 0 != lock->inflight[request].id;
+    portEXIT_CRITICAL(&lock->queue_mux);
+    return found;
 }
 
-static void ol305_connect()
+// Answer time of the lock, measured from the last written frame
+static void ol305_update_rtt(OL305Details_t *lock)
 {
-    while (OL305_STATE_ENABLE != ol305_details.new_state)
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock->queue_mux);
+    if (0 != lock->write_time)
     {
-        ESP_LOGW(TAG,"OL305 not enabled set!");
-        vTaskDelay (250 / portTICK_PERIOD_MS);
-        continue;
+        int64_t sample = now - lock->write_time;
+        lock->rtt_us = (0 == lock->rtt_us) ? sample : (7 * lock->rtt_us + sample) / 8;
+        lock->write_time = 0;
     }
+    portEXIT_CRITICAL(&lock->queue_mux);
+}
 
-    set_uuid(service_uuid, SERVICE_UUID);
-    set_uuid(write_uuid, WRITE_UUID);
-    set_uuid(notify_uuid, NOTIFY_UUID);
-    set_uuid(notify_decr_uuid, NOTIFY_DESCR_UUID);
-    set_target_mac(ol305_details.mac, sizeof(ol305_details.mac));
-    ble_init();
-
-    while (true != is_ble_connected())
+// Stores what the lock reported, battery_voltage < 0 keeps the cached voltage, status 0x00 the cached status
+static void ol305_cache_status(OL305Details_t *lock, uint8_t status, int battery_voltage, ol305_lock_info_t *info)
+{
+    portENTER_CRITICAL(&lock->queue_mux);
+    if (0 <= battery_voltage)
+        lock->battery_voltage = battery_voltage;
+    if (0x00 != status)
     {
-        vTaskDelay (250 / portTICK_PERIOD_MS);
-        continue;
+        lock->status = status;
+        lock->status_time = esp_timer_get_time();
     }
-                
-    ol305_encode_key_message(ol305_details.password);
-    ol305_send_message();
+    info->status = lock->status;
+    info->battery_voltage = lock->battery_voltage;
+    portEXIT_CRITICAL(&lock->queue_mux);
 }
 
-static void ol305_status_check()
+// Copies the cached status, returns false when it is older than the TTL
+static bool ol305_cached_status(OL305Details_t *lock, ol305_lock_info_t *info, int64_t *age_us)
 {
-    ol305_encode_query_message();
-    ol305_send_message();
-    if (ol305_details.status != ol305_details.expected_status && 0 != ol305_details.expected_status)
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock->queue_mux);
+    int64_t status_time = lock->status_time;
+    info->status = lock->status;
+    info->battery_voltage = lock->battery_voltage;
+    portEXIT_CRITICAL(&lock->queue_mux);
+
+    if (0 == status_time)
     {
-        if (ol305_details.status == 0x01)
-            ESP_LOGW(TAG,"Warning : OL305 should be locked but it is unlocked");
-        else if (ol305_details.status == 0x02)
-            ESP_LOGW(TAG,"Warning : OL305 should be unlocked but it is locked");
+        *age_us = INT64_MAX;
+        return false;
     }
-    else if (ol305_details.status != ol305_details.expected_status && 0 == ol305_details.expected_status)
-        ol305_details.expected_status = ol305_details.status;
+    *age_us = now - status_time;
+    return *age_us < lock->status_ttl_ms * 1000LL;
 }
 
-void ol305_task(void *pvParameters)
+static void ol305_drop_expired(OL305Details_t *lock)
 {
-	ESP_LOGI(TAG, "Task started!");
-	while (1)
-	{
-		switch (ol305_details.state)
-		{
-            case INVALID:
-                if (ol305_details.new_state == OL305_STATE_ENABLE)
-                    ol305_task_events(CONNECTING);
-                else
-                    ol305_task_events(DISCONNECTED);
-                break;
+    ol305_cmd_t cmd;
+    int64_t now = esp_timer_get_time();
+    while (1)
+    {
+        portENTER_CRITICAL(&lock->queue_mux);
+        bool found = ol305_cmdq_pop_expired(&lock->queue, now, &cmd);
+        portEXIT_CRITICAL(&lock->queue_mux);
+        if (!found)
+            break;
+        ESP_LOGW(TAG,"OL305 %d request %" PRIu32 " expired", lock->index, cmd.id);
+        ol305_stat(lock, OL305_STAT_REQUEST_TIMEOUTS);
+        ol305_complete(lock, &cmd, ESP_ERR_TIMEOUT, NULL);
+    }
 
-            case CONNECTING:
-                if (ol305_details.new_state == OL305_STATE_DISABLE)
-                {
-                    ESP_LOGI(TAG, "Connecting to Disable");
-                    ol305_task_events(DISCONNECTING);
-                    continue;
-                }
-                if (ol305_details.new_state == OL305_STATE_SHUTDOWN)
-                {
-                    ESP_LOGI(TAG, "Connecting to ShutDown");
-                    ol305_task_events(DISCONNECTING);
-                    continue;
-                }
-                ol305_connect();
-                break;
+    for (uint8_t i = 0; i < OL305_REQ_MAX; i++)
+    {
+        portENTER_CRITICAL(&lock->queue_mux);
+        cmd = lock->inflight[i];
+        bool expired = 0 != cmd.id && 0 != cmd.deadline && now >= cmd.deadline;
+        if (expired)
+            lock->inflight[i].id = 0;
+        portEXIT_CRITICAL(&lock->queue_mux);
+        if (!expired)
+            continue;
+        ESP_LOGW(TAG,"OL305 %d request %" PRIu32 " not answered", lock->index, cmd.id);
+        ol305_stat(lock, OL305_STAT_REQUEST_TIMEOUTS);
+        ol305_complete(lock, &cmd, ESP_ERR_TIMEOUT, NULL);
+    }
+}
 
-            case CONNECTED:
-                if (ol305_details.new_state == OL305_STATE_DISABLE)
-                {
-                    ESP_LOGI(TAG, "Connected to Disable");
-                    ol305_task_events(DISCONNECTING);
-                    continue;
-                }
-                if (ol305_details.new_state == OL305_STATE_SHUTDOWN)
-                {
-                    ESP_LOGI(TAG, "Connected to ShutDown");
-                    ol305_task_events(DISCONNECTING);
-                    continue;
-                }
+static void ol305_flush_commands(OL305Details_t *lock)
+{
+    ol305_cmd_t cmd;
+    while (1)
+    {
+        portENTER_CRITICAL(&lock->queue_mux);
+        bool found = ol305_cmdq_pop(&lock->queue, &cmd);
+        portEXIT_CRITICAL(&lock->queue_mux);
+        if (!found)
+            break;
+        ESP_LOGW(TAG,"OL305 %d request %" PRIu32 " dropped, lock disconnected", lock->index, cmd.id);
+        ol305_complete(lock, &cmd, ESP_ERR_INVALID_STATE, NULL);
+    }
+    ol305_fail_inflight(lock, ESP_ERR_INVALID_STATE);
+}
 
-                switch (message_to_send.msg_type)
-                {
-                    case UNLOCK_MESSAGE:
-                        uint8_t control_cmd = 0x01;
-                        int64_t user_id = 0x01;
-                        int64_t operation_timestamp = esp_timer_get_time() / 1000;
-                        uint8_t unlock_status = 0x00;
-                        
-                        ol305_encode_query_message();
-                        ol305_send_message();
-                        if (ol305_details.status != 0x01)
-                        {
-                            while (ol305_details.status != 0x01)
-                            {
-                                ol305_encode_unlock_message(control_cmd, user_id, operation_timestamp, unlock_status);
-                                ol305_send_message();
-                                ol305_encode_query_message();
-                                ol305_send_message();
-                                vTaskDelay(2500 / portTICK_PERIOD_MS);
-                            }
-                            ESP_LOGI(TAG,"Successfully unlocked");
-                            ol305_details.expected_status = 0x01;
-                        }
-                        else
-                            ESP_LOGW(TAG,"OL305 already unlocked!");
-                        break;
+static void ol305_usage_done(OL305Details_t *lock, esp_err_t err)
+{
+    ol305_result_t result = {0};
+    result.usage = lock->usage_sync;
+    result.usage.elapsed_ms = (esp_timer_get_time() - lock->usage_start) / 1000;
+    uint32_t ms = (0 == result.usage.elapsed_ms) ? 1 : result.usage.elapsed_ms;
+    ESP_LOGI(TAG,"OL305 %d usage sync %s: %" PRIu32 " records, %" PRIu32 " duplicates in %" PRIu32 " ms, %" PRIu32 " records/s",
+             lock->index, esp_err_to_name(err), result.usage.records, result.usage.duplicates, result.usage.elapsed_ms,
+             (uint32_t)(result.usage.records * 1000ULL / ms));
+    ol305_usage_release(lock);
+    ol305_reply(lock, OL305_REQ_SYNC_USAGE, err, &result);
+}
 
-                    case QUERY_INFO_MESSAGE:
-                        ol305_encode_query_message();
-                        ol305_send_message();
-                        while (ol305_details.status == 0x00)
-                        {
-                            ol305_encode_query_message();
-                            ol305_send_message();
-                            vTaskDelay(150 / portTICK_PERIOD_MS);
-                        }
-
-                        if (ol305_details.status == 0x02)
-                            ESP_LOGI(TAG,"Status : locked");
-                        else if (ol305_details.status == 0x01)
-                            ESP_LOGI(TAG,"Status : unlocked");
-
-                        ESP_LOGI(TAG,"Battery voltage : %d mV", ol305_details.battery_voltage);
-                        ol305_details.status = 0x00;
-                        break;
+// The lock answers in order: only the answer to the newest OBTAIN tells what the lock holds now
+static void ol305_usage_obtain(OL305Details_t *lock)
+{
+    ol305_send_message(lock, ol305_encode_usage_message(OBTAIN_LAST_USAGE));
+    lock->usage_obtains++;
+    lock->usage_fresh = 0 == lock->usage_deletes;
+}
 
-                    case UNLOCK_RESPONSE_MESSAGE: 
-                        ol305_encode_response_message(UNLOCK);
-                        ol305_send_message();
-                        break;
+static void ol305_usage_delete(OL305Details_t *lock)
+{
+    ol305_send_message(lock, ol305_encode_usage_message(DELETE_LAST_USAGE));
+    lock->usage_deletes++;
+}
 
-                    case LOCK_RESPONSE_MESSAGE:
-                        ol305_encode_response_message(LOCK);
-                        ol305_send_message();
-                        break;
+// Asks for the oldest record, waits for an answer that is late, closes the store once the sync is over
+static void ol305_usage_step(OL305Details_t *lock)
+{
+    if (!ol305_in_flight(lock, OL305_REQ_SYNC_USAGE))
+    {
+        ol305_usage_release(lock);
+        return;
+    }
 
-                    case REGISTER_RFID_MESSAGE:
-                        ol305_encode_read_rfid_message();
-                        ol305_send_message();
-                        break;
+    int64_t now = esp_timer_get_time();
+    if (now < lock->usage_retry_at)
+        return;
+    if (OL305_USAGE_MAX_ATTEMPTS <= lock->usage_attempts)
+    {
+        ESP_LOGE(TAG,"OL305 %d usage records not answered", lock->index);
+        ol305_stat(lock, OL305_STAT_REQUEST_TIMEOUTS);
+        ol305_usage_done(lock, ESP_ERR_TIMEOUT);
+        //answers still owed would be taken for those of the next sync, the link starts over
+        ol305_task_events(lock, DISCONNECTING);
+        return;
+    }
+    //asked again while an answer is owed, the lock would hand the record out twice
+    if (0 == lock->usage_obtains && 0 == lock->usage_deletes)
+        ol305_usage_obtain(lock);
+    lock->usage_attempts++;
+    lock->usage_retry_at = now + OL305_USAGE_STALL_MS * 1000LL;
+}
 
-                    case DELETE_RFID_MESSAGE:
-                        uint8_t all_nfc_tokens[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-                        ol305_encode_delete_rfid_message(all_nfc_tokens,sizeof(all_nfc_tokens));
-                        ol305_send_message();
+static void ol305_start_usage_sync(OL305Details_t *lock, const ol305_cmd_t *cmd)
+{
+    portENTER_CRITICAL(&lock->queue_mux);
+    bool dropping = lock->usage_dropping;
+    lock->usage_busy = !dropping;
+    portEXIT_CRITICAL(&lock->queue_mux);
+    esp_err_t err = dropping ? ESP_ERR_INVALID_STATE : ol305_usage_open(&lock->usage, lock->mac);
+    if (ESP_OK != err)
+    {
+        ESP_LOGE(TAG,"OL305 %d no usage store: %s", lock->index, esp_err_to_name(err));
+        ol305_usage_release(lock);
+        ol305_complete(lock, cmd, err, NULL);
+        return;
+    }
+    memset(&lock->usage_sync, 0, sizeof(lock->usage_sync));
+    lock->usage_start = esp_timer_get_time();
+    lock->usage_retry_at = lock->usage_start;
+    lock->usage_attempts = 0;
+    lock->usage_repeats = 0;
+    ol305_track_reply(lock, cmd);
+    ol305_usage_step(lock);
+}
+
+// A usage record of the lock: committed to flash, only then deleted from the lock
+static void ol305_usage_record(OL305Details_t *lock, const ol305_frame_t *frame)
+{
+    if (0 < lock->usage_obtains)
+        lock->usage_obtains--;
+    if (!ol305_in_flight(lock, OL305_REQ_SYNC_USAGE))
+        return;
+    lock->usage_attempts = 0;
+    lock->usage_retry_at = esp_timer_get_time() + OL305_USAGE_STALL_MS * 1000LL;
+    //an older OBTAIN, or one sent before a DELETE still unanswered: the lock may have moved on since
+    if (0 < lock->usage_obtains || 0 < lock->usage_deletes)
+    {
+        ESP_LOGD(TAG,"OL305 %d stale usage answer dropped", lock->index);
+        return;
+    }
+
+    if (0x00 == frame->data[0])
+    {
+        ol305_usage_done(lock, ESP_OK);
+        return;
+    }
+    if (OL305_USAGE_RECORD_LEN > frame->len)
+    {
+        ESP_LOGE(TAG,"OL305 %d usage record too short", lock->index);
+        ol305_usage_done(lock, ESP_ERR_INVALID_RESPONSE);
+        return;
+    }
+
+    const uint8_t *data = frame->data;
+    ol305_usage_rec_t record =
+    {
+        .user_id = ol305_get_be32(&data[1]),
+        .unlock_time = ol305_get_be32(&data[5]),
+        .lock_time = ol305_get_be32(&data[9]),
+        .lock = lock->index,
+    };
+    if (ol305_usage_is_synced(&lock->usage, &record))
+    {
+        if (!lock->usage_fresh)
+        {
+            //asked for before the last DELETE was answered, only a fresh answer proves the lock kept it
+            ol305_usage_obtain(lock);
+            return;
+        }
+        lock->usage_sync.duplicates++;
+        if (OL305_USAGE_MAX_ATTEMPTS <= ++lock->usage_repeats)
+        {
+            ESP_LOGE(TAG,"OL305 %d keeps its usage record, delete refused", lock->index);
+            ol305_usage_done(lock, ESP_FAIL);
+            return;
+        }
+    }
+    else
+    {
+        esp_err_t err = ol305_usage_commit(&lock->usage, &record);
+        if (ESP_OK != err)
+        {
+            //not deleted, the lock keeps it for the next sync
+            ESP_LOGE(TAG,"OL305 %d usage record not stored: %s", lock->index, esp_err_to_name(err));
+            ol305_usage_done(lock, err);
+            return;
+        }
+        lock->usage_sync.records++;
+        lock->usage_repeats = 0;
+    }
+
+    //pipelined: the lock answers in order, the next record comes back in the same round trip as the delete
+    ol305_usage_delete(lock);
+    ol305_usage_obtain(lock);
+}
+
+// Answer to a DELETE_LAST_USAGE, the OBTAIN answers after it are fresh again
+static void ol305_usage_deleted(OL305Details_t *lock, const ol305_frame_t *frame)
+{
+    if (0 < lock->usage_deletes)
+        lock->usage_deletes--;
+    if (ol305_in_flight(lock, OL305_REQ_SYNC_USAGE))
+    {
+        lock->usage_attempts = 0;
+        lock->usage_retry_at = esp_timer_get_time() + OL305_USAGE_STALL_MS * 1000LL;
+    }
+    //the next read hands the same record out again, the cursor skips it
+    if (0x01 != frame->data[0])
+        ESP_LOGW(TAG,"OL305 %d usage record not deleted", lock->index);
+}
+
+// Keeps the local index in step with a card the lock registered or deleted
+static esp_err_t ol305_rfid_changed(OL305Details_t *lock, ol305_rfid_op_t op, const uint8_t *card)
+{
+    static const uint8_t all_cards[OL305_RFID_CARD_LEN] = {0};
+    esp_err_t err = ESP_OK;
+    portENTER_CRITICAL(&lock->queue_mux);
+    if (OL305_RFID_OP_REGISTER == op)
+        err = ol305_rfid_insert(&lock->rfid, card);
+    else if (0 == memcmp(card, all_cards, OL305_RFID_CARD_LEN))
+        ol305_rfid_clear(&lock->rfid);
+    else
+        ol305_rfid_remove(&lock->rfid, card);
+    portEXIT_CRITICAL(&lock->queue_mux);
+
+    if (ESP_OK != err)
+    {
+        //more cards on the lock than we can track, list them again next time
+        lock->rfid_verified = false;
+        return err;
+    }
+    return ol305_rfid_store(&lock->rfid, lock->mac);
+}
+
+static void ol305_rfid_done(OL305Details_t *lock, esp_err_t err)
+{
+    ol305_result_t result = {0};
+    result.rfid = lock->rfid_sync;
+    result.rfid.elapsed_ms = (esp_timer_get_time() - lock->rfid_start) / 1000;
+    ESP_LOGI(TAG,"OL305 %d card sync %s: %u registered, %u deleted, %u listed in %" PRIu32 " ms", lock->index,
+             esp_err_to_name(err), result.rfid.registered, result.rfid.deleted, result.rfid.listed, result.rfid.elapsed_ms);
+    ol305_reply(lock, OL305_REQ_SYNC_RFID, err, &result);
+}
+
+// Sends the current step of the card sync again when its answer was lost
+static void ol305_rfid_step(OL305Details_t *lock)
+{
+    if (!ol305_in_flight(lock, OL305_REQ_SYNC_RFID))
+        return;
+
+    int64_t now = esp_timer_get_time();
+    if (now < lock->rfid_retry_at)
+        return;
+    if (OL305_RFID_MAX_ATTEMPTS <= lock->rfid_attempts)
+    {
+        ESP_LOGE(TAG,"OL305 %d card sync not answered", lock->index);
+        ol305_stat(lock, OL305_STAT_REQUEST_TIMEOUTS);
+        ol305_rfid_done(lock, ESP_ERR_TIMEOUT);
+        return;
+    }
+
+    if (OL305_RFID_OP_DELETE == lock->rfid_op)
+        ol305_send_message(lock, ol305_encode_delete_rfid_message(lock->rfid_card, OL305_RFID_CARD_LEN));
+    else if (OL305_RFID_OP_REGISTER == lock->rfid_op)
+        ol305_send_message(lock, ol305_encode_register_card_message(lock->rfid_card));
+    else
+        ol305_send_message(lock, ol305_encode_get_rfid_message(lock->rfid_next));
+    lock->rfid_attempts++;
+    lock->rfid_retry_at = now + OL305_RFID_STALL_MS * 1000LL;
+}
+
+// Next step: list the cards of the lock when the index is not trusted, then one change at a time
+static void ol305_rfid_advance(OL305Details_t *lock)
+{
+    lock->rfid_attempts = 0;
+    lock->rfid_retry_at = 0;
+    if (!lock->rfid_verified)
+    {
+        lock->rfid_op = OL305_RFID_OP_NONE;
+        lock->rfid_next = 0;
+        ol305_rfid_step(lock);
+        return;
+    }
+
+    portENTER_CRITICAL(&lock->queue_mux);
+    ol305_rfid_op_t op = OL305_RFID_OP_NONE;
+    if (lock->rfid_has_desired)
+        op = ol305_rfid_next_op(&lock->rfid, &lock->rfid_desired, lock->rfid_card);
+    portEXIT_CRITICAL(&lock->queue_mux);
+
+    if (OL305_RFID_OP_NONE == op)
+    {
+        ol305_rfid_done(lock, ESP_OK);
+        return;
+    }
+    lock->rfid_op = op;
+    ol305_rfid_step(lock);
+}
+
+static void ol305_start_rfid_sync(OL305Details_t *lock, const ol305_cmd_t *cmd)
+{
+    memset(&lock->rfid_sync, 0, sizeof(lock->rfid_sync));
+    lock->rfid_start = esp_timer_get_time();
+    ol305_track_reply(lock, cmd);
+
+    if (lock->rfid_verified && lock->rfid_has_desired)
+    {
+        uint16_t deletes;
+        uint16_t registers;
+        portENTER_CRITICAL(&lock->queue_mux);
+        ol305_rfid_diff_count(&lock->rfid, &lock->rfid_desired, &deletes, &registers);
+        portEXIT_CRITICAL(&lock->queue_mux);
+        ESP_LOGI(TAG,"OL305 %d card sync: %u to delete, %u to register", lock->index, deletes, registers);
+    }
+    ol305_rfid_advance(lock);
+}
+
+// GET_RFID answer: 0x01 -> card follows, 0x00 -> no card at that index; card count; index; card
+static void ol305_rfid_listed(OL305Details_t *lock, const ol305_frame_t *frame)
+{
+    if (!ol305_in_flight(lock, OL305_REQ_SYNC_RFID) || OL305_RFID_OP_NONE != lock->rfid_op)
+        return;
+    if (0x01 == frame->data[0] && OL305_RFID_LIST_LEN > frame->len)
+    {
+        ol305_rfid_done(lock, ESP_ERR_INVALID_RESPONSE);
+        return;
+    }
+
+    uint8_t total = frame->data[1];
+    uint8_t index = frame->data[2];
+    //answer to a GET_RFID sent again, already handled
+    if (index != lock->rfid_next)
+        return;
+
+    if (0 == index)
+    {
+        portENTER_CRITICAL(&lock->queue_mux);
+        bool same_count = total == lock->rfid.count;
+        if (!same_count)
+            ol305_rfid_clear(&lock->rfid);
+        portEXIT_CRITICAL(&lock->queue_mux);
+        if (same_count)
+        {
+            //the index is trusted, nothing more is read
+            lock->rfid_verified = true;
+            ol305_rfid_advance(lock);
+            return;
+        }
+        ESP_LOGW(TAG,"OL305 %d has %u cards, %u in the index, listing them", lock->index, total, lock->rfid.count);
+    }
+
+    if (0x01 == frame->data[0])
+    {
+        portENTER_CRITICAL(&lock->queue_mux);
+        esp_err_t err = ol305_rfid_insert(&lock->rfid, &frame->data[3]);
+        portEXIT_CRITICAL(&lock->queue_mux);
+        if (ESP_OK != err)
+        {
+            ESP_LOGE(TAG,"OL305 %d has more than %d cards", lock->index, OL305_RFID_MAX_CARDS);
+            ol305_rfid_done(lock, err);
+            return;
+        }
+        lock->rfid_sync.listed++;
+    }
+
+    lock->rfid_next = index + 1;
+    if (0x01 == frame->data[0] && lock->rfid_next < total)
+    {
+        lock->rfid_attempts = 0;
+        lock->rfid_retry_at = 0;
+        ol305_rfid_step(lock);
+        return;
+    }
+    ol305_rfid_store(&lock->rfid, lock->mac);
+    lock->rfid_verified = true;
+    ol305_rfid_advance(lock);
+}
+
+// REGISTER_RFID / DELETE_RFID answer to the change sent by the card sync, false when it is not one
+static bool ol305_rfid_applied(OL305Details_t *lock, uint8_t cmd, uint8_t status)
+{
+    if (!ol305_in_flight(lock, OL305_REQ_SYNC_RFID))
+        return false;
+    if ((REGISTER_RFID == cmd) != (OL305_RFID_OP_REGISTER == lock->rfid_op) || OL305_RFID_OP_NONE == lock->rfid_op)
+        return true;
+
+    if (REGISTER_RFID == cmd)
+    {
+        //0x01 -> registered; 0x03 -> the lock already had it, a retry of ours or the index is off
+        if (0x01 != status && 0x03 != status)
+        {
+            ESP_LOGE(TAG,"OL305 %d refused a card", lock->index);
+            ol305_rfid_done(lock, ESP_FAIL);
+            return true;
+        }
+        if (0x01 == status)
+            lock->rfid_sync.registered++;
+    }
+    else if (0x01 == status)
+        lock->rfid_sync.deleted++;
+    //0x00 on delete: the card is not on the lock, which is what was asked
+
+    esp_err_t err = ol305_rfid_changed(lock, lock->rfid_op, lock->rfid_card);
+    if (ESP_OK != err)
+    {
+        ol305_rfid_done(lock, err);
+        return true;
+    }
+    ol305_rfid_advance(lock);
+    return true;
+}
+
+// A complete frame out of the notification stream, run by ol305_task
+static void ol305_handle_frame(void *ctx, const ol305_frame_t *message_recived)
+{
+    OL305Details_t *lock = (OL305Details_t *)ctx;
+    if (message_recived->key != lock->key && 0x00 != lock->key)
+    {
+        ESP_LOGE(TAG,"Invalid key recived");
+        ol305_stat(lock, OL305_STAT_KEY_ERRORS);
+        return;
+    }
+    if (message_recived->cmd < sizeof(ol305_answer_min_len) && message_recived->len < ol305_answer_min_len[message_recived->cmd])
+    {
+        ESP_LOGE(TAG,"OL305 %d answer 0x%02x too short: %u bytes", lock->index, message_recived->cmd, message_recived->len);
+        ol305_stat(lock, OL305_STAT_LENGTH_ERRORS);
+        return;
+    }
+    ol305_stat(lock, OL305_STAT_FRAMES_RX);
+    ol305_evlog_write(lock->index, OL305_EV_FRAME_RX, message_recived->cmd, message_recived->data[0], 0);
+
+    ol305_result_t result = {0};
+    
+    switch (message_recived->cmd)
+    {   
+        case BLE_KEY:
+            if (message_recived->key == message_recived->data[1])
+            {
+                ESP_LOGD(TAG,"Correct BLE Key");
+                lock->key = message_recived->key;
+                ol305_lat_mark(lock->link, OL305_LAT_KEY);
+                ol305_stat(lock, OL305_STAT_CONNECTS);
+                ol305_task_events(lock, CONNECTED);
+            }
+            else
+            {
+                ESP_LOGE(TAG,"Error trying to get the BLE Key");
+                ol305_stat(lock, OL305_STAT_KEY_ERRORS);
+            }
+            break;
+        
+        case UNLOCK:
+            ol305_update_rtt(lock);
+            if (0x01 == message_recived->data[0])
+            {
+                ol305_submit_message(lock, UNLOCK_RESPONSE_MESSAGE, NULL, 0, NULL);
+                lock->expected_status = 0x01;
+                ol305_cache_status(lock, 0x01, -1, &result.info);
+                ol305_reply(lock, OL305_REQ_UNLOCK, ESP_OK, &result);
+            }
+            else if (0x02 == message_recived->data[0])
+            {
+                ESP_LOGE(TAG,"Unlock failed");
+                ol305_stat(lock, OL305_STAT_UNLOCK_FAILURES);
+                lock->unlock_refused = true;
+            }
+            break;
+        
+        case CMD_ERROR:
+            ol305_stat(lock, OL305_STAT_CMD_ERRORS);
+            ol305_stats_set(&lock->stats, OL305_STAT_LAST_CMD_ERROR, message_recived->data[0]);
+            if (0x01 == message_recived->data[0])
+                ESP_LOGE(TAG,"CRC authentication error");
+            else if (0x02 == message_recived->data[0])
+            {
+                ESP_LOGE(TAG,"Bluetooth KEY not obtained");
+                ol305_task_events(lock, DISCONNECTING);
+            }
+            else if (0x03 == message_recived->data[0])
+            {
+                ESP_LOGE(TAG,"Received Bluetooth KEY, but Bluetooth KEY error");
+                ol305_task_events(lock, DISCONNECTING);
+            }
+            break;
+        
+        case LOCK:
+            if (0x01 == message_recived->data[0])
+            {
+                ESP_LOGD(TAG,"Successfully locked");
+                lock->expected_status = 0x02;
+                ol305_cache_status(lock, 0x02, -1, &result.info);
+                ol305_submit_message(lock, LOCK_RESPONSE_MESSAGE, NULL, 0, NULL);
+            }
+            else if (0x02 == message_recived->data[0])
+            {
+                ESP_LOGE(TAG,"Lock failed");
+                ol305_stat(lock, OL305_STAT_LOCK_FAILURES);
+            }
+            break;
+        
+        case QUERY_INFO:
+        {
+            ol305_update_rtt(lock);
+            uint16_t battery_voltage = (message_recived->data[0] << 8) | message_recived->data[1];
+            uint8_t status = 0x00; //neither bit set -> unknown
+
+            if (1 == ((message_recived->data[2] >> 1) & 1))  
+                status = 0x02; //locked
+
+            if (1 == ((message_recived->data[2] >> 0) & 1))
+                status = 0x01; //unlocked
+
+            if (0x00 == status)
+                ESP_LOGW(TAG,"OL305 %d status : unknown (0x%02x), battery voltage : %d mV", lock->index, message_recived->data[2], ((int)battery_voltage) * 10);
+            else if (status != lock->status)
+                ESP_LOGI(TAG,"OL305 %d status : %s, battery voltage : %d mV", lock->index, (0x01 == status) ? "unlocked" : "locked", ((int)battery_voltage) * 10);
+            ol305_cache_status(lock, status, ((int)battery_voltage) * 10, &result.info);
+            ol305_reply(lock, OL305_REQ_QUERY, ESP_OK, &result);
+            if (0x01 == status)
+            {
+                lock->expected_status = 0x01;
+                ol305_reply(lock, OL305_REQ_UNLOCK, ESP_OK, &result);
+            }
+            break;
+        }
+        
+        case REGISTER_RFID:
+            if (0x00 != message_recived->data[0] && ol305_rfid_applied(lock, REGISTER_RFID, message_recived->data[0]))
+                break;
+            if ((0x01 == message_recived->data[0] || 0x03 == message_recived->data[0]) &&
+                1 + OL305_RFID_CARD_LEN > message_recived->len)
+            {
+                //no card to put in the index
+                ESP_LOGE(TAG,"OL305 %d card answer too short", lock->index);
+                ol305_reply(lock, OL305_REQ_READ_RFID, ESP_ERR_INVALID_RESPONSE, NULL);
+                break;
+            }
+            if (0x00 == message_recived->data[0])
+                ESP_LOGD(TAG,"Start reading");
+            else if (0x01 == message_recived->data[0])
+            {
+                ESP_LOGI(TAG,"Read card successfully, valid card number : ");
+                memcpy(result.card, &message_recived->data[1], sizeof(result.card));
+                ESP_LOGI(TAG,"RFID registered : ");
+                ESP_LOG_BUFFER_HEX(TAG, result.card, sizeof(result.card));
+                ol305_rfid_changed(lock, OL305_RFID_OP_REGISTER, result.card);
+                ol305_reply(lock, OL305_REQ_READ_RFID, ESP_OK, &result);
+            }
+            else if (0x02 == message_recived->data[0])
+            {
+                ESP_LOGE(TAG,"Adding failed");
+                ol305_reply(lock, OL305_REQ_READ_RFID, ESP_FAIL, NULL);
+            }
+            else if (0x03 == message_recived->data[0])
+            {
+                ESP_LOGW(TAG,"Card already exists");
+                memcpy(result.card, &message_recived->data[1], sizeof(result.card));
+                ol305_rfid_changed(lock, OL305_RFID_OP_REGISTER, result.card);
+                ol305_reply(lock, OL305_REQ_READ_RFID, ESP_FAIL, &result);
+            }
+            break;
+
+        case DELETE_RFID:
+            if (ol305_rfid_applied(lock, DELETE_RFID, message_recived->data[0]))
+                break;
+            if (0x00 == message_recived->data[0])
+            {
+                ESP_LOGE(TAG,"Delete failed/Card doesn't exist");
+                ol305_reply(lock, OL305_REQ_DELETE_RFID, ESP_FAIL, NULL);
+            }
+            else if (0x01 == message_recived->data[0])
+            {
+                ESP_LOGD(TAG,"Deleted successfully");
+                portENTER_CRITICAL(&lock->queue_mux);
+                memcpy(result.card, lock->inflight[OL305_REQ_DELETE_RFID].data, sizeof(result.card));
+                portEXIT_CRITICAL(&lock->queue_mux);
+                ol305_rfid_changed(lock, OL305_RFID_OP_DELETE, result.card);
+                ol305_reply(lock, OL305_REQ_DELETE_RFID, ESP_OK, &result);
+            }
+            break;
+
+        case GET_RFID:
+            ol305_update_rtt(lock);
+            ol305_rfid_listed(lock, message_recived);
+            break;
+
+        case LOCK_SETTINGS:
+            for (uint8_t i = 0; i < 3; i++)
+            {
+                switch (i)
+                {
+                    case 0:
+                        ESP_LOGD(TAG,"BLE Unlock : ");
                         break;
-                    
-                    case LOCK_SETTINGS_MESSAGE:
-                        ol305_encode_settings_message(0x02, 0x01, 0x01);
-                        ol305_send_message();
+
+                    case 1:
+                        ESP_LOGD(TAG,"Button Unlock : ");
                         break;
 
+                    case 2:
+                        ESP_LOGD(TAG,"RFID Unlock : ");
+                        break;
+                    
                     default:
                         break;
                 }
-                message_to_send.msg_type = INVALID_MESSAGE;
-                ol305_status_check();
+
+                if (0x01 == message_recived->data[i])
+                    ESP_LOGD(TAG,"OFF");
+                else if (0x02 == message_recived->data[i])
+                    ESP_LOGD(TAG,"ON");
+            }
+            result.settings.bluetooth_unlock = message_recived->data[0];
+            result.settings.button_unlock = message_recived->data[1];
+            result.settings.rfid_unlock = message_recived->data[2];
+            ol305_reply(lock, OL305_REQ_SETTINGS, ESP_OK, &result);
+            break;
+
+        case OBTAIN_LAST_USAGE:
+            ol305_update_rtt(lock);
+            ol305_usage_record(lock, message_recived);
+            break;
+
+        case DELETE_LAST_USAGE:
+            ol305_usage_deleted(lock, message_recived);
+            break;
+        default:
+            ESP_LOGD(TAG,"Invalid command recived");
+            break;
+    }
+}
+
+// Called from the transport context: only copies, the frames are decoded by ol305_task
+void ol305_recive_message(ol305_handle_t lock, uint8_t *data, uint16_t len)
+{
+    ol305_rxq_push(&lock->rxq, data, len);
+    ol305_wake(lock, OL305_EVT_NOTIFY);
+}
+
+// HCI reason of a lost link, as reported by the transport
+static void ol305_count_disconnect(OL305Details_t *lock, const ol305_rxq_slot_t *marker)
+{
+    uint16_t reason = (2 == marker->data_len) ? (marker->data[0] | (marker->data[1] << 8)) : 0;
+    ol305_evlog_write(lock->index, OL305_EV_LINK_LOST, 0, reason, 0);
+    switch (reason)
+    {
+        case 0x08:
+            ol305_stat(lock, OL305_STAT_DISC_TIMEOUT);
+            break;
+        case 0x13:
+            ol305_stat(lock, OL305_STAT_DISC_REMOTE);
+            break;
+        case 0x16:
+            ol305_stat(lock, OL305_STAT_DISC_LOCAL);
+            break;
+        case 0x3e:
+            ol305_stat(lock, OL305_STAT_DISC_FAIL_ESTABLISH);
+            break;
+        default:
+            ol305_stat(lock, OL305_STAT_DISC_OTHER);
+            break;
+    }
+}
+
+// Notifications may split or coalesce frames, the reassembler finds them in the byte stream
+static void ol305_process_rx(OL305Details_t *lock)
+{
+    ol305_reasm_t *rx = &lock->rx;
+    uint32_t bad_crc = rx->bad_crc;
+    uint32_t bad_length = rx->bad_length;
+    uint32_t resyncs = rx->resyncs;
+    const ol305_rxq_slot_t *slot;
+    while (NULL != (slot = ol305_rxq_front(&lock->rxq)))
+    {
+        if (0 == slot->len)
+        {
+            ol305_reasm_reset(rx);
+            ol305_count_disconnect(lock, slot);
+        }
+        else
+        {
+            ol305_reasm_feed(rx, slot->data, slot->len, ol305_handle_frame, lock);
+        }
+        ol305_rxq_release(&lock->rxq);
+    }
+
+    if (bad_crc != rx->bad_crc || bad_length != rx->bad_length)
+        ESP_LOGE(TAG,"Invalid data recived, %" PRIu32 " bad CRC, %" PRIu32 " bad length", rx->bad_crc, rx->bad_length);
+    if (bad_crc != rx->bad_crc)
+        ol305_stats_add(&lock->stats, OL305_STAT_CRC_ERRORS, rx->bad_crc - bad_crc);
+    if (bad_length != rx->bad_length)
+        ol305_stats_add(&lock->stats, OL305_STAT_LENGTH_ERRORS, rx->bad_length - bad_length);
+    if (resyncs != rx->resyncs)
+        ol305_stats_add(&lock->stats, OL305_STAT_STX_RESYNCS, rx->resyncs - resyncs);
+
+    uint32_t dropped = atomic_load(&lock->rxq.dropped);
+    if (dropped != lock->rx_dropped)
+    {
+        ESP_LOGW(TAG, "OL305 %d %" PRIu32 " notifications dropped, queue full", lock->index, dropped - lock->rx_dropped);
+        ol305_stats_add(&lock->stats, OL305_STAT_RX_DROPPED, dropped - lock->rx_dropped);
+        lock->rx_dropped = dropped;
+    }
+}
+
+#ifdef OL305_HOST_HOOKS
+// Fuzzing and decode benchmarks on the host: a fresh link, no key, nothing buffered
+void ol305_host_reset(ol305_handle_t lock)
+{
+    ol305_rxq_clear(&lock->rxq);
+    ol305_reasm_reset(&lock->rx);
+    lock->key = 0x00;
+    lock->state = INVALID;
+}
+
+// Decodes what ol305_recive_message queued, in the caller's context instead of ol305_task
+void ol305_host_process_rx(ol305_handle_t lock)
+{
+    ol305_process_rx(lock);
+    ol305_dispatch_results(lock);
+}
+#endif
+
+#ifdef OL305_TEST_HOOKS
+// Unit tests: one ol305_encode_* function, the buffer goes back to the pool
+uint16_t ol305_test_encode(ol305_handle_t lock, const ol305_test_msg_t *msg, uint8_t rand, uint8_t *frame)
+{
+    ol305_txbuf_t *buf = NULL;
+    lock->key = msg->key;
+    switch (msg->encoder)
+    {
+        case OL305_TEST_ENC_KEY:
+            buf = ol305_encode_key_message(lock, msg->password);
+            break;
+        case OL305_TEST_ENC_UNLOCK:
+            buf = ol305_encode_unlock_message(msg->arg[0], msg->user_id, msg->timestamp, msg->arg[1]);
+            break;
+        case OL305_TEST_ENC_QUERY:
+            buf = ol305_encode_query_message();
+            break;
+        case OL305_TEST_ENC_READ_RFID:
+            buf = ol305_encode_read_rfid_message();
+            break;
+        case OL305_TEST_ENC_REGISTER_CARD:
+            buf = ol305_encode_register_card_message(msg->data);
+            break;
+        case OL305_TEST_ENC_GET_RFID:
+            buf = ol305_encode_get_rfid_message(msg->arg[0]);
+            break;
+        case OL305_TEST_ENC_DELETE_RFID:
+            buf = ol305_encode_delete_rfid_message(msg->data, msg->len);
+            break;
+        case OL305_TEST_ENC_SETTINGS:
+            buf = ol305_encode_settings_message(msg->arg[0], msg->arg[1], msg->arg[2]);
+            break;
+        case OL305_TEST_ENC_USAGE:
+            buf = ol305_encode_usage_message(msg->arg[0]);
+            break;
+        case OL305_TEST_ENC_RESPONSE:
+            buf = ol305_encode_response_message(msg->arg[0]);
+            break;
+        default:
+            break;
+    }
+    if (NULL == buf)
+        return 0;
+
+    uint16_t len = ol305_codec_seal(buf->frame, rand, lock->key, buf->cmd, buf->len);
+    memcpy(frame, buf->frame, len);
+    ol305_txpool_put(buf);
+    return len;
+}
+
+void ol305_test_set_state_cb(ol305_test_state_cb_t cb, void *ctx)
+{
+    ol305_test_state_ctx = ctx;
+    ol305_test_state_cb = cb;
+}
+
+const char *ol305_test_state_name(uint8_t state)
+{
+    static const char *names[] =
+    {
+        [INVALID] = "INVALID",
+        [CONNECTING] = "CONNECTING",
+        [CONNECTED] = "CONNECTED",
+        [DISCONNECTING] = "DISCONNECTING",
+        [DISCONNECTED] = "DISCONNECTED",
+    };
+    if (state >= sizeof(names) / sizeof(names[0]))
+        return "?";
+    return names[state];
+}
+#endif
+
+static void ol305_link_event(void *ctx, ol305_link_event_t event, uint8_t *data, uint16_t len)
+{
+    OL305Details_t *lock = (OL305Details_t *)ctx;
+    switch (event)
+    {
+        case OL305_LINK_DATA:
+            ol305_recive_message(lock, data, len);
+            break;
+        case OL305_LINK_WRITTEN:
+            ol305_tx_written(lock);
+            break;
+        case OL305_LINK_CLOSED:
+            //writes in flight on the lost link are never completed
+            ol305_tx_release_all(lock);
+            ol305_rxq_push_reset(&lock->rxq, data, len);
+            ol305_wake(lock, OL305_EVT_LINK);
+            break;
+        default:
+            ol305_wake(lock, OL305_EVT_LINK);
+            break;
+    }
+}
+
+// What the lock needs a connection slot for: its queue, the requests in flight and the age of its status
+static ol305_work_t ol305_fleet_work(OL305Details_t *lock, uint8_t *depth, bool *busy)
+{
+    ol305_work_t work = OL305_WORK_NONE;
+    ol305_lock_info_t info;
+    int64_t age_us;
+    *depth = 0;
+    *busy = false;
+    if (OL305_STATE_ENABLE != lock->new_state)
+        return work;
+    if (!ol305_cached_status(lock, &info, &age_us))
+        work = OL305_WORK_REFRESH;
+
+    portENTER_CRITICAL(&lock->queue_mux);
+    for (uint8_t i = 0; i < ol305_cmdq_count(&lock->queue); i++)
+    {
+        if (ol305_cmd_policy[lock->queue.entries[i].type].work < work)
+            work = ol305_cmd_policy[lock->queue.entries[i].type].work;
+    }
+    *depth = ol305_cmdq_count(&lock->queue);
+    for (uint8_t i = 0; i < OL305_REQ_MAX; i++)
+    {
+        if (0 == lock->inflight[i].id)
+            continue;
+        if (ol305_cmd_policy[lock->inflight[i].type].work < work)
+            work = ol305_cmd_policy[lock->inflight[i].type].work;
+        (*depth)++;
+        *busy = true;
+    }
+    portEXIT_CRITICAL(&lock->queue_mux);
+    return work;
+}
+
+// The scheduler has a new waiter or a free slot, the other locks look at their turn again
+static void ol305_fleet_kick(OL305Details_t *lock)
+{
+    for (uint8_t i = 0; i < ol305_lock_count; i++)
+    {
+        if (&ol305_locks[i] != lock)
+            ol305_wake(&ol305_locks[i], OL305_EVT_STATE);
+    }
+}
+
+// Gives the connection slot to a waiting lock, the queued requests stay for the next turn
+static void ol305_yield(OL305Details_t *lock)
+{
+    ESP_LOGI(TAG, "OL305 %d yields its link", lock->index);
+    lock->key = 0x00;
+    lock->key_sent_time = 0;
+    if (lock->ble_started)
+        ol305_transport->close(lock->link);
+    ol305_tx_release_all(lock);
+    lock->link = OL305_INVALID_LINK;
+    ol305_fleet_release(lock->index);
+    ol305_fleet_kick(lock);
+    ol305_task_events(lock, DISCONNECTED);
+}
+
+static void ol305_connect(OL305Details_t *lock)
+{
+    if (OL305_STATE_ENABLE != lock->new_state)
+    {
+        ESP_LOGW(TAG,"OL305 not enabled set!");
+        return;
+    }
+
+    if (!lock->ble_started)
+    {
+        if (NULL == ol305_transport)
+        {
+            ESP_LOGE(TAG,"No OL305 transport set!");
+            return;
+        }
+        ol305_transport->init();
+        lock->ble_started = true;
+        lock->cold_start = true;
+        lock->key_sent_time = 0;
+    }
+
+    //no free connection slot yet, tried again on the next pass
+    if (OL305_INVALID_LINK == lock->link)
+    {
+        ol305_rxq_clear(&lock->rxq);
+        ol305_reasm_reset(&lock->rx);
+        lock->link = ol305_transport->open(lock->mac, sizeof(lock->mac), ol305_link_event, lock);
+        ol305_lat_begin(lock->link, lock->connect_start);
+    }
+
+    if (true != ol305_transport->is_connected(lock->link))
+        return;
+
+    //the key is resent until the lock answers, the answer moves the task to CONNECTED
+    int64_t now = esp_timer_get_time();
+    if (0 == lock->key_sent_time || now - lock->key_sent_time >= OL305_KEY_RETRY_MS * 1000LL)
+    {
+        lock->key_sent_time = now;
+        ol305_send_message(lock, ol305_encode_key_message(lock, lock->password));
+    }
+}
+
+// How long the task may sleep when nothing wakes it up
+static uint32_t ol305_idle_timeout(OL305Details_t *lock)
+{
+    switch (lock->state)
+    {
+        case CONNECTING:
+        {
+            uint32_t fleet_ms = ol305_fleet_timeout(lock->index, esp_timer_get_time());
+            return (fleet_ms < OL305_KEY_RETRY_MS) ? fleet_ms : OL305_KEY_RETRY_MS;
+        }
+        case CONNECTED:
+        {
+            ol305_lock_info_t info;
+            int64_t now = esp_timer_get_time();
+            int64_t age_us;
+            int64_t wait_us;
+
+            //until the cached status goes stale, or until the stale status may be queried again
+            if (ol305_cached_status(lock, &info, &age_us))
+                wait_us = lock->status_ttl_ms * 1000LL - age_us;
+            else
+                wait_us = lock->query_time + OL305_QUERY_RETRY_MS * 1000LL - now;
+
+            if (ol305_in_flight(lock, OL305_REQ_UNLOCK) && lock->unlock_retry_at - now < wait_us)
+                wait_us = lock->unlock_retry_at - now;
+            if (ol305_in_flight(lock, OL305_REQ_SYNC_USAGE) && lock->usage_retry_at - now < wait_us)
+                wait_us = lock->usage_retry_at - now;
+            if (ol305_in_flight(lock, OL305_REQ_SYNC_RFID) && lock->rfid_retry_at - now < wait_us)
+                wait_us = lock->rfid_retry_at - now;
+            //a waiting lock may get the slot once the quantum is over
+            uint32_t fleet_ms = ol305_fleet_timeout(lock->index, now);
+            if (UINT32_MAX != fleet_ms && fleet_ms * 1000LL < wait_us)
+                wait_us = fleet_ms * 1000LL;
+            if (wait_us <= 0)
+                return 0;
+            return (wait_us + 999) / 1000;
+        }
+        case DISCONNECTED:
+        {
+            if (lock->new_state == OL305_STATE_DISABLE)
+                return portMAX_DELAY;
+            if (!ol305_fleet_enabled() || lock->new_state != OL305_STATE_ENABLE)
+                return 0;
+            //no slot: until the scheduler may change its mind, a request comes or the status goes stale
+            ol305_lock_info_t info;
+            int64_t age_us;
+            uint32_t fleet_ms = ol305_fleet_timeout(lock->index, esp_timer_get_time());
+            if (ol305_cached_status(lock, &info, &age_us) && (lock->status_ttl_ms * 1000LL - age_us) / 1000 + 1 < fleet_ms)
+                fleet_ms = (lock->status_ttl_ms * 1000LL - age_us) / 1000 + 1;
+            return (UINT32_MAX == fleet_ms) ? portMAX_DELAY : fleet_ms;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Drops this lock's reference on the BLE stack, the last lock tears it down
+static void ol305_ble_release(OL305Details_t *lock)
+{
+    if (!lock->ble_started)
+        return;
+    ol305_transport->deinit();
+    lock->ble_started = false;
+}
+
+// Queries the lock only when the cached status is older than the TTL
+static void ol305_status_check(OL305Details_t *lock)
+{
+    ol305_lock_info_t info;
+    int64_t age_us;
+    int64_t now = esp_timer_get_time();
+
+    if (!ol305_cached_status(lock, &info, &age_us) && now - lock->query_time >= OL305_QUERY_RETRY_MS * 1000LL)
+    {
+        lock->query_time = now;
+        ol305_send_message(lock, ol305_encode_query_message());
+    }
+
+    if (info.status != lock->expected_status && 0 != lock->expected_status)
+    {
+        if (info.status == 0x01)
+            ESP_LOGW(TAG,"Warning : OL305 should be locked but it is unlocked");
+        else if (info.status == 0x02)
+            ESP_LOGW(TAG,"Warning : OL305 should be unlocked but it is locked");
+    }
+    else if (info.status != lock->expected_status && 0 == lock->expected_status)
+        lock->expected_status = info.status;
+}
+
+// Sends the unlock until the lock confirms it, the confirmation (UNLOCK ack or QUERY_INFO) is handled
+// by ol305_recive_message and the hard deadline by ol305_drop_expired
+static void ol305_unlock_step(OL305Details_t *lock)
+{
+    if (!ol305_in_flight(lock, OL305_REQ_UNLOCK))
+        return;
+
+    int64_t now = esp_timer_get_time();
+    if (now < lock->unlock_retry_at)
+        return;
+
+    if (OL305_UNLOCK_MAX_ATTEMPTS <= lock->unlock_attempts)
+    {
+        ESP_LOGE(TAG,"OL305 %d unlock not confirmed after %d attempts", lock->index, lock->unlock_attempts);
+        if (!lock->unlock_refused)
+            ol305_stat(lock, OL305_STAT_REQUEST_TIMEOUTS);
+        ol305_reply(lock, OL305_REQ_UNLOCK, lock->unlock_refused ? ESP_FAIL : ESP_ERR_TIMEOUT, NULL);
+        return;
+    }
+
+    uint8_t control_cmd = 0x01;
+    int64_t user_id = 0x01;
+    int64_t operation_timestamp = now / 1000;
+    uint8_t unlock_status = 0x00;
+
+    ol305_send_message(lock, ol305_encode_unlock_message(control_cmd, user_id, operation_timestamp, unlock_status));
+    ol305_send_message(lock, ol305_encode_query_message());
+
+    lock->unlock_attempts++;
+    lock->unlock_retry_at = now + lock->unlock_backoff_ms * 1000LL;
+    lock->unlock_backoff_ms *= 2;
+    if (OL305_UNLOCK_MAX_RETRY_MS < lock->unlock_backoff_ms)
+        lock->unlock_backoff_ms = OL305_UNLOCK_MAX_RETRY_MS;
+}
+
+static void ol305_start_unlock(OL305Details_t *lock, const ol305_cmd_t *cmd)
+{
+    ol305_cmd_t unlock = *cmd;
+    int64_t now = esp_timer_get_time();
+
+    if (0 == unlock.deadline || now + OL305_UNLOCK_DEADLINE_MS * 1000LL < unlock.deadline)
+        unlock.deadline = now + OL305_UNLOCK_DEADLINE_MS * 1000LL;
+
+    //the first retry waits for three answer times of the lock
+    lock->unlock_backoff_ms = 3 * lock->rtt_us / 1000;
+    if (OL305_UNLOCK_MIN_RETRY_MS > lock->unlock_backoff_ms)
+        lock->unlock_backoff_ms = OL305_UNLOCK_MIN_RETRY_MS;
+    if (OL305_UNLOCK_MAX_RETRY_MS < lock->unlock_backoff_ms)
+        lock->unlock_backoff_ms = OL305_UNLOCK_MAX_RETRY_MS;
+    lock->unlock_attempts = 0;
+    lock->unlock_refused = false;
+    lock->unlock_retry_at = now;
+
+    ol305_track_reply(lock, &unlock);
+    ol305_unlock_step(lock);
+}
+
+static void ol305_run_command(OL305Details_t *lock, const ol305_cmd_t *cmd)
+{
+    ol305_result_t result = {0};
+    lock->command_time = cmd->created;
+    switch (cmd->type)
+    {
+        case UNLOCK_MESSAGE:
+            ol305_start_unlock(lock, cmd);
+            break;
+
+        case QUERY_INFO_MESSAGE:
+        {
+            int64_t age_us;
+            if (ol305_cached_status(lock, &result.info, &age_us))
+            {
+                ol305_complete(lock, cmd, ESP_OK, &result);
+                break;
+            }
+            //answered by the query ol305_status_check sends right away
+            ol305_track_reply(lock, cmd);
+            lock->query_time = 0;
+            break;
+        }
+
+        case UNLOCK_RESPONSE_MESSAGE: 
+            ol305_send_message(lock, ol305_encode_response_message(UNLOCK));
+            break;
+
+        case LOCK_RESPONSE_MESSAGE:
+            ol305_send_message(lock, ol305_encode_response_message(LOCK));
+            break;
+
+        case REGISTER_RFID_MESSAGE:
+            ol305_track_reply(lock, cmd);
+            ol305_send_message(lock, ol305_encode_read_rfid_message());
+            break;
+
+        case DELETE_RFID_MESSAGE:
+            ol305_track_reply(lock, cmd);
+            ol305_send_message(lock, ol305_encode_delete_rfid_message(cmd->data, cmd->data_len));
+            break;
+        
+        case LOCK_SETTINGS_MESSAGE:
+            ol305_track_reply(lock, cmd);
+            ol305_send_message(lock, ol305_encode_settings_message(cmd->data[0], cmd->data[1], cmd->data[2]));
+            break;
+
+        case USAGE_SYNC_MESSAGE:
+            ol305_start_usage_sync(lock, cmd);
+            break;
+
+        case RFID_SYNC_MESSAGE:
+            ol305_start_rfid_sync(lock, cmd);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void ol305_task(void *pvParameters)
+{
+	OL305Details_t *lock = (OL305Details_t *)pvParameters;
+	ESP_LOGI(TAG, "Task started for lock %d!", lock->index);
+	lock->task = xTaskGetCurrentTaskHandle();
+	while (1)
+	{
+		ol305_process_rx(lock);
+		ol305_drop_expired(lock);
+		ol305_dispatch_results(lock);
+		uint8_t depth;
+		bool busy;
+		ol305_work_t work = ol305_fleet_work(lock, &depth, &busy);
+		if (ol305_fleet_update(lock->index, work, depth, busy, esp_timer_get_time()))
+		    ol305_fleet_kick(lock);
+		switch (lock->state)
+		{
+            case INVALID:
+                if (lock->new_state == OL305_STATE_ENABLE && ol305_fleet_acquire(lock->index, esp_timer_get_time()))
+                    ol305_task_events(lock, CONNECTING);
+                else
+                    ol305_task_events(lock, DISCONNECTED);
+                break;
+
+            case CONNECTING:
+                if (lock->new_state == OL305_STATE_DISABLE)
+                {
+                    ESP_LOGI(TAG, "Connecting to Disable");
+                    ol305_task_events(lock, DISCONNECTING);
+                    continue;
+                }
+                if (lock->new_state == OL305_STATE_SHUTDOWN)
+                {
+                    ESP_LOGI(TAG, "Connecting to ShutDown");
+                    ol305_task_events(lock, DISCONNECTING);
+                    continue;
+                }
+                //the lock is out of reach, a waiting lock gets the slot
+                if (ol305_fleet_should_yield(lock->index, esp_timer_get_time()))
+                {
+                    ol305_yield(lock);
+                    continue;
+                }
+                ol305_connect(lock);
+                break;
+
+            case CONNECTED:
+                if (lock->new_state == OL305_STATE_DISABLE)
+                {
+                    ESP_LOGI(TAG, "Connected to Disable");
+                    ol305_task_events(lock, DISCONNECTING);
+                    continue;
+                }
+                if (lock->new_state == OL305_STATE_SHUTDOWN)
+                {
+                    ESP_LOGI(TAG, "Connected to ShutDown");
+                    ol305_task_events(lock, DISCONNECTING);
+                    continue;
+                }
+                if (!ol305_transport->is_connected(lock->link))
+                {
+                    //the link is searched again by the BLE layer, a new key is needed once it is back
+                    ESP_LOGW(TAG, "OL305 %d link lost", lock->index);
+                    ol305_stat(lock, OL305_STAT_RECONNECTS);
+                    lock->key = 0x00;
+                    lock->key_sent_time = 0;
+                    ol305_fail_inflight(lock, ESP_ERR_INVALID_STATE);
+                    ol305_fleet_set_connected(lock->index, false, esp_timer_get_time());
+                    ol305_task_events(lock, CONNECTING);
+                    continue;
+                }
+                if (ol305_fleet_should_yield(lock->index, esp_timer_get_time()))
+                {
+                    ol305_yield(lock);
+                    continue;
+                }
+
+                ol305_unlock_step(lock);
+                ol305_usage_step(lock);
+                ol305_rfid_step(lock);
+                ol305_cmd_t cmd;
+                if (ol305_next_command(lock, &cmd))
+                {
+                    ol305_run_command(lock, &cmd);
+                    //more requests may be queued, run the next one without sleeping
+                    if (ol305_runnable_commands(lock))
+                        lock->missed_events |= OL305_EVT_COMMAND;
+                }
+                ol305_status_check(lock);
                 break;
 
             case DISCONNECTING:
-                ol305_deinit_message();
-                ol305_details_deinit();
-                message_to_send.key = 0x00;
-                ble_deinit();
-                ol305_task_events(DISCONNECTED);
-                if (ol305_details.new_state == OL305_STATE_SHUTDOWN)
+                ol305_flush_commands(lock);
+                ol305_dispatch_results(lock);
+                ol305_details_deinit(lock);
+                lock->key = 0x00;
+                if (lock->ble_started)
+                    ol305_transport->close(lock->link);
+                ol305_tx_release_all(lock);
+                lock->link = OL305_INVALID_LINK;
+                ol305_fleet_release(lock->index);
+                ol305_fleet_kick(lock);
+                //in warm mode the stack stays up for the next connection
+                if (lock->new_state == OL305_STATE_SHUTDOWN || lock->ble_mode == OL305_BLE_COLD)
+                    ol305_ble_release(lock);
+                ol305_task_events(lock, DISCONNECTED);
+                if (lock->new_state == OL305_STATE_SHUTDOWN)
                 {
                     ESP_LOGI(TAG, "stoping task");
                     vTaskDelete(NULL);
@@ -608,17 +2102,24 @@ void ol305_task(void *pvParameters)
                 break;
 
             case DISCONNECTED:
-                if (ol305_details.new_state == OL305_STATE_DISABLE)
+                if (lock->new_state != OL305_STATE_ENABLE)
                 {
-                    vTaskDelay(10 / portTICK_PERIOD_MS);
-                    continue;
+                    //nothing is sent while the lock is disabled, the callers are not kept waiting
+                    ol305_flush_commands(lock);
+                    ol305_dispatch_results(lock);
                 }
-                if (ol305_details.new_state == OL305_STATE_SHUTDOWN)
+                if (lock->new_state == OL305_STATE_DISABLE)
+                    break;
+                if (lock->new_state == OL305_STATE_SHUTDOWN)
                 {
+                    ol305_ble_release(lock);
                     ESP_LOGI(TAG, "stoping task");
                     vTaskDelete(NULL);
                 }
-                ol305_task_events(CONNECTING);
+                //in line for a connection slot, the work of the lock tells how urgently
+                if (!ol305_fleet_acquire(lock->index, esp_timer_get_time()))
+                    break;
+                ol305_task_events(lock, CONNECTING);
                 break;
 
             default:
@@ -626,48 +2127,199 @@ void ol305_task(void *pvParameters)
                 break;
 
 		}
-		vTaskDelay(1000 / portTICK_PERIOD_MS);
+		ol305_task_sleep(lock, ol305_idle_timeout(lock));
 	}
 	ESP_LOGI(TAG, "stoping task");
 	vTaskDelete(NULL);
 }
 
-void ol305_disconnect()
+void ol305_disconnect(ol305_handle_t lock)
+{
+    ol305_task_events(lock, DISCONNECTING);
+}
+
+uint32_t ol305_submit(ol305_handle_t lock, const ol305_request_t *request)
+{
+    switch (request->request)
+    {
+        case OL305_REQ_UNLOCK:
+            return ol305_submit_message(lock, UNLOCK_MESSAGE, NULL, 0, request);
+
+        case OL305_REQ_QUERY:
+            return ol305_submit_message(lock, QUERY_INFO_MESSAGE, NULL, 0, request);
+
+        case OL305_REQ_READ_RFID:
+            return ol305_submit_message(lock, REGISTER_RFID_MESSAGE, NULL, 0, request);
+
+        case OL305_REQ_DELETE_RFID:
+            return ol305_submit_message(lock, DELETE_RFID_MESSAGE, request->card, sizeof(request->card), request);
+
+        case OL305_REQ_SYNC_USAGE:
+            return ol305_submit_message(lock, USAGE_SYNC_MESSAGE, NULL, 0, request);
+
+        case OL305_REQ_SYNC_RFID:
+        {
+            if (NULL == request->cards)
+                return ol305_submit_message(lock, RFID_SYNC_MESSAGE, NULL, 0, request);
+            //sorted outside of the critical section
+            ol305_rfid_index_t desired;
+            if (ESP_OK != ol305_rfid_build(&desired, request->cards, request->card_count))
+            {
+                ESP_LOGE(TAG,"OL305 %d too many cards: %u", lock->index, request->card_count);
+                return 0;
+            }
+            return ol305_queue_message(lock, RFID_SYNC_MESSAGE, NULL, 0, request, &desired);
+        }
+
+        case OL305_REQ_SETTINGS:
+        {
+            const ol305_settings_t *settings = &request->settings;
+            if (settings->bluetooth_unlock < 0x01 || settings->bluetooth_unlock > 0x02 ||
+                settings->button_unlock < 0x01 || settings->button_unlock > 0x02 ||
+                settings->rfid_unlock < 0x01 || settings->rfid_unlock > 0x02)
+            {
+                ESP_LOGE(TAG,"Invalid OL305 settings");
+                return 0;
+            }
+            uint8_t data[] = {settings->bluetooth_unlock, settings->button_unlock, settings->rfid_unlock};
+            return ol305_submit_message(lock, LOCK_SETTINGS_MESSAGE, data, sizeof(data), request);
+        }
+
+        default:
+            ESP_LOGE(TAG,"Unknown OL305 request %d", request->request);
+            return 0;
+    }
+}
+
+uint32_t ol305_unlock(ol305_handle_t lock)
+{
+    ol305_request_t request = {.request = OL305_REQ_UNLOCK};
+    return ol305_submit(lock, &request);
+}
+
+uint32_t ol305_query(ol305_handle_t lock)
+{
+    ol305_request_t request = {.request = OL305_REQ_QUERY};
+    return ol305_submit(lock, &request);
+}
+
+uint32_t ol305_read_rfid(ol305_handle_t lock)
+{
+    ol305_request_t request = {.request = OL305_REQ_READ_RFID};
+    return ol305_submit(lock, &request);
+}
+
+uint32_t ol305_delete_rfid(ol305_handle_t lock, const uint8_t *card)
+{
+    //an all zero card deletes all the NFC tokens
+    ol305_request_t request = {.request = OL305_REQ_DELETE_RFID};
+    if (NULL != card)
+        memcpy(request.card, card, sizeof(request.card));
+    return ol305_submit(lock, &request);
+}
+
+uint32_t ol305_settings(ol305_handle_t lock)
+{
+    ol305_request_t request = {.request = OL305_REQ_SETTINGS};
+    request.settings.bluetooth_unlock = 0x02;
+    request.settings.button_unlock = 0x01;
+    request.settings.rfid_unlock = 0x01;
+    return ol305_submit(lock, &request);
+}
+
+esp_err_t ol305_set_cards(ol305_handle_t lock, const uint8_t (*cards)[8], uint16_t count)
+{
+    //sorted outside of the critical section
+    ol305_rfid_index_t desired;
+    esp_err_t err = ol305_rfid_build(&desired, cards, count);
+    if (ESP_OK != err)
+        return err;
+
+    portENTER_CRITICAL(&lock->queue_mux);
+    lock->rfid_desired = desired;
+    lock->rfid_has_desired = true;
+    portEXIT_CRITICAL(&lock->queue_mux);
+    return ESP_OK;
+}
+
+uint32_t ol305_sync_cards(ol305_handle_t lock)
+{
+    ol305_request_t request = {.request = OL305_REQ_SYNC_RFID};
+    return ol305_submit(lock, &request);
+}
+
+uint16_t ol305_get_cards(ol305_handle_t lock, uint8_t (*cards)[8], uint16_t max)
+{
+    portENTER_CRITICAL(&lock->queue_mux);
+    uint16_t count = lock->rfid.count;
+    memcpy(cards, lock->rfid.cards, ((count < max) ? count : max) * OL305_RFID_CARD_LEN);
+    portEXIT_CRITICAL(&lock->queue_mux);
+    return count;
+}
+
+uint32_t ol305_sync_usage(ol305_handle_t lock)
+{
+    ol305_request_t request = {.request = OL305_REQ_SYNC_USAGE};
+    return ol305_submit(lock, &request);
+}
+
+esp_err_t ol305_read_usage(ol305_handle_t lock, uint32_t first, ol305_usage_rec_t *records, uint32_t *count)
 {
-    ol305_task_events(DISCONNECTING);
+    //complete records only, a sync may append meanwhile
+    return ol305_usage_read(lock->mac, first, records, count);
 }
 
-void ol305_unlock()
+esp_err_t ol305_drop_usage(ol305_handle_t lock, uint32_t count)
 {
-    message_to_send.msg_type = UNLOCK_MESSAGE;
+    portENTER_CRITICAL(&lock->queue_mux);
+    bool busy = lock->usage_busy || lock->usage_dropping;
+    if (!busy)
+        lock->usage_dropping = true;
+    portEXIT_CRITICAL(&lock->queue_mux);
+    if (busy)
+        return ESP_ERR_INVALID_STATE;
+
+    esp_err_t err = ol305_usage_drop(lock->mac, count);
+    portENTER_CRITICAL(&lock->queue_mux);
+    lock->usage_dropping = false;
+    portEXIT_CRITICAL(&lock->queue_mux);
+    //a sync held back meanwhile may run now
+    ol305_wake(lock, OL305_EVT_COMMAND);
+    return err;
 }
 
-void ol305_query()
+void ol305_set_status_ttl(ol305_handle_t lock, uint32_t ttl_ms)
 {
-    message_to_send.msg_type = QUERY_INFO_MESSAGE;
+    lock->status_ttl_ms = ttl_ms;
+    ol305_wake(lock, OL305_EVT_STATE);
 }
 
-void ol305_read_rfid()
+esp_err_t ol305_get_status(ol305_handle_t lock, ol305_status_t *status)
 {
-    message_to_send.msg_type = REGISTER_RFID_MESSAGE;
+    int64_t age_us;
+    ol305_cached_status(lock, &status->info, &age_us);
+    if (INT64_MAX == age_us)
+        return ESP_ERR_NOT_FOUND;
+    status->age_ms = age_us / 1000;
+    return ESP_OK;
 }
 
-void ol305_delete_rfid()
+void ol305_get_stats(ol305_handle_t lock, ol305_stats_t *stats)
 {
-    message_to_send.msg_type = DELETE_RFID_MESSAGE;
+    ol305_stats_snapshot(&lock->stats, stats);
 }
 
-void ol305_settings()
+bool is_ol305_connected(ol305_handle_t lock)
 {
-    message_to_send.msg_type = LOCK_SETTINGS_MESSAGE;
+    return lock->state == CONNECTED;
 }
 
-bool is_ol305_connected()
+void ol305_set_ble_mode(ol305_handle_t lock, OL305_BLE_MODE mode)
 {
-    return ol305_details.state == CONNECTED;
+    lock->ble_mode = mode;
 }
 
-void ol305_control(OL305_STATE state, uint8_t wait, uint32_t timeout_ms)
+void ol305_control(ol305_handle_t lock, OL305_STATE state, uint8_t wait, uint32_t timeout_ms)
 {
 	switch (state)
 	{
@@ -685,14 +2337,15 @@ void ol305_control(OL305_STATE state, uint8_t wait, uint32_t timeout_ms)
             break;
 	}
 	
-	ol305_details.new_state = state;
+	lock->new_state = state;
+	ol305_wake(lock, OL305_EVT_STATE);
 	if (!wait)
 		return;
-	uint32_t timeout_timer = esp_timer_get_time() + timeout_ms;
+	int64_t timeout_timer = esp_timer_get_time() + timeout_ms * 1000LL;
 	do
 	{
-		const uint8_t enable_done = ol305_details.state == CONNECTED && ol305_details.new_state == OL305_STATE_ENABLE;
-		const uint8_t disable_shutdown_done = ol305_details.state == DISCONNECTED && (ol305_details.new_state == OL305_STATE_DISABLE || ol305_details.new_state == OL305_STATE_SHUTDOWN);
+		const uint8_t enable_done = lock->state == CONNECTED && lock->new_state == OL305_STATE_ENABLE;
+		const uint8_t disable_shutdown_done = lock->state == DISCONNECTED && (lock->new_state == OL305_STATE_DISABLE || lock->new_state == OL305_STATE_SHUTDOWN);
 		if (enable_done || disable_shutdown_done)
 		{
 			ESP_LOGI(TAG, "Job done");
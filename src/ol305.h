@@ -2,6 +2,17 @@
 #define __OL305_H__
 
 #include "nvs.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "ol305_transport.h"
+#include "ol305_usage.h"
+
+//locks served by one board, one ol305_task each; a gateway with more lockers than connection slots
+//raises it with -DOL305_MAX_LOCKS and lets ol305_fleet.h take turns on the slots
+#ifndef OL305_MAX_LOCKS
+#define OL305_MAX_LOCKS 8
+#endif
 
 typedef enum
 {
@@ -11,6 +22,12 @@ typedef enum
 	OL305_STATE_MAX
 }OL305_STATE;
 
+typedef enum
+{
+	OL305_BLE_WARM, //disable only closes the link, the stack is torn down on shutdown
+	OL305_BLE_COLD, //disable also tears down the stack when no other lock uses it
+}OL305_BLE_MODE;
+
 typedef enum 
 {
     BLE_KEY = 0x01,
@@ -27,17 +44,209 @@ typedef enum
     GET_RFID = 0x87,
 } ol305b_cmd;
 
-void ol305_recive_message(uint8_t *data, uint16_t len);
-void set_ol305_mac_addr(uint8_t *ol305_mac_addr, uint16_t len);
+typedef enum
+{
+    OL305_REQ_UNLOCK,
+    OL305_REQ_QUERY,
+    OL305_REQ_READ_RFID,
+    OL305_REQ_DELETE_RFID,
+    OL305_REQ_SETTINGS,
+    OL305_REQ_SYNC_USAGE,
+    OL305_REQ_SYNC_RFID,
+    OL305_REQ_MAX
+} OL305_REQUEST;
+
+//protocol health counters of a lock, monotonic unless noted
+typedef enum
+{
+    OL305_STAT_FRAMES_RX,       //frames decoded
+    OL305_STAT_FRAMES_TX,       //frames accepted by the transport
+    OL305_STAT_TX_DROPPED,      //frames not sent: no buffer, too many pending, write refused
+    OL305_STAT_RX_DROPPED,      //notifications lost, receive queue full
+    OL305_STAT_CRC_ERRORS,
+    OL305_STAT_LENGTH_ERRORS,
+    OL305_STAT_STX_RESYNCS,     //bytes skipped to find the next STX
+    OL305_STAT_KEY_ERRORS,      //wrong session key or key handshake refused
+    OL305_STAT_CMD_ERRORS,      //CMD_ERROR frames
+    OL305_STAT_LAST_CMD_ERROR,  //code of the last CMD_ERROR, not a counter
+    OL305_STAT_UNLOCK_FAILURES, //the lock answered that the unlock failed
+    OL305_STAT_LOCK_FAILURES,
+    OL305_STAT_REQUEST_TIMEOUTS,
+    OL305_STAT_CONNECTS,        //BLE_KEY handshakes completed
+    OL305_STAT_RECONNECTS,      //link lost while connected
+    OL305_STAT_DISC_TIMEOUT,    //disconnect reasons reported by the transport
+    OL305_STAT_DISC_REMOTE,
+    OL305_STAT_DISC_LOCAL,
+    OL305_STAT_DISC_FAIL_ESTABLISH,
+    OL305_STAT_DISC_OTHER,
+    OL305_STAT_MAX
+} ol305_stat_t;
+
+typedef struct
+{
+    uint32_t counters[OL305_STAT_MAX];
+} ol305_stats_t;
+
+//every lock has its own context and ol305_task instance
+//the commands return the id of the queued request, 0 when it was rejected
+typedef struct ol305_lock *ol305_handle_t;
+
+typedef struct
+{
+    uint8_t status; //unlocked -> 0x01; locked -> 0x02
+    int battery_voltage; //mV
+} ol305_lock_info_t;
+
+//last status reported by the lock
+typedef struct
+{
+    ol305_lock_info_t info;
+    uint32_t age_ms;
+} ol305_status_t;
+
+typedef struct
+{
+    uint8_t bluetooth_unlock; //off -> 0x01; on -> 0x02
+    uint8_t button_unlock;
+    uint8_t rfid_unlock;
+} ol305_settings_t;
+
+//OBTAIN_LAST_USAGE / DELETE_LAST_USAGE round of one connection
+typedef struct
+{
+    uint32_t records; //committed to flash and deleted from the lock
+    uint32_t duplicates; //committed by an earlier sync whose delete was lost, only deleted
+    uint32_t elapsed_ms;
+} ol305_usage_sync_t;
+
+//cards set with ol305_set_cards() applied to the lock
+typedef struct
+{
+    uint16_t registered;
+    uint16_t deleted;
+    uint16_t listed; //cards read with GET_RFID, 0 when the local index matched the lock
+    uint32_t elapsed_ms;
+} ol305_rfid_sync_t;
+
+typedef struct
+{
+    uint32_t id;
+    OL305_REQUEST request;
+    //ESP_OK; ESP_FAIL -> refused by the lock; ESP_ERR_TIMEOUT -> no answer before the deadline;
+    //ESP_ERR_INVALID_STATE -> lock disabled or link lost; ESP_ERR_NO_MEM -> pushed out by a more urgent request
+    esp_err_t err;
+    int64_t latency_us; //from submission to completion
+    union
+    {
+        ol305_lock_info_t info; //UNLOCK, QUERY
+        uint8_t card[8]; //READ_RFID, DELETE_RFID
+        ol305_settings_t settings; //SETTINGS
+        ol305_usage_sync_t usage; //SYNC_USAGE, zero when the link was lost or the deadline passed
+        ol305_rfid_sync_t rfid; //SYNC_RFID, same
+    };
+} ol305_result_t;
+
+//called from ol305_task, it must not block
+typedef void (*ol305_done_cb_t)(ol305_handle_t lock, const ol305_result_t *result, void *ctx);
+
+typedef struct
+{
+    OL305_REQUEST request;
+    uint8_t card[8]; //DELETE_RFID, all zero -> every card
+    ol305_settings_t settings; //SETTINGS
+    const uint8_t (*cards)[8]; //SYNC_RFID, replaces the cards of ol305_set_cards once queued; NULL -> keeps them
+    uint16_t card_count;
+    uint32_t timeout_ms; //0 -> default timeout of the request
+    ol305_done_cb_t done_cb; //optional
+    void *ctx;
+    EventGroupHandle_t event_group; //optional, done_bits are set once the result is written to *result
+    EventBits_t done_bits;
+    ol305_result_t *result; //optional
+} ol305_request_t;
+
+void ol305_set_transport(const ol305_transport_t *transport);
+ol305_handle_t ol305_add_lock();
+ol305_handle_t ol305_get_lock(uint8_t index);
+uint8_t ol305_get_lock_count();
+void ol305_recive_message(ol305_handle_t lock, uint8_t *data, uint16_t len);
+void set_ol305_mac_addr(ol305_handle_t lock, uint8_t *ol305_mac_addr, uint16_t len);
 void ol305_task(void *pvParameters);
-void ol305_unlock();
-void ol305_query();
-void ol305_read_rfid();
-void ol305_delete_rfid();
-void ol305_settings(); 
-bool is_ol305_connected();
-void ol305_control(OL305_STATE state, uint8_t wait, uint32_t timeout_ms);
-void ol305_disconnect();
-void set_ol305_ble_password(const char *password);
+uint32_t ol305_submit(ol305_handle_t lock, const ol305_request_t *request);
+uint32_t ol305_unlock(ol305_handle_t lock);
+uint32_t ol305_query(ol305_handle_t lock);
+uint32_t ol305_read_rfid(ol305_handle_t lock);
+//card NULL -> every card
+uint32_t ol305_delete_rfid(ol305_handle_t lock, const uint8_t *card);
+uint32_t ol305_settings(ol305_handle_t lock);
+//moves the usage records of the lock to flash, see ol305_usage.h; needs ol305_usage_set_dir()
+uint32_t ol305_sync_usage(ol305_handle_t lock);
+//records stored by the usage syncs, oldest first: up to *count from first, *count is set to the records read
+esp_err_t ol305_read_usage(ol305_handle_t lock, uint32_t first, ol305_usage_rec_t *records, uint32_t *count);
+//removes the count oldest records once they are read out, the syncs have room again;
+//ESP_ERR_INVALID_STATE while a usage sync of the lock runs, ESP_ERR_NOT_FOUND when nothing is stored
+esp_err_t ol305_drop_usage(ol305_handle_t lock, uint32_t count);
+//cards the lock should accept, applied by the next SYNC_RFID request: only the difference with the
+//local index of the lock is sent, the index is read again with GET_RFID when its card count is off
+esp_err_t ol305_set_cards(ol305_handle_t lock, const uint8_t (*cards)[8], uint16_t count);
+uint32_t ol305_sync_cards(ol305_handle_t lock);
+//copy of the local index, sorted; returns the number of cards on the lock, it may exceed max
+uint16_t ol305_get_cards(ol305_handle_t lock, uint8_t (*cards)[8], uint16_t max);
+//the status is queried again once it is older than ttl_ms, LOCK/UNLOCK notifications refresh it
+void ol305_set_status_ttl(ol305_handle_t lock, uint32_t ttl_ms);
+//cached status, ESP_ERR_NOT_FOUND when the lock never reported it
+esp_err_t ol305_get_status(ol305_handle_t lock, ol305_status_t *status);
+bool is_ol305_connected(ol305_handle_t lock);
+//consistent copy of the counters, never blocks ol305_task
+void ol305_get_stats(ol305_handle_t lock, ol305_stats_t *stats);
+const char *ol305_stat_name(ol305_stat_t stat);
+void ol305_set_ble_mode(ol305_handle_t lock, OL305_BLE_MODE mode);
+void ol305_control(ol305_handle_t lock, OL305_STATE state, uint8_t wait, uint32_t timeout_ms);
+void ol305_disconnect(ol305_handle_t lock);
+void set_ol305_ble_password(ol305_handle_t lock, const char *password);
+
+#ifdef OL305_HOST_HOOKS
+//host fuzzing and benchmarks only: run the receive path without ol305_task
+void ol305_host_reset(ol305_handle_t lock);
+void ol305_host_process_rx(ol305_handle_t lock);
+#endif
+
+#ifdef OL305_TEST_HOOKS
+//unit tests (test/) only: the frame builders and the state machine of ol305_task
+typedef enum
+{
+    OL305_TEST_ENC_KEY,             //password
+    OL305_TEST_ENC_UNLOCK,          //arg[0] control cmd, user_id, timestamp, arg[1] unlock status
+    OL305_TEST_ENC_QUERY,
+    OL305_TEST_ENC_READ_RFID,
+    OL305_TEST_ENC_REGISTER_CARD,   //data: the card, 8 bytes
+    OL305_TEST_ENC_GET_RFID,        //arg[0] index
+    OL305_TEST_ENC_DELETE_RFID,     //data, len
+    OL305_TEST_ENC_SETTINGS,        //arg[0..2] bluetooth, button, RFID unlock
+    OL305_TEST_ENC_USAGE,           //arg[0] OBTAIN_LAST_USAGE or DELETE_LAST_USAGE
+    OL305_TEST_ENC_RESPONSE,        //arg[0] UNLOCK or LOCK
+    OL305_TEST_ENC_MAX
+} ol305_test_encoder_t;
+
+typedef struct
+{
+    ol305_test_encoder_t encoder;
+    uint8_t key;            //session key of the lock when the frame is built
+    const char *password;
+    int64_t user_id;
+    int64_t timestamp;
+    uint8_t arg[3];
+    const uint8_t *data;
+    uint16_t len;
+} ol305_test_msg_t;
+
+//called by ol305_task on every state change, state is one of ol305_test_state_name()
+typedef void (*ol305_test_state_cb_t)(ol305_handle_t lock, uint8_t state, void *ctx);
+
+//the frame the ol305_encode_* function builds, sealed as ol305_send_message does with rand;
+//returns its length, 0 when the function refused the arguments
+uint16_t ol305_test_encode(ol305_handle_t lock, const ol305_test_msg_t *msg, uint8_t rand, uint8_t *frame);
+void ol305_test_set_state_cb(ol305_test_state_cb_t cb, void *ctx);
+const char *ol305_test_state_name(uint8_t state);
+#endif
 
 #endif
\ No newline at end of file
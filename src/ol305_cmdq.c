@@ -0,0 +1,131 @@
+#include <string.h>
+#include "ol305_cmdq.h"
+
+static void cmdq_remove_at(ol305_cmdq_t *queue, uint8_t index, ol305_cmd_t *cmd)
+{
+    if (NULL != cmd)
+        *cmd = queue->entries[index];
+    memmove(&queue->entries[index], &queue->entries[index + 1], (queue->count - index - 1) * sizeof(ol305_cmd_t));
+    queue->count--;
+}
+
+static bool cmdq_same_request(const ol305_cmd_t *a, const ol305_cmd_t *b)
+{
+    return a->type == b->type && a->data_len == b->data_len && 0 == memcmp(a->data, b->data, a->data_len);
+}
+
+static uint32_t cmdq_new_id(ol305_cmdq_t *queue)
+{
+    if (0 == ++queue->next_id)
+        queue->next_id = 1;
+    return queue->next_id;
+}
+
+// Sorted insert, the caller makes sure there is room
+static void cmdq_insert(ol305_cmdq_t *queue, const ol305_cmd_t *cmd)
+{
+    uint8_t pos = queue->count;
+    while (0 < pos && queue->entries[pos - 1].priority > cmd->priority)
+        pos--;
+
+    memmove(&queue->entries[pos + 1], &queue->entries[pos], (queue->count - pos) * sizeof(ol305_cmd_t));
+    queue->entries[pos] = *cmd;
+    queue->count++;
+}
+
+void ol305_cmdq_init(ol305_cmdq_t *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+// Queues a copy of cmd and returns its request id.
+// An idempotent command equal to a pending one is merged into it and gets the pending id, the merged entry keeps
+// the most urgent priority and the latest deadline.
+// When the queue is full the least urgent entry is dropped into *dropped if it is less urgent than cmd,
+// otherwise 0 is returned. dropped->id is 0 when nothing was dropped.
+uint32_t ol305_cmdq_push(ol305_cmdq_t *queue, const ol305_cmd_t *cmd, ol305_cmd_t *dropped)
+{
+    if (NULL != dropped)
+        dropped->id = 0;
+
+    if (cmd->data_len > OL305_CMD_DATA_LEN)
+        return 0;
+
+    if (cmd->idempotent)
+    {
+        for (uint8_t i = 0; i < queue->count; i++)
+        {
+            ol305_cmd_t *pending = &queue->entries[i];
+            if (!pending->idempotent || !cmdq_same_request(pending, cmd))
+                continue;
+
+            uint32_t id = pending->id;
+            if (0 != pending->deadline && (0 == cmd->deadline || cmd->deadline > pending->deadline))
+                pending->deadline = cmd->deadline;
+            if (cmd->priority < pending->priority)
+            {
+                //move it up to its new place
+                ol305_cmd_t merged;
+                cmdq_remove_at(queue, i, &merged);
+                merged.priority = cmd->priority;
+                cmdq_insert(queue, &merged);
+            }
+            return id;
+        }
+    }
+
+    if (OL305_CMDQ_LEN <= queue->count)
+    {
+        ol305_cmd_t *last = &queue->entries[queue->count - 1];
+        if (last->priority <= cmd->priority)
+            return 0;
+        cmdq_remove_at(queue, queue->count - 1, dropped);
+    }
+
+    ol305_cmd_t entry = *cmd;
+    entry.id = cmdq_new_id(queue);
+    cmdq_insert(queue, &entry);
+    return entry.id;
+}
+
+// Takes the most urgent command
+bool ol305_cmdq_pop(ol305_cmdq_t *queue, ol305_cmd_t *cmd)
+{
+    if (0 == queue->count)
+        return false;
+    cmdq_remove_at(queue, 0, cmd);
+    return true;
+}
+
+// Takes the most urgent command accepted by filter, the others keep their place
+bool ol305_cmdq_pop_first(ol305_cmdq_t *queue, ol305_cmdq_filter_t filter, void *ctx, ol305_cmd_t *cmd)
+{
+    for (uint8_t i = 0; i < queue->count; i++)
+    {
+        if (filter(&queue->entries[i], ctx))
+        {
+            cmdq_remove_at(queue, i, cmd);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes one command whose deadline is over, call it until it returns false
+bool ol305_cmdq_pop_expired(ol305_cmdq_t *queue, int64_t now, ol305_cmd_t *cmd)
+{
+    for (uint8_t i = 0; i < queue->count; i++)
+    {
+        if (0 != queue->entries[i].deadline && now >= queue->entries[i].deadline)
+        {
+            cmdq_remove_at(queue, i, cmd);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t ol305_cmdq_count(const ol305_cmdq_t *queue)
+{
+    return queue->count;
+}
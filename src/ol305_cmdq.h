@@ -0,0 +1,40 @@
+#ifndef __OL305_CMDQ_H__
+#define __OL305_CMDQ_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OL305_CMDQ_LEN 8
+#define OL305_CMD_DATA_LEN 8
+
+typedef struct
+{
+    uint32_t id;            //request id, 0 -> invalid
+    uint8_t type;           //command type, defined by the user of the queue
+    uint8_t priority;       //0 is the most urgent
+    bool idempotent;        //a pending command with the same type and data absorbs the new one
+    int64_t created;        //us on the esp_timer clock
+    int64_t deadline;       //us on the esp_timer clock, 0 -> no deadline
+    uint8_t data_len;
+    uint8_t data[OL305_CMD_DATA_LEN];
+} ol305_cmd_t;
+
+//entries are kept sorted by priority, in arrival order for the same priority
+typedef struct
+{
+    ol305_cmd_t entries[OL305_CMDQ_LEN];
+    uint8_t count;
+    uint32_t next_id;
+} ol305_cmdq_t;
+
+//returns true when the command may be taken now
+typedef bool (*ol305_cmdq_filter_t)(const ol305_cmd_t *cmd, void *ctx);
+
+void ol305_cmdq_init(ol305_cmdq_t *queue);
+uint32_t ol305_cmdq_push(ol305_cmdq_t *queue, const ol305_cmd_t *cmd, ol305_cmd_t *dropped);
+bool ol305_cmdq_pop(ol305_cmdq_t *queue, ol305_cmd_t *cmd);
+bool ol305_cmdq_pop_first(ol305_cmdq_t *queue, ol305_cmdq_filter_t filter, void *ctx, ol305_cmd_t *cmd);
+bool ol305_cmdq_pop_expired(ol305_cmdq_t *queue, int64_t now, ol305_cmd_t *cmd);
+uint8_t ol305_cmdq_count(const ol305_cmdq_t *queue);
+
+#endif
@@ -0,0 +1,251 @@
+#include <string.h>
+#include "ol305_codec.h"
+
+#if OL305_CODEC_IMPL == OL305_CODEC_SLICE4
+#define OL305_CRC_TABLES 4
+#else
+#define OL305_CRC_TABLES 1
+#endif
+
+//Dallas/Maxim CRC8 (reflected 0x31, init 0), table k is the byte followed by k zero bytes
+static const uint8_t crc8_table[OL305_CRC_TABLES][256] =
+{
+    {
+        0x00, 0x5e, 0xbc, 0xe2, 0x61, 0x3f, 0xdd, 0x83, 0xc2, 0x9c, 0x7e, 0x20, 0xa3, 0xfd, 0x1f, 0x41,
+        0x9d, 0xc3, 0x21, 0x7f, 0xfc, 0xa2, 0x40, 0x1e, 0x5f, 0x01, 0xe3, 0xbd, 0x3e, 0x60, 0x82, 0xdc,
+        0x23, 0x7d, 0x9f, 0xc1, 0x42, 0x1c, 0xfe, 0xa0, 0xe1, 0xbf, 0x5d, 0x03, 0x80, 0xde, 0x3c, 0x62,
+        0xbe, 0xe0, 0x02, 0x5c, 0xdf, 0x81, 0x63, 0x3d, 0x7c, 0x22, 0xc0, 0x9e, 0x1d, 0x43, 0xa1, 0xff,
+        0x46, 0x18, 0xfa, 0xa4, 0x27, 0x79, 0x9b, 0xc5, 0x84, 0xda, 0x38, 0x66, 0xe5, 0xbb, 0x59, 0x07,
+        0xdb, 0x85, 0x67, 0x39, 0xba, 0xe4, 0x06, 0x58, 0x19, 0x47, 0xa5, 0xfb, 0x78, 0x26, 0xc4, 0x9a,
+        0x65, 0x3b, 0xd9, 0x87, 0x04, 0x5a, 0xb8, 0xe6, 0xa7, 0xf9, 0x1b, 0x45, 0xc6, 0x98, 0x7a, 0x24,
+        0xf8, 0xa6, 0x44, 0x1a, 0x99, 0xc7, 0x25, 0x7b, 0x3a, 0x64, 0x86, 0xd8, 0x5b, 0x05, 0xe7, 0xb9,
+        0x8c, 0xd2, 0x30, 0x6e, 0xed, 0xb3, 0x51, 0x0f, 0x4e, 0x10, 0xf2, 0xac, 0x2f, 0x71, 0x93, 0xcd,
+        0x11, 0x4f, 0xad, 0xf3, 0x70, 0x2e, 0xcc, 0x92, 0xd3, 0x8d, 0x6f, 0x31, 0xb2, 0xec, 0x0e, 0x50,
+        0xaf, 0xf1, 0x13, 0x4d, 0xce, 0x90, 0x72, 0x2c, 0x6d, 0x33, 0xd1, 0x8f, 0x0c, 0x52, 0xb0, 0xee,
+        0x32, 0x6c, 0x8e, 0xd0, 0x53, 0x0d, 0xef, 0xb1, 0xf0, 0xae, 0x4c, 0x12, 0x91, 0xcf, 0x2d, 0x73,
+        0xca, 0x94, 0x76, 0x28, 0xab, 0xf5, 0x17, 0x49, 0x08, 0x56, 0xb4, 0xea, 0x69, 0x37, 0xd5, 0x8b,
+        0x57, 0x09, 0xeb, 0xb5, 0x36, 0x68, 0x8a, 0xd4, 0x95, 0xcb, 0x29, 0x77, 0xf4, 0xaa, 0x48, 0x16,
+        0xe9, 0xb7, 0x55, 0x0b, 0x88, 0xd6, 0x34, 0x6a, 0x2b, 0x75, 0x97, 0xc9, 0x4a, 0x14, 0xf6, 0xa8,
+        0x74, 0x2a, 0xc8, 0x96, 0x15, 0x4b, 0xa9, 0xf7, 0xb6, 0xe8, 0x0a, 0x54, 0xd7, 0x89, 0x6b, 0x35,
+    },
+#if OL305_CODEC_IMPL == OL305_CODEC_SLICE4
+    {
+        0x00, 0xc4, 0x91, 0x55, 0x3b, 0xff, 0xaa, 0x6e, 0x76, 0xb2, 0xe7, 0x23, 0x4d, 0x89, 0xdc, 0x18,
+        0xec, 0x28, 0x7d, 0xb9, 0xd7, 0x13, 0x46, 0x82, 0x9a, 0x5e, 0x0b, 0xcf, 0xa1, 0x65, 0x30, 0xf4,
+        0xc1, 0x05, 0x50, 0x94, 0xfa, 0x3e, 0x6b, 0xaf, 0xb7, 0x73, 0x26, 0xe2, 0x8c, 0x48, 0x1d, 0xd9,
+        0x2d, 0xe9, 0xbc, 0x78, 0x16, 0xd2, 0x87, 0x43, 0x5b, 0x9f, 0xca, 0x0e, 0x60, 0xa4, 0xf1, 0x35,
+        0x9b, 0x5f, 0x0a, 0xce, 0xa0, 0x64, 0x31, 0xf5, 0xed, 0x29, 0x7c, 0xb8, 0xd6, 0x12, 0x47, 0x83,
+        0x77, 0xb3, 0xe6, 0x22, 0x4c, 0x88, 0xdd, 0x19, 0x01, 0xc5, 0x90, 0x54, 0x3a, 0xfe, 0xab, 0x6f,
+        0x5a, 0x9e, 0xcb, 0x0f, 0x61, 0xa5, 0xf0, 0x34, 0x2c, 0xe8, 0xbd, 0x79, 0x17, 0xd3, 0x86, 0x42,
+        0xb6, 0x72, 0x27, 0xe3, 0x8d, 0x49, 0x1c, 0xd8, 0xc0, 0x04, 0x51, 0x95, 0xfb, 0x3f, 0x6a, 0xae,
+        0x2f, 0xeb, 0xbe, 0x7a, 0x14, 0xd0, 0x85, 0x41, 0x59, 0x9d, 0xc8, 0x0c, 0x62, 0xa6, 0xf3, 0x37,
+        0xc3, 0x07, 0x52, 0x96, 0xf8, 0x3c, 0x69, 0xad, 0xb5, 0x71, 0x24, 0xe0, 0x8e, 0x4a, 0x1f, 0xdb,
+        0xee, 0x2a, 0x7f, 0xbb, 0xd5, 0x11, 0x44, 0x80, 0x98, 0x5c, 0x09, 0xcd, 0xa3, 0x67, 0x32, 0xf6,
+        0x02, 0xc6, 0x93, 0x57, 0x39, 0xfd, 0xa8, 0x6c, 0x74, 0xb0, 0xe5, 0x21, 0x4f, 0x8b, 0xde, 0x1a,
+        0xb4, 0x70, 0x25, 0xe1, 0x8f, 0x4b, 0x1e, 0xda, 0xc2, 0x06, 0x53, 0x97, 0xf9, 0x3d, 0x68, 0xac,
+        0x58, 0x9c, 0xc9, 0x0d, 0x63, 0xa7, 0xf2, 0x36, 0x2e, 0xea, 0xbf, 0x7b, 0x15, 0xd1, 0x84, 0x40,
+        0x75, 0xb1, 0xe4, 0x20, 0x4e, 0x8a, 0xdf, 0x1b, 0x03, 0xc7, 0x92, 0x56, 0x38, 0xfc, 0xa9, 0x6d,
+        0x99, 0x5d, 0x08, 0xcc, 0xa2, 0x66, 0x33, 0xf7, 0xef, 0x2b, 0x7e, 0xba, 0xd4, 0x10, 0x45, 0x81,
+    },
+    {
+        0x00, 0xab, 0x4f, 0xe4, 0x9e, 0x35, 0xd1, 0x7a, 0x25, 0x8e, 0x6a, 0xc1, 0xbb, 0x10, 0xf4, 0x5f,
+        0x4a, 0xe1, 0x05, 0xae, 0xd4, 0x7f, 0x9b, 0x30, 0x6f, 0xc4, 0x20, 0x8b, 0xf1, 0x5a, 0xbe, 0x15,
+        0x94, 0x3f, 0xdb, 0x70, 0x0a, 0xa1, 0x45, 0xee, 0xb1, 0x1a, 0xfe, 0x55, 0x2f, 0x84, 0x60, 0xcb,
+        0xde, 0x75, 0x91, 0x3a, 0x40, 0xeb, 0x0f, 0xa4, 0xfb, 0x50, 0xb4, 0x1f, 0x65, 0xce, 0x2a, 0x81,
+        0x31, 0x9a, 0x7e, 0xd5, 0xaf, 0x04, 0xe0, 0x4b, 0x14, 0xbf, 0x5b, 0xf0, 0x8a, 0x21, 0xc5, 0x6e,
+        0x7b, 0xd0, 0x34, 0x9f, 0xe5, 0x4e, 0xaa, 0x01, 0x5e, 0xf5, 0x11, 0xba, 0xc0, 0x6b, 0x8f, 0x24,
+        0xa5, 0x0e, 0xea, 0x41, 0x3b, 0x90, 0x74, 0xdf, 0x80, 0x2b, 0xcf, 0x64, 0x1e, 0xb5, 0x51, 0xfa,
+        0xef, 0x44, 0xa0, 0x0b, 0x71, 0xda, 0x3e, 0x95, 0xca, 0x61, 0x85, 0x2e, 0x54, 0xff, 0x1b, 0xb0,
+        0x62, 0xc9, 0x2d, 0x86, 0xfc, 0x57, 0xb3, 0x18, 0x47, 0xec, 0x08, 0xa3, 0xd9, 0x72, 0x96, 0x3d,
+        0x28, 0x83, 0x67, 0xcc, 0xb6, 0x1d, 0xf9, 0x52, 0x0d, 0xa6, 0x42, 0xe9, 0x93, 0x38, 0xdc, 0x77,
+        0xf6, 0x5d, 0xb9, 0x12, 0x68, 0xc3, 0x27, 0x8c, 0xd3, 0x78, 0x9c, 0x37, 0x4d, 0xe6, 0x02, 0xa9,
+        0xbc, 0x17, 0xf3, 0x58, 0x22, 0x89, 0x6d, 0xc6, 0x99, 0x32, 0xd6, 0x7d, 0x07, 0xac, 0x48, 0xe3,
+        0x53, 0xf8, 0x1c, 0xb7, 0xcd, 0x66, 0x82, 0x29, 0x76, 0xdd, 0x39, 0x92, 0xe8, 0x43, 0xa7, 0x0c,
+        0x19, 0xb2, 0x56, 0xfd, 0x87, 0x2c, 0xc8, 0x63, 0x3c, 0x97, 0x73, 0xd8, 0xa2, 0x09, 0xed, 0x46,
+        0xc7, 0x6c, 0x88, 0x23, 0x59, 0xf2, 0x16, 0xbd, 0xe2, 0x49, 0xad, 0x06, 0x7c, 0xd7, 0x33, 0x98,
+        0x8d, 0x26, 0xc2, 0x69, 0x13, 0xb8, 0x5c, 0xf7, 0xa8, 0x03, 0xe7, 0x4c, 0x36, 0x9d, 0x79, 0xd2,
+    },
+    {
+        0x00, 0x8f, 0x07, 0x88, 0x0e, 0x81, 0x09, 0x86, 0x1c, 0x93, 0x1b, 0x94, 0x12, 0x9d, 0x15, 0x9a,
+        0x38, 0xb7, 0x3f, 0xb0, 0x36, 0xb9, 0x31, 0xbe, 0x24, 0xab, 0x23, 0xac, 0x2a, 0xa5, 0x2d, 0xa2,
+        0x70, 0xff, 0x77, 0xf8, 0x7e, 0xf1, 0x79, 0xf6, 0x6c, 0xe3, 0x6b, 0xe4, 0x62, 0xed, 0x65, 0xea,
+        0x48, 0xc7, 0x4f, 0xc0, 0x46, 0xc9, 0x41, 0xce, 0x54, 0xdb, 0x53, 0xdc, 0x5a, 0xd5, 0x5d, 0xd2,
+        0xe0, 0x6f, 0xe7, 0x68, 0xee, 0x61, 0xe9, 0x66, 0xfc, 0x73, 0xfb, 0x74, 0xf2, 0x7d, 0xf5, 0x7a,
+        0xd8, 0x57, 0xdf, 0x50, 0xd6, 0x59, 0xd1, 0x5e, 0xc4, 0x4b, 0xc3, 0x4c, 0xca, 0x45, 0xcd, 0x42,
+        0x90, 0x1f, 0x97, 0x18, 0x9e, 0x11, 0x99, 0x16, 0x8c, 0x03, 0x8b, 0x04, 0x82, 0x0d, 0x85, 0x0a,
+        0xa8, 0x27, 0xaf, 0x20, 0xa6, 0x29, 0xa1, 0x2e, 0xb4, 0x3b, 0xb3, 0x3c, 0xba, 0x35, 0xbd, 0x32,
+        0xd9, 0x56, 0xde, 0x51, 0xd7, 0x58, 0xd0, 0x5f, 0xc5, 0x4a, 0xc2, 0x4d, 0xcb, 0x44, 0xcc, 0x43,
+        0xe1, 0x6e, 0xe6, 0x69, 0xef, 0x60, 0xe8, 0x67, 0xfd, 0x72, 0xfa, 0x75, 0xf3, 0x7c, 0xf4, 0x7b,
+        0xa9, 0x26, 0xae, 0x21, 0xa7, 0x28, 0xa0, 0x2f, 0xb5, 0x3a, 0xb2, 0x3d, 0xbb, 0x34, 0xbc, 0x33,
+        0x91, 0x1e, 0x96, 0x19, 0x9f, 0x10, 0x98, 0x17, 0x8d, 0x02, 0x8a, 0x05, 0x83, 0x0c, 0x84, 0x0b,
+        0x39, 0xb6, 0x3e, 0xb1, 0x37, 0xb8, 0x30, 0xbf, 0x25, 0xaa, 0x22, 0xad, 0x2b, 0xa4, 0x2c, 0xa3,
+        0x01, 0x8e, 0x06, 0x89, 0x0f, 0x80, 0x08, 0x87, 0x1d, 0x92, 0x1a, 0x95, 0x13, 0x9c, 0x14, 0x9b,
+        0x49, 0xc6, 0x4e, 0xc1, 0x47, 0xc8, 0x40, 0xcf, 0x55, 0xda, 0x52, 0xdd, 0x5b, 0xd4, 0x5c, 0xd3,
+        0x71, 0xfe, 0x76, 0xf9, 0x7f, 0xf0, 0x78, 0xf7, 0x6d, 0xe2, 0x6a, 0xe5, 0x63, 0xec, 0x64, 0xeb,
+    },
+#endif
+};
+
+static inline uint8_t crc8_byte(uint8_t crc, uint8_t byte)
+{
+    return crc8_table[0][crc ^ byte];
+}
+
+#if OL305_CODEC_IMPL == OL305_CODEC_SLICE4
+
+// The CRC has no final XOR, so the 4 bytes can be folded independently
+static inline uint8_t crc8_word(uint8_t crc, const uint8_t *p)
+{
+    return crc8_table[3][crc ^ p[0]] ^ crc8_table[2][p[1]] ^ crc8_table[1][p[2]] ^ crc8_table[0][p[3]];
+}
+
+static uint8_t crc8_update(uint8_t crc, const uint8_t *p, uint16_t len)
+{
+    for (; 4 <= len; p += 4, len -= 4)
+        crc = crc8_word(crc, p);
+    while (len--)
+        crc = crc8_byte(crc, *p++);
+    return crc;
+}
+
+// Encode: dst = src ^ rand, the CRC runs over dst
+static uint8_t crc8_scramble(uint8_t crc, uint8_t *dst, const uint8_t *src, uint16_t len, uint8_t rand)
+{
+    const uint32_t mask = 0x01010101u * rand;
+    uint16_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, &src[i], sizeof(word));
+        word ^= mask;
+        memcpy(&dst[i], &word, sizeof(word));
+        crc = crc8_word(crc, &dst[i]);
+    }
+    for (; i < len; i++)
+    {
+        dst[i] = src[i] ^ rand;
+        crc = crc8_byte(crc, dst[i]);
+    }
+    return crc;
+}
+
+// Decode: dst = src ^ rand, the CRC runs over src
+static uint8_t crc8_unscramble(uint8_t crc, uint8_t *dst, const uint8_t *src, uint16_t len, uint8_t rand)
+{
+    const uint32_t mask = 0x01010101u * rand;
+    uint16_t i = 0;
+    for (; i + 4 <= len; i += 4)
+    {
+        uint32_t word;
+        crc = crc8_word(crc, &src[i]);
+        memcpy(&word, &src[i], sizeof(word));
+        word ^= mask;
+        memcpy(&dst[i], &word, sizeof(word));
+    }
+    for (; i < len; i++)
+    {
+        crc = crc8_byte(crc, src[i]);
+        dst[i] = src[i] ^ rand;
+    }
+    return crc;
+}
+
+#else
+
+static uint8_t crc8_update(uint8_t crc, const uint8_t *p, uint16_t len)
+{
+    while (len--)
+        crc = crc8_byte(crc, *p++);
+    return crc;
+}
+
+static uint8_t crc8_scramble(uint8_t crc, uint8_t *dst, const uint8_t *src, uint16_t len, uint8_t rand)
+{
+    for (uint16_t i = 0; i < len; i++)
+    {
+        dst[i] = src[i] ^ rand;
+        crc = crc8_byte(crc, dst[i]);
+    }
+    return crc;
+}
+
+static uint8_t crc8_unscramble(uint8_t crc, uint8_t *dst, const uint8_t *src, uint16_t len, uint8_t rand)
+{
+    for (uint16_t i = 0; i < len; i++)
+    {
+        crc = crc8_byte(crc, src[i]);
+        dst[i] = src[i] ^ rand;
+    }
+    return crc;
+}
+
+#endif
+
+uint8_t ol305_crc8(const uint8_t *data, uint16_t len)
+{
+    return crc8_update(0, data, len);
+}
+
+static uint16_t codec_frame(uint8_t *frame, uint8_t rand, uint8_t key, uint8_t cmd, const uint8_t *data, uint8_t len)
+{
+    frame[0] = OL305_FRAME_STX_HI;
+    frame[1] = OL305_FRAME_STX_LO;
+    frame[2] = len;
+    frame[3] = 0x32 + rand;
+    frame[4] = key ^ rand;
+    frame[5] = cmd ^ rand;
+    uint8_t crc = crc8_update(0, frame, OL305_FRAME_HEADER_LEN);
+    //the scrambled bytes are summed as they are written
+    crc = crc8_scramble(crc, &frame[OL305_FRAME_HEADER_LEN], data, len, rand);
+    frame[OL305_FRAME_HEADER_LEN + len] = crc;
+    return OL305_FRAME_HEADER_LEN + len + 1;
+}
+
+uint16_t ol305_codec_encode(uint8_t *frame, uint16_t size, uint8_t rand, uint8_t key, uint8_t cmd, const uint8_t *data, uint8_t len)
+{
+    if (OL305_FRAME_MAX_DATA < len || OL305_FRAME_HEADER_LEN + len + 1 > size)
+        return 0;
+    return codec_frame(frame, rand, key, cmd, data, len);
+}
+
+// Scrambles the payload in place, the frame holds OL305_FRAME_MAX_LEN bytes
+uint16_t ol305_codec_seal(uint8_t *frame, uint8_t rand, uint8_t key, uint8_t cmd, uint8_t len)
+{
+    if (OL305_FRAME_MAX_DATA < len)
+        return 0;
+    return codec_frame(frame, rand, key, cmd, &frame[OL305_FRAME_HEADER_LEN], len);
+}
+
+esp_err_t ol305_codec_decode(const uint8_t *frame, uint16_t len, ol305_frame_t *out)
+{
+    if (OL305_FRAME_HEADER_LEN + 1 >= len)
+        return ESP_ERR_INVALID_SIZE;
+    if (OL305_FRAME_STX_HI != frame[0] || OL305_FRAME_STX_LO != frame[1])
+        return ESP_ERR_INVALID_ARG;
+
+    uint8_t data_len = frame[2];
+    if (OL305_FRAME_MAX_DATA < data_len || OL305_FRAME_HEADER_LEN + data_len + 1 > len)
+        return ESP_ERR_INVALID_SIZE;
+
+    uint8_t rand = frame[3] - 0x32;
+    uint8_t crc = crc8_update(0, frame, OL305_FRAME_HEADER_LEN);
+    //the received bytes are summed as they are unscrambled
+    crc = crc8_unscramble(crc, out->data, &frame[OL305_FRAME_HEADER_LEN], data_len, rand);
+    if (crc != frame[OL305_FRAME_HEADER_LEN + data_len])
+        return ESP_ERR_INVALID_CRC;
+
+    out->rand = rand;
+    out->key = frame[4] ^ rand;
+    out->cmd = frame[5] ^ rand;
+    out->len = data_len;
+    return ESP_OK;
+}
+
+const char *ol305_codec_name()
+{
+#if OL305_CODEC_IMPL == OL305_CODEC_SLICE4
+    return "slice4";
+#else
+    return "bytewise";
+#endif
+}
@@ -0,0 +1,41 @@
+#ifndef __OL305_CODEC_H__
+#define __OL305_CODEC_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+
+//A3 A4 | len | rand+0x32 | key^rand | cmd^rand | data^rand ... | crc8 of everything before it
+#define OL305_FRAME_STX_HI 0xa3
+#define OL305_FRAME_STX_LO 0xa4
+#define OL305_FRAME_HEADER_LEN 6
+#define OL305_FRAME_MAX_DATA 16
+#define OL305_FRAME_MAX_LEN (OL305_FRAME_HEADER_LEN + OL305_FRAME_MAX_DATA + 1)
+
+//kernel used by ol305_codec_encode/decode, chosen at build time
+#define OL305_CODEC_BYTEWISE 0  //one table lookup per byte, 256 B of tables
+#define OL305_CODEC_SLICE4 1    //XOR a word at a time, CRC over 4 bytes per step, 1 KB of tables
+
+#ifndef OL305_CODEC_IMPL
+#define OL305_CODEC_IMPL OL305_CODEC_SLICE4
+#endif
+
+typedef struct
+{
+    uint8_t rand;
+    uint8_t key;
+    uint8_t cmd;
+    uint8_t len;
+    uint8_t data[OL305_FRAME_MAX_DATA];
+} ol305_frame_t;
+
+uint8_t ol305_crc8(const uint8_t *data, uint16_t len);
+//builds the frame in one pass, returns its length or 0 when it does not fit in size
+uint16_t ol305_codec_encode(uint8_t *frame, uint16_t size, uint8_t rand, uint8_t key, uint8_t cmd, const uint8_t *data, uint8_t len);
+//same as ol305_codec_encode for a frame whose len payload bytes are already at frame + OL305_FRAME_HEADER_LEN
+uint16_t ol305_codec_seal(uint8_t *frame, uint8_t rand, uint8_t key, uint8_t cmd, uint8_t len);
+//checks and unscrambles the frame in one pass
+//ESP_ERR_INVALID_SIZE -> truncated or too long; ESP_ERR_INVALID_ARG -> bad STX; ESP_ERR_INVALID_CRC -> bad CRC
+esp_err_t ol305_codec_decode(const uint8_t *frame, uint16_t len, ol305_frame_t *out);
+const char *ol305_codec_name();
+
+#endif
@@ -0,0 +1,470 @@
+#include <string.h>
+#include <inttypes.h>
+#include "ol305_console.h"
+#include "ol305.h"
+#include "ol305_latency.h"
+#include "ol305_trace.h"
+#include "ol305_evlog.h"
+#include "ol305_fleet.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+const static char *TAG = "OL305_CONSOLE";
+
+#define CON_READ_CHUNK 64
+#define CON_STREAM_POLL_MS 50
+#define CON_ARGS_CARDS 0xffff //a multiple of 8 bytes, at least one card
+
+//how each console command is checked and run
+typedef struct
+{
+    bool known;
+    bool needs_lock;
+    OL305_REQUEST request; //OL305_REQ_MAX -> answered by the console
+    uint16_t args; //argument bytes
+} con_cmd_policy_t;
+
+static const con_cmd_policy_t con_cmd_policy[] =
+{
+    [OL305_CON_UNLOCK] = {.known = true, .needs_lock = true, .request = OL305_REQ_UNLOCK, .args = 0},
+    [OL305_CON_QUERY] = {.known = true, .needs_lock = true, .request = OL305_REQ_QUERY, .args = 0},
+    [OL305_CON_READ_RFID] = {.known = true, .needs_lock = true, .request = OL305_REQ_READ_RFID, .args = 0},
+    [OL305_CON_DELETE_RFID] = {.known = true, .needs_lock = true, .request = OL305_REQ_DELETE_RFID, .args = 8},
+    [OL305_CON_SETTINGS] = {.known = true, .needs_lock = true, .request = OL305_REQ_SETTINGS, .args = 3},
+    [OL305_CON_SYNC_USAGE] = {.known = true, .needs_lock = true, .request = OL305_REQ_SYNC_USAGE, .args = 0},
+    [OL305_CON_SYNC_CARDS] = {.known = true, .needs_lock = true, .request = OL305_REQ_SYNC_RFID, .args = CON_ARGS_CARDS},
+    [OL305_CON_INFO] = {.known = true, .needs_lock = false, .request = OL305_REQ_MAX, .args = 0},
+    [OL305_CON_STATUS] = {.known = true, .needs_lock = true, .request = OL305_REQ_MAX, .args = 0},
+    [OL305_CON_STATS] = {.known = true, .needs_lock = true, .request = OL305_REQ_MAX, .args = 0},
+    [OL305_CON_LATENCY] = {.known = true, .needs_lock = false, .request = OL305_REQ_MAX, .args = 1},
+    [OL305_CON_CONTROL] = {.known = true, .needs_lock = true, .request = OL305_REQ_MAX, .args = 1},
+    [OL305_CON_DISCONNECT] = {.known = true, .needs_lock = true, .request = OL305_REQ_MAX, .args = 0},
+    [OL305_CON_TRACE] = {.known = true, .needs_lock = false, .request = OL305_REQ_MAX, .args = 1},
+    [OL305_CON_LOG_LEVEL] = {.known = true, .needs_lock = false, .request = OL305_REQ_MAX, .args = 1},
+    [OL305_CON_FLEET] = {.known = true, .needs_lock = true, .request = OL305_REQ_MAX, .args = 0},
+    [OL305_CON_USAGE_READ] = {.known = true, .needs_lock = true, .request = OL305_REQ_MAX, .args = 4},
+    [OL305_CON_USAGE_DROP] = {.known = true, .needs_lock = true, .request = OL305_REQ_MAX, .args = 4},
+};
+
+static const ol305_console_io_t *con_io = NULL;
+static ol305_con_parser_t con_parser; //reader task only
+static TaskHandle_t con_writer = NULL;
+
+//responses from the reader task and from the ol305_task of every lock, taken by the writer task
+static ol305_con_response_t con_tx[OL305_CON_TX_SLOTS];
+static uint8_t con_tx_head = 0;
+static uint8_t con_tx_count = 0;
+static uint32_t con_tx_dropped = 0;
+static bool con_streaming = false;
+static portMUX_TYPE con_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Any task, it never blocks: ol305_task calls it from the done callbacks
+static void con_send(const ol305_con_response_t *response)
+{
+    bool queued = false;
+    portENTER_CRITICAL(&con_mux);
+    if (OL305_CON_TX_SLOTS > con_tx_count)
+    {
+        con_tx[(con_tx_head + con_tx_count) % OL305_CON_TX_SLOTS] = *response;
+        con_tx_count++;
+        queued = true;
+    }
+    else
+        con_tx_dropped++;
+    portEXIT_CRITICAL(&con_mux);
+    if (queued && NULL != con_writer)
+        xTaskNotify(con_writer, 1, eSetBits);
+}
+
+// seq, lock and cmd of the request ride in the ctx of ol305_request_t
+static inline void *con_ctx(const ol305_con_response_t *response)
+{
+    return (void *)(uintptr_t)(((uint32_t)response->seq << 16) | (response->lock << 8) | response->cmd);
+}
+
+static void con_request_done(ol305_handle_t lock, const ol305_result_t *result, void *ctx)
+{
+    uint32_t packed = (uint32_t)(uintptr_t)ctx;
+    ol305_con_response_t response =
+    {
+        .seq = packed >> 16,
+        .lock = (packed >> 8) & 0xff,
+        .cmd = packed & 0xff,
+        .kind = OL305_CON_RESULT,
+        .err = result->err,
+        .latency_us = (0 > result->latency_us || UINT32_MAX < result->latency_us) ? UINT32_MAX : result->latency_us,
+    };
+
+    uint8_t *p = response.payload;
+    switch (result->request)
+    {
+        case OL305_REQ_UNLOCK:
+        case OL305_REQ_QUERY:
+            p[0] = result->info.status;
+            put16(&p[1], result->info.battery_voltage);
+            response.len = 3;
+            break;
+        case OL305_REQ_READ_RFID:
+        case OL305_REQ_DELETE_RFID:
+            memcpy(p, result->card, sizeof(result->card));
+            response.len = sizeof(result->card);
+            break;
+        case OL305_REQ_SETTINGS:
+            p[0] = result->settings.bluetooth_unlock;
+            p[1] = result->settings.button_unlock;
+            p[2] = result->settings.rfid_unlock;
+            response.len = 3;
+            break;
+        case OL305_REQ_SYNC_USAGE:
+            put32(&p[0], result->usage.records);
+            put32(&p[4], result->usage.duplicates);
+            put32(&p[8], result->usage.elapsed_ms);
+            response.len = 12;
+            break;
+        case OL305_REQ_SYNC_RFID:
+            put16(&p[0], result->rfid.registered);
+            put16(&p[2], result->rfid.deleted);
+            put16(&p[4], result->rfid.listed);
+            put32(&p[6], result->rfid.elapsed_ms);
+            response.len = 10;
+            break;
+        default:
+            break;
+    }
+    con_send(&response);
+}
+
+// Queues the request to the lock, the result comes back through con_request_done
+static esp_err_t con_submit(ol305_handle_t lock, OL305_REQUEST type, const uint8_t *args, uint16_t len,
+                            const ol305_con_response_t *response)
+{
+    ol305_request_t request = {.request = type, .done_cb = con_request_done, .ctx = con_ctx(response)};
+    switch (type)
+    {
+        case OL305_REQ_DELETE_RFID:
+            memcpy(request.card, args, sizeof(request.card));
+            break;
+        case OL305_REQ_SETTINGS:
+            for (int i = 0; i < 3; i++)
+            {
+                if (0x01 > args[i] || 0x02 < args[i])
+                    return ESP_ERR_INVALID_ARG;
+            }
+            request.settings = (ol305_settings_t){args[0], args[1], args[2]};
+            break;
+        case OL305_REQ_SYNC_RFID:
+            //the cards of the lock change only once the request is queued
+            request.cards = (const uint8_t (*)[8])args;
+            request.card_count = len / 8;
+            break;
+        default:
+            break;
+    }
+    //rejected: too many requests queued for the lock
+    return (0 == ol305_submit(lock, &request)) ? ESP_ERR_NO_MEM : ESP_OK;
+}
+
+static esp_err_t con_trace(uint8_t mode, ol305_con_response_t *response)
+{
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    switch (mode)
+    {
+        case OL305_CON_TRACE_STOP:
+            portENTER_CRITICAL(&con_mux);
+            con_streaming = false;
+            portEXIT_CRITICAL(&con_mux);
+            err = ol305_trace_stop(2000);
+            break;
+        case OL305_CON_TRACE_FILE:
+            err = ol305_trace_start(OL305_EVLOG_MOUNT "/" OL305_TRACE_NAME);
+            break;
+        case OL305_CON_TRACE_STREAM:
+        {
+            ol305_trace_header_t header;
+            err = ol305_trace_start_stream(&header);
+            if (ESP_OK != err)
+                break;
+            //the header goes out first, the records follow as events from the writer task
+            memcpy(response->payload, &header, sizeof(header));
+            response->len = sizeof(header);
+            portENTER_CRITICAL(&con_mux);
+            con_streaming = true;
+            portEXIT_CRITICAL(&con_mux);
+            break;
+        }
+        default:
+            break;
+    }
+    return err;
+}
+
+// Commands answered without the lock
+static esp_err_t con_local(ol305_handle_t lock, const uint8_t *args, ol305_con_response_t *response)
+{
+    uint8_t *p = response->payload;
+    switch (response->cmd)
+    {
+        case OL305_CON_INFO:
+        {
+            uint32_t connected = 0;
+            for (uint8_t i = 0; i < ol305_get_lock_count() && i < 32; i++)
+            {
+                if (is_ol305_connected(ol305_get_lock(i)))
+                    connected |= 1UL << i;
+            }
+            p[0] = OL305_CON_VERSION;
+            p[1] = ol305_get_lock_count();
+            put32(&p[2], connected);
+            put32(&p[6], con_parser.errors);
+            portENTER_CRITICAL(&con_mux);
+            put32(&p[10], con_tx_dropped);
+            portEXIT_CRITICAL(&con_mux);
+            response->len = 14;
+            return ESP_OK;
+        }
+
+        case OL305_CON_STATUS:
+        {
+            ol305_status_t status;
+            esp_err_t err = ol305_get_status(lock, &status);
+            if (ESP_OK != err)
+                return err;
+            p[0] = status.info.status;
+            put16(&p[1], status.info.battery_voltage);
+            put32(&p[3], status.age_ms);
+            response->len = 7;
+            return ESP_OK;
+        }
+
+        case OL305_CON_STATS:
+        {
+            ol305_stats_t stats;
+            ol305_get_stats(lock, &stats);
+            for (ol305_stat_t stat = 0; stat < OL305_STAT_MAX; stat++)
+                put32(&p[4 * stat], stats.counters[stat]);
+            response->len = 4 * OL305_STAT_MAX;
+            return ESP_OK;
+        }
+
+        case OL305_CON_LATENCY:
+        {
+            ol305_lat_summary_t summary;
+            if (OL305_LAT_MAX <= args[0])
+                return ESP_ERR_INVALID_ARG;
+            esp_err_t err = ol305_lat_get(args[0], &summary);
+            if (ESP_OK != err)
+                return err;
+            const uint32_t values[] = {summary.count, summary.min_us, summary.max_us, summary.avg_us,
+                                       summary.p50_us, summary.p95_us, summary.p99_us};
+            for (uint8_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+                put32(&p[4 * i], values[i]);
+            response->len = sizeof(values);
+            return ESP_OK;
+        }
+
+        case OL305_CON_CONTROL:
+            if (OL305_STATE_MAX <= args[0])
+                return ESP_ERR_INVALID_ARG;
+            ol305_control(lock, args[0], 0, 0);
+            return ESP_OK;
+
+        case OL305_CON_DISCONNECT:
+            ol305_disconnect(lock);
+            return ESP_OK;
+
+        case OL305_CON_TRACE:
+            return con_trace(args[0], response);
+
+        case OL305_CON_LOG_LEVEL:
+            if (ESP_LOG_VERBOSE < args[0])
+                return ESP_ERR_INVALID_ARG;
+            esp_log_level_set("*", args[0]);
+            return ESP_OK;
+
+        case OL305_CON_FLEET:
+        {
+            ol305_fleet_lock_t fleet;
+            ol305_fleet_get(response->lock, &fleet, esp_timer_get_time());
+            p[0] = fleet.work;
+            p[1] = fleet.depth;
+            p[2] = fleet.holding;
+            put32(&p[3], fleet.wait_ms);
+            put32(&p[7], fleet.max_wait_ms);
+            put32(&p[11], fleet.grants);
+            put32(&p[15], fleet.preemptions);
+            response->len = 19;
+            return ESP_OK;
+        }
+
+        case OL305_CON_USAGE_READ:
+        {
+            ol305_usage_rec_t records[OL305_CON_MAX_PAYLOAD / sizeof(ol305_usage_rec_t)];
+            uint32_t count = sizeof(records) / sizeof(records[0]);
+            esp_err_t err = ol305_read_usage(lock, get32(args), records, &count);
+            if (ESP_OK != err)
+                return err;
+            //as in the file, the controller drops them once it has stored them
+            memcpy(p, records, count * sizeof(records[0]));
+            response->len = count * sizeof(records[0]);
+            return ESP_OK;
+        }
+
+        case OL305_CON_USAGE_DROP:
+            return ol305_drop_usage(lock, get32(args));
+
+        default:
+            return ESP_ERR_NOT_SUPPORTED;
+    }
+}
+
+// A request frame from the controller, answered now or once the lock answered
+static void con_execute(const uint8_t *body, uint16_t len)
+{
+    if (OL305_CON_REQ_HEADER > len)
+    {
+        con_parser.errors++;
+        return;
+    }
+
+    ol305_con_response_t response =
+    {
+        .seq = body[0] | (body[1] << 8),
+        .lock = body[2],
+        .cmd = body[3],
+        .kind = OL305_CON_RESULT,
+    };
+    const uint8_t *args = &body[OL305_CON_REQ_HEADER];
+    uint16_t args_len = len - OL305_CON_REQ_HEADER;
+
+    const con_cmd_policy_t *policy = NULL;
+    if (response.cmd < sizeof(con_cmd_policy) / sizeof(con_cmd_policy[0]) && con_cmd_policy[response.cmd].known)
+        policy = &con_cmd_policy[response.cmd];
+    ol305_handle_t lock = ol305_get_lock(response.lock);
+
+    if (NULL == policy)
+        response.err = ESP_ERR_NOT_SUPPORTED;
+    else if (policy->needs_lock && NULL == lock)
+        response.err = ESP_ERR_NOT_FOUND;
+    else if (CON_ARGS_CARDS == policy->args ? (0 == args_len || 0 != args_len % 8) : policy->args != args_len)
+        response.err = ESP_ERR_INVALID_ARG;
+    else if (OL305_REQ_MAX != policy->request)
+    {
+        //nothing to send yet, the result comes from ol305_task
+        response.err = con_submit(lock, policy->request, args, args_len, &response);
+        if (ESP_OK == response.err)
+            return;
+    }
+    else
+        response.err = con_local(lock, args, &response);
+
+    if (ESP_OK != response.err)
+        ESP_LOGD(TAG, "seq %u cmd 0x%02x: %s", response.seq, response.cmd, esp_err_to_name(response.err));
+    con_send(&response);
+}
+
+static void con_reader_task(void *arg)
+{
+    uint8_t chunk[CON_READ_CHUNK];
+    while (1)
+    {
+        int len = con_io->read(chunk, sizeof(chunk), UINT32_MAX);
+        for (int i = 0; i < len; i++)
+        {
+            uint16_t body_len = ol305_con_parse(&con_parser, chunk[i]);
+            if (0 != body_len)
+                con_execute(&con_parser.frame[4], body_len);
+        }
+    }
+}
+
+static void con_write_response(const ol305_con_response_t *response)
+{
+    static uint8_t frame[OL305_CON_MAX_FRAME];
+    uint16_t len = ol305_con_put_response(&frame[4], response);
+    len = ol305_con_encode(frame, sizeof(frame), &frame[4], len);
+    con_io->write(frame, len);
+}
+
+// Trace records captured for the stream so far, as events
+static void con_drain_trace()
+{
+    static ol305_con_response_t event = {.cmd = OL305_CON_TRACE, .kind = OL305_CON_EVENT};
+    while (0 != (event.len = ol305_trace_read(event.payload, sizeof(event.payload))))
+        con_write_response(&event);
+}
+
+// Owns the output: the queued responses, then the trace records while a stream runs
+static void con_writer_task(void *arg)
+{
+    static ol305_con_response_t response;
+    while (1)
+    {
+        portENTER_CRITICAL(&con_mux);
+        bool streaming = con_streaming;
+        portEXIT_CRITICAL(&con_mux);
+        xTaskNotifyWait(0, UINT32_MAX, NULL, streaming ? pdMS_TO_TICKS(CON_STREAM_POLL_MS) : portMAX_DELAY);
+
+        while (1)
+        {
+            bool found = false;
+            portENTER_CRITICAL(&con_mux);
+            if (0 < con_tx_count)
+            {
+                response = con_tx[con_tx_head];
+                con_tx_head = (con_tx_head + 1) % OL305_CON_TX_SLOTS;
+                con_tx_count--;
+                found = true;
+            }
+            portEXIT_CRITICAL(&con_mux);
+            if (!found)
+                break;
+            //the stream header goes out before the records, a stop after the last of them
+            if (OL305_CON_TRACE == response.cmd && sizeof(ol305_trace_header_t) != response.len)
+                con_drain_trace();
+            con_write_response(&response);
+        }
+        if (streaming)
+            con_drain_trace();
+    }
+}
+
+esp_err_t ol305_console_start(const ol305_console_io_t *io)
+{
+    if (NULL != con_io)
+        return ESP_ERR_INVALID_STATE;
+    if (NULL != io->init)
+    {
+        esp_err_t err = io->init();
+        if (ESP_OK != err)
+        {
+            ESP_LOGE(TAG, "Can't open the %s console: %s", io->name, esp_err_to_name(err));
+            return err;
+        }
+    }
+    con_io = io;
+    xTaskCreate(&con_writer_task, "OL305_CON_TX", 3072, NULL, 4, &con_writer);
+    xTaskCreate(&con_reader_task, "OL305_CON_RX", 4096, NULL, 5, NULL);
+    ESP_LOGI(TAG, "Binary console on %s", io->name);
+    return ESP_OK;
+}
@@ -0,0 +1,108 @@
+#ifndef __OL305_CONSOLE_H__
+#define __OL305_CONSOLE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+//A5 5A | len u16 | body | crc16 u16 of len and body (CCITT, init 0xffff); little endian
+//the log shares the UART: bytes between frames are skipped, 0xA5 never appears in log text
+#define OL305_CON_SOF_HI 0xa5
+#define OL305_CON_SOF_LO 0x5a
+#define OL305_CON_VERSION 1
+//request body: seq u16 | lock u8 | cmd u8 | args
+#define OL305_CON_REQ_HEADER 4
+//response body: seq u16 | lock u8 | cmd u8 | kind u8 | err i32 | latency_us u32 | payload
+#define OL305_CON_RSP_HEADER 13
+#define OL305_CON_MAX_BODY (OL305_CON_REQ_HEADER + 8 * 64) //SYNC_CARDS with every card of a lock
+#define OL305_CON_MAX_FRAME (OL305_CON_MAX_BODY + 6)
+//payload of a response or event, a trace record of OL305_TRACE_MAX_DATA fits
+#define OL305_CON_MAX_PAYLOAD 256
+//responses waiting for the UART, a full queue drops the newest
+#define OL305_CON_TX_SLOTS 12
+
+typedef enum
+{
+    //queued to the lock, the result comes when the lock answered, any number in flight
+    OL305_CON_UNLOCK = 0x01,        //-> status u8, battery_mv u16
+    OL305_CON_QUERY = 0x02,         //-> status u8, battery_mv u16
+    OL305_CON_READ_RFID = 0x03,     //-> card[8]
+    OL305_CON_DELETE_RFID = 0x04,   //args: card[8], all zero -> every card; -> card[8]
+    OL305_CON_SETTINGS = 0x05,      //args: bluetooth, button, RFID unlock (off 0x01, on 0x02); -> the same
+    OL305_CON_SYNC_USAGE = 0x06,    //-> records u32, duplicates u32, elapsed_ms u32
+    OL305_CON_SYNC_CARDS = 0x07,    //args: card[8] x n, the cards the lock should accept; -> registered u16, deleted u16, listed u16, elapsed_ms u32
+    //answered by the console right away
+    OL305_CON_INFO = 0x20,          //lock ignored; -> version u8, locks u8, connected u32 (bit per lock), rx_errors u32, tx_dropped u32
+    OL305_CON_STATUS = 0x21,        //-> status u8, battery_mv u16, age_ms u32; ESP_ERR_NOT_FOUND before the first report
+    OL305_CON_STATS = 0x22,         //-> OL305_STAT_MAX x u32, see ol305_stat_t
+    OL305_CON_LATENCY = 0x23,       //lock ignored; args: ol305_lat_id_t; -> count, min, max, avg, p50, p95, p99 u32 (us)
+    OL305_CON_CONTROL = 0x24,       //args: OL305_STATE
+    OL305_CON_DISCONNECT = 0x25,
+    OL305_CON_TRACE = 0x26,         //lock ignored; args: OL305_CON_TRACE_*
+    OL305_CON_LOG_LEVEL = 0x27,     //lock ignored; args: esp_log_level_t, 0 keeps the UART for the frames
+    OL305_CON_FLEET = 0x28,         //-> work u8, depth u8, holding u8, wait_ms u32, max_wait_ms u32, grants u32, preemptions u32; see ol305_fleet.h
+    OL305_CON_USAGE_READ = 0x29,    //args: first u32; -> ol305_usage_rec_t x n as in the file, n < 17, 0 past the last record
+    OL305_CON_USAGE_DROP = 0x2a,    //args: count u32, the oldest records, once read out; ESP_ERR_INVALID_STATE while the lock syncs
+} ol305_con_cmd_t;
+
+typedef enum
+{
+    OL305_CON_TRACE_STOP,
+    OL305_CON_TRACE_FILE,           //to the spiffs partition, see ol305_trace.h
+    OL305_CON_TRACE_STREAM,         //OL305_CON_EVENT frames: the trace header, then whole records
+} ol305_con_trace_t;
+
+typedef enum
+{
+    OL305_CON_RESULT,               //answer to the request of the same seq
+    OL305_CON_EVENT,                //not asked for, seq 0, cmd tells which
+} ol305_con_kind_t;
+
+typedef struct
+{
+    uint16_t seq;
+    uint8_t lock;
+    uint8_t cmd;                    //ol305_con_cmd_t
+    uint8_t kind;                   //ol305_con_kind_t
+    int32_t err;                    //esp_err_t; ESP_ERR_NOT_SUPPORTED -> unknown cmd; ESP_ERR_INVALID_ARG -> bad args
+    uint32_t latency_us;            //from submission to completion, 0 when answered by the console
+    uint16_t len;
+    uint8_t payload[OL305_CON_MAX_PAYLOAD];
+} ol305_con_response_t;
+
+//the frame stream of one direction, fed a byte at a time
+typedef struct
+{
+    uint8_t frame[OL305_CON_MAX_FRAME];
+    uint16_t pos;
+    uint32_t skipped;               //bytes outside of frames, the log among them
+    uint32_t errors;                //frames with a bad length or CRC
+} ol305_con_parser_t;
+
+//the byte stream the console runs on, UART on the board
+typedef struct
+{
+    const char *name;
+    esp_err_t (*init)(void);
+    //bytes read, 0 when none came within timeout_ms; UINT32_MAX waits for ever
+    int (*read)(uint8_t *buf, size_t size, uint32_t timeout_ms);
+    //whole frames, never interleaved with another write
+    void (*write)(const uint8_t *data, size_t len);
+} ol305_console_io_t;
+
+extern const ol305_console_io_t ol305_console_uart;
+
+uint16_t ol305_con_crc16(const uint8_t *data, size_t len);
+//frames body, returns the frame length or 0 when it does not fit in size
+uint16_t ol305_con_encode(uint8_t *frame, uint16_t size, const uint8_t *body, uint16_t len);
+//length of the body completed by byte, at parser->frame + 4; 0 while no frame is complete
+uint16_t ol305_con_parse(ol305_con_parser_t *parser, uint8_t byte);
+//response <-> body, for the console and the controller on the host
+uint16_t ol305_con_put_response(uint8_t *body, const ol305_con_response_t *response);
+esp_err_t ol305_con_get_response(const uint8_t *body, uint16_t len, ol305_con_response_t *response);
+
+//serves the binary command protocol on io: a reader and a writer task, the locks of ol305_add_lock()
+esp_err_t ol305_console_start(const ol305_console_io_t *io);
+
+#endif
@@ -0,0 +1,129 @@
+#include <string.h>
+#include "ol305_console.h"
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// CRC-16/CCITT-FALSE, bitwise: the frames are short and rare next to the BLE traffic
+uint16_t ol305_con_crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xffff;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+uint16_t ol305_con_encode(uint8_t *frame, uint16_t size, const uint8_t *body, uint16_t len)
+{
+    if (OL305_CON_MAX_BODY < len || len + 6 > size)
+        return 0;
+    frame[0] = OL305_CON_SOF_HI;
+    frame[1] = OL305_CON_SOF_LO;
+    put16(&frame[2], len);
+    memmove(&frame[4], body, len);
+    put16(&frame[4 + len], ol305_con_crc16(&frame[2], len + 2));
+    return len + 6;
+}
+
+uint16_t ol305_con_parse(ol305_con_parser_t *parser, uint8_t byte)
+{
+    uint8_t *frame = parser->frame;
+    switch (parser->pos)
+    {
+        case 0:
+            if (OL305_CON_SOF_HI == byte)
+                frame[parser->pos++] = byte;
+            else
+                parser->skipped++;
+            return 0;
+
+        case 1:
+            if (OL305_CON_SOF_LO == byte)
+                frame[parser->pos++] = byte;
+            else if (OL305_CON_SOF_HI != byte)
+            {
+                parser->skipped += 2;
+                parser->pos = 0;
+            }
+            else
+                parser->skipped++;
+            return 0;
+
+        default:
+            break;
+    }
+
+    frame[parser->pos++] = byte;
+    if (4 > parser->pos)
+        return 0;
+    uint16_t len = get16(&frame[2]);
+    if (OL305_CON_MAX_BODY < len)
+    {
+        parser->errors++;
+        parser->pos = 0;
+        return 0;
+    }
+    if (len + 6 > parser->pos)
+        return 0;
+
+    parser->pos = 0;
+    if (get16(&frame[4 + len]) != ol305_con_crc16(&frame[2], len + 2))
+    {
+        parser->errors++;
+        return 0;
+    }
+    return len;
+}
+
+uint16_t ol305_con_put_response(uint8_t *body, const ol305_con_response_t *response)
+{
+    uint16_t len = (OL305_CON_MAX_PAYLOAD < response->len) ? OL305_CON_MAX_PAYLOAD : response->len;
+    put16(&body[0], response->seq);
+    body[2] = response->lock;
+    body[3] = response->cmd;
+    body[4] = response->kind;
+    put32(&body[5], response->err);
+    put32(&body[9], response->latency_us);
+    memcpy(&body[OL305_CON_RSP_HEADER], response->payload, len);
+    return OL305_CON_RSP_HEADER + len;
+}
+
+esp_err_t ol305_con_get_response(const uint8_t *body, uint16_t len, ol305_con_response_t *response)
+{
+    if (OL305_CON_RSP_HEADER > len || OL305_CON_RSP_HEADER + OL305_CON_MAX_PAYLOAD < len)
+        return ESP_ERR_INVALID_SIZE;
+    response->seq = get16(&body[0]);
+    response->lock = body[2];
+    response->cmd = body[3];
+    response->kind = body[4];
+    response->err = (int32_t)get32(&body[5]);
+    response->latency_us = get32(&body[9]);
+    response->len = len - OL305_CON_RSP_HEADER;
+    memcpy(response->payload, &body[OL305_CON_RSP_HEADER], response->len);
+    return ESP_OK;
+}
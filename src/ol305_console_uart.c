@@ -0,0 +1,44 @@
+#include "ol305_console.h"
+#include "driver/uart.h"
+#include "driver/uart_vfs.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#define CON_UART UART_NUM_0
+#define CON_UART_RX_BUF 1024
+#define CON_UART_TX_BUF 2048
+
+// The console UART keeps the baud rate of the boot log, the driver takes it over from the ROM routines
+static esp_err_t con_uart_init(void)
+{
+    esp_err_t err = uart_driver_install(CON_UART, CON_UART_RX_BUF, CON_UART_TX_BUF, 0, NULL, 0);
+    if (ESP_OK != err)
+        return err;
+    //the log goes through the driver too, so a frame is never cut by a log line
+    uart_vfs_dev_use_driver(CON_UART);
+    return ESP_OK;
+}
+
+static int con_uart_read(uint8_t *buf, size_t size, uint32_t timeout_ms)
+{
+    TickType_t ticks = (UINT32_MAX == timeout_ms) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    //returns what is there once the first byte came, the frames are parsed a byte at a time
+    int len = uart_read_bytes(CON_UART, buf, 1, ticks);
+    if (0 >= len)
+        return 0;
+    int more = uart_read_bytes(CON_UART, buf + 1, size - 1, 0);
+    return (0 < more) ? 1 + more : 1;
+}
+
+static void con_uart_write(const uint8_t *data, size_t len)
+{
+    uart_write_bytes(CON_UART, data, len);
+}
+
+const ol305_console_io_t ol305_console_uart =
+{
+    .name = "uart0",
+    .init = con_uart_init,
+    .read = con_uart_read,
+    .write = con_uart_write,
+};
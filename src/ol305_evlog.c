@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "ol305_evlog.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+const static char *TAG = "OL305_EVLOG";
+
+#define EVLOG_MASK (OL305_EVLOG_RING_LEN - 1)
+
+static ol305_ev_t evlog_ring[OL305_EVLOG_RING_LEN];
+static uint32_t evlog_head = 0; //next record to write, free running
+static uint32_t evlog_tail = 0; //next record to flush
+static uint32_t evlog_lost = 0;
+static uint16_t evlog_seq = 0;
+static portMUX_TYPE evlog_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t evlog_task_handle = NULL;
+static atomic_uint evlog_flushed; //evlog_head value the file is up to date with
+
+//flush task only
+static char evlog_dir[32];
+static FILE *evlog_file = NULL;
+static long evlog_size = 0;
+static uint32_t evlog_lost_logged = 0;
+
+void ol305_evlog_write(uint8_t lock, ol305_ev_type_t type, uint8_t cmd, int16_t result, uint32_t latency_us)
+{
+    ol305_ev_t ev =
+    {
+        .time_ms = esp_timer_get_time() / 1000,
+        .lock = lock,
+        .type = type,
+        .cmd = cmd,
+        .result = result,
+        .latency_us = latency_us,
+    };
+    bool kick;
+
+    portENTER_CRITICAL(&evlog_mux);
+    ev.seq = evlog_seq++;
+    evlog_ring[evlog_head & EVLOG_MASK] = ev;
+    evlog_head++;
+    if (OL305_EVLOG_RING_LEN < evlog_head - evlog_tail)
+    {
+        evlog_tail = evlog_head - OL305_EVLOG_RING_LEN;
+        evlog_lost++;
+    }
+    //half full: flush before the timer expires
+    kick = (OL305_EVLOG_RING_LEN / 2 == evlog_head - evlog_tail);
+    portEXIT_CRITICAL(&evlog_mux);
+
+    if (kick && NULL != evlog_task_handle)
+        xTaskNotify(evlog_task_handle, 1, eSetBits);
+}
+
+uint32_t ol305_evlog_lost()
+{
+    portENTER_CRITICAL(&evlog_mux);
+    uint32_t lost = evlog_lost;
+    portEXIT_CRITICAL(&evlog_mux);
+    return lost;
+}
+
+static void evlog_path(char *path, size_t size, int index)
+{
+    if (0 == index)
+        snprintf(path, size, "%s/" OL305_EVLOG_NAME ".log", evlog_dir);
+    else
+        snprintf(path, size, "%s/" OL305_EVLOG_NAME ".%d.log", evlog_dir, index);
+}
+
+static bool evlog_open()
+{
+    char path[48];
+    evlog_path(path, sizeof(path), 0);
+    evlog_file = fopen(path, "ab");
+    if (NULL == evlog_file)
+    {
+        ESP_LOGE(TAG, "Can't open %s", path);
+        return false;
+    }
+    fseek(evlog_file, 0, SEEK_END);
+    evlog_size = ftell(evlog_file);
+    if (0 < evlog_size)
+        return true;
+
+    ol305_ev_header_t header =
+    {
+        .magic = OL305_EVLOG_MAGIC,
+        .version = OL305_EVLOG_VERSION,
+        .record_size = sizeof(ol305_ev_t),
+        .time_ms = esp_timer_get_time() / 1000,
+    };
+    if (1 != fwrite(&header, sizeof(header), 1, evlog_file))
+    {
+        ESP_LOGE(TAG, "Can't write %s", path);
+        fclose(evlog_file);
+        evlog_file = NULL;
+        return false;
+    }
+    evlog_size = sizeof(header);
+    return true;
+}
+
+// Oldest file dropped, every other one moves up by one
+static void evlog_rotate()
+{
+    char from[48];
+    char to[48];
+    fclose(evlog_file);
+    evlog_file = NULL;
+
+    evlog_path(to, sizeof(to), OL305_EVLOG_FILES - 1);
+    remove(to);
+    for (int i = OL305_EVLOG_FILES - 1; i > 0; i--)
+    {
+        evlog_path(from, sizeof(from), i - 1);
+        evlog_path(to, sizeof(to), i);
+        rename(from, to);
+    }
+    ESP_LOGI(TAG, "Rotated at %ld bytes", evlog_size);
+}
+
+// Moves the ring to the file in batches, the copy is the only work done under evlog_mux
+static void evlog_drain()
+{
+    ol305_ev_t batch[OL305_EVLOG_BATCH + 1];
+    for (;;)
+    {
+        uint8_t count = 0;
+        uint32_t lost;
+        uint32_t head;
+
+        portENTER_CRITICAL(&evlog_mux);
+        lost = evlog_lost;
+        head = evlog_head;
+        uint32_t pending = evlog_head - evlog_tail;
+        uint8_t take = (OL305_EVLOG_BATCH < pending) ? OL305_EVLOG_BATCH : pending;
+        if (lost != evlog_lost_logged)
+            count = 1; //room for the overrun record
+        for (uint8_t i = 0; i < take; i++)
+            batch[count++] = evlog_ring[(evlog_tail + i) & EVLOG_MASK];
+        evlog_tail += take;
+        portEXIT_CRITICAL(&evlog_mux);
+
+        if (lost != evlog_lost_logged)
+        {
+            uint32_t missed = lost - evlog_lost_logged;
+            batch[0] = (ol305_ev_t)
+            {
+                .time_ms = esp_timer_get_time() / 1000,
+                .lock = 0xff,
+                .type = OL305_EV_OVERRUN,
+                .result = (INT16_MAX < missed) ? INT16_MAX : missed,
+            };
+            evlog_lost_logged = lost;
+        }
+        if (0 == count)
+        {
+            atomic_store(&evlog_flushed, head);
+            break;
+        }
+
+        //without a file the records are dropped, the ring must keep moving
+        if (NULL != evlog_file || evlog_open())
+        {
+            if (count != fwrite(batch, sizeof(ol305_ev_t), count, evlog_file))
+            {
+                ESP_LOGE(TAG, "Write failed, file closed");
+                fclose(evlog_file);
+                evlog_file = NULL;
+            }
+            else
+            {
+                evlog_size += count * sizeof(ol305_ev_t);
+                if (OL305_EVLOG_FILE_MAX <= evlog_size)
+                    evlog_rotate();
+            }
+        }
+    }
+
+    if (NULL != evlog_file)
+    {
+        fflush(evlog_file);
+        fsync(fileno(evlog_file));
+    }
+}
+
+static void evlog_task(void *pvParameters)
+{
+    for (;;)
+    {
+        xTaskNotifyWait(0, UINT32_MAX, NULL, pdMS_TO_TICKS(OL305_EVLOG_FLUSH_MS));
+        evlog_drain();
+    }
+}
+
+esp_err_t ol305_evlog_start(const char *dir)
+{
+    if (NULL != evlog_task_handle)
+        return ESP_ERR_INVALID_STATE;
+    if (NULL == dir || sizeof(evlog_dir) <= strlen(dir))
+        return ESP_ERR_INVALID_ARG;
+
+    strcpy(evlog_dir, dir);
+    if (pdPASS != xTaskCreate(&evlog_task, "OL305_EVLOG", 3072, NULL, 1, &evlog_task_handle))
+    {
+        evlog_task_handle = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Logging to %s/" OL305_EVLOG_NAME ".log", dir);
+    return ESP_OK;
+}
+
+esp_err_t ol305_evlog_flush(uint32_t timeout_ms)
+{
+    if (NULL == evlog_task_handle)
+        return ESP_ERR_INVALID_STATE;
+
+    portENTER_CRITICAL(&evlog_mux);
+    uint32_t target = evlog_head;
+    portEXIT_CRITICAL(&evlog_mux);
+
+    xTaskNotify(evlog_task_handle, 1, eSetBits);
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    while (0 > (int32_t)(atomic_load(&evlog_flushed) - target))
+    {
+        if (esp_timer_get_time() >= deadline)
+            return ESP_ERR_TIMEOUT;
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return ESP_OK;
+}
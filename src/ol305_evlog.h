@@ -0,0 +1,71 @@
+#ifndef __OL305_EVLOG_H__
+#define __OL305_EVLOG_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+
+//records kept in RAM until the flush task writes them, power of 2
+#define OL305_EVLOG_RING_LEN 256
+//records written per batch
+#define OL305_EVLOG_BATCH 32
+#define OL305_EVLOG_FLUSH_MS 2000
+//the log is rotated past this size, ol305.log -> ol305.1.log -> ... -> ol305.<FILES - 1>.log
+//4 x 64K + the trace + a full usage store per lock keep the 0x160000 spiffs partition under 60%
+#define OL305_EVLOG_FILE_MAX (64 * 1024)
+#define OL305_EVLOG_FILES 4
+
+#define OL305_EVLOG_MOUNT "/spiffs"
+#define OL305_EVLOG_NAME "ol305"
+#define OL305_EVLOG_MAGIC 0x56454c4f //"OLEV"
+#define OL305_EVLOG_VERSION 1
+
+typedef enum
+{
+    OL305_EV_FRAME_TX = 1,  //cmd: frame command
+    OL305_EV_FRAME_RX,      //cmd: frame command, result: first data byte
+    OL305_EV_REQUEST,       //cmd: OL305_REQUEST, result: esp_err_t, latency: submission -> completion
+    OL305_EV_CONNECTED,     //latency: connect start -> BLE_KEY answered
+    OL305_EV_DISCONNECTED,
+    OL305_EV_LINK_LOST,     //result: HCI reason
+    OL305_EV_OVERRUN,       //written by the flush task, result: records lost since the last batch
+} ol305_ev_type_t;
+
+//fixed size, little endian on the target and in the file
+typedef struct
+{
+    uint32_t time_ms; //esp_timer clock
+    uint8_t lock;
+    uint8_t type; //ol305_ev_type_t
+    uint8_t cmd;
+    uint8_t reserved;
+    int16_t result;
+    uint16_t seq; //gaps show records lost before they reached the file
+    uint32_t latency_us;
+} ol305_ev_t;
+
+_Static_assert(16 == sizeof(ol305_ev_t), "ol305_ev_t is a file format");
+
+//first record of every file
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t time_ms; //file opened
+    uint32_t reserved;
+} ol305_ev_header_t;
+
+_Static_assert(sizeof(ol305_ev_t) == sizeof(ol305_ev_header_t), "the header takes one record");
+
+//copies a record into the RAM ring, from any task; the oldest record is overwritten when full
+void ol305_evlog_write(uint8_t lock, ol305_ev_type_t type, uint8_t cmd, int16_t result, uint32_t latency_us);
+//starts the low priority task that appends the ring to <dir>/ol305.log
+esp_err_t ol305_evlog_start(const char *dir);
+//waits until the records written so far are in the file, ESP_ERR_TIMEOUT otherwise
+esp_err_t ol305_evlog_flush(uint32_t timeout_ms);
+//records overwritten before the flush task took them
+uint32_t ol305_evlog_lost();
+//mounts the spiffs partition on OL305_EVLOG_MOUNT, formatted on first use; target only
+esp_err_t ol305_evlog_mount();
+
+#endif
@@ -0,0 +1,29 @@
+#include "ol305_evlog.h"
+#include "esp_log.h"
+#include "esp_spiffs.h"
+
+const static char *TAG = "OL305_EVLOG";
+
+esp_err_t ol305_evlog_mount()
+{
+    esp_vfs_spiffs_conf_t conf =
+    {
+        .base_path = OL305_EVLOG_MOUNT,
+        .partition_label = "spiffs",
+        //the event log, a usage store per link, the trace, a usage drop (the store and its copy)
+        .max_files = 7,
+        .format_if_mount_failed = true,
+    };
+    esp_err_t err = esp_vfs_spiffs_register(&conf);
+    if (ESP_OK != err)
+    {
+        ESP_LOGE(TAG, "Can't mount spiffs: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    size_t total = 0;
+    size_t used = 0;
+    if (ESP_OK == esp_spiffs_info(conf.partition_label, &total, &used))
+        ESP_LOGI(TAG, "spiffs mounted, %u of %u bytes used", (unsigned)used, (unsigned)total);
+    return ESP_OK;
+}
@@ -0,0 +1,295 @@
+#include <string.h>
+#include <inttypes.h>
+#include "ol305_fleet.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+const static char *TAG = "OL305_FLEET";
+
+#define FLEET_QUANTUM_MS 3000
+#define FLEET_AGING_MS 2000
+#define FLEET_MAX_WAIT_MS 30000
+#define FLEET_CONNECT_TIMEOUT_MS 10000
+
+static const char *fleet_work_names[OL305_WORK_MAX] =
+{
+    [OL305_WORK_UNLOCK] = "unlock",
+    [OL305_WORK_PROVISION] = "provision",
+    [OL305_WORK_REFRESH] = "refresh",
+    [OL305_WORK_NONE] = "none",
+};
+
+typedef struct
+{
+    ol305_work_t work;
+    uint8_t depth;
+    bool busy;
+    bool waiting;
+    bool holding;
+    bool connected;
+    int64_t wait_since;
+    int64_t granted_at;
+    int64_t connect_since; //granted, or link lost and searched again
+    uint32_t max_wait_ms;
+    uint32_t grants;
+    uint32_t preemptions;
+} fleet_lock;
+
+static fleet_lock fleet_locks[OL305_MAX_LOCKS] = {[0 ... OL305_MAX_LOCKS - 1] = {.work = OL305_WORK_NONE}};
+static ol305_fleet_config_t fleet_config = {0};
+static uint8_t fleet_holding = 0;
+static portMUX_TYPE fleet_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Called with fleet_mux held: the work class a waiter competes with, one class up every aging_ms,
+// -1 past the starvation limit
+static int fleet_rank(const fleet_lock *lock, int64_t now)
+{
+    int64_t waited_ms = (now - lock->wait_since) / 1000;
+    if (fleet_config.max_wait_ms <= waited_ms)
+        return -1;
+    int rank = (int)lock->work - (int)(waited_ms / fleet_config.aging_ms);
+    return (0 > rank) ? 0 : rank;
+}
+
+// Called with fleet_mux held: true when waiter a is served before waiter b, longest wait first in a class
+static bool fleet_before(uint8_t a, uint8_t b, int64_t now)
+{
+    int rank_a = fleet_rank(&fleet_locks[a], now);
+    int rank_b = fleet_rank(&fleet_locks[b], now);
+    if (rank_a != rank_b)
+        return rank_a < rank_b;
+    if (fleet_locks[a].wait_since != fleet_locks[b].wait_since)
+        return fleet_locks[a].wait_since < fleet_locks[b].wait_since;
+    return a < b;
+}
+
+// Called with fleet_mux held
+static int fleet_first_waiter(int64_t now)
+{
+    int first = -1;
+    for (uint8_t i = 0; i < OL305_MAX_LOCKS; i++)
+    {
+        if (fleet_locks[i].waiting && (0 > first || fleet_before(i, first, now)))
+            first = i;
+    }
+    return first;
+}
+
+// Called with fleet_mux held: 0 -> idle, 1 -> did not connect in time, 2 -> has work left
+static int fleet_yield_order(const fleet_lock *lock, int64_t now)
+{
+    if (OL305_WORK_NONE == lock->work)
+        return 0;
+    if (!lock->connected && now - lock->connect_since >= fleet_config.connect_timeout_ms * 1000LL)
+        return 1;
+    return 2;
+}
+
+// Called with fleet_mux held: true when the holder may give its slot to a waiter of the given rank.
+// An answer awaited is never cut, a holder with work left only after its quantum and for a waiter as urgent.
+static bool fleet_can_yield(const fleet_lock *lock, int rank, int64_t now)
+{
+    if (lock->busy)
+        return false;
+    if (2 > fleet_yield_order(lock, now))
+        return true;
+    return now - lock->granted_at >= fleet_config.quantum_ms * 1000LL && rank <= (int)lock->work;
+}
+
+// Called with fleet_mux held: true when holder a yields before holder b
+static bool fleet_yields_before(uint8_t a, uint8_t b, int64_t now)
+{
+    int order_a = fleet_yield_order(&fleet_locks[a], now);
+    int order_b = fleet_yield_order(&fleet_locks[b], now);
+    if (order_a != order_b)
+        return order_a < order_b;
+    if (fleet_locks[a].work != fleet_locks[b].work)
+        return fleet_locks[a].work > fleet_locks[b].work;
+    if (fleet_locks[a].granted_at != fleet_locks[b].granted_at)
+        return fleet_locks[a].granted_at < fleet_locks[b].granted_at;
+    return a < b;
+}
+
+// Called with fleet_mux held
+static void fleet_grant(fleet_lock *lock, int64_t now)
+{
+    if (lock->waiting)
+    {
+        uint32_t waited_ms = (now - lock->wait_since) / 1000;
+        if (lock->max_wait_ms < waited_ms)
+            lock->max_wait_ms = waited_ms;
+    }
+    lock->waiting = false;
+    lock->holding = true;
+    lock->connected = false;
+    lock->granted_at = now;
+    lock->connect_since = now;
+    lock->grants++;
+    fleet_holding++;
+}
+
+// Before the tasks start, the scheduler starts over with every lock idle
+void ol305_fleet_configure(const ol305_fleet_config_t *config)
+{
+    portENTER_CRITICAL(&fleet_mux);
+    for (uint8_t i = 0; i < OL305_MAX_LOCKS; i++)
+        fleet_locks[i] = (fleet_lock){.work = OL305_WORK_NONE};
+    fleet_holding = 0;
+    fleet_config = *config;
+    if (0 == fleet_config.quantum_ms)
+        fleet_config.quantum_ms = FLEET_QUANTUM_MS;
+    if (0 == fleet_config.aging_ms)
+        fleet_config.aging_ms = FLEET_AGING_MS;
+    if (0 == fleet_config.max_wait_ms)
+        fleet_config.max_wait_ms = FLEET_MAX_WAIT_MS;
+    if (0 == fleet_config.connect_timeout_ms)
+        fleet_config.connect_timeout_ms = FLEET_CONNECT_TIMEOUT_MS;
+    portEXIT_CRITICAL(&fleet_mux);
+    ESP_LOGI(TAG, "%u slots, quantum %" PRIu32 " ms, aging %" PRIu32 " ms, max wait %" PRIu32 " ms", config->slots,
+             fleet_config.quantum_ms, fleet_config.aging_ms, fleet_config.max_wait_ms);
+}
+
+bool ol305_fleet_enabled()
+{
+    return 0 < fleet_config.slots;
+}
+
+bool ol305_fleet_update(uint8_t lock, ol305_work_t work, uint8_t depth, bool busy, int64_t now)
+{
+    fleet_lock *entry = &fleet_locks[lock];
+    bool joined = false;
+    portENTER_CRITICAL(&fleet_mux);
+    entry->work = work;
+    entry->depth = depth;
+    entry->busy = busy;
+    if (entry->holding || OL305_WORK_NONE == work || 0 == fleet_config.slots)
+        entry->waiting = false;
+    else if (!entry->waiting)
+    {
+        //at the back of the line, a lock that just yielded too
+        entry->waiting = true;
+        entry->wait_since = now;
+        joined = true;
+    }
+    portEXIT_CRITICAL(&fleet_mux);
+    return joined;
+}
+
+bool ol305_fleet_acquire(uint8_t lock, int64_t now)
+{
+    fleet_lock *entry = &fleet_locks[lock];
+    bool granted = false;
+    portENTER_CRITICAL(&fleet_mux);
+    if (entry->holding)
+        granted = true;
+    else if (0 == fleet_config.slots)
+    {
+        fleet_grant(entry, now);
+        granted = true;
+    }
+    else if (entry->waiting && fleet_holding < fleet_config.slots)
+    {
+        //the free slots go to the first waiters in line
+        uint8_t ahead = 0;
+        for (uint8_t i = 0; i < OL305_MAX_LOCKS; i++)
+        {
+            if (i != lock && fleet_locks[i].waiting && fleet_before(i, lock, now))
+                ahead++;
+        }
+        if (ahead < fleet_config.slots - fleet_holding)
+        {
+            fleet_grant(entry, now);
+            granted = true;
+        }
+    }
+    portEXIT_CRITICAL(&fleet_mux);
+    return granted;
+}
+
+void ol305_fleet_set_connected(uint8_t lock, bool connected, int64_t now)
+{
+    fleet_lock *entry = &fleet_locks[lock];
+    portENTER_CRITICAL(&fleet_mux);
+    if (entry->connected != connected && !connected)
+        entry->connect_since = now;
+    entry->connected = connected;
+    portEXIT_CRITICAL(&fleet_mux);
+}
+
+bool ol305_fleet_should_yield(uint8_t lock, int64_t now)
+{
+    int victim = -1;
+    portENTER_CRITICAL(&fleet_mux);
+    int waiter = fleet_first_waiter(now);
+    //a free slot serves the waiter without taking one away
+    if (fleet_locks[lock].holding && 0 <= waiter && fleet_holding >= fleet_config.slots)
+    {
+        int rank = fleet_rank(&fleet_locks[waiter], now);
+        for (uint8_t i = 0; i < OL305_MAX_LOCKS; i++)
+        {
+            if (!fleet_locks[i].holding || !fleet_can_yield(&fleet_locks[i], rank, now))
+                continue;
+            if (0 > victim || fleet_yields_before(i, victim, now))
+                victim = i;
+        }
+    }
+    portEXIT_CRITICAL(&fleet_mux);
+    return victim == lock;
+}
+
+void ol305_fleet_release(uint8_t lock)
+{
+    fleet_lock *entry = &fleet_locks[lock];
+    portENTER_CRITICAL(&fleet_mux);
+    if (entry->holding)
+    {
+        entry->holding = false;
+        entry->connected = false;
+        fleet_holding--;
+        if (OL305_WORK_NONE != entry->work)
+            entry->preemptions++;
+    }
+    portEXIT_CRITICAL(&fleet_mux);
+}
+
+uint32_t ol305_fleet_timeout(uint8_t lock, int64_t now)
+{
+    fleet_lock *entry = &fleet_locks[lock];
+    uint32_t timeout_ms = UINT32_MAX;
+    portENTER_CRITICAL(&fleet_mux);
+    //without waiters nothing changes until an event
+    if (0 < fleet_config.slots && (entry->holding || entry->waiting) && 0 <= fleet_first_waiter(now))
+    {
+        timeout_ms = fleet_config.aging_ms;
+        int64_t left_us = entry->granted_at + fleet_config.quantum_ms * 1000LL - now;
+        if (entry->holding && 0 < left_us && left_us / 1000 < timeout_ms)
+            timeout_ms = (left_us + 999) / 1000;
+        left_us = entry->connect_since + fleet_config.connect_timeout_ms * 1000LL - now;
+        if (entry->holding && !entry->connected && 0 < left_us && left_us / 1000 < timeout_ms)
+            timeout_ms = (left_us + 999) / 1000;
+    }
+    portEXIT_CRITICAL(&fleet_mux);
+    return timeout_ms;
+}
+
+void ol305_fleet_get(uint8_t lock, ol305_fleet_lock_t *info, int64_t now)
+{
+    fleet_lock *entry = &fleet_locks[lock];
+    portENTER_CRITICAL(&fleet_mux);
+    *info = (ol305_fleet_lock_t)
+    {
+        .work = entry->work,
+        .depth = entry->depth,
+        .holding = entry->holding,
+        .wait_ms = entry->waiting ? (now - entry->wait_since) / 1000 : 0,
+        .max_wait_ms = entry->max_wait_ms,
+        .grants = entry->grants,
+        .preemptions = entry->preemptions,
+    };
+    portEXIT_CRITICAL(&fleet_mux);
+}
+
+const char *ol305_work_name(ol305_work_t work)
+{
+    return (OL305_WORK_MAX > work) ? fleet_work_names[work] : "?";
+}
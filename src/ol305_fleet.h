@@ -0,0 +1,59 @@
+#ifndef __OL305_FLEET_H__
+#define __OL305_FLEET_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ol305.h"
+
+//what a lock needs a connection for, most urgent first
+typedef enum
+{
+    OL305_WORK_UNLOCK,      //unlock requests, answers to the notifications of the lock
+    OL305_WORK_PROVISION,   //RFID and settings requests
+    OL305_WORK_REFRESH,     //status older than its TTL, queries and usage syncs
+    OL305_WORK_NONE,
+    OL305_WORK_MAX
+} ol305_work_t;
+
+//time slicing of the connection slots when the locks outnumber them, 0 -> default for the timings
+typedef struct
+{
+    uint8_t slots;                  //links open at once, 0 -> no scheduling, every enabled lock keeps its link
+    uint32_t quantum_ms;            //a lock with work left keeps its slot this long before a waiter as urgent gets it
+    uint32_t aging_ms;              //a waiting lock moves up one work class every aging_ms
+    uint32_t max_wait_ms;           //starvation limit, past it a waiter goes first, ahead of unlocks
+    uint32_t connect_timeout_ms;    //a lock that does not connect in time gives its slot to a waiter
+} ol305_fleet_config_t;
+
+//per lock view of the scheduler
+typedef struct
+{
+    ol305_work_t work;
+    uint8_t depth;          //requests queued or in flight
+    bool holding;           //owns a connection slot
+    uint32_t wait_ms;       //current wait for a slot, 0 -> not waiting
+    uint32_t max_wait_ms;   //longest wait so far
+    uint32_t grants;        //slots given to the lock
+    uint32_t preemptions;   //slots given up to a waiter with work left
+} ol305_fleet_lock_t;
+
+//before the tasks start, every lock starts idle
+void ol305_fleet_configure(const ol305_fleet_config_t *config);
+bool ol305_fleet_enabled();
+//ol305_task, every pass; busy -> an answer of the lock is awaited, the slot is not taken away meanwhile.
+//returns true when the lock just joined the waiters, the holders should look at ol305_fleet_should_yield
+bool ol305_fleet_update(uint8_t lock, ol305_work_t work, uint8_t depth, bool busy, int64_t now);
+//true when the lock holds a slot or got one now, it may open its link
+bool ol305_fleet_acquire(uint8_t lock, int64_t now);
+//the link of the holder is up, or was lost and is searched again
+void ol305_fleet_set_connected(uint8_t lock, bool connected, int64_t now);
+//true when the holder should close its link so a waiter gets the slot
+bool ol305_fleet_should_yield(uint8_t lock, int64_t now);
+//the slot is free again, the waiters should try ol305_fleet_acquire
+void ol305_fleet_release(uint8_t lock);
+//ms until a decision about the lock may change without an event, UINT32_MAX -> only events change it
+uint32_t ol305_fleet_timeout(uint8_t lock, int64_t now);
+void ol305_fleet_get(uint8_t lock, ol305_fleet_lock_t *info, int64_t now);
+const char *ol305_work_name(ol305_work_t work);
+
+#endif
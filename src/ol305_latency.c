@@ -0,0 +1,203 @@
+#include <string.h>
+#include <inttypes.h>
+#include "ol305_latency.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+const static char *TAG = "OL305_LAT";
+
+//upper bound of each bucket, the last one takes everything above
+static const uint32_t lat_bounds_us[OL305_LAT_BUCKETS] =
+{
+    500, 1000, 2000, 3000, 5000, 7500, 10000, 15000, 20000, 30000, 50000, 75000, 100000,
+    150000, 200000, 300000, 500000, 750000, 1000000, 1500000, 2000000, 3000000, 5000000,
+    10000000, 30000000, UINT32_MAX
+};
+
+static const char *lat_names[OL305_LAT_MAX] =
+{
+    [OL305_LAT_SCAN] = "scan",
+    [OL305_LAT_ADV] = "adv",
+    [OL305_LAT_OPEN] = "open",
+    [OL305_LAT_MTU] = "mtu",
+    [OL305_LAT_SEARCH] = "search",
+    [OL305_LAT_NOTIFY_REG] = "notify_reg",
+    [OL305_LAT_CCCD] = "cccd",
+    [OL305_LAT_KEY] = "key",
+    [OL305_LAT_CONNECT] = "connect",
+    [OL305_LAT_REQ_BASE + OL305_REQ_UNLOCK] = "unlock",
+    [OL305_LAT_REQ_BASE + OL305_REQ_QUERY] = "query",
+    [OL305_LAT_REQ_BASE + OL305_REQ_READ_RFID] = "read_rfid",
+    [OL305_LAT_REQ_BASE + OL305_REQ_DELETE_RFID] = "delete_rfid",
+    [OL305_LAT_REQ_BASE + OL305_REQ_SETTINGS] = "settings",
+    [OL305_LAT_REQ_BASE + OL305_REQ_SYNC_USAGE] = "sync_usage",
+    [OL305_LAT_REQ_BASE + OL305_REQ_SYNC_RFID] = "sync_rfid",
+};
+
+typedef struct
+{
+    uint32_t buckets[OL305_LAT_BUCKETS];
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+} lat_hist;
+
+//connection attempt in progress on a link
+typedef struct
+{
+    bool active;
+    uint32_t marked; //phases already timed, a restarted scan or a rediscovery is not counted twice
+    int64_t start;
+    int64_t last;
+} lat_session;
+
+static lat_hist lat_hists[OL305_LAT_MAX];
+static lat_session lat_sessions[OL305_LAT_MAX_LINKS];
+static portMUX_TYPE lat_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Called with lat_mux held
+static void lat_add(lat_hist *hist, int64_t us)
+{
+    uint32_t sample = (0 > us) ? 0 : (UINT32_MAX < us) ? UINT32_MAX : (uint32_t)us;
+    uint8_t bucket = 0;
+    while (OL305_LAT_BUCKETS - 1 > bucket && sample > lat_bounds_us[bucket])
+        bucket++;
+
+    hist->buckets[bucket]++;
+    if (0 == hist->count || sample < hist->min_us)
+        hist->min_us = sample;
+    if (sample > hist->max_us)
+        hist->max_us = sample;
+    hist->count++;
+    hist->sum_us += sample;
+}
+
+// Linear inside the bucket the percentile falls in, clamped to what was seen
+static uint32_t lat_percentile(const lat_hist *hist, uint32_t percent)
+{
+    uint64_t rank = ((uint64_t)hist->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (uint8_t i = 0; i < OL305_LAT_BUCKETS; i++)
+    {
+        if (seen + hist->buckets[i] < rank)
+        {
+            seen += hist->buckets[i];
+            continue;
+        }
+
+        uint64_t low = (0 == i) ? 0 : lat_bounds_us[i - 1];
+        uint64_t high = (OL305_LAT_BUCKETS - 1 == i) ? hist->max_us : lat_bounds_us[i];
+        uint64_t value = low + (high - low) * (rank - seen) / hist->buckets[i];
+        if (value < hist->min_us)
+            value = hist->min_us;
+        if (value > hist->max_us)
+            value = hist->max_us;
+        return (uint32_t)value;
+    }
+    return hist->max_us;
+}
+
+void ol305_lat_begin(int link, int64_t start_us)
+{
+    if (0 > link || OL305_LAT_MAX_LINKS <= link)
+        return;
+    portENTER_CRITICAL(&lat_mux);
+    lat_sessions[link].active = true;
+    lat_sessions[link].marked = 0;
+    lat_sessions[link].start = start_us;
+    lat_sessions[link].last = start_us;
+    portEXIT_CRITICAL(&lat_mux);
+}
+
+void ol305_lat_mark(int link, ol305_lat_id_t phase)
+{
+    if (0 > link || OL305_LAT_MAX_LINKS <= link || OL305_LAT_CONNECT <= phase)
+        return;
+
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lat_mux);
+    lat_session *session = &lat_sessions[link];
+    if (session->active && 0 == (session->marked & (1UL << phase)))
+    {
+        session->marked |= 1UL << phase;
+        lat_add(&lat_hists[phase], now - session->last);
+        session->last = now;
+        //the key answer ends the attempt
+        if (OL305_LAT_KEY == phase)
+        {
+            lat_add(&lat_hists[OL305_LAT_CONNECT], now - session->start);
+            session->active = false;
+        }
+    }
+    portEXIT_CRITICAL(&lat_mux);
+}
+
+void ol305_lat_record(ol305_lat_id_t id, int64_t us)
+{
+    if (OL305_LAT_MAX <= id)
+        return;
+    portENTER_CRITICAL(&lat_mux);
+    lat_add(&lat_hists[id], us);
+    portEXIT_CRITICAL(&lat_mux);
+}
+
+esp_err_t ol305_lat_get(ol305_lat_id_t id, ol305_lat_summary_t *summary)
+{
+    if (OL305_LAT_MAX <= id)
+        return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&lat_mux);
+    const lat_hist *hist = &lat_hists[id];
+    memset(summary, 0, sizeof(*summary));
+    if (0 < hist->count)
+    {
+        summary->count = hist->count;
+        summary->min_us = hist->min_us;
+        summary->max_us = hist->max_us;
+        summary->avg_us = hist->sum_us / hist->count;
+        summary->p50_us = lat_percentile(hist, 50);
+        summary->p95_us = lat_percentile(hist, 95);
+        summary->p99_us = lat_percentile(hist, 99);
+    }
+    portEXIT_CRITICAL(&lat_mux);
+    return (0 < summary->count) ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+void ol305_lat_get_buckets(ol305_lat_id_t id, uint32_t *counts, const uint32_t **bounds_us)
+{
+    if (NULL != bounds_us)
+        *bounds_us = lat_bounds_us;
+    if (OL305_LAT_MAX <= id || NULL == counts)
+        return;
+    portENTER_CRITICAL(&lat_mux);
+    memcpy(counts, lat_hists[id].buckets, sizeof(lat_hists[id].buckets));
+    portEXIT_CRITICAL(&lat_mux);
+}
+
+const char *ol305_lat_name(ol305_lat_id_t id)
+{
+    return (OL305_LAT_MAX > id && NULL != lat_names[id]) ? lat_names[id] : "?";
+}
+
+void ol305_lat_reset()
+{
+    portENTER_CRITICAL(&lat_mux);
+    memset(lat_hists, 0, sizeof(lat_hists));
+    portEXIT_CRITICAL(&lat_mux);
+}
+
+void ol305_lat_dump()
+{
+    ESP_LOGI(TAG, "%-12s %6s %9s %9s %9s %9s %9s (ms)", "phase", "count", "min", "p50", "p95", "p99", "max");
+    for (ol305_lat_id_t id = 0; id < OL305_LAT_MAX; id++)
+    {
+        ol305_lat_summary_t summary;
+        if (ESP_OK != ol305_lat_get(id, &summary))
+            continue;
+        ESP_LOGI(TAG, "%-12s %6" PRIu32 " %9.1f %9.1f %9.1f %9.1f %9.1f", ol305_lat_name(id), summary.count,
+                 summary.min_us / 1000.0, summary.p50_us / 1000.0, summary.p95_us / 1000.0,
+                 summary.p99_us / 1000.0, summary.max_us / 1000.0);
+    }
+}
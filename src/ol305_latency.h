@@ -0,0 +1,52 @@
+#ifndef __OL305_LATENCY_H__
+#define __OL305_LATENCY_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "ol305.h"
+
+//one histogram per connection phase and per request
+typedef enum
+{
+    OL305_LAT_SCAN,         //connect start -> scan running
+    OL305_LAT_ADV,          //-> advertisement of the lock seen
+    OL305_LAT_OPEN,         //-> OPEN_EVT
+    OL305_LAT_MTU,          //-> MTU exchanged
+    OL305_LAT_SEARCH,       //-> service search complete, skipped with cached handles
+    OL305_LAT_NOTIFY_REG,   //-> registered for notifications
+    OL305_LAT_CCCD,         //-> CCCD written, link ready
+    OL305_LAT_KEY,          //-> BLE_KEY answered
+    OL305_LAT_CONNECT,      //connect start -> BLE_KEY answered
+    OL305_LAT_REQ_BASE,     //+ OL305_REQUEST: request sent -> answer of the lock
+    OL305_LAT_MAX = OL305_LAT_REQ_BASE + OL305_REQ_MAX,
+} ol305_lat_id_t;
+
+#define OL305_LAT_BUCKETS 26
+#define OL305_LAT_MAX_LINKS 8
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t avg_us;
+    uint32_t p50_us; //estimated from the buckets
+    uint32_t p95_us;
+    uint32_t p99_us;
+} ol305_lat_summary_t;
+
+//a connection attempt on link started at start_us (esp_timer clock)
+void ol305_lat_begin(int link, int64_t start_us);
+//the phase of link ended now, it is timed from the previous mark
+void ol305_lat_mark(int link, ol305_lat_id_t phase);
+void ol305_lat_record(ol305_lat_id_t id, int64_t us);
+//ESP_ERR_NOT_FOUND when nothing was recorded
+esp_err_t ol305_lat_get(ol305_lat_id_t id, ol305_lat_summary_t *summary);
+//bucket counts, upper bounds in us, OL305_LAT_BUCKETS entries each
+void ol305_lat_get_buckets(ol305_lat_id_t id, uint32_t *counts, const uint32_t **bounds_us);
+const char *ol305_lat_name(ol305_lat_id_t id);
+void ol305_lat_reset();
+//logs p50/p95/p99 of every histogram that has samples
+void ol305_lat_dump();
+
+#endif
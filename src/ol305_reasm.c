@@ -0,0 +1,124 @@
+#include <string.h>
+#include <stdbool.h>
+#include "ol305_reasm.h"
+
+#define REASM_MASK (OL305_REASM_LEN - 1)
+
+static inline uint8_t reasm_at(const ol305_reasm_t *reasm, uint16_t offset)
+{
+    return reasm->ring[(reasm->head + offset) & REASM_MASK];
+}
+
+static inline void reasm_drop(ol305_reasm_t *reasm, uint16_t count)
+{
+    reasm->head = (reasm->head + count) & REASM_MASK;
+    reasm->count -= count;
+}
+
+// Copies as much of data as fits, the caller drains the ring in between
+static uint16_t reasm_push(ol305_reasm_t *reasm, const uint8_t *data, uint16_t len)
+{
+    uint16_t room = OL305_REASM_LEN - reasm->count;
+    if (len > room)
+        len = room;
+
+    uint16_t tail = (reasm->head + reasm->count) & REASM_MASK;
+    uint16_t first = OL305_REASM_LEN - tail;
+    if (first > len)
+        first = len;
+    memcpy(&reasm->ring[tail], data, first);
+    memcpy(reasm->ring, &data[first], len - first);
+    reasm->count += len;
+    return len;
+}
+
+// Leaves the ring starting with STX, or with a lone STX_HI that may be completed by the next bytes
+static void reasm_sync(ol305_reasm_t *reasm)
+{
+    bool skipped = false;
+    while (0 < reasm->count)
+    {
+        if (OL305_FRAME_STX_HI == reasm_at(reasm, 0))
+        {
+            if (1 == reasm->count || OL305_FRAME_STX_LO == reasm_at(reasm, 1))
+                break;
+        }
+        reasm_drop(reasm, 1);
+        reasm->skipped_bytes++;
+        skipped = true;
+    }
+    if (skipped)
+        reasm->resyncs++;
+}
+
+static uint16_t reasm_drain(ol305_reasm_t *reasm, ol305_reasm_cb_t cb, void *ctx)
+{
+    uint16_t emitted = 0;
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    ol305_frame_t decoded = {0};
+
+    while (1)
+    {
+        reasm_sync(reasm);
+        if (3 > reasm->count)
+            break;
+
+        uint8_t data_len = reasm_at(reasm, 2);
+        if (OL305_FRAME_MAX_DATA < data_len)
+        {
+            //not a frame start, look for the next STX
+            reasm->bad_length++;
+            reasm_drop(reasm, 1);
+            continue;
+        }
+
+        uint16_t frame_len = OL305_FRAME_HEADER_LEN + data_len + 1;
+        if (frame_len > reasm->count)
+            break;
+
+        uint16_t first = OL305_REASM_LEN - reasm->head;
+        if (first > frame_len)
+            first = frame_len;
+        memcpy(frame, &reasm->ring[reasm->head], first);
+        memcpy(&frame[first], reasm->ring, frame_len - first);
+
+        if (ESP_OK != ol305_codec_decode(frame, frame_len, &decoded))
+        {
+            //the STX may have been payload, resync one byte further
+            reasm->bad_crc++;
+            reasm_drop(reasm, 1);
+            continue;
+        }
+
+        reasm_drop(reasm, frame_len);
+        reasm->frames++;
+        emitted++;
+        cb(ctx, &decoded);
+    }
+    return emitted;
+}
+
+void ol305_reasm_init(ol305_reasm_t *reasm)
+{
+    memset(reasm, 0, sizeof(*reasm));
+}
+
+void ol305_reasm_reset(ol305_reasm_t *reasm)
+{
+    reasm->head = 0;
+    reasm->count = 0;
+}
+
+uint16_t ol305_reasm_feed(ol305_reasm_t *reasm, const uint8_t *data, uint16_t len, ol305_reasm_cb_t cb, void *ctx)
+{
+    uint16_t emitted = 0;
+    while (0 < len)
+    {
+        uint16_t pushed = reasm_push(reasm, data, len);
+        data += pushed;
+        len -= pushed;
+        //at most one partial frame is left behind, there is room for the next chunk
+        emitted += reasm_drain(reasm, cb, ctx);
+    }
+    return emitted;
+}
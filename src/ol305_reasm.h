@@ -0,0 +1,32 @@
+#ifndef __OL305_REASM_H__
+#define __OL305_REASM_H__
+
+#include <stdint.h>
+#include "ol305_codec.h"
+
+//room for a partial frame plus a full one behind it, power of 2
+#define OL305_REASM_LEN 64
+
+//gets every frame that passed the length and CRC checks
+typedef void (*ol305_reasm_cb_t)(void *ctx, const ol305_frame_t *frame);
+
+//turns the notification byte stream back into frames, whatever the notification boundaries
+typedef struct
+{
+    uint8_t ring[OL305_REASM_LEN];
+    uint16_t head; //oldest byte
+    uint16_t count;
+    uint32_t frames;
+    uint32_t bad_length; //STX found but the length byte is out of range
+    uint32_t bad_crc; //STX and length fine but the CRC is wrong
+    uint32_t resyncs; //runs of bytes that did not start with STX
+    uint32_t skipped_bytes; //dropped while looking for STX
+} ol305_reasm_t;
+
+void ol305_reasm_init(ol305_reasm_t *reasm);
+//drops a partial frame, the counters are kept
+void ol305_reasm_reset(ol305_reasm_t *reasm);
+//returns the number of frames emitted
+uint16_t ol305_reasm_feed(ol305_reasm_t *reasm, const uint8_t *data, uint16_t len, ol305_reasm_cb_t cb, void *ctx);
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "ol305_rfid.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+const static char *TAG = "OL305_RFID";
+
+// Position of card, or where it would be inserted
+static uint16_t rfid_find(const ol305_rfid_index_t *index, const uint8_t *card, bool *found)
+{
+    uint16_t low = 0;
+    uint16_t high = index->count;
+    *found = false;
+    while (low < high)
+    {
+        uint16_t mid = (low + high) / 2;
+        int cmp = memcmp(index->cards[mid], card, OL305_RFID_CARD_LEN);
+        if (0 == cmp)
+        {
+            *found = true;
+            return mid;
+        }
+        if (0 > cmp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+void ol305_rfid_clear(ol305_rfid_index_t *index)
+{
+    index->count = 0;
+}
+
+bool ol305_rfid_contains(const ol305_rfid_index_t *index, const uint8_t *card)
+{
+    bool found;
+    rfid_find(index, card, &found);
+    return found;
+}
+
+esp_err_t ol305_rfid_insert(ol305_rfid_index_t *index, const uint8_t *card)
+{
+    bool found;
+    uint16_t pos = rfid_find(index, card, &found);
+    if (found)
+        return ESP_OK;
+    if (OL305_RFID_MAX_CARDS <= index->count)
+        return ESP_ERR_NO_MEM;
+
+    memmove(index->cards[pos + 1], index->cards[pos], (index->count - pos) * OL305_RFID_CARD_LEN);
+    memcpy(index->cards[pos], card, OL305_RFID_CARD_LEN);
+    index->count++;
+    return ESP_OK;
+}
+
+void ol305_rfid_remove(ol305_rfid_index_t *index, const uint8_t *card)
+{
+    bool found;
+    uint16_t pos = rfid_find(index, card, &found);
+    if (!found)
+        return;
+    index->count--;
+    memmove(index->cards[pos], index->cards[pos + 1], (index->count - pos) * OL305_RFID_CARD_LEN);
+}
+
+esp_err_t ol305_rfid_build(ol305_rfid_index_t *index, const uint8_t (*cards)[OL305_RFID_CARD_LEN], uint16_t count)
+{
+    ol305_rfid_clear(index);
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (ESP_OK != ol305_rfid_insert(index, cards[i]))
+            return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+ol305_rfid_op_t ol305_rfid_next_op(const ol305_rfid_index_t *current, const ol305_rfid_index_t *desired, uint8_t *card)
+{
+    const uint8_t *first_register = NULL;
+    uint16_t i = 0;
+    uint16_t j = 0;
+    while (i < current->count || j < desired->count)
+    {
+        int cmp;
+        if (i == current->count)
+            cmp = 1;
+        else if (j == desired->count)
+            cmp = -1;
+        else
+            cmp = memcmp(current->cards[i], desired->cards[j], OL305_RFID_CARD_LEN);
+
+        if (0 > cmp)
+        {
+            //on the lock only
+            memcpy(card, current->cards[i], OL305_RFID_CARD_LEN);
+            return OL305_RFID_OP_DELETE;
+        }
+        if (0 < cmp)
+        {
+            if (NULL == first_register)
+                first_register = desired->cards[j];
+            j++;
+            continue;
+        }
+        i++;
+        j++;
+    }
+    if (NULL == first_register)
+        return OL305_RFID_OP_NONE;
+    memcpy(card, first_register, OL305_RFID_CARD_LEN);
+    return OL305_RFID_OP_REGISTER;
+}
+
+void ol305_rfid_diff_count(const ol305_rfid_index_t *current, const ol305_rfid_index_t *desired, uint16_t *deletes, uint16_t *registers)
+{
+    uint16_t i = 0;
+    uint16_t j = 0;
+    *deletes = 0;
+    *registers = 0;
+    while (i < current->count || j < desired->count)
+    {
+        int cmp;
+        if (i == current->count)
+            cmp = 1;
+        else if (j == desired->count)
+            cmp = -1;
+        else
+            cmp = memcmp(current->cards[i], desired->cards[j], OL305_RFID_CARD_LEN);
+
+        if (0 > cmp)
+        {
+            (*deletes)++;
+            i++;
+        }
+        else if (0 < cmp)
+        {
+            (*registers)++;
+            j++;
+        }
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+}
+
+static void rfid_key(const uint8_t *mac, char *key)
+{
+    snprintf(key, 13, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+esp_err_t ol305_rfid_load(ol305_rfid_index_t *index, const uint8_t *mac)
+{
+    nvs_handle_t handle;
+    char key[13];
+    size_t len = sizeof(*index);
+
+    ol305_rfid_clear(index);
+    esp_err_t err = nvs_open(OL305_RFID_NAMESPACE, NVS_READONLY, &handle);
+    if (ESP_OK != err)
+        return err;
+    rfid_key(mac, key);
+    err = nvs_get_blob(handle, key, index, &len);
+    nvs_close(handle);
+    if (ESP_OK != err)
+        return err;
+    //only the used part of the index is stored
+    if (offsetof(ol305_rfid_index_t, cards) + index->count * OL305_RFID_CARD_LEN != len || OL305_RFID_MAX_CARDS < index->count)
+    {
+        ESP_LOGW(TAG, "Stored index of %s is invalid", key);
+        ol305_rfid_clear(index);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t ol305_rfid_store(const ol305_rfid_index_t *index, const uint8_t *mac)
+{
+    nvs_handle_t handle;
+    char key[13];
+
+    esp_err_t err = nvs_open(OL305_RFID_NAMESPACE, NVS_READWRITE, &handle);
+    if (ESP_OK != err)
+        return err;
+    rfid_key(mac, key);
+    err = nvs_set_blob(handle, key, index, offsetof(ol305_rfid_index_t, cards) + index->count * OL305_RFID_CARD_LEN);
+    if (ESP_OK == err)
+        err = nvs_commit(handle);
+    nvs_close(handle);
+    if (ESP_OK != err)
+        ESP_LOGE(TAG, "Index of %s not stored", key);
+    return err;
+}
@@ -0,0 +1,41 @@
+#ifndef __OL305_RFID_H__
+#define __OL305_RFID_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define OL305_RFID_MAX_CARDS 64
+#define OL305_RFID_CARD_LEN 8
+#define OL305_RFID_NAMESPACE "ol305_rfid"
+
+//card ids of a lock, kept sorted: lookups are binary searches, diffs a single merge walk
+typedef struct
+{
+    uint16_t count;
+    uint8_t cards[OL305_RFID_MAX_CARDS][OL305_RFID_CARD_LEN];
+} ol305_rfid_index_t;
+
+typedef enum
+{
+    OL305_RFID_OP_NONE,
+    OL305_RFID_OP_DELETE,
+    OL305_RFID_OP_REGISTER,
+} ol305_rfid_op_t;
+
+void ol305_rfid_clear(ol305_rfid_index_t *index);
+bool ol305_rfid_contains(const ol305_rfid_index_t *index, const uint8_t *card);
+//ESP_ERR_NO_MEM when full, ESP_OK when the card was already there
+esp_err_t ol305_rfid_insert(ol305_rfid_index_t *index, const uint8_t *card);
+void ol305_rfid_remove(ol305_rfid_index_t *index, const uint8_t *card);
+//builds a sorted index out of any list, duplicates are dropped
+esp_err_t ol305_rfid_build(ol305_rfid_index_t *index, const uint8_t (*cards)[OL305_RFID_CARD_LEN], uint16_t count);
+//first change that turns current into desired, deletes before registers; OP_NONE when they match
+ol305_rfid_op_t ol305_rfid_next_op(const ol305_rfid_index_t *current, const ol305_rfid_index_t *desired, uint8_t *card);
+//cards on each side of the difference
+void ol305_rfid_diff_count(const ol305_rfid_index_t *current, const ol305_rfid_index_t *desired, uint16_t *deletes, uint16_t *registers);
+//NVS copy, keyed by the MAC of the lock
+esp_err_t ol305_rfid_load(ol305_rfid_index_t *index, const uint8_t *mac);
+esp_err_t ol305_rfid_store(const ol305_rfid_index_t *index, const uint8_t *mac);
+
+#endif
@@ -0,0 +1,83 @@
+#include <string.h>
+#include "ol305_rxq.h"
+
+#define RXQ_MASK (OL305_RXQ_LEN - 1)
+
+void ol305_rxq_init(ol305_rxq_t *queue)
+{
+    memset(queue->slots, 0, sizeof(queue->slots));
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->dropped, 0);
+}
+
+// The indexes run freely, tail - head is the number of filled slots
+static uint16_t rxq_room(ol305_rxq_t *queue, unsigned tail)
+{
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    return OL305_RXQ_LEN - (tail - head);
+}
+
+bool ol305_rxq_push(ol305_rxq_t *queue, const uint8_t *data, uint16_t len)
+{
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint16_t needed = (len + OL305_RXQ_CHUNK - 1) / OL305_RXQ_CHUNK;
+    //all or nothing, half a notification would only be resynced away
+    if (0 == len || rxq_room(queue, tail) < needed)
+    {
+        atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    for (; 0 < len; tail++)
+    {
+        ol305_rxq_slot_t *slot = &queue->slots[tail & RXQ_MASK];
+        slot->len = (OL305_RXQ_CHUNK < len) ? OL305_RXQ_CHUNK : len;
+        slot->data_len = slot->len;
+        memcpy(slot->data, data, slot->len);
+        data += slot->len;
+        len -= slot->len;
+    }
+    //the slots are visible to the consumer once tail moves
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+    return true;
+}
+
+bool ol305_rxq_push_reset(ol305_rxq_t *queue, const uint8_t *reason, uint16_t reason_len)
+{
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (0 == rxq_room(queue, tail))
+    {
+        atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    ol305_rxq_slot_t *slot = &queue->slots[tail & RXQ_MASK];
+    slot->len = 0;
+    slot->data_len = (NULL == reason || OL305_RXQ_CHUNK < reason_len) ? 0 : reason_len;
+    if (0 < slot->data_len)
+        memcpy(slot->data, reason, slot->data_len);
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+const ol305_rxq_slot_t *ol305_rxq_front(ol305_rxq_t *queue)
+{
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    return &queue->slots[head & RXQ_MASK];
+}
+
+void ol305_rxq_release(ol305_rxq_t *queue)
+{
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    //the slot may be overwritten once head moves
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+void ol305_rxq_clear(ol305_rxq_t *queue)
+{
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    atomic_store_explicit(&queue->head, tail, memory_order_release);
+}
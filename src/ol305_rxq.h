@@ -0,0 +1,40 @@
+#ifndef __OL305_RXQ_H__
+#define __OL305_RXQ_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+//power of 2, a few notifications may arrive while ol305_task is busy
+#define OL305_RXQ_LEN 16
+//a default MTU notification fits one slot, longer ones take several
+#define OL305_RXQ_CHUNK 24
+
+//lock-free single producer (transport context) / single consumer (ol305_task) queue of notification bytes
+typedef struct
+{
+    uint8_t len; //0 -> link reset marker, data_len bytes of data say why
+    uint8_t data_len;
+    uint8_t data[OL305_RXQ_CHUNK];
+} ol305_rxq_slot_t;
+
+typedef struct
+{
+    ol305_rxq_slot_t slots[OL305_RXQ_LEN];
+    atomic_uint head; //next slot to read, written by the consumer
+    atomic_uint tail; //next slot to write, written by the producer
+    atomic_uint dropped; //chunks lost because the queue was full
+} ol305_rxq_t;
+
+void ol305_rxq_init(ol305_rxq_t *queue);
+//producer: copies data, false when it did not fit
+bool ol305_rxq_push(ol305_rxq_t *queue, const uint8_t *data, uint16_t len);
+//producer: the bytes that follow belong to a new link, reason is kept with the marker
+bool ol305_rxq_push_reset(ol305_rxq_t *queue, const uint8_t *reason, uint16_t reason_len);
+//consumer: the oldest slot or NULL, valid until ol305_rxq_release
+const ol305_rxq_slot_t *ol305_rxq_front(ol305_rxq_t *queue);
+void ol305_rxq_release(ol305_rxq_t *queue);
+//consumer: drops everything queued
+void ol305_rxq_clear(ol305_rxq_t *queue);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include "ol305_stats.h"
+
+static const char *stat_names[OL305_STAT_MAX] =
+{
+    [OL305_STAT_FRAMES_RX] = "frames_rx",
+    [OL305_STAT_FRAMES_TX] = "frames_tx",
+    [OL305_STAT_TX_DROPPED] = "tx_dropped",
+    [OL305_STAT_RX_DROPPED] = "rx_dropped",
+    [OL305_STAT_CRC_ERRORS] = "crc_errors",
+    [OL305_STAT_LENGTH_ERRORS] = "length_errors",
+    [OL305_STAT_STX_RESYNCS] = "stx_resyncs",
+    [OL305_STAT_KEY_ERRORS] = "key_errors",
+    [OL305_STAT_CMD_ERRORS] = "cmd_errors",
+    [OL305_STAT_LAST_CMD_ERROR] = "last_cmd_error",
+    [OL305_STAT_UNLOCK_FAILURES] = "unlock_failures",
+    [OL305_STAT_LOCK_FAILURES] = "lock_failures",
+    [OL305_STAT_REQUEST_TIMEOUTS] = "request_timeouts",
+    [OL305_STAT_CONNECTS] = "connects",
+    [OL305_STAT_RECONNECTS] = "reconnects",
+    [OL305_STAT_DISC_TIMEOUT] = "disc_timeout",
+    [OL305_STAT_DISC_REMOTE] = "disc_remote",
+    [OL305_STAT_DISC_LOCAL] = "disc_local",
+    [OL305_STAT_DISC_FAIL_ESTABLISH] = "disc_fail_establish",
+    [OL305_STAT_DISC_OTHER] = "disc_other",
+};
+
+void ol305_stats_init(ol305_stats_block_t *block)
+{
+    atomic_init(&block->seq, 0);
+    for (uint8_t i = 0; i < OL305_STAT_MAX; i++)
+        atomic_init(&block->counters[i], 0);
+}
+
+static void stats_write(ol305_stats_block_t *block, ol305_stat_t stat, uint32_t value, bool add)
+{
+    if (OL305_STAT_MAX <= stat)
+        return;
+
+    unsigned seq = atomic_load_explicit(&block->seq, memory_order_relaxed);
+    atomic_store_explicit(&block->seq, seq + 1, memory_order_relaxed);
+    //the odd sequence is visible before the counter changes
+    atomic_thread_fence(memory_order_release);
+    if (add)
+        value += atomic_load_explicit(&block->counters[stat], memory_order_relaxed);
+    atomic_store_explicit(&block->counters[stat], value, memory_order_relaxed);
+    atomic_store_explicit(&block->seq, seq + 2, memory_order_release);
+}
+
+void ol305_stats_add(ol305_stats_block_t *block, ol305_stat_t stat, uint32_t count)
+{
+    stats_write(block, stat, count, true);
+}
+
+void ol305_stats_set(ol305_stats_block_t *block, ol305_stat_t stat, uint32_t value)
+{
+    stats_write(block, stat, value, false);
+}
+
+void ol305_stats_snapshot(ol305_stats_block_t *block, ol305_stats_t *stats)
+{
+    unsigned before;
+    unsigned after;
+    do
+    {
+        before = atomic_load_explicit(&block->seq, memory_order_acquire);
+        for (uint8_t i = 0; i < OL305_STAT_MAX; i++)
+            stats->counters[i] = atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+        //the copy is done before the sequence is read again
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&block->seq, memory_order_relaxed);
+    } while (before != after || (before & 1));
+}
+
+const char *ol305_stat_name(ol305_stat_t stat)
+{
+    return (OL305_STAT_MAX > stat && NULL != stat_names[stat]) ? stat_names[stat] : "?";
+}
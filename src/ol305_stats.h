@@ -0,0 +1,22 @@
+#ifndef __OL305_STATS_H__
+#define __OL305_STATS_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "ol305.h"
+
+//counters written by a single task and read from anywhere: seqlock, no lock on either side
+typedef struct
+{
+    atomic_uint seq; //odd while an update is in progress
+    atomic_uint counters[OL305_STAT_MAX];
+} ol305_stats_block_t;
+
+void ol305_stats_init(ol305_stats_block_t *block);
+//writer side, only from the task that owns the block
+void ol305_stats_add(ol305_stats_block_t *block, ol305_stat_t stat, uint32_t count);
+void ol305_stats_set(ol305_stats_block_t *block, ol305_stat_t stat, uint32_t value);
+//reader side, retries while an update is in progress
+void ol305_stats_snapshot(ol305_stats_block_t *block, ol305_stats_t *stats);
+
+#endif
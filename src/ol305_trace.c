@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "ol305_trace.h"
+#include "ol305.h"
+#include "ol305_codec.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+const static char *TAG = "OL305_TRACE";
+
+#define TRACE_MASK (OL305_TRACE_RING_LEN - 1)
+#define TRACE_MAX_SLOTS 8
+#define TRACE_BATCH 1024
+#define TRACE_EVT_FLUSH 0x01
+#define TRACE_EVT_STOP 0x02
+
+//links of the client, the callback of the backend is routed through them
+typedef struct
+{
+    bool used;
+    int link;
+    uint8_t mac[6];
+    uint16_t mac_len;
+    ol305_link_cb_t cb;
+    void *ctx;
+} trace_slot_t;
+
+static const ol305_transport_t *trace_inner = NULL;
+static trace_slot_t trace_slots[TRACE_MAX_SLOTS];
+
+static uint8_t trace_ring[OL305_TRACE_RING_LEN];
+static uint32_t trace_head = 0; //next byte to write, free running
+static uint32_t trace_tail = 0; //next byte to take, always at the start of a record
+static bool trace_capture = false;
+static int64_t trace_last_us = 0; //time of the previous record
+static uint32_t trace_lost = 0;
+static uint32_t trace_lost_pending = 0; //dropped since the last OL305_TRACE_LOST record
+static portMUX_TYPE trace_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t trace_task_handle = NULL;
+static atomic_bool trace_file_open;
+
+//flush task, and ol305_trace_start before it runs
+static FILE *trace_file = NULL;
+static long trace_size = 0;
+
+// Called with trace_mux held
+static void trace_copy_in(const void *data, uint16_t len)
+{
+    uint32_t pos = trace_head & TRACE_MASK;
+    uint32_t first = (OL305_TRACE_RING_LEN - pos < len) ? OL305_TRACE_RING_LEN - pos : len;
+    memcpy(&trace_ring[pos], data, first);
+    memcpy(trace_ring, (const uint8_t *)data + first, len - first);
+    trace_head += len;
+}
+
+static void trace_copy_out(uint32_t from, void *data, uint16_t len)
+{
+    uint32_t pos = from & TRACE_MASK;
+    uint32_t first = (OL305_TRACE_RING_LEN - pos < len) ? OL305_TRACE_RING_LEN - pos : len;
+    memcpy(data, &trace_ring[pos], first);
+    memcpy((uint8_t *)data + first, trace_ring, len - first);
+}
+
+// From any task: the Bluetooth task, ol305_task, the simulator thread
+static void trace_append(ol305_trace_type_t type, int link, const uint8_t *data, uint16_t len)
+{
+    if (OL305_TRACE_MAX_DATA < len)
+        len = OL305_TRACE_MAX_DATA;
+    bool kick = false;
+
+    portENTER_CRITICAL(&trace_mux);
+    if (!trace_capture)
+    {
+        portEXIT_CRITICAL(&trace_mux);
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    uint32_t lost_len = (0 < trace_lost_pending) ? sizeof(ol305_trace_rec_t) + sizeof(uint32_t) : 0;
+    if (OL305_TRACE_RING_LEN - (trace_head - trace_tail) < lost_len + sizeof(ol305_trace_rec_t) + len)
+    {
+        trace_lost++;
+        trace_lost_pending++;
+        portEXIT_CRITICAL(&trace_mux);
+        return;
+    }
+
+    int64_t delta = now - trace_last_us;
+    ol305_trace_rec_t rec =
+    {
+        .delta_us = (UINT32_MAX < delta) ? UINT32_MAX : (0 > delta) ? 0 : delta,
+        .link = link,
+    };
+    //in place of the records dropped, a replay knows where the gap is
+    if (0 < lost_len)
+    {
+        rec.type = OL305_TRACE_LOST;
+        rec.len = sizeof(uint32_t);
+        trace_copy_in(&rec, sizeof(rec));
+        trace_copy_in(&trace_lost_pending, sizeof(trace_lost_pending));
+        trace_lost_pending = 0;
+        rec.delta_us = 0;
+    }
+    rec.type = type;
+    rec.len = len;
+    trace_copy_in(&rec, sizeof(rec));
+    if (0 < len)
+        trace_copy_in(data, len);
+    trace_last_us = now;
+    kick = OL305_TRACE_RING_LEN / 2 <= trace_head - trace_tail;
+    portEXIT_CRITICAL(&trace_mux);
+
+    if (kick && NULL != trace_task_handle && atomic_load(&trace_file_open))
+        xTaskNotify(trace_task_handle, TRACE_EVT_FLUSH, eSetBits);
+}
+
+// Whole records only, the copy is the only work done under trace_mux
+static size_t trace_take(uint8_t *buf, size_t size)
+{
+    size_t taken = 0;
+    portENTER_CRITICAL(&trace_mux);
+    while (trace_tail != trace_head)
+    {
+        ol305_trace_rec_t rec;
+        trace_copy_out(trace_tail, &rec, sizeof(rec));
+        uint16_t rec_len = sizeof(rec) + rec.len;
+        if (size - taken < rec_len)
+            break;
+        trace_copy_out(trace_tail, &buf[taken], rec_len);
+        trace_tail += rec_len;
+        taken += rec_len;
+    }
+    portEXIT_CRITICAL(&trace_mux);
+    return taken;
+}
+
+static void trace_reset(int64_t now)
+{
+    portENTER_CRITICAL(&trace_mux);
+    trace_head = 0;
+    trace_tail = 0;
+    trace_lost_pending = 0;
+    trace_last_us = now;
+    trace_capture = true;
+    portEXIT_CRITICAL(&trace_mux);
+}
+
+// A capture started mid session opens with the links already up, so a replay knows which lock each one is
+static void trace_seed()
+{
+    trace_slot_t slots[TRACE_MAX_SLOTS];
+    portENTER_CRITICAL(&trace_mux);
+    memcpy(slots, trace_slots, sizeof(slots));
+    portEXIT_CRITICAL(&trace_mux);
+    for (uint8_t i = 0; i < TRACE_MAX_SLOTS; i++)
+    {
+        if (!slots[i].used || OL305_INVALID_LINK == slots[i].link)
+            continue;
+        trace_append(OL305_TRACE_OPEN, slots[i].link, slots[i].mac, slots[i].mac_len);
+        if (trace_inner->is_connected(slots[i].link))
+            trace_append(OL305_TRACE_READY, slots[i].link, NULL, 0);
+    }
+}
+
+static void trace_drain()
+{
+    uint8_t batch[TRACE_BATCH];
+    size_t len;
+    while (NULL != trace_file && 0 < (len = trace_take(batch, sizeof(batch))))
+    {
+        if (OL305_TRACE_FILE_MAX < trace_size + len)
+        {
+            ESP_LOGW(TAG, "Trace full at %ld bytes, capture stopped", trace_size);
+            portENTER_CRITICAL(&trace_mux);
+            trace_capture = false;
+            portEXIT_CRITICAL(&trace_mux);
+            break;
+        }
+        if (1 != fwrite(batch, len, 1, trace_file))
+        {
+            ESP_LOGE(TAG, "Write failed, capture stopped");
+            portENTER_CRITICAL(&trace_mux);
+            trace_capture = false;
+            portEXIT_CRITICAL(&trace_mux);
+            break;
+        }
+        trace_size += len;
+    }
+    if (NULL != trace_file)
+    {
+        fflush(trace_file);
+        fsync(fileno(trace_file));
+    }
+}
+
+static void trace_task(void *pvParameters)
+{
+    for (;;)
+    {
+        uint32_t events = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &events, pdMS_TO_TICKS(OL305_TRACE_FLUSH_MS));
+        trace_drain();
+        if ((events & TRACE_EVT_STOP) && NULL != trace_file)
+        {
+            fclose(trace_file);
+            trace_file = NULL;
+            ESP_LOGI(TAG, "Capture stopped, %ld bytes", trace_size);
+            atomic_store(&trace_file_open, false);
+        }
+    }
+}
+
+esp_err_t ol305_trace_start(const char *path)
+{
+    if (atomic_load(&trace_file_open))
+        return ESP_ERR_INVALID_STATE;
+    if (NULL == trace_task_handle &&
+        pdPASS != xTaskCreate(&trace_task, "OL305_TRACE", 3072, NULL, 1, &trace_task_handle))
+    {
+        trace_task_handle = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    trace_file = fopen(path, "wb");
+    if (NULL == trace_file)
+    {
+        ESP_LOGE(TAG, "Can't open %s", path);
+        return ESP_FAIL;
+    }
+    ol305_trace_header_t header =
+    {
+        .magic = OL305_TRACE_MAGIC,
+        .version = OL305_TRACE_VERSION,
+        .rec_size = sizeof(ol305_trace_rec_t),
+        .start_us = esp_timer_get_time(),
+    };
+    if (1 != fwrite(&header, sizeof(header), 1, trace_file))
+    {
+        ESP_LOGE(TAG, "Can't write %s", path);
+        fclose(trace_file);
+        trace_file = NULL;
+        return ESP_FAIL;
+    }
+    trace_size = sizeof(header);
+    atomic_store(&trace_file_open, true);
+    trace_reset(header.start_us);
+    trace_seed();
+    ESP_LOGI(TAG, "Capture to %s", path);
+    return ESP_OK;
+}
+
+esp_err_t ol305_trace_start_stream(ol305_trace_header_t *header)
+{
+    if (atomic_load(&trace_file_open))
+        return ESP_ERR_INVALID_STATE;
+    *header = (ol305_trace_header_t)
+    {
+        .magic = OL305_TRACE_MAGIC,
+        .version = OL305_TRACE_VERSION,
+        .rec_size = sizeof(ol305_trace_rec_t),
+        .start_us = esp_timer_get_time(),
+    };
+    trace_reset(header->start_us);
+    trace_seed();
+    return ESP_OK;
+}
+
+esp_err_t ol305_trace_stop(uint32_t timeout_ms)
+{
+    portENTER_CRITICAL(&trace_mux);
+    trace_capture = false;
+    portEXIT_CRITICAL(&trace_mux);
+    if (!atomic_load(&trace_file_open))
+        return ESP_OK;
+
+    xTaskNotify(trace_task_handle, TRACE_EVT_STOP, eSetBits);
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    while (atomic_load(&trace_file_open))
+    {
+        if (esp_timer_get_time() >= deadline)
+            return ESP_ERR_TIMEOUT;
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return ESP_OK;
+}
+
+size_t ol305_trace_read(uint8_t *buf, size_t size)
+{
+    //the flush task owns the ring while a file is written
+    if (atomic_load(&trace_file_open))
+        return 0;
+    return trace_take(buf, size);
+}
+
+uint32_t ol305_trace_lost()
+{
+    portENTER_CRITICAL(&trace_mux);
+    uint32_t lost = trace_lost;
+    portEXIT_CRITICAL(&trace_mux);
+    return lost;
+}
+
+static void trace_link_cb(void *ctx, ol305_link_event_t event, uint8_t *data, uint16_t len)
+{
+    trace_slot_t *slot = (trace_slot_t *)ctx;
+    switch (event)
+    {
+        case OL305_LINK_READY:
+            trace_append(OL305_TRACE_READY, slot->link, data, len);
+            break;
+        case OL305_LINK_DATA:
+            trace_append(OL305_TRACE_RX, slot->link, data, len);
+            break;
+        case OL305_LINK_CLOSED:
+            trace_append(OL305_TRACE_CLOSED, slot->link, data, len);
+            break;
+        case OL305_LINK_WRITTEN:
+            trace_append(OL305_TRACE_WRITTEN, slot->link, NULL, 0);
+            break;
+    }
+    slot->cb(slot->ctx, event, data, len);
+}
+
+static void trace_init(void)
+{
+    trace_inner->init();
+}
+
+static void trace_deinit(void)
+{
+    trace_inner->deinit();
+}
+
+static int trace_open(uint8_t *mac_addr, uint16_t mac_len, ol305_link_cb_t cb, void *ctx)
+{
+    trace_slot_t *slot = NULL;
+    portENTER_CRITICAL(&trace_mux);
+    for (uint8_t i = 0; i < TRACE_MAX_SLOTS; i++)
+    {
+        if (!trace_slots[i].used)
+        {
+            slot = &trace_slots[i];
+            *slot = (trace_slot_t){.used = true, .link = OL305_INVALID_LINK, .cb = cb, .ctx = ctx};
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&trace_mux);
+    if (NULL == slot)
+        return OL305_INVALID_LINK;
+
+    int link = trace_inner->open(mac_addr, mac_len, trace_link_cb, slot);
+    if (OL305_INVALID_LINK == link)
+    {
+        slot->used = false;
+        return link;
+    }
+    slot->link = link;
+    slot->mac_len = (sizeof(slot->mac) < mac_len) ? sizeof(slot->mac) : mac_len;
+    memcpy(slot->mac, mac_addr, slot->mac_len);
+    trace_append(OL305_TRACE_OPEN, link, mac_addr, mac_len);
+    return link;
+}
+
+static void trace_close(int link)
+{
+    trace_append(OL305_TRACE_CLOSE, link, NULL, 0);
+    trace_inner->close(link);
+    portENTER_CRITICAL(&trace_mux);
+    for (uint8_t i = 0; i < TRACE_MAX_SLOTS; i++)
+    {
+        if (trace_slots[i].used && link == trace_slots[i].link)
+            trace_slots[i].used = false;
+    }
+    portEXIT_CRITICAL(&trace_mux);
+}
+
+static bool trace_is_connected(int link)
+{
+    return trace_inner->is_connected(link);
+}
+
+static bool trace_write(int link, uint8_t *data, uint16_t len)
+{
+    //recorded first, the backend may complete the write before it returns
+    ol305_frame_t frame;
+    uint8_t masked[OL305_FRAME_MAX_LEN];
+    const uint8_t *traced = data;
+    if (ESP_OK == ol305_codec_decode(data, len, &frame) && BLE_KEY == frame.cmd)
+    {
+        //the password stays off the trace, the replay only needs the command
+        memset(frame.data, 0, frame.len);
+        ol305_codec_encode(masked, sizeof(masked), frame.rand, frame.key, frame.cmd, frame.data, frame.len);
+        traced = masked;
+    }
+    trace_append(OL305_TRACE_TX, link, traced, len);
+    if (trace_inner->write(link, data, len))
+        return true;
+    trace_append(OL305_TRACE_REFUSED, link, NULL, 0);
+    return false;
+}
+
+static const ol305_transport_t trace_transport =
+{
+    .name = "trace",
+    .init = trace_init,
+    .deinit = trace_deinit,
+    .open = trace_open,
+    .close = trace_close,
+    .is_connected = trace_is_connected,
+    .write = trace_write,
+};
+
+const ol305_transport_t *ol305_trace_transport(const ol305_transport_t *inner)
+{
+    trace_inner = inner;
+    return &trace_transport;
+}
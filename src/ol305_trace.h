@@ -0,0 +1,68 @@
+#ifndef __OL305_TRACE_H__
+#define __OL305_TRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "ol305_transport.h"
+
+//bytes kept in RAM until the flush task writes them, power of 2
+#define OL305_TRACE_RING_LEN 8192
+#define OL305_TRACE_FLUSH_MS 1000
+//the capture stops at this size, the start of a problem is what a replay needs
+#define OL305_TRACE_FILE_MAX (256 * 1024)
+//longer notifications are cut, an ATT payload of the default MTU fits
+#define OL305_TRACE_MAX_DATA 244
+
+#define OL305_TRACE_NAME "ol305.trc"
+#define OL305_TRACE_MAGIC 0x52544c4f //"OLTR"
+#define OL305_TRACE_VERSION 1
+
+typedef enum
+{
+    OL305_TRACE_OPEN = 1,   //link opened by the client, data: MAC of the lock
+    OL305_TRACE_CLOSE,      //link closed by the client
+    OL305_TRACE_READY,      //backend events, data: as passed to the client
+    OL305_TRACE_RX,
+    OL305_TRACE_CLOSED,
+    OL305_TRACE_WRITTEN,
+    OL305_TRACE_TX,         //frame passed to write(), the payload of BLE_KEY is zeroed
+    OL305_TRACE_LOST,       //in place of dropped records, data: uint32 records dropped, ring full
+    OL305_TRACE_REFUSED,    //the write of the previous OL305_TRACE_TX returned false
+} ol305_trace_type_t;
+
+//little endian on the target and in the file, len bytes of data follow
+typedef struct
+{
+    uint32_t delta_us; //since the previous record, clipped to UINT32_MAX
+    uint8_t type; //ol305_trace_type_t
+    int8_t link;
+    uint16_t len;
+} ol305_trace_rec_t;
+
+_Static_assert(8 == sizeof(ol305_trace_rec_t), "ol305_trace_rec_t is a file format");
+
+//first bytes of a trace
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    int64_t start_us; //esp_timer clock of the first delta
+} ol305_trace_header_t;
+
+//the backend to give ol305_set_transport(): calls go to inner, and every write, notification and
+//link event is copied into the trace ring while a capture runs; one inner backend per build
+const ol305_transport_t *ol305_trace_transport(const ol305_transport_t *inner);
+//starts a capture to path, truncated first, written by a low priority task
+esp_err_t ol305_trace_start(const char *path);
+//ends the capture once the ring is in the file, ESP_ERR_TIMEOUT when it was not
+esp_err_t ol305_trace_stop(uint32_t timeout_ms);
+//capture without a file, the caller streams the trace (console): header, then ol305_trace_read()
+esp_err_t ol305_trace_start_stream(ol305_trace_header_t *header);
+//whole records out of the ring, returns the bytes copied
+size_t ol305_trace_read(uint8_t *buf, size_t size);
+//records dropped, ring full
+uint32_t ol305_trace_lost();
+
+#endif
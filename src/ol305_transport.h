@@ -0,0 +1,36 @@
+#ifndef __OL305_TRANSPORT_H__
+#define __OL305_TRANSPORT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OL305_INVALID_LINK -1
+
+typedef enum
+{
+    OL305_LINK_READY,   //the link can be written
+    OL305_LINK_DATA,    //frame received from the lock
+    OL305_LINK_CLOSED,  //link lost, the backend reconnects until close(); data: HCI reason, uint16 little endian, optional
+    OL305_LINK_WRITTEN, //the oldest pending write completed, its buffer is given back
+}ol305_link_event_t;
+
+//called from the context of the backend (Bluetooth task, simulator thread), keep it short
+typedef void (*ol305_link_cb_t)(void *ctx, ol305_link_event_t event, uint8_t *data, uint16_t len);
+
+//how ol305.c reaches the locks, one backend per build target
+typedef struct
+{
+    const char *name;
+    void (*init)(void); //reference counted, every init has a matching deinit
+    void (*deinit)(void);
+    int (*open)(uint8_t *mac_addr, uint16_t mac_len, ol305_link_cb_t cb, void *ctx); //OL305_INVALID_LINK when no slot is free
+    void (*close)(int link);
+    bool (*is_connected)(int link);
+    //data is lent to the backend until OL305_LINK_WRITTEN, false -> not sent and no event follows
+    bool (*write)(int link, uint8_t *data, uint16_t len);
+}ol305_transport_t;
+
+//ESP-IDF GATTC backend, ol305_transport_ble.c
+extern const ol305_transport_t ol305_ble_transport;
+
+#endif
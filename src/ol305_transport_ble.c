@@ -0,0 +1,108 @@
+#include <string.h>
+#include "ble_connection.h"
+#include "ol305_transport.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+const static char *TAG = "OL305_BLE";
+
+static uint8_t service_uuid[] = {0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e};
+static uint8_t write_uuid[] = {0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x02, 0x00, 0x40, 0x6e};
+static uint8_t notify_uuid[] = {0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x03, 0x00, 0x40, 0x6e};
+static uint8_t notify_decr_uuid[] = {0x29, 0x02};
+
+//the owner of each GATTC link, ble_link_cb_t only carries one context pointer
+typedef struct
+{
+    bool used;
+    ol305_link_cb_t cb;
+    void *ctx;
+}ble_transport_link;
+
+static ble_transport_link ble_transport_links[BLE_MAX_LINKS];
+static ble_transport_link *ble_transport_owner[BLE_MAX_LINKS];
+static portMUX_TYPE ble_transport_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void ble_transport_event(void *ctx, ble_link_event_t event, uint8_t *data, uint16_t len)
+{
+    ble_transport_link *owner = (ble_transport_link *)ctx;
+    switch (event)
+    {
+        case BLE_LINK_READY:
+            owner->cb(owner->ctx, OL305_LINK_READY, data, len);
+            break;
+        case BLE_LINK_DATA:
+            owner->cb(owner->ctx, OL305_LINK_DATA, data, len);
+            break;
+        case BLE_LINK_CLOSED:
+            owner->cb(owner->ctx, OL305_LINK_CLOSED, data, len);
+            break;
+        case BLE_LINK_WRITTEN:
+            owner->cb(owner->ctx, OL305_LINK_WRITTEN, data, len);
+            break;
+        default:
+            break;
+    }
+}
+
+static void ble_transport_init()
+{
+    set_uuid(service_uuid, SERVICE_UUID);
+    set_uuid(write_uuid, WRITE_UUID);
+    set_uuid(notify_uuid, NOTIFY_UUID);
+    set_uuid(notify_decr_uuid, NOTIFY_DESCR_UUID);
+    ble_init();
+}
+
+static int ble_transport_open(uint8_t *mac_addr, uint16_t mac_len, ol305_link_cb_t cb, void *ctx)
+{
+    ble_transport_link *owner = NULL;
+    portENTER_CRITICAL(&ble_transport_mux);
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if (!ble_transport_links[i].used)
+        {
+            owner = &ble_transport_links[i];
+            owner->used = true;
+            owner->cb = cb;
+            owner->ctx = ctx;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&ble_transport_mux);
+    if (NULL == owner)
+        return OL305_INVALID_LINK;
+
+    int link = ble_link_open(mac_addr, mac_len, ble_transport_event, owner);
+    if (BLE_INVALID_LINK == link)
+    {
+        owner->used = false;
+        return OL305_INVALID_LINK;
+    }
+    ble_transport_owner[link] = owner;
+    return link;
+}
+
+static void ble_transport_close(int link)
+{
+    if (0 > link || BLE_MAX_LINKS <= link)
+        return;
+    ble_link_close(link);
+    if (NULL != ble_transport_owner[link])
+    {
+        ble_transport_owner[link]->used = false;
+        ble_transport_owner[link] = NULL;
+    }
+    ESP_LOGD(TAG, "link %d released", link);
+}
+
+const ol305_transport_t ol305_ble_transport =
+{
+    .name = "ble",
+    .init = ble_transport_init,
+    .deinit = ble_deinit,
+    .open = ble_transport_open,
+    .close = ble_transport_close,
+    .is_connected = is_ble_connected,
+    .write = ble_write,
+};
@@ -0,0 +1,54 @@
+#include <stddef.h>
+#include "ol305_txpool.h"
+#include "freertos/FreeRTOS.h"
+
+static ol305_txbuf_t txpool_buffers[OL305_TXPOOL_LEN];
+static ol305_txbuf_t *txpool_free[OL305_TXPOOL_LEN];
+static uint8_t txpool_free_len = 0;
+static bool txpool_ready = false;
+static portMUX_TYPE txpool_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Called with txpool_mux held
+static void txpool_init()
+{
+    for (uint8_t i = 0; i < OL305_TXPOOL_LEN; i++)
+        txpool_free[i] = &txpool_buffers[i];
+    txpool_free_len = OL305_TXPOOL_LEN;
+    txpool_ready = true;
+}
+
+ol305_txbuf_t *ol305_txpool_get(uint8_t cmd)
+{
+    ol305_txbuf_t *buf = NULL;
+    portENTER_CRITICAL(&txpool_mux);
+    if (!txpool_ready)
+        txpool_init();
+    if (0 < txpool_free_len)
+        buf = txpool_free[--txpool_free_len];
+    portEXIT_CRITICAL(&txpool_mux);
+
+    if (NULL != buf)
+    {
+        buf->cmd = cmd;
+        buf->len = 0;
+    }
+    return buf;
+}
+
+void ol305_txpool_put(ol305_txbuf_t *buf)
+{
+    if (NULL == buf)
+        return;
+    portENTER_CRITICAL(&txpool_mux);
+    if (OL305_TXPOOL_LEN > txpool_free_len)
+        txpool_free[txpool_free_len++] = buf;
+    portEXIT_CRITICAL(&txpool_mux);
+}
+
+uint8_t ol305_txpool_free_count()
+{
+    portENTER_CRITICAL(&txpool_mux);
+    uint8_t count = txpool_ready ? txpool_free_len : OL305_TXPOOL_LEN;
+    portEXIT_CRITICAL(&txpool_mux);
+    return count;
+}
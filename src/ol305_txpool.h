@@ -0,0 +1,26 @@
+#ifndef __OL305_TXPOOL_H__
+#define __OL305_TXPOOL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ol305_codec.h"
+
+//shared by every lock: up to 2 frames in flight per link plus the one being built
+#define OL305_TXPOOL_LEN 12
+
+//a frame is built in place: the payload goes to OL305_TXBUF_DATA(), ol305_codec_seal() adds the rest
+typedef struct
+{
+    uint8_t cmd;
+    uint8_t len;            //payload length, then frame length once sealed
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+} ol305_txbuf_t;
+
+#define OL305_TXBUF_DATA(buf) (&(buf)->frame[OL305_FRAME_HEADER_LEN])
+
+//NULL when every buffer is lent to the transport
+ol305_txbuf_t *ol305_txpool_get(uint8_t cmd);
+void ol305_txpool_put(ol305_txbuf_t *buf);
+uint8_t ol305_txpool_free_count();
+
+#endif
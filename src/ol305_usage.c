@@ -0,0 +1,225 @@
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ol305_usage.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+const static char *TAG = "OL305_USAGE";
+
+static char usage_dir[OL305_USAGE_DIR_LEN + 1];
+
+void ol305_usage_set_dir(const char *dir)
+{
+    usage_dir[0] = '\0';
+    if (NULL == dir)
+        return;
+    if (sizeof(usage_dir) <= strlen(dir))
+        ESP_LOGE(TAG, "%s is too long for the usage files", dir);
+    else
+        strcpy(usage_dir, dir);
+}
+
+static void usage_path(const uint8_t *mac, char *path, size_t size)
+{
+    snprintf(path, size, "%s/usage_%02x%02x%02x%02x%02x%02x.bin", usage_dir, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+// The copy ol305_usage_drop writes before it replaces the file
+static void usage_tmp_path(const char *path, char *tmp, size_t size)
+{
+    snprintf(tmp, size, "%.*s.tmp", (int)(strlen(path) - strlen(".bin")), path);
+}
+
+// A drop cut by a reset: the copy is complete once the old file is gone, partial while it is still there
+static void usage_recover(const char *path)
+{
+    char tmp[OL305_USAGE_PATH_LEN];
+    struct stat st;
+    usage_tmp_path(path, tmp, sizeof(tmp));
+    if (0 != stat(tmp, &st))
+        return;
+    if (0 == stat(path, &st))
+        remove(tmp);
+    else if (0 != rename(tmp, path))
+        ESP_LOGE(TAG, "Can't restore %s", path);
+}
+
+static bool usage_same(const ol305_usage_rec_t *a, const ol305_usage_rec_t *b)
+{
+    return a->user_id == b->user_id && a->unlock_time == b->unlock_time && a->lock_time == b->lock_time;
+}
+
+// The cursor is the newest of the NVS copy and the last record of the file
+static void usage_load_cursor(ol305_usage_store_t *store)
+{
+    nvs_handle_t handle;
+    size_t len = sizeof(store->cursor);
+
+    store->has_cursor = false;
+    if (ESP_OK == nvs_open(OL305_USAGE_NAMESPACE, NVS_READONLY, &handle))
+    {
+        store->has_cursor = ESP_OK == nvs_get_blob(handle, store->key, &store->cursor, &len) && sizeof(store->cursor) == len;
+        nvs_close(handle);
+    }
+
+    //written to the file, the power went before the cursor was stored
+    ol305_usage_rec_t last;
+    if (0 < store->count && 0 == fseek(store->file, (long)(store->count - 1) * sizeof(last), SEEK_SET) &&
+        1 == fread(&last, sizeof(last), 1, store->file))
+    {
+        store->cursor = last;
+        store->has_cursor = true;
+    }
+    fseek(store->file, 0, SEEK_END);
+}
+
+esp_err_t ol305_usage_open(ol305_usage_store_t *store, const uint8_t *mac)
+{
+    if (NULL != store->file)
+        return ESP_OK;
+    if ('\0' == usage_dir[0])
+        return ESP_ERR_INVALID_STATE;
+
+    usage_path(mac, store->path, sizeof(store->path));
+    usage_recover(store->path);
+    snprintf(store->key, sizeof(store->key), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    //appended to and read back for the cursor
+    store->file = fopen(store->path, "a+b");
+    if (NULL == store->file)
+    {
+        ESP_LOGE(TAG, "Can't open %s", store->path);
+        return ESP_FAIL;
+    }
+    fseek(store->file, 0, SEEK_END);
+    long size = ftell(store->file);
+    store->count = (0 < size) ? size / sizeof(ol305_usage_rec_t) : 0;
+    if (0 < size && 0 != size % sizeof(ol305_usage_rec_t))
+    {
+        //cut by a reset, the next record would be shifted
+        ESP_LOGW(TAG, "%s ends with a partial record", store->path);
+        fclose(store->file);
+        truncate(store->path, store->count * sizeof(ol305_usage_rec_t));
+        store->file = fopen(store->path, "a+b");
+        if (NULL == store->file)
+            return ESP_FAIL;
+    }
+    usage_load_cursor(store);
+    return ESP_OK;
+}
+
+void ol305_usage_close(ol305_usage_store_t *store)
+{
+    if (NULL == store->file)
+        return;
+    fclose(store->file);
+    store->file = NULL;
+}
+
+bool ol305_usage_is_synced(const ol305_usage_store_t *store, const ol305_usage_rec_t *record)
+{
+    return store->has_cursor && usage_same(&store->cursor, record);
+}
+
+esp_err_t ol305_usage_commit(ol305_usage_store_t *store, const ol305_usage_rec_t *record)
+{
+    if (NULL == store->file)
+        return ESP_ERR_INVALID_STATE;
+    if (OL305_USAGE_MAX_RECORDS <= store->count)
+        return ESP_ERR_NO_MEM;
+
+    if (1 != fwrite(record, sizeof(*record), 1, store->file) || 0 != fflush(store->file) || 0 != fsync(fileno(store->file)))
+    {
+        ESP_LOGE(TAG, "Write to %s failed", store->path);
+        //a partial record would shift every later one, start over on the next sync
+        ol305_usage_close(store);
+        return ESP_FAIL;
+    }
+    store->count++;
+    store->cursor = *record;
+    store->has_cursor = true;
+
+    nvs_handle_t handle;
+    if (ESP_OK != nvs_open(OL305_USAGE_NAMESPACE, NVS_READWRITE, &handle))
+        return ESP_OK; //the file still has it
+    if (ESP_OK != nvs_set_blob(handle, store->key, record, sizeof(*record)) || ESP_OK != nvs_commit(handle))
+        ESP_LOGW(TAG, "Usage cursor not stored");
+    nvs_close(handle);
+    return ESP_OK;
+}
+
+esp_err_t ol305_usage_read(const uint8_t *mac, uint32_t first, ol305_usage_rec_t *records, uint32_t *count)
+{
+    char path[OL305_USAGE_PATH_LEN];
+    if ('\0' == usage_dir[0])
+        return ESP_ERR_INVALID_STATE;
+
+    usage_path(mac, path, sizeof(path));
+    usage_recover(path);
+    FILE *file = fopen(path, "rb");
+    if (NULL == file)
+    {
+        *count = 0;
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (0 != fseek(file, (long)first * sizeof(ol305_usage_rec_t), SEEK_SET))
+        *count = 0;
+    else
+        *count = fread(records, sizeof(ol305_usage_rec_t), *count, file);
+    fclose(file);
+    return ESP_OK;
+}
+
+esp_err_t ol305_usage_drop(const uint8_t *mac, uint32_t count)
+{
+    char path[OL305_USAGE_PATH_LEN];
+    char tmp[OL305_USAGE_PATH_LEN];
+    if ('\0' == usage_dir[0])
+        return ESP_ERR_INVALID_STATE;
+    if (0 == count)
+        return ESP_OK;
+
+    usage_path(mac, path, sizeof(path));
+    usage_recover(path);
+    FILE *file = fopen(path, "rb");
+    if (NULL == file)
+        return ESP_ERR_NOT_FOUND;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    uint32_t total = (0 < size) ? size / sizeof(ol305_usage_rec_t) : 0;
+    if (count >= total)
+    {
+        fclose(file);
+        return (0 == remove(path)) ? ESP_OK : ESP_FAIL;
+    }
+
+    //the records left go to a copy, the old file stays until the copy is on flash
+    usage_tmp_path(path, tmp, sizeof(tmp));
+    FILE *copy = fopen(tmp, "wb");
+    if (NULL == copy)
+    {
+        fclose(file);
+        ESP_LOGE(TAG, "Can't open %s", tmp);
+        return ESP_FAIL;
+    }
+    ol305_usage_rec_t records[32];
+    size_t read = 0;
+    bool ok = 0 == fseek(file, (long)count * sizeof(ol305_usage_rec_t), SEEK_SET);
+    while (ok && 0 < (read = fread(records, sizeof(records[0]), sizeof(records) / sizeof(records[0]), file)))
+        ok = read == fwrite(records, sizeof(records[0]), read, copy);
+    ok = ok && 0 == fflush(copy) && 0 == fsync(fileno(copy));
+    fclose(copy);
+    fclose(file);
+    if (!ok)
+    {
+        ESP_LOGE(TAG, "Write to %s failed", tmp);
+        remove(tmp);
+        return ESP_FAIL;
+    }
+    //spiffs does not rename over a file
+    if (0 != remove(path) || 0 != rename(tmp, path))
+        return ESP_FAIL;
+    ESP_LOGI(TAG, "%s: %" PRIu32 " records read out, %" PRIu32 " left", path, count, total - count);
+    return ESP_OK;
+}
@@ -0,0 +1,52 @@
+#ifndef __OL305_USAGE_H__
+#define __OL305_USAGE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+//records kept per lock until they are read out and dropped, the sync stops once the file is full
+#define OL305_USAGE_MAX_RECORDS 2048
+#define OL305_USAGE_NAMESPACE "ol305_usage"
+//longest directory ol305_usage_set_dir takes, the path still fits the file name after it
+#define OL305_USAGE_DIR_LEN 31
+#define OL305_USAGE_PATH_LEN (OL305_USAGE_DIR_LEN + sizeof("/usage_001122334455.bin"))
+
+//one usage record of the lock, fixed size, little endian in the file
+typedef struct
+{
+    uint32_t user_id;
+    uint32_t unlock_time; //as written by the unlock command
+    uint32_t lock_time;
+    uint8_t lock; //index of the lock on this board
+    uint8_t reserved[3];
+} ol305_usage_rec_t;
+
+_Static_assert(16 == sizeof(ol305_usage_rec_t), "ol305_usage_rec_t is a file format");
+
+//append only file of a lock, <dir>/usage_<mac>.bin, used by its ol305_task only
+typedef struct
+{
+    FILE *file;
+    char path[OL305_USAGE_PATH_LEN];
+    char key[13]; //nvs key of the cursor
+    uint32_t count;
+    bool has_cursor;
+    ol305_usage_rec_t cursor; //last record committed, in NVS too: survives the records being dropped
+} ol305_usage_store_t;
+
+//directory the stores are created in, NULL or longer than OL305_USAGE_DIR_LEN -> usage sync not available
+void ol305_usage_set_dir(const char *dir);
+esp_err_t ol305_usage_open(ol305_usage_store_t *store, const uint8_t *mac);
+void ol305_usage_close(ol305_usage_store_t *store);
+//true when the record is the last one committed: stored, but the lock did not get the delete
+bool ol305_usage_is_synced(const ol305_usage_store_t *store, const ol305_usage_rec_t *record);
+//the record is on flash and the cursor moved when ESP_OK is returned; ESP_ERR_NO_MEM -> file full
+esp_err_t ol305_usage_commit(ol305_usage_store_t *store, const ol305_usage_rec_t *record);
+//reads up to *count records starting at first, *count is set to the records read
+esp_err_t ol305_usage_read(const uint8_t *mac, uint32_t first, ol305_usage_rec_t *records, uint32_t *count);
+//removes the count oldest records, read out with ol305_usage_read; not while the store of the lock is open
+esp_err_t ol305_usage_drop(const uint8_t *mac, uint32_t count);
+
+#endif
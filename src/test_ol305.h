@@ -1,6 +0,0 @@
-#ifndef __TEST_OL305_H__
-#define __TEST_OL305_H__
-
-void test_task();
-
-#endif
\ No newline at end of file
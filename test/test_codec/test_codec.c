@@ -0,0 +1,260 @@
+// Frame builders of ol305.c through the codec and back: every ol305_encode_* function, sealed as
+// ol305_send_message does, must decode to the command and payload the lock expects.
+// Runs on the board (pio test -e esp32dev_test) and on the host (pio test -e native, or ctest in host/).
+
+#include <string.h>
+#include "unity.h"
+#include "ol305.h"
+#include "ol305_codec.h"
+#include "ol305_txpool.h"
+
+static ol305_handle_t lock;
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+    //a builder that keeps its buffer starves the transmit path
+    TEST_ASSERT_EQUAL(OL305_TXPOOL_LEN, ol305_txpool_free_count());
+}
+
+// Builds msg, checks the frame around the payload and decodes it
+static ol305_frame_t round_trip(const ol305_test_msg_t *msg, uint8_t rand)
+{
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    ol305_frame_t decoded;
+    uint16_t len = ol305_test_encode(lock, msg, rand, frame);
+    TEST_ASSERT_TRUE(0 < len);
+    TEST_ASSERT_EQUAL(OL305_FRAME_HEADER_LEN + frame[2] + 1, len);
+    TEST_ASSERT_EQUAL_HEX8(OL305_FRAME_STX_HI, frame[0]);
+    TEST_ASSERT_EQUAL_HEX8(OL305_FRAME_STX_LO, frame[1]);
+    TEST_ASSERT_EQUAL_HEX8(rand + 0x32, frame[3]);
+    TEST_ASSERT_EQUAL(ESP_OK, ol305_codec_decode(frame, len, &decoded));
+    TEST_ASSERT_EQUAL_HEX8(rand, decoded.rand);
+    return decoded;
+}
+
+static void test_crc8_check_value(void)
+{
+    //Dallas/Maxim CRC8 of "123456789"
+    TEST_ASSERT_EQUAL_HEX8(0xa1, ol305_crc8((const uint8_t *)"123456789", 9));
+}
+
+static void test_query_known_frame(void)
+{
+    static const uint8_t expected[] = {0xa3, 0xa4, 0x01, 0x42, 0x4a, 0x21, 0x11, 0x08};
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_QUERY, .key = 0x5a};
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    TEST_ASSERT_EQUAL(sizeof(expected), ol305_test_encode(lock, &msg, 0x10, frame));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, frame, sizeof(expected));
+}
+
+static void test_key_known_frame(void)
+{
+    static const uint8_t expected[] =
+    {
+        0xa3, 0xa4, 0x08, 0xa9, 0x77, 0x76, 0x0e, 0x38, 0x23, 0x1a, 0x3c, 0x42, 0x47, 0x0d, 0x30
+    };
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_KEY, .key = 0x5a, .password = "yOTmK50z"};
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    TEST_ASSERT_EQUAL(sizeof(expected), ol305_test_encode(lock, &msg, 0x77, frame));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, frame, sizeof(expected));
+}
+
+static void test_encode_key(void)
+{
+    //the key of the previous session is dropped, the request goes out with key 0
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_KEY, .key = 0x5a, .password = "yOTmK50z"};
+    ol305_frame_t frame = round_trip(&msg, 0x21);
+    TEST_ASSERT_EQUAL_HEX8(BLE_KEY, frame.cmd);
+    TEST_ASSERT_EQUAL_HEX8(0x00, frame.key);
+    TEST_ASSERT_EQUAL(8, frame.len);
+    TEST_ASSERT_EQUAL_MEMORY("yOTmK50z", frame.data, 8);
+}
+
+static void test_encode_unlock(void)
+{
+    //user id and timestamp are sent big endian
+    ol305_test_msg_t msg =
+    {
+        .encoder = OL305_TEST_ENC_UNLOCK,
+        .key = 0x3c,
+        .user_id = 0x11223344,
+        .timestamp = 0x65a1b2c3,
+        .arg = {0x01, 0x02},
+    };
+    static const uint8_t expected[] = {0x01, 0x11, 0x22, 0x33, 0x44, 0x65, 0xa1, 0xb2, 0xc3, 0x02};
+    ol305_frame_t frame = round_trip(&msg, 0x99);
+    TEST_ASSERT_EQUAL_HEX8(UNLOCK, frame.cmd);
+    TEST_ASSERT_EQUAL_HEX8(0x3c, frame.key);
+    TEST_ASSERT_EQUAL(sizeof(expected), frame.len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, frame.data, sizeof(expected));
+}
+
+static void test_encode_unlock_every_rand(void)
+{
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_UNLOCK, .key = 0xa5, .user_id = 1, .timestamp = 2, .arg = {0x01, 0x00}};
+    for (int rand = 0; rand < 256; rand++)
+    {
+        ol305_frame_t frame = round_trip(&msg, rand);
+        TEST_ASSERT_EQUAL_HEX8(UNLOCK, frame.cmd);
+        TEST_ASSERT_EQUAL_HEX8(0xa5, frame.key);
+        TEST_ASSERT_EQUAL_HEX8(0x01, frame.data[4]);
+        TEST_ASSERT_EQUAL_HEX8(0x02, frame.data[8]);
+    }
+}
+
+static void test_encode_query(void)
+{
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_QUERY, .key = 0x42};
+    ol305_frame_t frame = round_trip(&msg, 0x00);
+    TEST_ASSERT_EQUAL_HEX8(QUERY_INFO, frame.cmd);
+    TEST_ASSERT_EQUAL_HEX8(0x42, frame.key);
+    TEST_ASSERT_EQUAL(1, frame.len);
+    TEST_ASSERT_EQUAL_HEX8(0x01, frame.data[0]);
+}
+
+static void test_encode_read_rfid(void)
+{
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_READ_RFID, .key = 0x42};
+    ol305_frame_t frame = round_trip(&msg, 0xff);
+    TEST_ASSERT_EQUAL_HEX8(REGISTER_RFID, frame.cmd);
+    TEST_ASSERT_EQUAL(1, frame.len);
+    TEST_ASSERT_EQUAL_HEX8(0x01, frame.data[0]);
+}
+
+static void test_encode_register_card(void)
+{
+    static const uint8_t card[8] = {0x04, 0xa2, 0x19, 0x7c, 0x00, 0x00, 0x00, 0xe1};
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_REGISTER_CARD, .key = 0x42, .data = card};
+    ol305_frame_t frame = round_trip(&msg, 0x13);
+    TEST_ASSERT_EQUAL_HEX8(REGISTER_RFID, frame.cmd);
+    TEST_ASSERT_EQUAL(8, frame.len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(card, frame.data, 8);
+}
+
+static void test_encode_get_rfid(void)
+{
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_GET_RFID, .key = 0x42, .arg = {17}};
+    ol305_frame_t frame = round_trip(&msg, 0x80);
+    TEST_ASSERT_EQUAL_HEX8(GET_RFID, frame.cmd);
+    TEST_ASSERT_EQUAL(1, frame.len);
+    TEST_ASSERT_EQUAL(17, frame.data[0]);
+}
+
+static void test_encode_delete_rfid(void)
+{
+    static const uint8_t card[8] = {0x04, 0xa2, 0x19, 0x7c, 0x00, 0x00, 0x00, 0xe1};
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_DELETE_RFID, .key = 0x42, .data = card, .len = 8};
+    ol305_frame_t frame = round_trip(&msg, 0x31);
+    TEST_ASSERT_EQUAL_HEX8(DELETE_RFID, frame.cmd);
+    TEST_ASSERT_EQUAL(8, frame.len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(card, frame.data, 8);
+}
+
+static void test_encode_delete_rfid_wrong_length(void)
+{
+    static const uint8_t card[8] = {0};
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_DELETE_RFID, .key = 0x42, .data = card, .len = 7};
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    TEST_ASSERT_EQUAL(0, ol305_test_encode(lock, &msg, 0x31, frame));
+}
+
+static void test_encode_settings(void)
+{
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_SETTINGS, .key = 0x42, .arg = {0x02, 0x01, 0x02}};
+    static const uint8_t expected[] = {0x02, 0x01, 0x02, 0x00};
+    ol305_frame_t frame = round_trip(&msg, 0x5e);
+    TEST_ASSERT_EQUAL_HEX8(LOCK_SETTINGS, frame.cmd);
+    TEST_ASSERT_EQUAL(sizeof(expected), frame.len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, frame.data, sizeof(expected));
+}
+
+static void test_encode_settings_out_of_range(void)
+{
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_SETTINGS, .key = 0x42, .arg = {0x02, 0x03, 0x02}};
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    TEST_ASSERT_EQUAL(0, ol305_test_encode(lock, &msg, 0x5e, frame));
+}
+
+static void test_encode_usage(void)
+{
+    static const uint8_t cmds[] = {OBTAIN_LAST_USAGE, DELETE_LAST_USAGE};
+    for (int i = 0; i < sizeof(cmds); i++)
+    {
+        ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_USAGE, .key = 0x42, .arg = {cmds[i]}};
+        ol305_frame_t frame = round_trip(&msg, 0x07);
+        TEST_ASSERT_EQUAL_HEX8(cmds[i], frame.cmd);
+        TEST_ASSERT_EQUAL(1, frame.len);
+        TEST_ASSERT_EQUAL_HEX8(0x01, frame.data[0]);
+    }
+}
+
+static void test_encode_response(void)
+{
+    static const uint8_t cmds[] = {UNLOCK, LOCK};
+    for (int i = 0; i < sizeof(cmds); i++)
+    {
+        ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_RESPONSE, .key = 0x42, .arg = {cmds[i]}};
+        ol305_frame_t frame = round_trip(&msg, 0xc4);
+        TEST_ASSERT_EQUAL_HEX8(cmds[i], frame.cmd);
+        TEST_ASSERT_EQUAL(1, frame.len);
+        TEST_ASSERT_EQUAL_HEX8(0x02, frame.data[0]);
+    }
+}
+
+static void test_decode_rejects_damaged_frames(void)
+{
+    ol305_test_msg_t msg = {.encoder = OL305_TEST_ENC_QUERY, .key = 0x5a};
+    uint8_t frame[OL305_FRAME_MAX_LEN];
+    ol305_frame_t decoded;
+    uint16_t len = ol305_test_encode(lock, &msg, 0x10, frame);
+
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, ol305_codec_decode(frame, len - 1, &decoded));
+    frame[len - 1] ^= 0x01;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, ol305_codec_decode(frame, len, &decoded));
+    frame[len - 1] ^= 0x01;
+    frame[6] ^= 0x80;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, ol305_codec_decode(frame, len, &decoded));
+    frame[6] ^= 0x80;
+    frame[0] = 0x00;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, ol305_codec_decode(frame, len, &decoded));
+}
+
+static int run_tests(void)
+{
+    lock = ol305_add_lock();
+    UNITY_BEGIN();
+    RUN_TEST(test_crc8_check_value);
+    RUN_TEST(test_query_known_frame);
+    RUN_TEST(test_key_known_frame);
+    RUN_TEST(test_encode_key);
+    RUN_TEST(test_encode_unlock);
+    RUN_TEST(test_encode_unlock_every_rand);
+    RUN_TEST(test_encode_query);
+    RUN_TEST(test_encode_read_rfid);
+    RUN_TEST(test_encode_register_card);
+    RUN_TEST(test_encode_get_rfid);
+    RUN_TEST(test_encode_delete_rfid);
+    RUN_TEST(test_encode_delete_rfid_wrong_length);
+    RUN_TEST(test_encode_settings);
+    RUN_TEST(test_encode_settings_out_of_range);
+    RUN_TEST(test_encode_usage);
+    RUN_TEST(test_encode_response);
+    RUN_TEST(test_decode_rejects_damaged_frames);
+    return UNITY_END();
+}
+
+#ifdef ESP_PLATFORM
+void app_main(void)
+{
+    run_tests();
+}
+#else
+int main(void)
+{
+    return run_tests();
+}
+#endif
@@ -0,0 +1,230 @@
+// Decisions of the fleet scheduler (ol305_fleet.c) on a made up clock: who gets a free slot, which holder
+// gives its slot up and when, aging and the starvation limit.
+// Runs on the board (pio test -e esp32dev_test) and on the host (pio test -e native, or ctest in host/).
+
+#include "unity.h"
+#include "ol305_fleet.h"
+
+#define MS 1000LL
+
+static const ol305_fleet_config_t config =
+{
+    .slots = 1,
+    .quantum_ms = 1000,
+    .aging_ms = 5000,
+    .max_wait_ms = 20000,
+    .connect_timeout_ms = 3000,
+};
+
+void setUp(void)
+{
+    ol305_fleet_configure(&config);
+}
+
+void tearDown(void)
+{
+}
+
+// The lock gets a slot at now and its link comes up
+static void hold(uint8_t lock, ol305_work_t work, int64_t now)
+{
+    ol305_fleet_update(lock, work, 1, false, now);
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(lock, now));
+    ol305_fleet_set_connected(lock, true, now);
+}
+
+static void test_disabled_grants_every_lock(void)
+{
+    ol305_fleet_configure(&(ol305_fleet_config_t){.slots = 0});
+    TEST_ASSERT_FALSE(ol305_fleet_enabled());
+    for (uint8_t lock = 0; lock < 4; lock++)
+    {
+        TEST_ASSERT_FALSE(ol305_fleet_update(lock, OL305_WORK_NONE, 0, false, 0));
+        TEST_ASSERT_TRUE(ol305_fleet_acquire(lock, 0));
+    }
+    ol305_fleet_update(4, OL305_WORK_UNLOCK, 1, false, 0);
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 60000 * MS));
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, ol305_fleet_timeout(0, 60000 * MS));
+}
+
+static void test_idle_lock_does_not_wait(void)
+{
+    TEST_ASSERT_FALSE(ol305_fleet_update(0, OL305_WORK_NONE, 0, false, 0));
+    TEST_ASSERT_FALSE(ol305_fleet_acquire(0, 0));
+    TEST_ASSERT_TRUE(ol305_fleet_update(0, OL305_WORK_REFRESH, 1, false, 10 * MS));
+    TEST_ASSERT_FALSE(ol305_fleet_update(0, OL305_WORK_REFRESH, 1, false, 20 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(0, 30 * MS));
+
+    ol305_fleet_lock_t info;
+    ol305_fleet_get(0, &info, 30 * MS);
+    TEST_ASSERT_TRUE(info.holding);
+    TEST_ASSERT_EQUAL_UINT32(1, info.grants);
+    TEST_ASSERT_EQUAL_UINT32(20, info.max_wait_ms);
+}
+
+static void test_free_slots_go_to_the_first_waiters(void)
+{
+    ol305_fleet_configure(&(ol305_fleet_config_t){.slots = 2, .aging_ms = 60000, .max_wait_ms = 60000});
+    ol305_fleet_update(0, OL305_WORK_REFRESH, 1, false, 0);
+    ol305_fleet_update(1, OL305_WORK_REFRESH, 1, false, 1 * MS);
+    ol305_fleet_update(2, OL305_WORK_REFRESH, 1, false, 2 * MS);
+    //lock 2 is third in line for two slots, asking first does not help it
+    TEST_ASSERT_FALSE(ol305_fleet_acquire(2, 3 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(1, 3 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(0, 3 * MS));
+    TEST_ASSERT_FALSE(ol305_fleet_acquire(2, 3 * MS));
+
+    ol305_fleet_update(0, OL305_WORK_NONE, 0, false, 4 * MS);
+    ol305_fleet_release(0);
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(2, 5 * MS));
+}
+
+static void test_unlock_goes_first(void)
+{
+    hold(0, OL305_WORK_REFRESH, 0);
+    ol305_fleet_update(1, OL305_WORK_REFRESH, 1, false, 0);
+    ol305_fleet_update(2, OL305_WORK_PROVISION, 1, false, 1 * MS);
+    ol305_fleet_update(3, OL305_WORK_UNLOCK, 1, false, 2 * MS);
+    ol305_fleet_update(0, OL305_WORK_NONE, 0, false, 3 * MS);
+    ol305_fleet_release(0);
+
+    TEST_ASSERT_FALSE(ol305_fleet_acquire(1, 4 * MS));
+    TEST_ASSERT_FALSE(ol305_fleet_acquire(2, 4 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(3, 4 * MS));
+}
+
+static void test_idle_holder_yields_at_once(void)
+{
+    hold(0, OL305_WORK_UNLOCK, 0);
+    ol305_fleet_update(0, OL305_WORK_NONE, 0, false, 10 * MS);
+    //nobody waits, the link stays up for the next request
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 20 * MS));
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, ol305_fleet_timeout(0, 20 * MS));
+
+    TEST_ASSERT_TRUE(ol305_fleet_update(1, OL305_WORK_REFRESH, 1, false, 30 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_should_yield(0, 30 * MS));
+    ol305_fleet_release(0);
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(1, 40 * MS));
+
+    ol305_fleet_lock_t info;
+    ol305_fleet_get(0, &info, 40 * MS);
+    TEST_ASSERT_FALSE(info.holding);
+    TEST_ASSERT_EQUAL_UINT32(0, info.preemptions);
+}
+
+static void test_answer_awaited_is_never_cut(void)
+{
+    hold(0, OL305_WORK_REFRESH, 0);
+    ol305_fleet_update(0, OL305_WORK_REFRESH, 1, true, 0);
+    ol305_fleet_update(1, OL305_WORK_UNLOCK, 1, false, 0);
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 50000 * MS));
+    ol305_fleet_update(0, OL305_WORK_REFRESH, 1, false, 50000 * MS);
+    TEST_ASSERT_TRUE(ol305_fleet_should_yield(0, 50000 * MS));
+}
+
+static void test_quantum_and_urgency(void)
+{
+    hold(0, OL305_WORK_PROVISION, 0);
+    ol305_fleet_update(1, OL305_WORK_REFRESH, 1, false, 0);
+    //a less urgent waiter waits for the holder to run out of work, even past the quantum
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 500 * MS));
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 2000 * MS));
+    //an as urgent one gets the slot once the quantum is over
+    ol305_fleet_update(2, OL305_WORK_PROVISION, 1, false, 2000 * MS);
+    TEST_ASSERT_EQUAL_UINT32(config.aging_ms, ol305_fleet_timeout(0, 2000 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_should_yield(0, 2000 * MS));
+    ol305_fleet_release(0);
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(2, 2000 * MS));
+
+    ol305_fleet_lock_t info;
+    ol305_fleet_get(0, &info, 2000 * MS);
+    TEST_ASSERT_EQUAL_UINT32(1, info.preemptions);
+    TEST_ASSERT_EQUAL_UINT8(1, info.depth);
+}
+
+static void test_waiter_ages_into_a_turn(void)
+{
+    hold(0, OL305_WORK_UNLOCK, 0);
+    ol305_fleet_update(1, OL305_WORK_REFRESH, 1, false, 0);
+    ol305_fleet_update(2, OL305_WORK_UNLOCK, 1, false, 9000 * MS);
+    ol305_fleet_update(0, OL305_WORK_NONE, 0, false, 10000 * MS);
+    ol305_fleet_release(0);
+    //after two aging steps the refresh ranks with unlocks, and has waited longer
+    TEST_ASSERT_FALSE(ol305_fleet_acquire(2, 10000 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(1, 10000 * MS));
+}
+
+static void test_starving_waiter_preempts_unlocks(void)
+{
+    //no aging, only the starvation limit moves the waiter up
+    ol305_fleet_configure(&(ol305_fleet_config_t){.slots = 1, .quantum_ms = 1000, .aging_ms = 60000, .max_wait_ms = 20000});
+    hold(0, OL305_WORK_UNLOCK, 0);
+    ol305_fleet_update(1, OL305_WORK_REFRESH, 1, false, 0);
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 19000 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_should_yield(0, 20000 * MS));
+}
+
+static void test_unreachable_lock_gives_its_slot(void)
+{
+    ol305_fleet_update(0, OL305_WORK_UNLOCK, 1, false, 0);
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(0, 0));
+    ol305_fleet_update(1, OL305_WORK_REFRESH, 1, false, 0);
+    TEST_ASSERT_EQUAL_UINT32(1000, ol305_fleet_timeout(0, 0));
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 2999 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_should_yield(0, 3000 * MS));
+
+    //a link lost later is given the same time to come back
+    ol305_fleet_set_connected(0, true, 3000 * MS);
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 4000 * MS));
+    ol305_fleet_set_connected(0, false, 4000 * MS);
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(0, 6999 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_should_yield(0, 7000 * MS));
+}
+
+static void test_one_holder_yields_per_waiter(void)
+{
+    ol305_fleet_configure(&(ol305_fleet_config_t){.slots = 3});
+    hold(0, OL305_WORK_REFRESH, 0);
+    hold(1, OL305_WORK_REFRESH, 1 * MS);
+    hold(2, OL305_WORK_REFRESH, 2 * MS);
+    ol305_fleet_update(0, OL305_WORK_NONE, 0, false, 10 * MS);
+    ol305_fleet_update(1, OL305_WORK_NONE, 0, false, 10 * MS);
+    ol305_fleet_update(2, OL305_WORK_UNLOCK, 1, false, 10 * MS);
+    ol305_fleet_update(3, OL305_WORK_UNLOCK, 1, false, 10 * MS);
+    //the idle holder that got its slot first
+    TEST_ASSERT_TRUE(ol305_fleet_should_yield(0, 20 * MS));
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(1, 20 * MS));
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(2, 20 * MS));
+    ol305_fleet_release(0);
+    TEST_ASSERT_FALSE(ol305_fleet_should_yield(1, 30 * MS));
+    TEST_ASSERT_TRUE(ol305_fleet_acquire(3, 30 * MS));
+}
+
+static int run_tests(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_disabled_grants_every_lock);
+    RUN_TEST(test_idle_lock_does_not_wait);
+    RUN_TEST(test_free_slots_go_to_the_first_waiters);
+    RUN_TEST(test_unlock_goes_first);
+    RUN_TEST(test_idle_holder_yields_at_once);
+    RUN_TEST(test_answer_awaited_is_never_cut);
+    RUN_TEST(test_quantum_and_urgency);
+    RUN_TEST(test_waiter_ages_into_a_turn);
+    RUN_TEST(test_starving_waiter_preempts_unlocks);
+    RUN_TEST(test_unreachable_lock_gives_its_slot);
+    RUN_TEST(test_one_holder_yields_per_waiter);
+    return UNITY_END();
+}
+
+#ifdef ESP_PLATFORM
+void app_main(void)
+{
+    run_tests();
+}
+#else
+int main(void)
+{
+    return run_tests();
+}
+#endif
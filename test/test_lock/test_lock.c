@@ -0,0 +1,269 @@
+// ol305_task against a lock: the state changes of ol305_task_events for enable, link loss, disable and
+// shutdown, requests refused while disabled, and the time budgets of connect-to-ready and
+// unlock-to-confirmed. On the host the peer is the simulated lock of host/sim (50 ms to READY,
+// 15-20 ms each way); on the board it is the real lock below, in range and with its shackle closed.
+// The tests run in order on one lock, each starts from the state the previous one left.
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "nvs_flash.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "ol305.h"
+#ifndef ESP_PLATFORM
+#include "ol305_transport_sim.h"
+#endif
+
+#ifndef OL305_TEST_MAC
+#define OL305_TEST_MAC {0xd5, 0x7b, 0xf1, 0xca, 0x51, 0x51}
+#endif
+#ifndef OL305_TEST_PASSWORD
+#define OL305_TEST_PASSWORD "yOTmK50z"
+#endif
+
+//enable -> BLE_KEY answered, and unlock submitted -> answer of the lock
+#ifdef ESP_PLATFORM
+#ifndef OL305_TEST_CONNECT_BUDGET_MS
+#define OL305_TEST_CONNECT_BUDGET_MS 8000 //cold stack, scan, service discovery
+#endif
+#ifndef OL305_TEST_UNLOCK_BUDGET_MS
+#define OL305_TEST_UNLOCK_BUDGET_MS 1500
+#endif
+#else
+#ifndef OL305_TEST_CONNECT_BUDGET_MS
+#define OL305_TEST_CONNECT_BUDGET_MS 400
+#endif
+#ifndef OL305_TEST_UNLOCK_BUDGET_MS
+#define OL305_TEST_UNLOCK_BUDGET_MS 250
+#endif
+#endif
+
+#define TEST_MAX_STATES 16
+#define TEST_DONE_BIT (1 << 0)
+
+static ol305_handle_t lock;
+#ifndef ESP_PLATFORM
+static ol305_emulator_t *emu;
+#endif
+
+static portMUX_TYPE states_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t states[TEST_MAX_STATES];
+static int64_t state_times[TEST_MAX_STATES];
+static volatile uint8_t state_count;
+
+// ol305_task context
+static void record_state(ol305_handle_t handle, uint8_t state, void *ctx)
+{
+    portENTER_CRITICAL(&states_mux);
+    if (TEST_MAX_STATES > state_count)
+    {
+        states[state_count] = state;
+        state_times[state_count] = esp_timer_get_time();
+        state_count++;
+    }
+    portEXIT_CRITICAL(&states_mux);
+}
+
+static void clear_states(void)
+{
+    portENTER_CRITICAL(&states_mux);
+    state_count = 0;
+    portEXIT_CRITICAL(&states_mux);
+}
+
+// The states recorded so far, as "CONNECTING CONNECTED"; time of the last one in *last_us
+static void get_states(char *text, size_t size, int64_t *last_us)
+{
+    text[0] = '\0';
+    portENTER_CRITICAL(&states_mux);
+    for (uint8_t i = 0; i < state_count; i++)
+    {
+        size_t used = strlen(text);
+        snprintf(&text[used], size - used, "%s%s", (0 == i) ? "" : " ", ol305_test_state_name(states[i]));
+    }
+    if (NULL != last_us)
+        *last_us = (0 == state_count) ? 0 : state_times[state_count - 1];
+    portEXIT_CRITICAL(&states_mux);
+}
+
+// Until the states recorded since clear_states() are expected; returns the time of the last one
+static int64_t expect_states(const char *expected, uint32_t timeout_ms)
+{
+    char text[TEST_MAX_STATES * 16];
+    int64_t last_us = 0;
+    int64_t deadline = esp_timer_get_time() + timeout_ms * 1000LL;
+    do
+    {
+        get_states(text, sizeof(text), &last_us);
+        if (0 == strcmp(expected, text))
+            return last_us;
+        vTaskDelay(pdMS_TO_TICKS(5));
+    } while (deadline > esp_timer_get_time());
+    TEST_ASSERT_EQUAL_STRING(expected, text);
+    return last_us;
+}
+
+static esp_err_t run_request(OL305_REQUEST type, ol305_result_t *result, uint32_t timeout_ms)
+{
+    EventGroupHandle_t done = xEventGroupCreate();
+    ol305_request_t request =
+    {
+        .request = type,
+        .timeout_ms = timeout_ms,
+        .event_group = done,
+        .done_bits = TEST_DONE_BIT,
+        .result = result,
+    };
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (0 != ol305_submit(lock, &request))
+    {
+        xEventGroupWaitBits(done, TEST_DONE_BIT, pdTRUE, pdTRUE, portMAX_DELAY);
+        err = result->err;
+    }
+    vEventGroupDelete(done);
+    return err;
+}
+
+void setUp(void)
+{
+    clear_states();
+}
+
+void tearDown(void)
+{
+}
+
+static void test_enable_connects_within_budget(void)
+{
+    //a new lock starts enabled, the task connects as soon as it runs
+    int64_t start = esp_timer_get_time();
+    xTaskCreate(&ol305_task, "OL305_TASK", 5000, lock, 5, NULL);
+    int64_t ready = expect_states("CONNECTING CONNECTED", 4 * OL305_TEST_CONNECT_BUDGET_MS);
+    TEST_ASSERT_TRUE(is_ol305_connected(lock));
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(OL305_TEST_CONNECT_BUDGET_MS, (ready - start) / 1000);
+}
+
+static void test_unlock_confirmed_within_budget(void)
+{
+    ol305_result_t result = {0};
+    TEST_ASSERT_EQUAL(ESP_OK, run_request(OL305_REQ_UNLOCK, &result, 4 * OL305_TEST_UNLOCK_BUDGET_MS));
+    TEST_ASSERT_EQUAL_HEX8(0x01, result.info.status);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(OL305_TEST_UNLOCK_BUDGET_MS, result.latency_us / 1000);
+
+    ol305_status_t status;
+    TEST_ASSERT_EQUAL(ESP_OK, ol305_get_status(lock, &status));
+    TEST_ASSERT_EQUAL_HEX8(0x01, status.info.status);
+    //no state change while connected
+    expect_states("", 0);
+}
+
+static void test_lock_notification_updates_status(void)
+{
+#ifdef ESP_PLATFORM
+    TEST_IGNORE_MESSAGE("needs the shackle closed by hand");
+#else
+    ol305_sim_lock(emu);
+    ol305_status_t status = {0};
+    int64_t deadline = esp_timer_get_time() + 4 * OL305_TEST_UNLOCK_BUDGET_MS * 1000LL;
+    while (deadline > esp_timer_get_time())
+    {
+        if (ESP_OK == ol305_get_status(lock, &status) && 0x02 == status.info.status)
+            break;
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    TEST_ASSERT_EQUAL_HEX8(0x02, status.info.status);
+#endif
+}
+
+static void test_link_loss_reconnects(void)
+{
+#ifdef ESP_PLATFORM
+    TEST_IGNORE_MESSAGE("needs the lock taken out of range");
+#else
+    ol305_stats_t before, after;
+    ol305_get_stats(lock, &before);
+    int64_t start = esp_timer_get_time();
+    ol305_sim_drop_link(emu);
+    int64_t ready = expect_states("CONNECTING CONNECTED", 4 * OL305_TEST_CONNECT_BUDGET_MS);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(OL305_TEST_CONNECT_BUDGET_MS, (ready - start) / 1000);
+    ol305_get_stats(lock, &after);
+    TEST_ASSERT_EQUAL(before.counters[OL305_STAT_RECONNECTS] + 1, after.counters[OL305_STAT_RECONNECTS]);
+    TEST_ASSERT_EQUAL(before.counters[OL305_STAT_CONNECTS] + 1, after.counters[OL305_STAT_CONNECTS]);
+#endif
+}
+
+static void test_disable_disconnects(void)
+{
+    ol305_control(lock, OL305_STATE_DISABLE, 1, OL305_TEST_CONNECT_BUDGET_MS);
+    expect_states("DISCONNECTING DISCONNECTED", OL305_TEST_CONNECT_BUDGET_MS);
+    TEST_ASSERT_FALSE(is_ol305_connected(lock));
+}
+
+static void test_request_refused_while_disabled(void)
+{
+    ol305_result_t result = {0};
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, run_request(OL305_REQ_UNLOCK, &result, 0));
+    expect_states("", 0);
+}
+
+static void test_enable_after_disable_reconnects(void)
+{
+    int64_t start = esp_timer_get_time();
+    ol305_control(lock, OL305_STATE_ENABLE, 0, 0);
+    int64_t ready = expect_states("CONNECTING CONNECTED", 4 * OL305_TEST_CONNECT_BUDGET_MS);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(OL305_TEST_CONNECT_BUDGET_MS, (ready - start) / 1000);
+
+    ol305_result_t result = {0};
+    TEST_ASSERT_EQUAL(ESP_OK, run_request(OL305_REQ_UNLOCK, &result, 4 * OL305_TEST_UNLOCK_BUDGET_MS));
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(OL305_TEST_UNLOCK_BUDGET_MS, result.latency_us / 1000);
+}
+
+static void test_shutdown_ends_task(void)
+{
+    ol305_control(lock, OL305_STATE_SHUTDOWN, 1, OL305_TEST_CONNECT_BUDGET_MS);
+    expect_states("DISCONNECTING DISCONNECTED", OL305_TEST_CONNECT_BUDGET_MS);
+}
+
+static int run_tests(void)
+{
+    uint8_t mac[6] = OL305_TEST_MAC;
+    nvs_flash_init();
+#ifdef ESP_PLATFORM
+    ol305_set_transport(&ol305_ble_transport);
+#else
+    ol305_sim_config_t config = {.connect_ms = 50, .latency_ms = 15, .jitter_ms = 5, .loss_pct = 0};
+    ol305_sim_configure(&config);
+    ol305_set_transport(&ol305_sim_transport);
+    emu = ol305_sim_add_lock(mac, OL305_TEST_PASSWORD);
+#endif
+    lock = ol305_add_lock();
+    set_ol305_ble_password(lock, OL305_TEST_PASSWORD);
+    set_ol305_mac_addr(lock, mac, sizeof(mac));
+    ol305_test_set_state_cb(record_state, NULL);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_enable_connects_within_budget);
+    RUN_TEST(test_unlock_confirmed_within_budget);
+    RUN_TEST(test_lock_notification_updates_status);
+    RUN_TEST(test_link_loss_reconnects);
+    RUN_TEST(test_disable_disconnects);
+    RUN_TEST(test_request_refused_while_disabled);
+    RUN_TEST(test_enable_after_disable_reconnects);
+    RUN_TEST(test_shutdown_ends_task);
+    return UNITY_END();
+}
+
+#ifdef ESP_PLATFORM
+void app_main(void)
+{
+    run_tests();
+}
+#else
+int main(void)
+{
+    return run_tests();
+}
+#endif